@@ -0,0 +1,1294 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* ape_bench.c */
+
+/*
+	Standalone load generator for aped (built with "make bench").
+
+	Each scenario of the scenario file (see bench/scenarios.conf) :
+	  - opens "clients" simulated clients at "connect_rate" per second over
+	    one transport (longpolling, xhrstreaming, jsonp, sse, websocket)
+	  - CONNECT then JOIN one of "channels" channels
+	  - "senders" clients SEND a timestamped message to their channel every
+	    "send_interval" ms for "duration" seconds
+	  - fan-out latency is measured on every DATA raw received
+	  - with "cmd" set, senders run this command instead of SEND (with
+	    "cmd_fields" params fields), its handler answers with params.t and
+	    the round trip is measured the same way (see scripts/utils/benchParams.js)
+
+	Results (connect rate, commands throughput, latency percentiles, server
+	RSS) are written as JSON to the "results" file.
+
+	usage : ape_bench [-f scenarios.conf] [-o results.json] [-p aped_pid]
+	                  [-s scenario] [-l label]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define BENCH_MAX_EVENTS 1024
+#define BENCH_BUF_SIZE 4096
+#define BENCH_MAX_SCENARIOS 32
+#define BENCH_MAX_CONNS 4 /* per client, the HTTP transports open one connection per command */
+#define BENCH_TOKEN_MAX 64 /* longest token we look for in the server output */
+#define BENCH_DRAIN_TIME 2000000
+#define BENCH_QUIT_TIME 1000000
+
+#define BENCH_WS_KEY "dGhlIHNhbXBsZSBub25jZQ=="
+
+/* same layout as the server histograms (src/metrics.h) */
+#define HISTO_SUB 4
+#define HISTO_OCTAVES 32
+#define HISTO_BUCKETS (HISTO_OCTAVES * HISTO_SUB)
+
+typedef struct _bench_histo bench_histo;
+struct _bench_histo {
+	unsigned long buckets[HISTO_BUCKETS];
+	unsigned long count;
+	unsigned long max;
+	unsigned long long sum;
+};
+
+struct _bench_transport {
+	const char *name;
+	int id; /* see src/transports.h */
+	int websocket;
+};
+
+static struct _bench_transport bench_transports[] = {
+	{"longpolling", 0, 0},
+	{"xhrstreaming", 1, 0},
+	{"jsonp", 2, 0},
+	{"sse", 4, 0},
+	{"websocket", 6, 1},
+	{NULL, 0, 0}
+};
+
+typedef struct _bench_scenario bench_scenario;
+struct _bench_scenario {
+	char name[64];
+	struct _bench_transport *transport;
+
+	unsigned int clients;
+	unsigned int connect_rate; /* per second, 0 : as fast as possible */
+	unsigned int connect_timeout; /* ms */
+	unsigned int channels;
+	unsigned int senders;
+	unsigned int send_interval; /* ms */
+	unsigned int duration; /* s */
+	unsigned int msg_size;
+	unsigned int cmd_fields; /* params fields of a custom command */
+
+	char cmd[32]; /* SEND or a custom command echoing params.t */
+};
+
+typedef enum {
+	CLIENT_NEW,
+	CLIENT_CONNECTING,
+	CLIENT_CONNECTED,
+	CLIENT_JOINED,
+	CLIENT_FAILED
+} client_state;
+
+typedef struct _bench_client bench_client;
+typedef struct _bench_conn bench_conn;
+
+struct _bench_client {
+	uint64_t launched;
+	uint64_t next_send;
+
+	bench_conn *ws;
+
+	unsigned int id;
+	unsigned int chan;
+	unsigned int chl;
+	unsigned int nconns;
+
+	client_state state;
+
+	char sessid[33];
+};
+
+struct _bench_conn {
+	bench_client *client;
+
+	char *out;
+	size_t out_len;
+	size_t out_pos;
+	size_t out_size;
+
+	char *in;
+	size_t in_len;
+	size_t in_size;
+	size_t scanned;
+
+	int fd;
+	int connected;
+	int handshake; /* websocket : waiting for the upgrade response */
+	int wantout;
+};
+
+typedef enum {
+	PHASE_CONNECT,
+	PHASE_SEND,
+	PHASE_DRAIN,
+	PHASE_QUIT,
+	PHASE_DONE
+} bench_phase;
+
+struct _bench_result {
+	unsigned long attempted;
+	unsigned long connected;
+	unsigned long joined;
+	unsigned long failed;
+	unsigned long errors;
+
+	unsigned long cmds;
+	unsigned long sends;
+	unsigned long sends_skipped;
+	unsigned long requests; /* TCP connections opened */
+
+	unsigned long expected;
+	unsigned long delivered;
+
+	uint64_t connect_start;
+	uint64_t connect_end;
+	uint64_t send_start;
+	uint64_t send_end;
+
+	long rss_start;
+	long rss_end;
+	long rss_peak;
+
+	bench_histo connect_lat;
+	bench_histo fanout_lat;
+};
+
+static struct {
+	char host[256];
+	char results[1024];
+	char label[128];
+
+	struct sockaddr_in addr;
+
+	bench_scenario scenarios[BENCH_MAX_SCENARIOS];
+	unsigned int nscenarios;
+
+	int port;
+	pid_t pid;
+	int epfd;
+	unsigned int runtag;
+
+	/* current scenario */
+	bench_scenario *scn;
+	bench_client *clients;
+	bench_conn **conns; /* indexed by fd */
+	unsigned int nfds;
+	unsigned int *members; /* joined clients per channel */
+	char (*pipes)[33]; /* channel pubid */
+	bench_phase phase;
+	struct _bench_result res;
+} bench;
+
+static uint64_t now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	void *ret = realloc(ptr, size);
+
+	if (ret == NULL) {
+		fprintf(stderr, "[ape_bench] Out of memory\n");
+		exit(1);
+	}
+
+	return ret;
+}
+
+/* Histograms */
+
+static void histo_add(bench_histo *h, unsigned long usec)
+{
+	unsigned int b;
+
+	if (usec < HISTO_SUB) {
+		b = usec;
+	} else {
+		int msb = 63 - __builtin_clzl(usec);
+
+		b = (msb - 1) * HISTO_SUB + ((usec >> (msb - 2)) & (HISTO_SUB - 1));
+	}
+	if (b >= HISTO_BUCKETS) {
+		b = HISTO_BUCKETS - 1;
+	}
+
+	h->buckets[b]++;
+	h->count++;
+	h->sum += usec;
+
+	if (usec > h->max) {
+		h->max = usec;
+	}
+}
+
+/* upper bound of the bucket holding the q-th quantile */
+static unsigned long histo_percentile(bench_histo *h, double q)
+{
+	unsigned long rank, seen = 0, upper;
+	unsigned int b;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	rank = (unsigned long)(q * h->count);
+	if (rank >= h->count) {
+		rank = h->count - 1;
+	}
+
+	for (b = 0; b < HISTO_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > rank) {
+			break;
+		}
+	}
+	if (b < HISTO_SUB) {
+		upper = b;
+	} else {
+		int msb = b / HISTO_SUB + 1;
+
+		upper = ((unsigned long)(HISTO_SUB + b % HISTO_SUB) << (msb - 2)) + (1UL << (msb - 2)) - 1;
+	}
+
+	return (upper > h->max ? h->max : upper);
+}
+
+static void histo_json(FILE *fp, bench_histo *h)
+{
+	fprintf(fp, "{\"count\":%lu,\"mean\":%llu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}",
+		h->count, (h->count ? h->sum / h->count : 0),
+		histo_percentile(h, 0.50), histo_percentile(h, 0.90),
+		histo_percentile(h, 0.99), histo_percentile(h, 0.999), h->max);
+}
+
+/* Server RSS */
+
+static pid_t find_server_pid()
+{
+	DIR *dir;
+	struct dirent *ent;
+	pid_t pid = 0;
+
+	if ((dir = opendir("/proc")) == NULL) {
+		return 0;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		char path[300], comm[64];
+		FILE *fp;
+
+		if (!isdigit(ent->d_name[0])) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%s/comm", ent->d_name);
+		if ((fp = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		if (fgets(comm, sizeof(comm), fp) != NULL && strcmp(comm, "aped\n") == 0) {
+			pid = atoi(ent->d_name);
+		}
+		fclose(fp);
+		if (pid) {
+			break;
+		}
+	}
+	closedir(dir);
+
+	return pid;
+}
+
+/* VmRSS in kB, -1 if unknown */
+static long server_rss()
+{
+	char path[64], line[256];
+	FILE *fp;
+	long rss = -1;
+
+	if (bench.pid <= 0) {
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)bench.pid);
+	if ((fp = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			rss = atol(&line[6]);
+			break;
+		}
+	}
+	fclose(fp);
+
+	return rss;
+}
+
+static void sample_rss()
+{
+	long rss = server_rss();
+
+	if (rss > bench.res.rss_peak) {
+		bench.res.rss_peak = rss;
+	}
+}
+
+/* Connections */
+
+static void conn_update_events(bench_conn *conn)
+{
+	struct epoll_event ev;
+	int wantout = (!conn->connected || conn->out_pos < conn->out_len);
+
+	if (wantout == conn->wantout) {
+		return;
+	}
+	conn->wantout = wantout;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (wantout ? EPOLLOUT : 0);
+	ev.data.fd = conn->fd;
+
+	epoll_ctl(bench.epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void client_poll(bench_client *client);
+
+static void conn_close(bench_conn *conn)
+{
+	bench_client *client = conn->client;
+	int was_ws = (client->ws == conn);
+
+	epoll_ctl(bench.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	bench.conns[conn->fd] = NULL;
+
+	free(conn->out);
+	free(conn->in);
+	free(conn);
+
+	client->nconns--;
+
+	if (was_ws) {
+		client->ws = NULL;
+		if (client->state != CLIENT_FAILED && bench.phase < PHASE_QUIT) {
+			client->state = CLIENT_FAILED;
+			bench.res.failed++;
+		}
+		return;
+	}
+
+	if (client->nconns == 0 && bench.phase < PHASE_QUIT) {
+		if (client->state == CLIENT_CONNECTING) {
+			/* CONNECT request closed without a session */
+			client->state = CLIENT_FAILED;
+			bench.res.failed++;
+		} else if (client->state == CLIENT_CONNECTED || client->state == CLIENT_JOINED) {
+			client_poll(client);
+		}
+	}
+}
+
+static bench_conn *conn_open(bench_client *client)
+{
+	bench_conn *conn;
+	struct epoll_event ev;
+	int fd, one = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		return NULL;
+	}
+	if ((unsigned int)fd >= bench.nfds) {
+		close(fd);
+		return NULL;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(fd, (struct sockaddr *)&bench.addr, sizeof(bench.addr)) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return NULL;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	conn->fd = fd;
+	conn->client = client;
+	conn->wantout = 1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.fd = fd;
+	epoll_ctl(bench.epfd, EPOLL_CTL_ADD, fd, &ev);
+
+	bench.conns[fd] = conn;
+	client->nconns++;
+	bench.res.requests++;
+
+	return conn;
+}
+
+static void conn_flush(bench_conn *conn)
+{
+	while (conn->connected && conn->out_pos < conn->out_len) {
+		ssize_t n = write(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				conn_close(conn);
+				return;
+			}
+			break;
+		}
+		conn->out_pos += n;
+	}
+	if (conn->out_pos == conn->out_len) {
+		conn->out_pos = conn->out_len = 0;
+	}
+	conn_update_events(conn);
+}
+
+static void conn_write(bench_conn *conn, const char *data, size_t len)
+{
+	if (conn->out_len + len > conn->out_size) {
+		conn->out_size = conn->out_len + len + BENCH_BUF_SIZE;
+		conn->out = xrealloc(conn->out, conn->out_size);
+	}
+	memcpy(conn->out + conn->out_len, data, len);
+	conn->out_len += len;
+}
+
+/* masked frame (client to server frames must be masked) */
+static void conn_write_ws_frame(bench_conn *conn, unsigned char start, const char *data, size_t len)
+{
+	unsigned char head[10], mask[4];
+	size_t hlen = 2, i;
+	char *payload;
+
+	head[0] = start;
+	if (len < 126) {
+		head[1] = 0x80 | len;
+	} else if (len < 65536) {
+		head[1] = 0x80 | 126;
+		head[2] = (len >> 8) & 0xFF;
+		head[3] = len & 0xFF;
+		hlen = 4;
+	} else {
+		head[1] = 0x80 | 127;
+		for (i = 0; i < 8; i++) {
+			head[2 + i] = ((uint64_t)len >> (56 - i * 8)) & 0xFF;
+		}
+		hlen = 10;
+	}
+	for (i = 0; i < 4; i++) {
+		mask[i] = rand() & 0xFF;
+	}
+	conn_write(conn, (char *)head, hlen);
+	conn_write(conn, (char *)mask, 4);
+
+	payload = conn->out + conn->out_len;
+	conn_write(conn, data, len);
+
+	for (i = 0; i < len; i++) {
+		payload[i] ^= mask[i % 4];
+	}
+}
+
+static void conn_write_ws(bench_conn *conn, const char *data, size_t len)
+{
+	conn_write_ws_frame(conn, 0x81, data, len);
+}
+
+/* Commands */
+
+static void client_cmd(bench_client *client, const char *cmd, const char *params)
+{
+	size_t size = strlen(cmd) + strlen(params) + 128;
+	char *json = malloc(size);
+	int len;
+
+	if (client->state == CLIENT_NEW || client->state == CLIENT_CONNECTING) {
+		len = snprintf(json, size, "[{\"cmd\":\"%s\",\"chl\":%u,\"params\":%s}]",
+			cmd, ++client->chl, params);
+	} else {
+		len = snprintf(json, size, "[{\"cmd\":\"%s\",\"chl\":%u,\"sessid\":\"%s\",\"params\":%s}]",
+			cmd, ++client->chl, client->sessid, params);
+	}
+
+	bench.res.cmds++;
+
+	if (client->ws != NULL) {
+		conn_write_ws(client->ws, json, len);
+		conn_flush(client->ws);
+	} else {
+		char head[512];
+		int hlen;
+		bench_conn *conn;
+
+		if ((conn = conn_open(client)) == NULL) {
+			bench.res.errors++;
+			free(json);
+			return;
+		}
+		hlen = snprintf(head, sizeof(head), "POST /%d/ HTTP/1.1\r\nHost: %s:%d\r\nContent-Length: %d\r\n\r\n",
+			bench.scn->transport->id, bench.host, bench.port, len);
+
+		conn_write(conn, head, hlen);
+		conn_write(conn, json, len);
+	}
+	free(json);
+}
+
+/* HTTP transports : keep one request pending on the server (long polling or stream) */
+static void client_poll(bench_client *client)
+{
+	client_cmd(client, "CHECK", "{}");
+}
+
+static void client_connect(bench_client *client)
+{
+	char params[128];
+
+	snprintf(params, sizeof(params), "{\"uin\":\"b%ux%u\"}", bench.runtag, client->id);
+	client_cmd(client, "CONNECT", params);
+}
+
+static void client_launch(bench_client *client)
+{
+	client->launched = now_usec();
+	client->state = CLIENT_CONNECTING;
+	bench.res.attempted++;
+
+	if (bench.scn->transport->websocket) {
+		char head[512];
+		int hlen;
+
+		if ((client->ws = conn_open(client)) == NULL) {
+			client->state = CLIENT_FAILED;
+			bench.res.failed++;
+			return;
+		}
+		client->ws->handshake = 1;
+
+		hlen = snprintf(head, sizeof(head), "GET /%d/ HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\nOrigin: http://%s\r\nSec-WebSocket-Key: " BENCH_WS_KEY "\r\n"
+			"Sec-WebSocket-Version: 13\r\n\r\n",
+			bench.scn->transport->id, bench.host, bench.port, bench.host);
+		conn_write(client->ws, head, hlen);
+
+		return;
+	}
+
+	client_connect(client);
+}
+
+static void client_send(bench_client *client, uint64_t now)
+{
+	bench_scenario *scn = bench.scn;
+	char *params;
+	unsigned int len, msg, i;
+
+	if (client->ws == NULL && client->nconns >= BENCH_MAX_CONNS) {
+		bench.res.sends_skipped++;
+		return;
+	}
+
+	params = malloc((scn->msg_size + 32) * (scn->cmd_fields + 1) + 128);
+
+	if (strcmp(scn->cmd, "SEND") == 0) {
+		len = sprintf(params, "{\"pipe\":\"%s\",\"msg\":\"", bench.pipes[client->chan]);
+	} else {
+		/* custom command : the handler is expected to answer with params.t */
+		len = sprintf(params, "{\"t\":\"");
+	}
+	msg = len;
+	len += sprintf(&params[len], "apb%llu_", (unsigned long long)now);
+	while (len - msg < scn->msg_size) {
+		params[len++] = 'x';
+	}
+	params[len++] = '"';
+
+	for (i = 1; i < scn->cmd_fields; i++) {
+		len += sprintf(&params[len], ",\"f%u\":\"", i);
+		memset(&params[len], 'x', scn->msg_size);
+		len += scn->msg_size;
+		params[len++] = '"';
+	}
+	strcpy(&params[len], "}");
+
+	client_cmd(client, scn->cmd, params);
+	free(params);
+
+	bench.res.sends++;
+	if (strcmp(scn->cmd, "SEND") != 0) {
+		bench.res.expected++;
+	} else if (bench.members[client->chan]) {
+		bench.res.expected += bench.members[client->chan] - 1;
+	}
+}
+
+/* Server output */
+
+static void on_sessid(bench_client *client, const char *sessid)
+{
+	char params[128];
+
+	if (client->state != CLIENT_CONNECTING) {
+		return;
+	}
+	memcpy(client->sessid, sessid, 32);
+	client->sessid[32] = '\0';
+	client->state = CLIENT_CONNECTED;
+
+	bench.res.connected++;
+	histo_add(&bench.res.connect_lat, now_usec() - client->launched);
+
+	snprintf(params, sizeof(params), "{\"channels\":[\"bench%ux%u\"]}", bench.runtag, client->chan);
+	client_cmd(client, "JOIN", params);
+}
+
+static void on_pipe(bench_client *client, const char *pubid)
+{
+	if (client->state != CLIENT_CONNECTED) {
+		return;
+	}
+	client->state = CLIENT_JOINED;
+
+	bench.res.joined++;
+	bench.res.connect_end = now_usec();
+	bench.members[client->chan]++;
+
+	if (bench.pipes[client->chan][0] == '\0') {
+		memcpy(bench.pipes[client->chan], pubid, 32);
+		bench.pipes[client->chan][32] = '\0';
+	}
+}
+
+static int is_hex32(const char *p)
+{
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (!isxdigit((unsigned char)p[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+	The output is scanned for a few tokens instead of being parsed, so the
+	same code works whatever the transport framing is (JSONP padding, SSE,
+	websocket frames...)
+*/
+static int conn_scan(bench_conn *conn, int final)
+{
+	bench_client *client = conn->client;
+	char *p, *end;
+
+	if (conn->handshake) {
+		char *eoh;
+
+		conn->in[conn->in_len] = '\0';
+		if ((eoh = strstr(conn->in, "\r\n\r\n")) == NULL) {
+			return 0;
+		}
+		if (strncmp(conn->in, "HTTP/1.1 101", 12) != 0) {
+			bench.res.errors++;
+			conn_close(conn);
+			return -1;
+		}
+		conn->handshake = 0;
+		conn->scanned = (eoh - conn->in) + 4;
+
+		client_connect(client);
+	}
+
+	p = conn->in + conn->scanned;
+	end = conn->in + conn->in_len;
+	if (!final) {
+		/* a token may be split between two reads */
+		end = (conn->in_len - conn->scanned > BENCH_TOKEN_MAX ? end - BENCH_TOKEN_MAX : p);
+	}
+
+	for (; p < end; p++) {
+		switch(*p) {
+			case 's':
+				if (strncmp(p, "sessid\":\"", 9) == 0 && is_hex32(p + 9)) {
+					on_sessid(client, p + 9);
+					p += 40;
+				}
+				break;
+			case 'm':
+				if (strncmp(p, "multi\",\"pubid\":\"", 16) == 0 && is_hex32(p + 16)) {
+					on_pipe(client, p + 16);
+					p += 47;
+				}
+				break;
+			case 'a':
+				if (p[1] == 'p' && p[2] == 'b' && isdigit((unsigned char)p[3])) {
+					unsigned long long sent = strtoull(p + 3, &p, 10);
+					uint64_t now = now_usec();
+
+					bench.res.delivered++;
+					histo_add(&bench.res.fanout_lat, (now > sent ? now - sent : 0));
+				}
+				break;
+			case 'E':
+				if (strncmp(p, "ERR\"", 4) == 0) {
+					bench.res.errors++;
+				}
+				break;
+			case '\x89':
+				/* server ping (never part of UTF-8 text when followed by 0) : answer or get dropped */
+				if (p[1] == '\0' && conn == client->ws) {
+					conn_write_ws_frame(conn, 0x8A, "", 0);
+					conn_flush(conn);
+					p++;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	if (p > conn->in + conn->in_len) {
+		p = conn->in + conn->in_len;
+	}
+
+	/* only keep what has not been scanned yet */
+	conn->scanned = p - conn->in;
+	if (conn->scanned > BENCH_BUF_SIZE / 2 || conn->scanned == conn->in_len) {
+		memmove(conn->in, p, conn->in_len - conn->scanned);
+		conn->in_len -= conn->scanned;
+		conn->scanned = 0;
+	}
+
+	return 0;
+}
+
+static void conn_read(bench_conn *conn)
+{
+	while (1) {
+		ssize_t n;
+
+		if (conn->in_size - conn->in_len < BENCH_BUF_SIZE) {
+			conn->in_size += BENCH_BUF_SIZE;
+			conn->in = xrealloc(conn->in, conn->in_size + 1);
+		}
+		n = read(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len);
+
+		if (n > 0) {
+			conn->in_len += n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && errno == EAGAIN) {
+			conn_scan(conn, 0);
+			return;
+		}
+		/* EOF or error */
+		if (conn_scan(conn, 1) == 0) {
+			conn_close(conn);
+		}
+		return;
+	}
+}
+
+static void conn_writable(bench_conn *conn)
+{
+	if (!conn->connected) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			bench.res.errors++;
+			conn_close(conn);
+			return;
+		}
+		conn->connected = 1;
+	}
+	conn_flush(conn);
+}
+
+/* Scenario */
+
+static void bench_quit()
+{
+	unsigned int i;
+
+	for (i = 0; i < bench.scn->clients; i++) {
+		bench_client *client = &bench.clients[i];
+
+		if (client->state == CLIENT_CONNECTED || client->state == CLIENT_JOINED) {
+			client_cmd(client, "QUIT", "{}");
+		}
+	}
+}
+
+static void bench_tick(uint64_t start, uint64_t now)
+{
+	static uint64_t last_rss = 0;
+	bench_scenario *scn = bench.scn;
+	unsigned int i;
+
+	if (now - last_rss >= 500000) {
+		sample_rss();
+		last_rss = now;
+	}
+
+	switch(bench.phase) {
+		case PHASE_CONNECT:
+		{
+			unsigned long target = scn->clients;
+
+			if (scn->connect_rate) {
+				target = (now - start) * scn->connect_rate / 1000000 + 1;
+				if (target > scn->clients) {
+					target = scn->clients;
+				}
+			}
+			while (bench.res.attempted < target) {
+				client_launch(&bench.clients[bench.res.attempted]);
+			}
+			if (bench.res.attempted == scn->clients &&
+				(bench.res.joined + bench.res.failed == scn->clients ||
+				now - bench.clients[scn->clients - 1].launched > (uint64_t)scn->connect_timeout * 1000)) {
+
+				if (bench.res.connect_end == 0) {
+					bench.res.connect_end = now;
+				}
+				bench.res.send_start = now;
+				bench.phase = PHASE_SEND;
+
+				for (i = 0; i < scn->senders && i < scn->clients; i++) {
+					bench.clients[i].next_send = now + (uint64_t)i * scn->send_interval * 1000 / scn->senders;
+				}
+			}
+			break;
+		}
+		case PHASE_SEND:
+			for (i = 0; i < scn->senders && i < scn->clients; i++) {
+				bench_client *client = &bench.clients[i];
+
+				if (client->state == CLIENT_JOINED && now >= client->next_send) {
+					client_send(client, now);
+					client->next_send += (uint64_t)scn->send_interval * 1000;
+				}
+			}
+			if (now - bench.res.send_start >= (uint64_t)scn->duration * 1000000) {
+				bench.res.send_end = now;
+				bench.res.rss_end = server_rss();
+				bench.phase = PHASE_DRAIN;
+			}
+			break;
+		case PHASE_DRAIN:
+			if (now - bench.res.send_end >= BENCH_DRAIN_TIME) {
+				bench.phase = PHASE_QUIT;
+				bench_quit();
+			}
+			break;
+		case PHASE_QUIT:
+			if (now - bench.res.send_end >= BENCH_DRAIN_TIME + BENCH_QUIT_TIME) {
+				bench.phase = PHASE_DONE;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static void bench_run(bench_scenario *scn)
+{
+	struct epoll_event events[BENCH_MAX_EVENTS];
+	uint64_t start;
+	unsigned int i;
+
+	bench.scn = scn;
+	bench.phase = PHASE_CONNECT;
+	memset(&bench.res, 0, sizeof(bench.res));
+
+	bench.clients = calloc(scn->clients, sizeof(*bench.clients));
+	bench.members = calloc(scn->channels, sizeof(*bench.members));
+	bench.pipes = calloc(scn->channels, sizeof(*bench.pipes));
+
+	for (i = 0; i < scn->clients; i++) {
+		bench.clients[i].id = i;
+		bench.clients[i].chan = i % scn->channels;
+	}
+
+	bench.res.rss_start = bench.res.rss_peak = server_rss();
+	bench.res.connect_start = start = now_usec();
+
+	fprintf(stderr, "[ape_bench] %s : %u clients over %s\n", scn->name, scn->clients, scn->transport->name);
+
+	while (bench.phase != PHASE_DONE) {
+		int nfds = epoll_wait(bench.epfd, events, BENCH_MAX_EVENTS, 1);
+
+		for (i = 0; i < (unsigned int)(nfds > 0 ? nfds : 0); i++) {
+			bench_conn *conn = bench.conns[events[i].data.fd];
+
+			if (conn != NULL && (events[i].events & EPOLLOUT)) {
+				conn_writable(conn);
+			}
+			if ((conn = bench.conns[events[i].data.fd]) != NULL &&
+				(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				conn_read(conn);
+			}
+		}
+		bench_tick(start, now_usec());
+	}
+
+	for (i = 0; i < bench.nfds; i++) {
+		if (bench.conns[i] != NULL) {
+			conn_close(bench.conns[i]);
+		}
+	}
+
+	free(bench.clients);
+	free(bench.members);
+	free(bench.pipes);
+}
+
+static void bench_result_json(FILE *fp, bench_scenario *scn, struct _bench_result *res)
+{
+	double connect_s = (res->connect_end > res->connect_start ? (res->connect_end - res->connect_start) / 1e6 : 0);
+	double send_s = (res->send_end > res->send_start ? (res->send_end - res->send_start) / 1e6 : 0);
+
+	fprintf(fp, "{\"name\":\"%s\",\"transport\":\"%s\",\"clients\":%u,\"channels\":%u,"
+		"\"senders\":%u,\"send_interval_ms\":%u,\"duration_s\":%u,\"msg_size\":%u,\"cmd\":\"%s\",\"cmd_fields\":%u,",
+		scn->name, scn->transport->name, scn->clients, scn->channels,
+		scn->senders, scn->send_interval, scn->duration, scn->msg_size, scn->cmd, scn->cmd_fields);
+
+	fprintf(fp, "\"connect\":{\"attempted\":%lu,\"connected\":%lu,\"joined\":%lu,\"failed\":%lu,"
+		"\"elapsed_s\":%.3f,\"rate_per_s\":%.1f,\"latency_us\":",
+		res->attempted, res->connected, res->joined, res->failed,
+		connect_s, (connect_s > 0 ? res->joined / connect_s : 0));
+	histo_json(fp, &res->connect_lat);
+
+	fprintf(fp, "},\"commands\":{\"sent\":%lu,\"send\":%lu,\"send_skipped\":%lu,\"tcp_connections\":%lu,"
+		"\"send_per_s\":%.1f},",
+		res->cmds, res->sends, res->sends_skipped, res->requests,
+		(send_s > 0 ? res->sends / send_s : 0));
+
+	fprintf(fp, "\"fanout\":{\"expected\":%lu,\"delivered\":%lu,\"delivered_per_s\":%.1f,\"latency_us\":",
+		res->expected, res->delivered, (send_s > 0 ? res->delivered / send_s : 0));
+	histo_json(fp, &res->fanout_lat);
+
+	fprintf(fp, "},\"errors\":%lu,\"server\":{\"pid\":%d,\"rss_kb_start\":%ld,\"rss_kb_end\":%ld,\"rss_kb_peak\":%ld}}",
+		res->errors, (int)bench.pid, res->rss_start, res->rss_end, res->rss_peak);
+}
+
+/* Scenario file (same syntax as ape.conf) */
+
+static char *trim(char *str)
+{
+	char *end;
+
+	while (isspace((unsigned char)*str)) {
+		str++;
+	}
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1])) {
+		*--end = '\0';
+	}
+
+	return str;
+}
+
+static int scenario_set(bench_scenario *scn, const char *key, const char *val)
+{
+	if (strcmp(key, "name") == 0) {
+		snprintf(scn->name, sizeof(scn->name), "%s", val);
+	} else if (strcmp(key, "transport") == 0) {
+		struct _bench_transport *t;
+
+		for (t = bench_transports; t->name != NULL; t++) {
+			if (strcmp(t->name, val) == 0) {
+				scn->transport = t;
+				return 1;
+			}
+		}
+		return 0;
+	} else if (strcmp(key, "clients") == 0) {
+		scn->clients = atoi(val);
+	} else if (strcmp(key, "connect_rate") == 0) {
+		scn->connect_rate = atoi(val);
+	} else if (strcmp(key, "connect_timeout") == 0) {
+		scn->connect_timeout = atoi(val);
+	} else if (strcmp(key, "channels") == 0) {
+		scn->channels = atoi(val);
+	} else if (strcmp(key, "senders") == 0) {
+		scn->senders = atoi(val);
+	} else if (strcmp(key, "send_interval") == 0) {
+		scn->send_interval = atoi(val);
+	} else if (strcmp(key, "duration") == 0) {
+		scn->duration = atoi(val);
+	} else if (strcmp(key, "cmd") == 0) {
+		snprintf(scn->cmd, sizeof(scn->cmd), "%s", val);
+	} else if (strcmp(key, "cmd_fields") == 0) {
+		scn->cmd_fields = atoi(val);
+	} else if (strcmp(key, "msg_size") == 0) {
+		scn->msg_size = atoi(val);
+		if (scn->msg_size > BENCH_BUF_SIZE) {
+			scn->msg_size = BENCH_BUF_SIZE;
+		}
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int bench_set(const char *key, const char *val)
+{
+	if (strcmp(key, "host") == 0) {
+		snprintf(bench.host, sizeof(bench.host), "%s", val);
+	} else if (strcmp(key, "port") == 0) {
+		bench.port = atoi(val);
+	} else if (strcmp(key, "results") == 0) {
+		if (bench.results[0] == '\0') {
+			snprintf(bench.results, sizeof(bench.results), "%s", val);
+		}
+	} else if (strcmp(key, "server_pid") == 0) {
+		if (bench.pid == 0) {
+			bench.pid = atoi(val);
+		}
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int load_scenarios(const char *file)
+{
+	FILE *fp;
+	char line[1024];
+	int lineno = 0;
+	enum {SECTION_NONE, SECTION_BENCH, SECTION_SCENARIO} section = SECTION_NONE;
+	bench_scenario *scn = NULL;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "[ape_bench] Cannot open %s : %s\n", file, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *l = trim(line), *eq;
+
+		lineno++;
+
+		if (*l == '#' || *l == '\0') {
+			continue;
+		}
+		if (*l == '}') {
+			section = SECTION_NONE;
+			continue;
+		}
+		if (l[strlen(l) - 1] == '{') {
+			l[strlen(l) - 1] = '\0';
+			l = trim(l);
+
+			if (strcmp(l, "Bench") == 0) {
+				section = SECTION_BENCH;
+			} else if (strcmp(l, "Scenario") == 0) {
+				if (bench.nscenarios == BENCH_MAX_SCENARIOS) {
+					fprintf(stderr, "[ape_bench] %s:%d : too many scenarios\n", file, lineno);
+					break;
+				}
+				scn = &bench.scenarios[bench.nscenarios++];
+
+				snprintf(scn->name, sizeof(scn->name), "scenario%u", bench.nscenarios);
+				scn->transport = &bench_transports[0];
+				scn->clients = 100;
+				scn->connect_timeout = 10000;
+				scn->channels = 1;
+				scn->senders = 1;
+				scn->send_interval = 1000;
+				scn->duration = 10;
+				scn->msg_size = 16;
+				scn->cmd_fields = 1;
+				strcpy(scn->cmd, "SEND");
+
+				section = SECTION_SCENARIO;
+			} else {
+				fprintf(stderr, "[ape_bench] %s:%d : unknown section %s\n", file, lineno, l);
+				section = SECTION_NONE;
+			}
+			continue;
+		}
+		if ((eq = strchr(l, '=')) == NULL) {
+			fprintf(stderr, "[ape_bench] %s:%d : syntax error\n", file, lineno);
+			continue;
+		}
+		*eq = '\0';
+
+		if ((section == SECTION_BENCH && !bench_set(trim(l), trim(eq + 1))) ||
+			(section == SECTION_SCENARIO && !scenario_set(scn, trim(l), trim(eq + 1)))) {
+			fprintf(stderr, "[ape_bench] %s:%d : invalid setting %s\n", file, lineno, trim(l));
+		}
+	}
+	fclose(fp);
+
+	return 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage : %s [-f scenarios.conf] [-o results.json] [-p aped_pid] [-s scenario] [-l label]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *file = "bench/scenarios.conf", *only = NULL;
+	struct hostent *he;
+	struct rlimit rl;
+	FILE *fp;
+	unsigned int i, ran = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:o:p:s:l:h")) != -1) {
+		switch(opt) {
+			case 'f':
+				file = optarg;
+				break;
+			case 'o':
+				snprintf(bench.results, sizeof(bench.results), "%s", optarg);
+				break;
+			case 'p':
+				bench.pid = atoi(optarg);
+				break;
+			case 's':
+				only = optarg;
+				break;
+			case 'l':
+				snprintf(bench.label, sizeof(bench.label), "%s", optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	strcpy(bench.host, "127.0.0.1");
+	bench.port = 6961;
+
+	if (!load_scenarios(file)) {
+		return 1;
+	}
+	if (bench.results[0] == '\0') {
+		strcpy(bench.results, "bench-results.json");
+	}
+	if (bench.pid == 0) {
+		bench.pid = find_server_pid();
+	}
+
+	if ((he = gethostbyname(bench.host)) == NULL) {
+		fprintf(stderr, "[ape_bench] Cannot resolve %s\n", bench.host);
+		return 1;
+	}
+	bench.addr.sin_family = AF_INET;
+	bench.addr.sin_port = htons(bench.port);
+	memcpy(&bench.addr.sin_addr, he->h_addr_list[0], sizeof(bench.addr.sin_addr));
+
+	/* tens of thousands of clients, and up to BENCH_MAX_CONNS sockets each */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	getrlimit(RLIMIT_NOFILE, &rl);
+
+	bench.nfds = (rl.rlim_cur > 4194304 ? 4194304 : rl.rlim_cur);
+	bench.conns = calloc(bench.nfds, sizeof(*bench.conns));
+	bench.epfd = epoll_create(1024);
+	bench.runtag = (unsigned int)time(NULL) ^ (getpid() << 16);
+
+	signal(SIGPIPE, SIG_IGN);
+	srand(bench.runtag);
+
+	if ((fp = fopen(bench.results, "w")) == NULL) {
+		fprintf(stderr, "[ape_bench] Cannot open %s : %s\n", bench.results, strerror(errno));
+		return 1;
+	}
+	fprintf(fp, "{\"version\":1,\"label\":\"%s\",\"time\":%ld,\"host\":\"%s\",\"port\":%d,\"scenarios\":[",
+		bench.label, (long)time(NULL), bench.host, bench.port);
+
+	for (i = 0; i < bench.nscenarios; i++) {
+		bench_scenario *scn = &bench.scenarios[i];
+
+		if (only != NULL && strcmp(only, scn->name) != 0) {
+			continue;
+		}
+		if (scn->clients == 0 || scn->channels == 0) {
+			continue;
+		}
+
+		bench_run(scn);
+
+		fprintf(fp, "%s", (ran++ ? "," : ""));
+		bench_result_json(fp, scn, &bench.res);
+		fflush(fp);
+
+		fprintf(stderr, "[ape_bench] %s : %lu/%lu joined, %lu sent, %lu/%lu delivered, p99 %lu us\n",
+			scn->name, bench.res.joined, bench.res.attempted, bench.res.sends,
+			bench.res.delivered, bench.res.expected, histo_percentile(&bench.res.fanout_lat, 0.99));
+	}
+
+	fprintf(fp, "]}\n");
+	fclose(fp);
+
+	close(bench.epfd);
+	free(bench.conns);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* http_parser_bench.c */
+
+/*
+	Micro benchmark of the request parser (built with "make bench").
+
+	A browser-like request (15 headers) is parsed in one read, then split
+	in small reads to measure the cost of resuming.
+
+	Built with -DHTTP_PARSER_FUZZ it is a libFuzzer target instead, e.g. :
+	  clang -g -fsanitize=fuzzer,address -DHTTP_PARSER_FUZZ -D_GNU_SOURCE \
+	    bench/http_parser_bench.c -o http_parser_fuzz
+
+	usage : http_parser_bench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/http_parser.c"
+
+void *xmalloc(size_t size)
+{
+	void *r = malloc(size);
+	
+	if (r == NULL) {
+		abort();
+	}
+	return r;
+}
+
+#ifdef HTTP_PARSER_FUZZ
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+	http_state http;
+	char *buf = xmalloc(size + 1);
+	size_t n, fed = 0, len = 0, step = (size ? data[0] % 16 + 1 : 1);
+	
+	http_parser_reset(&http);
+	
+	/* feed the input in "step" bytes reads */
+	while (fed < size) {
+		n = (size - fed < step ? size - fed : step);
+		memcpy(&buf[len], &data[fed], n);
+		len += n;
+		fed += n;
+		
+		if (http_parse(&http, buf, len) != HTTP_PARSE_AGAIN) {
+			break;
+		}
+		/* odd steps also drop the decoded body, as a streaming caller does */
+		if (step & 1) {
+			len = http_body_discard(&http, buf, len);
+		}
+	}
+	if (http.base != NULL) {
+		http_headers_detach(&http);
+		http_header(&http, HTTP_HEADER_HOST);
+		http_header_find(&http, "x-unknown");
+		free(http.head);
+	}
+	free(buf);
+	
+	return 0;
+}
+
+#else
+
+static const char request[] =
+	"GET /0/?[{\"cmd\":\"CHECK\",\"chl\":1,\"sessid\":\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"}] HTTP/1.1\r\n"
+	"Host: 0.ape.example.com:6969\r\n"
+	"Connection: keep-alive\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.9,fr;q=0.8\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://www.example.com/chat/index.html\r\n"
+	"Origin: http://www.example.com\r\n"
+	"Cookie: session=0123456789abcdef0123456789abcdef; prefs=dark; _ga=GA1.2.1234567890.1234567890\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Pragma: no-cache\r\n"
+	"DNT: 1\r\n"
+	"Sec-Fetch-Mode: cors\r\n"
+	"Sec-Fetch-Site: same-site\r\n"
+	"X-Forwarded-For: 192.0.2.1, 198.51.100.7\r\n"
+	"\r\n";
+
+static double bench(char *buf, unsigned int len, unsigned int chunk, long iterations)
+{
+	struct timespec start, end;
+	http_state http;
+	long n;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	for (n = 0; n < iterations; n++) {
+		unsigned int i = 0;
+		
+		memcpy(buf, request, len);
+		http_parser_reset(&http);
+		
+		do {
+			i = (i + chunk > len ? len : i + chunk);
+		} while (http_parse(&http, buf, i) == HTTP_PARSE_AGAIN && i < len);
+		
+		if (http.base == NULL || http_header(&http, HTTP_HEADER_COOKIE) == NULL) {
+			fprintf(stderr, "parse error\n");
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = (argc > 1 ? atol(argv[1]) : 1000000);
+	unsigned int len = sizeof(request) - 1;
+	unsigned int chunks[] = {0, 512, 64, 1};
+	char *buf = xmalloc(len + 1);
+	int i;
+	
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+		unsigned int chunk = (chunks[i] ? chunks[i] : len);
+		long n = (chunk == 1 ? iterations / 10 : iterations);
+		
+		printf("%4u bytes reads : %8.1f ns/request\n", chunk, bench(buf, len, chunk, n));
+	}
+	free(buf);
+	
+	return 0;
+}
+
+#endif
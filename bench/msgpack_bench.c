@@ -0,0 +1,259 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* msgpack_bench.c */
+
+/*
+	Bytes and CPU per raw, JSON against the "ape.msgpack" WebSocket
+	subprotocol (built with "make bench").
+
+	For a few typical raws :
+	  - size of the JSON text and of its MessagePack form
+	  - forge : json_to_string() of the raw tree (paid for every raw)
+	  - transcode : msgpack_from_json(), paid once per raw when at least one
+	    recipient is binary
+	  - parse : what the server pays to read the same data as a command,
+	    init_json_parser() against msgpack_to_json()
+
+	Built with -DMSGPACK_FUZZ it is a libFuzzer target instead, e.g. :
+	  clang -g -fsanitize=fuzzer,address -DMSGPACK_FUZZ -D_GNU_SOURCE \
+	    bench/msgpack_bench.c -lm -o msgpack_fuzz
+
+	usage : msgpack_bench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/utils.c"
+#include "../src/json_parser.c"
+#include "../src/json.c"
+#include "../src/msgpack.c"
+
+/*
+	JSON -> MessagePack -> tree -> JSON must give back the JSON -> tree -> JSON
+	text (the transcoder is a bit more lenient than the JSON parser)
+*/
+static int roundtrip(const char *json, size_t len)
+{
+	size_t blen;
+	char *bin = msgpack_from_json(json, len, &blen);
+	json_item *a, *b;
+	struct jsontring *sa, *sb;
+	int ret;
+	
+	if (bin == NULL || (a = init_json_parser(json)) == NULL) {
+		free(bin);
+		return 1;
+	}
+	b = msgpack_to_json(bin, blen);
+	free(bin);
+	
+	if (b == NULL) {
+		free_json_item(a);
+		return 0;
+	}
+	if (a->jchild.child == NULL || b->jchild.child == NULL) {
+		ret = (a->jchild.child == b->jchild.child);
+	} else {
+		sa = json_to_string(a, NULL, 1);
+		sb = json_to_string(b, NULL, 1);
+		ret = (sa->len == sb->len && memcmp(sa->jstring, sb->jstring, sa->len) == 0);
+		
+		free(sa->jstring);
+		free(sa);
+		free(sb->jstring);
+		free(sb);
+		a = b = NULL;
+	}
+	free_json_item(a);
+	free_json_item(b);
+	
+	return ret;
+}
+
+#ifdef MSGPACK_FUZZ
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+	char *buf = malloc(size + 1);
+	json_item *item;
+	
+	memcpy(buf, data, size);
+	buf[size] = '\0';
+	
+	if ((item = msgpack_to_json(buf, size)) != NULL) {
+		free_json_item(item);
+	}
+	if (memchr(buf, '\0', size) == NULL && !roundtrip(buf, size)) {
+		abort();
+	}
+	free(buf);
+	
+	return 0;
+}
+
+#else
+
+static json_item *raw_tree(const char *name, json_item *data)
+{
+	json_item *raw = json_new_object();
+	
+	json_set_property_strZ(raw, "time", "1792428207");
+	json_set_property_strZ(raw, "raw", name);
+	json_set_property_objN(raw, "data", 4, data);
+	
+	return raw;
+}
+
+static json_item *pipe_tree(const char *casttype, const char *pubid, const char *key, const char *val)
+{
+	json_item *pipe = json_new_object(), *properties = json_new_object();
+	
+	json_set_property_strZ(pipe, "casttype", casttype);
+	json_set_property_strZ(pipe, "pubid", pubid);
+	json_set_property_strZ(properties, key, val);
+	json_set_property_objN(pipe, "properties", 10, properties);
+	
+	return pipe;
+}
+
+/* scripts/examples/move.js */
+static json_item *raw_positions()
+{
+	json_item *data = json_new_object();
+	
+	json_set_property_intZ(data, "x", 412);
+	json_set_property_intZ(data, "y", 1187);
+	json_set_property_objN(data, "from", 4, pipe_tree("uni", "21abd4201708660561f08d1d7e789851", "name", "bob"));
+	json_set_property_objN(data, "pipe", 4, pipe_tree("multi", "f5220b989065cc1946029767c35b1137", "name", "arena"));
+	
+	return raw_tree("positions", data);
+}
+
+static json_item *raw_telemetry()
+{
+	json_item *data = json_new_object(), *samples = json_new_array();
+	int i;
+	
+	for (i = 0; i < 32; i++) {
+		json_set_element_float(samples, 20.5 + i * 0.25);
+	}
+	json_set_property_intZ(data, "sensor", 7);
+	json_set_property_intZ(data, "seq", 1048577);
+	json_set_property_objN(data, "samples", 7, samples);
+	
+	return raw_tree("telemetry", data);
+}
+
+static json_item *raw_chat()
+{
+	json_item *data = json_new_object();
+	
+	json_set_property_strZ(data, "msg", "Hello \"world\",\nsee http://www.ape-project.org/ \\o/ caf\xc3\xa9");
+	json_set_property_objN(data, "from", 4, pipe_tree("uni", "21abd4201708660561f08d1d7e789851", "name", "bob"));
+	json_set_property_objN(data, "pipe", 4, pipe_tree("multi", "f5220b989065cc1946029767c35b1137", "name", "lobby"));
+	
+	return raw_tree("DATA", data);
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec end;
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void bench(const char *name, json_item *(*forge)(), long iterations)
+{
+	struct timespec start;
+	struct jsontring *string;
+	json_item *tree = forge(), *item;
+	char *json, *bin;
+	size_t len, blen;
+	double forge_ns, transcode_ns, parse_json_ns, parse_bin_ns;
+	long i;
+	
+	string = json_to_string(tree, NULL, 1);
+	json = string->jstring;
+	len = string->len;
+	free(string);
+	
+	if ((bin = msgpack_from_json(json, len, &blen)) == NULL || init_json_parser(json) == NULL || !roundtrip(json, len)) {
+		fprintf(stderr, "%s : bad MessagePack encoding\n", name);
+		exit(1);
+	}
+	free(bin);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		string = json_to_string(forge(), NULL, 1);
+		free(string->jstring);
+		free(string);
+	}
+	forge_ns = elapsed(&start) / iterations;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		free(msgpack_from_json(json, len, &blen));
+	}
+	transcode_ns = elapsed(&start) / iterations;
+	
+	bin = msgpack_from_json(json, len, &blen);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		item = init_json_parser(json);
+		free_json_item(item);
+	}
+	parse_json_ns = elapsed(&start) / iterations;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		item = msgpack_to_json(bin, blen);
+		free_json_item(item);
+	}
+	parse_bin_ns = elapsed(&start) / iterations;
+	
+	printf("%-10s %5zu %5zu (%3.0f%%) %8.0f %10.0f %11.0f %11.0f\n", name, len, blen, blen * 100. / len,
+		forge_ns, transcode_ns, parse_json_ns, parse_bin_ns);
+	
+	free(json);
+	free(bin);
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = (argc > 1 ? atol(argv[1]) : 200000);
+	
+	printf("%-10s %5s %13s %8s %10s %11s %11s\n", "raw", "JSON", "MessagePack", "forge", "transcode", "parse JSON", "parse MP");
+	printf("%-10s %5s %13s %8s %10s %11s %11s\n", "", "bytes", "bytes", "ns", "ns", "ns", "ns");
+	
+	bench("positions", raw_positions, iterations);
+	bench("telemetry", raw_telemetry, iterations);
+	bench("chat", raw_chat, iterations);
+	
+	return 0;
+}
+
+#endif
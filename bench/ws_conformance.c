@@ -0,0 +1,431 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* ws_conformance.c */
+
+/*
+	RFC 6455 checks against a running aped (built with "make bench").
+
+	Each case opens a WebSocket on /6/, writes its frames (in one write, or
+	"split" bytes at a time) and compares what comes back : text replies,
+	pongs, and the close code before the server ends the connection.
+	Covered : handshake (Sec-WebSocket-Accept, 426 for unknown versions),
+	batched, split and fragmented frames, control frames between fragments,
+	protocol violations (1002), invalid UTF-8 (1007), oversized messages
+	(1009) and close echo.
+
+	With "ping_interval" (the ws_ping_interval of the server), an idle
+	client must get a ping within the interval and be dropped when it does
+	not answer.
+
+	usage : ws_conformance [host [port [ping_interval]]]
+
+	Exits with the number of failed cases.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define WSC_KEY "dGhlIHNhbXBsZSBub25jZQ=="
+#define WSC_ACCEPT "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" /* RFC 6455 1.3 */
+#define WSC_WAIT 600 /* ms of silence before a case is over */
+#define WSC_BIG 70000
+
+/* frame flags, the first byte (FIN, RSV, opcode) is given as is */
+#define WSC_NOMASK 1
+#define WSC_RAW 2 /* "data" is written as is, no header */
+
+#define CMD "[{\"cmd\":\"CHECK\",\"chl\":1,\"sessid\":\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"}]"
+
+struct wsc_frame {
+	unsigned char b0;
+	const char *data; /* NULL with len : a CHECK command padded to len */
+	int len; /* -1 : strlen(data) */
+	int flags;
+	unsigned long long forcelen; /* announced length if not 0, no payload sent */
+};
+
+struct wsc_case {
+	const char *name;
+	struct wsc_frame frames[4];
+	int split;
+	int texts; /* text frames expected back */
+	const char *pong; /* payload of the pong expected back, NULL if none */
+	int close; /* close code sent by the server before it closes, 0 : stays open */
+};
+
+static const struct wsc_case cases[] = {
+	{"single", {{0x81, CMD, -1}}, 0, 1, NULL, 0},
+	{"batched x3", {{0x81, CMD, -1}, {0x81, CMD, -1}, {0x81, CMD, -1}}, 0, 3, NULL, 0},
+	{"split by 1 byte", {{0x81, CMD, -1}, {0x81, CMD, -1}}, 1, 2, NULL, 0},
+	{"fragmented + ping", {{0x01, CMD, 10}, {0x89, "hi", -1}, {0x00, CMD + 10, 20}, {0x80, CMD + 30, -1}}, 0, 1, "hi", 0},
+	{"70000 bytes by 8192", {{0x81, NULL, WSC_BIG}}, 8192, 1, NULL, 0},
+	{"empty ping", {{0x89, "", 0}}, 0, 0, "", 0},
+	{"utf-8 split in fragments", {{0x01, "[\"\xce", -1}, {0x80, "\xba\"]", -1}}, 0, 1, NULL, 0},
+	{"unmasked", {{0x81, CMD, -1, WSC_NOMASK}}, 0, 0, NULL, 1002},
+	{"rsv1 set", {{0xc1, CMD, -1}}, 0, 0, NULL, 1002},
+	{"bad continuation", {{0x80, CMD, -1}}, 0, 0, NULL, 1002},
+	{"text in fragment", {{0x01, CMD, 5}, {0x81, CMD + 5, -1}}, 0, 0, NULL, 1002},
+	{"126 bytes ping", {{0x89, NULL, 126}}, 0, 0, NULL, 1002},
+	{"fragmented ping", {{0x09, "x", -1}}, 0, 0, NULL, 1002},
+	{"reserved opcode", {{0x83, "", 0}}, 0, 0, NULL, 1002},
+	{"64 bits length msb", {{0, "\x81\xff\x80\0\0\0\0\0\0\x01mask", 14, WSC_RAW}}, 0, 0, NULL, 1002},
+	{"invalid utf-8", {{0x81, "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5\xed\xa0\x80", -1}}, 0, 0, NULL, 1007},
+	{"truncated utf-8", {{0x81, "[\"\xce", -1}}, 0, 0, NULL, 1007},
+	{"too big", {{0x81, "", 0, 0, 1 << 30}}, 0, 0, NULL, 1009},
+	{"close 1000", {{0x88, "\x03\xe8" "bye", -1}}, 0, 0, NULL, 1000},
+	{"close empty", {{0x88, "", 0}}, 0, 0, NULL, 1000},
+	{"close 1 byte", {{0x88, "\x03", -1}}, 0, 0, NULL, 1002},
+	{"close 999", {{0x88, "\x03\xe7", -1}}, 0, 0, NULL, 1002},
+	{"close 1005", {{0x88, "\x03\xed", -1}}, 0, 0, NULL, 1002},
+	{"close bad reason", {{0x88, "\x03\xe8\xff", -1}}, 0, 0, NULL, 1007},
+	{NULL}
+};
+
+struct wsc_result {
+	int texts;
+	int pongs;
+	int pings;
+	char pong[128];
+	int close; /* -1 : no close frame */
+	int closed; /* the server ended the connection */
+};
+
+static const char *host = "127.0.0.1";
+static const char *port = "6961";
+
+static int wsc_connect(void)
+{
+	struct addrinfo hints, *res;
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		return -1;
+	}
+	fd = socket(res->ai_family, res->ai_socktype, 0);
+
+	if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+/* Read until the end of the response head (or "ms" of silence), returns its length */
+static int wsc_read_head(int fd, char *buf, int size, int ms)
+{
+	struct pollfd pfd = {fd, POLLIN, 0};
+	int len = 0, n;
+
+	while (len < size - 1 && poll(&pfd, 1, ms) == 1) {
+		if ((n = read(fd, buf + len, 1)) <= 0) {
+			break;
+		}
+		len += n;
+		buf[len] = '\0';
+
+		if (len >= 4 && memcmp(buf + len - 4, "\r\n\r\n", 4) == 0) {
+			break;
+		}
+	}
+	buf[len] = '\0';
+
+	return len;
+}
+
+/* Handshake with "version", the response head is left in "head" */
+static int wsc_open(const char *version, char *head, int size)
+{
+	char req[512];
+	int fd, len;
+
+	if ((fd = wsc_connect()) == -1) {
+		return -1;
+	}
+	len = snprintf(req, sizeof(req), "GET /6/ HTTP/1.1\r\nHost: %s:%s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: " WSC_KEY "\r\nSec-WebSocket-Version: %s\r\n\r\n", host, port, version);
+
+	if (write(fd, req, len) != len) {
+		close(fd);
+		return -1;
+	}
+	wsc_read_head(fd, head, size, 2000);
+
+	return fd;
+}
+
+static char *wsc_big_cmd(int len)
+{
+	char *cmd = malloc(len);
+	int head = strlen(CMD) - 2;
+
+	/* [{..."sessid":"..." ,"params":{"x":"aaa..."}}] */
+	memcpy(cmd, CMD, head);
+	memcpy(cmd + head, ",\"params\":{\"x\":\"", 16);
+	memset(cmd + head + 16, 'a', len - head - 16 - 4);
+	memcpy(cmd + len - 4, "\"}}]", 4);
+
+	return cmd;
+}
+
+/* Append the frame to "out" (large enough), returns its length */
+static size_t wsc_build(unsigned char *out, const struct wsc_frame *f)
+{
+	static const unsigned char mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+	char *big = NULL;
+	const char *data = f->data;
+	unsigned long long n;
+	size_t len = (f->len == -1 ? strlen(f->data) : (size_t)f->len), pos = 0, i;
+
+	if (f->flags & WSC_RAW) {
+		memcpy(out, data, len);
+		return len;
+	}
+	if (data == NULL) {
+		data = big = wsc_big_cmd(len);
+	}
+	n = (f->forcelen ? f->forcelen : len);
+
+	out[pos++] = f->b0;
+
+	if (n < 126) {
+		out[pos++] = n;
+	} else if (n < 65536) {
+		out[pos++] = 126;
+		out[pos++] = n >> 8;
+		out[pos++] = n;
+	} else {
+		out[pos++] = 127;
+		for (i = 0; i < 8; i++) {
+			out[pos++] = n >> (56 - i * 8);
+		}
+	}
+	if (f->flags & WSC_NOMASK) {
+		memcpy(out + pos, data, len);
+	} else {
+		out[1] |= 0x80;
+		memcpy(out + pos, mask, 4);
+		pos += 4;
+		for (i = 0; i < len; i++) {
+			out[pos + i] = data[i] ^ mask[i % 4];
+		}
+	}
+	free(big);
+
+	return pos + len;
+}
+
+static void wsc_send(int fd, const unsigned char *data, size_t len, int split)
+{
+	size_t pos = 0, n;
+
+	while (pos < len) {
+		n = (split && len - pos > (size_t)split ? (size_t)split : len - pos);
+		if (write(fd, data + pos, n) != (ssize_t)n) {
+			return;
+		}
+		pos += n;
+		if (split) {
+			usleep(500);
+		}
+	}
+}
+
+/* Collect the server frames until the connection ends or "ms" of silence */
+static void wsc_collect(int fd, struct wsc_result *res, int ms)
+{
+	static unsigned char buf[256 * 1024];
+	struct pollfd pfd = {fd, POLLIN, 0};
+	size_t len = 0, pos, n;
+	ssize_t r;
+
+	memset(res, 0, sizeof(*res));
+	res->close = -1;
+
+	while (poll(&pfd, 1, ms) == 1) {
+		if ((r = read(fd, buf + len, sizeof(buf) - len)) <= 0) {
+			res->closed = 1;
+			break;
+		}
+		len += r;
+
+		for (;;) {
+			if (len < 2) {
+				break;
+			}
+			n = buf[1] & 0x7f;
+			pos = 2;
+
+			if (n == 126) {
+				if (len < 4) {
+					break;
+				}
+				n = (buf[2] << 8) | buf[3];
+				pos = 4;
+			} else if (n == 127) {
+				if (len < 10) {
+					break;
+				}
+				n = 0;
+				for (pos = 2; pos < 10; pos++) {
+					n = (n << 8) | buf[pos];
+				}
+			}
+			if (len - pos < n) {
+				break;
+			}
+			switch (buf[0] & 0x0f) {
+				case 0x01:
+					res->texts++;
+					break;
+				case 0x08:
+					res->close = (n >= 2 ? (buf[pos] << 8) | buf[pos + 1] : 1005);
+					break;
+				case 0x09:
+					res->pings++;
+					break;
+				case 0x0a:
+					if (res->pongs++ == 0 && n < sizeof(res->pong)) {
+						memcpy(res->pong, buf + pos, n);
+						res->pong[n] = '\0';
+					}
+					break;
+			}
+			memmove(buf, buf + pos + n, len - pos - n);
+			len -= pos + n;
+		}
+	}
+}
+
+static int wsc_run(const struct wsc_case *c)
+{
+	static unsigned char out[WSC_BIG * 2];
+	struct wsc_result res;
+	char head[1024];
+	size_t len = 0;
+	int fd, i, ok;
+
+	if ((fd = wsc_open("13", head, sizeof(head))) == -1 || strncmp(head, "HTTP/1.1 101", 12) != 0) {
+		printf("%-28s FAIL (handshake)\n", c->name);
+		if (fd != -1) {
+			close(fd);
+		}
+		return 0;
+	}
+	for (i = 0; i < 4 && (c->frames[i].data != NULL || c->frames[i].len > 0); i++) {
+		len += wsc_build(out + len, &c->frames[i]);
+	}
+	wsc_send(fd, out, len, c->split);
+	wsc_collect(fd, &res, WSC_WAIT);
+	close(fd);
+
+	ok = (res.texts == c->texts &&
+		res.pongs == (c->pong != NULL) && (c->pong == NULL || strcmp(res.pong, c->pong) == 0) &&
+		(c->close ? (res.close == c->close && res.closed) : (res.close == -1 && !res.closed)));
+
+	if (ok) {
+		printf("%-28s ok\n", c->name);
+	} else {
+		printf("%-28s FAIL (texts %d/%d, pongs %d, close %d/%d, %s)\n", c->name, res.texts, c->texts,
+			res.pongs, res.close, c->close, (res.closed ? "closed" : "open"));
+	}
+
+	return ok;
+}
+
+static int wsc_handshake(void)
+{
+	char head[1024];
+	int fd, ok;
+
+	fd = wsc_open("13", head, sizeof(head));
+	ok = (fd != -1 && strncmp(head, "HTTP/1.1 101", 12) == 0 && strstr(head, "Sec-WebSocket-Accept: " WSC_ACCEPT "\r\n") != NULL);
+	printf("%-28s %s\n", "handshake", (ok ? "ok" : "FAIL"));
+	if (fd != -1) {
+		close(fd);
+	}
+	if ((fd = wsc_open("9", head, sizeof(head))) != -1) {
+		close(fd);
+	}
+	if (fd == -1 || strncmp(head, "HTTP/1.1 426", 12) != 0 || strstr(head, "Sec-WebSocket-Version: 13\r\n") == NULL) {
+		printf("%-28s FAIL\n", "unknown version (426)");
+		return ok;
+	}
+	printf("%-28s ok\n", "unknown version (426)");
+
+	return ok + 1;
+}
+
+/* Idle : pinged within "interval", then dropped when the pings are ignored */
+static int wsc_ping(int interval)
+{
+	struct wsc_result res;
+	char head[1024];
+	int fd, ok;
+
+	if ((fd = wsc_open("13", head, sizeof(head))) == -1) {
+		printf("%-28s FAIL (handshake)\n", "ping timeout");
+		return 0;
+	}
+	/* a ping comes within the interval, the drop at most one interval later */
+	wsc_collect(fd, &res, (interval * 2 + 1) * 1000);
+	ok = (res.pings > 0 && res.closed);
+	close(fd);
+	printf("%-28s %s\n", "ping timeout", (ok ? "ok" : "FAIL"));
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int i, total = 2, passed;
+
+	if (argc > 1) {
+		host = argv[1];
+	}
+	if (argc > 2) {
+		port = argv[2];
+	}
+	passed = wsc_handshake();
+
+	for (i = 0; cases[i].name != NULL; i++, total++) {
+		passed += wsc_run(&cases[i]);
+	}
+	if (argc > 3 && atoi(argv[3]) > 0) {
+		passed += wsc_ping(atoi(argv[3]));
+		total++;
+	}
+	printf("%d/%d passed\n", passed, total);
+
+	return total - passed;
+}
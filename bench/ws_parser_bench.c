@@ -0,0 +1,166 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+/* ws_parser_bench.c */
+
+/*
+	Frame throughput of the RFC 6455 parser (built with "make bench").
+
+	A stream of masked text frames is fed in socket-sized reads, the way
+	process_websocket() does, for a few payload sizes, then as messages
+	split in 4 fragments.
+
+	Built with -DWS_PARSER_FUZZ it is a libFuzzer target instead, e.g. :
+	  clang -g -fsanitize=fuzzer,address -DWS_PARSER_FUZZ -D_GNU_SOURCE \
+	    bench/ws_parser_bench.c -o ws_parser_fuzz
+
+	usage : ws_parser_bench [megabytes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/ws_parser.c"
+
+#ifdef WS_PARSER_FUZZ
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+	websocket_state ws;
+	char *buf = malloc(size + 1);
+	size_t n, fed = 0, step = (size ? data[0] % 64 + 1 : 1);
+	unsigned int len = 0;
+	ws_parse_status ret = WS_PARSE_AGAIN;
+	
+	ws_parser_reset(&ws, 4096);
+	
+	while (fed < size && ret != WS_PARSE_ERROR && ret != WS_PARSE_CLOSE) {
+		n = (size - fed < step ? size - fed : step);
+		memcpy(&buf[len], &data[fed], n);
+		len += n;
+		fed += n;
+		
+		while ((ret = ws_parse(&ws, buf, &len)) != WS_PARSE_AGAIN && ret != WS_PARSE_ERROR && ret != WS_PARSE_CLOSE) {
+			/* what process_websocket() does with a message */
+			char saved = buf[ws.data_len];
+			
+			buf[ws.data_len] = '\0';
+			buf[ws.data_len] = saved;
+		}
+	}
+	free(buf);
+	
+	return 0;
+}
+
+#else
+
+#define BENCH_READ 16384
+
+/* "count" masked frames of "size" bytes, each message split in "fragments" frames */
+static unsigned char *forge(unsigned int size, unsigned int fragments, unsigned int count, unsigned int *len)
+{
+	unsigned int frag = size / fragments, i, j, k, n, h;
+	unsigned char *stream = malloc((size + fragments * WS_MAX_HEADER) * count), *p = stream;
+	const unsigned char mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+	
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < fragments; j++) {
+			n = (j == fragments - 1 ? size - frag * j : frag);
+			
+			h = ws_frame_header(p, (j == fragments - 1 ? WS_FIN : 0) | (j == 0 ? WS_OP_TEXT : WS_OP_CONTINUATION), n);
+			p[1] |= 0x80; /* client frames are masked */
+			p += h;
+			memcpy(p, mask, 4);
+			p += 4;
+			
+			for (k = 0; k < n; k++) {
+				p[k] = ('a' + (k % 26)) ^ mask[k & 3];
+			}
+			p += n;
+		}
+	}
+	*len = p - stream;
+	
+	return stream;
+}
+
+static void bench(unsigned int size, unsigned int fragments, long total)
+{
+	struct timespec start, end;
+	websocket_state ws;
+	unsigned int count = (total / size > 0 ? total / size : 1), len, pos = 0, blen = 0, messages = 0;
+	unsigned char *stream = forge(size, fragments, count, &len);
+	char *buf = malloc(size + BENCH_READ * 2 + 1);
+	ws_parse_status ret;
+	double ns;
+	
+	ws_parser_reset(&ws, size + 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	while (pos < len) {
+		unsigned int n = (len - pos < BENCH_READ ? len - pos : BENCH_READ);
+		
+		memcpy(&buf[blen], &stream[pos], n);
+		blen += n;
+		pos += n;
+		
+		while ((ret = ws_parse(&ws, buf, &blen)) == WS_PARSE_MESSAGE) {
+			messages++;
+		}
+		if (ret != WS_PARSE_AGAIN) {
+			fprintf(stderr, "parse error %d\n", ws.close_code);
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	if (messages != count) {
+		fprintf(stderr, "%u messages parsed, %u expected\n", messages, count);
+		exit(1);
+	}
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	
+	printf("%6u bytes x %u frame%s : %10.0f messages/s %8.1f MB/s\n", size, fragments, (fragments > 1 ? "s" : " "),
+		count / ns * 1e9, len / ns * 1e3);
+	
+	free(stream);
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	long total = (argc > 1 ? atol(argv[1]) : 256) * 1024 * 1024;
+	unsigned int sizes[] = {16, 128, 1024, 16384, 262144};
+	int i;
+	
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench(sizes[i], 1, total);
+	}
+	for (i = 2; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench(sizes[i], 4, total);
+	}
+	
+	return 0;
+}
+
+#endif
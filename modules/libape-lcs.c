@@ -228,14 +228,7 @@ static unsigned int lcs_join(callbackp *callbacki)
 
 	bool oname_needfree = true;
 
-	struct _http_header_line *hl = callbacki->hlines;
-	while (hl) {
-		if (!strcasecmp(hl->key.val, "refer")) {
-			ref = hl->value.val;
-			break;
-		}
-		hl = hl->next;
-	}
+	ref = (char *)http_header_find(callbacki->http, "refer");
 	JNEED_STR(callbacki->param, "aname", aname, RETURN_BAD_PARAMS);
 	JNEED_INT(callbacki->param, "utime", utime, RETURN_BAD_PARAMS);
 	JNEED_STR(callbacki->param, "url", url, RETURN_BAD_PARAMS);
@@ -26,16 +26,26 @@
 #include <mysac.h>
 #endif
 #include <jsapi.h>
+#include <jsdbgapi.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <glob.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "plugins.h"
 #include "global_plugins.h"
+#include "../src/metrics.h"
+#include "../src/workers.h"
+#include "../src/http_client.h"
 
 #define MODULE_NAME "spidermonkey"
 
 /* Return the global SpiderMonkey Runtime instance e.g. ASMR->runtime */
-#define ASMR ((ape_sm_runtime *)get_property(g_ape->properties, "sm_runtime")->val)
-#define ASMC ((JSContext *)get_property(g_ape->properties, "sm_context")->val)
+#define ASMR ((ape_sm_runtime *)get_property_val_slot(g_ape->properties, &g_ape->slots, EXTEND_SLOT_SM_RUNTIME))
+#define ASMC ((JSContext *)get_property_val_slot(g_ape->properties, &g_ape->slots, EXTEND_SLOT_SM_CONTEXT))
 
 #define APEUSER_TO_JSOBJ(apeuser) \
 		 (JSObject *)get_property(apeuser->properties, "jsobj")->val
@@ -82,6 +92,7 @@ struct _ape_sm_callback
 	jsval func;
 	ape_sm_callback_t type;
 	JSContext *cx;
+	metric *stats;
 	struct _ape_sm_callback *next;
 };
 static int ape_fire_hook(ape_sm_callback *cbk, JSObject *obj, JSObject *cb, callbackp *callbacki, acetables *g_ape);
@@ -109,54 +120,394 @@ struct _ape_sm_runtime {
 	JSRuntime *runtime;
 	
 	ape_sm_compiled *scripts;
+	
+	/* Interrupts a handler running for more than "budget" msec (0 : disabled) */
+	struct {
+		pthread_t thread;
+		volatile int running;
+		volatile unsigned long deadline; /* CLOCK_MONOTONIC msec, 0 when disarmed */
+		
+		JSContext *cx;
+		const char *name;
+		int budget;
+		int depth;
+		int interrupted;
+		
+		metric *timeouts;
+	} watchdog;
+	
+	/* Idle-time GC scheduling (see sm_gc_tick()) */
+	struct {
+		JSContext *cx;
+		
+		uint32 max_bytes;
+		uint32 idle_threshold; /* heap growth since the last GC */
+		uint32 last_bytes; /* heap size after the last GC */
+		
+		int interval; /* msec */
+		int budget; /* % of wall time */
+		long credit; /* usec */
+		unsigned long avg_pause; /* usec */
+		unsigned long busy; /* loop processing time at the last tick */
+		
+		struct timespec start;
+		metric *pauses;
+	} gc;
 };
 
+static unsigned long sm_monotonic_msec()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void *sm_watchdog_thread(void *data)
+{
+	ape_sm_runtime *asr = data;
+	struct timespec tick = {0, 10000000}; /* 10ms resolution */
+	
+	while (asr->watchdog.running) {
+		unsigned long deadline;
+		
+		nanosleep(&tick, NULL);
+		
+		if ((deadline = asr->watchdog.deadline) && sm_monotonic_msec() >= deadline) {
+			/* The engine calls sm_operation_callback() at its next safe point */
+			JS_TriggerOperationCallback(asr->watchdog.cx);
+		}
+	}
+	
+	return NULL;
+}
+
+/* Started on first use : threads don't survive the daemonization */
+static void sm_watchdog_start(ape_sm_runtime *asr)
+{
+	sigset_t set, old;
+	
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	
+	asr->watchdog.running = 1;
+	if (pthread_create(&asr->watchdog.thread, NULL, sm_watchdog_thread, asr) != 0) {
+		asr->watchdog.running = 0;
+		asr->watchdog.budget = 0;
+		alog_warn("JavaScript : cannot start the watchdog thread, scripts run without time budget");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void sm_watchdog_stop(ape_sm_runtime *asr)
+{
+	if (asr->watchdog.running) {
+		asr->watchdog.running = 0;
+		pthread_join(asr->watchdog.thread, NULL);
+	}
+}
+
+/* "fn (file:line) < caller (file:line) < ..." */
+static void sm_stack_string(JSContext *cx, char *out, size_t size)
+{
+	JSStackFrame *fp, *iter = NULL;
+	size_t len = 0;
+	
+	out[0] = '\0';
+	
+	while ((fp = JS_FrameIterator(cx, &iter)) != NULL && len < size) {
+		JSScript *script = JS_GetFrameScript(cx, fp);
+		JSFunction *fun;
+		char fname[64] = "<top>";
+		
+		if (script == NULL) { /* native frame */
+			continue;
+		}
+		if ((fun = JS_GetFrameFunction(cx, fp)) != NULL) {
+			JSString *id = JS_GetFunctionId(fun);
+			
+			if (id != NULL) {
+				size_t flen = JS_EncodeStringToBuffer(id, fname, sizeof(fname) - 1);
+				fname[MIN(flen, sizeof(fname) - 1)] = '\0';
+			} else {
+				strcpy(fname, "<anonymous>");
+			}
+		}
+		len += snprintf(out + len, size - len, "%s%s (%s:%u)", (len ? " < " : ""), fname,
+			JS_GetScriptFilename(cx, script), JS_PCToLineNumber(cx, script, JS_GetFramePC(cx, fp)));
+	}
+}
+
+static JSBool sm_operation_callback(JSContext *cx)
+{
+	ape_sm_runtime *asr = JS_GetRuntimePrivate(JS_GetRuntime(cx));
+	unsigned long deadline;
+	
+	if (asr == NULL || !(deadline = asr->watchdog.deadline) || sm_monotonic_msec() < deadline) {
+		return JS_TRUE;
+	}
+	
+	if (!asr->watchdog.interrupted) {
+		char stack[512];
+		
+		sm_stack_string(cx, stack, sizeof(stack));
+		alog_warn("JavaScript : handler \"%s\" interrupted after %dms : %s", asr->watchdog.name, asr->watchdog.budget, stack);
+		
+		METRIC_INC(asr->watchdog.timeouts);
+		asr->watchdog.interrupted = 1;
+	}
+	
+	/* Uncatchable : unwinds the whole script */
+	return JS_FALSE;
+}
+
+static metric *sm_handler_metric(const char *type, const char *name)
+{
+	char label[128];
+	
+	snprintf(label, sizeof(label), "type=\"%s\",handler=\"%s\"", type, (name != NULL ? name : ""));
+	
+	return metric_register("ape_js_handler_duration_seconds", "JavaScript handlers execution time", METRIC_HISTOGRAM, label);
+}
+
+#define SM_HANDLER_STATS(var, type, name) \
+	((var) != NULL ? (var) : ((var) = sm_handler_metric(type, name)))
+
+/*
+	Run a JS handler under the watchdog and record its execution time.
+	Nested calls (handlers fired from a native) share the outermost budget.
+	"interrupted" (may be NULL) is set when the watchdog stopped the script.
+*/
+static JSBool sm_call_value(JSContext *cx, JSObject *obj, jsval fval, uintN argc, jsval *argv, jsval *rval, const char *name, metric *stats, int *interrupted)
+{
+	ape_sm_runtime *asr = JS_GetRuntimePrivate(JS_GetRuntime(cx));
+	struct timespec start;
+	JSBool ret;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	if (asr->watchdog.depth++ == 0 && asr->watchdog.budget) {
+		if (!asr->watchdog.running) {
+			sm_watchdog_start(asr);
+		}
+		asr->watchdog.cx = cx;
+		asr->watchdog.name = name;
+		asr->watchdog.interrupted = 0;
+		asr->watchdog.deadline = start.tv_sec * 1000UL + start.tv_nsec / 1000000 + asr->watchdog.budget;
+	}
+	
+	ret = JS_CallFunctionValue(cx, obj, fval, argc, argv, rval);
+	
+	if (stats != NULL) {
+		metric_observe(stats, metric_usec_since(&start));
+	}
+	
+	if (interrupted != NULL) {
+		*interrupted = asr->watchdog.interrupted;
+	}
+	
+	if (--asr->watchdog.depth == 0) {
+		asr->watchdog.deadline = 0;
+		asr->watchdog.interrupted = 0;
+	}
+	
+	return ret;
+}
+
+static JSBool sm_call_name(JSContext *cx, JSObject *obj, const char *fname, uintN argc, jsval *argv, jsval *rval, metric *stats)
+{
+	jsval fval;
+	
+	if (!JS_GetProperty(cx, obj, fname, &fval)) {
+		return JS_FALSE;
+	}
+	
+	return sm_call_value(cx, obj, fval, argc, argv, rval, fname, stats, NULL);
+}
+
+/* Fixed handlers (sockets, timers, ...) : one histogram per call site */
+#define SM_CALL_NAME(cx, obj, type, fname, argc, argv, rval) \
+	do { \
+		static metric *_stats = NULL; \
+		sm_call_name(cx, obj, fname, argc, argv, rval, SM_HANDLER_STATS(_stats, type, fname)); \
+	} while (0)
+
+#define SM_CALL_VALUE(cx, obj, fval, type, name, argc, argv, rval) \
+	do { \
+		static metric *_stats = NULL; \
+		sm_call_value(cx, obj, fval, argc, argv, rval, name, SM_HANDLER_STATS(_stats, type, name), NULL); \
+	} while (0)
+
+/*
+	GC scheduling : instead of collecting from socket callbacks (JS_MaybeGC),
+	sm_gc_tick() collects when the heap grew and the event loop is mostly idle.
+	GC time is limited to "budget" % of the wall time (token bucket), unless
+	the heap is close to its limit.
+*/
+static JSBool sm_gc_callback(JSContext *cx, JSGCStatus status)
+{
+	ape_sm_runtime *asr = JS_GetRuntimePrivate(JS_GetRuntime(cx));
+	unsigned long pause;
+	
+	if (asr == NULL) {
+		return JS_TRUE;
+	}
+	
+	switch(status) {
+		case JSGC_BEGIN:
+			clock_gettime(CLOCK_MONOTONIC, &asr->gc.start);
+			break;
+		case JSGC_END:
+			pause = metric_usec_since(&asr->gc.start);
+			
+			metric_observe(asr->gc.pauses, pause);
+			
+			asr->gc.avg_pause = (asr->gc.avg_pause * 7 + pause) / 8;
+			asr->gc.credit -= pause;
+			asr->gc.last_bytes = JS_GetGCParameter(asr->runtime, JSGC_BYTES);
+			break;
+		default:
+			break;
+	}
+	
+	return JS_TRUE;
+}
+
+static void sm_gc_tick(ape_sm_runtime *asr, int *last)
+{
+	uint32 bytes = JS_GetGCParameter(asr->runtime, JSGC_BYTES);
+	unsigned long busy = ape_metrics[APE_M_LOOP_TIME].histo->sum;
+	unsigned long interval = asr->gc.interval * 1000UL;
+	int idle = (busy - asr->gc.busy) < interval / 2;
+	
+	asr->gc.busy = busy;
+	
+	/* Earn GC time, up to one second worth of budget */
+	asr->gc.credit = MIN(asr->gc.credit + (long)(interval * asr->gc.budget / 100), 10000L * asr->gc.budget);
+	
+	if (bytes >= asr->gc.max_bytes / 4 * 3) {
+		JS_GC(asr->gc.cx);
+	} else if (idle && bytes > asr->gc.last_bytes + asr->gc.idle_threshold && asr->gc.credit >= (long)asr->gc.avg_pause) {
+		JS_GC(asr->gc.cx);
+	}
+}
+
+static long sm_gauge_heap_bytes(acetables *g_ape)
+{
+	return JS_GetGCParameter(ASMR->runtime, JSGC_BYTES);
+}
+
+/* How received data is handed to onRead() */
+typedef enum {
+	SM_SOCK_STRING,
+	SM_SOCK_LINES, /* "flushlf" */
+	SM_SOCK_BINARY, /* Buffer view */
+	SM_SOCK_FRAME16, /* Buffer view per frame, 16 or 32 bits big endian length prefix */
+	SM_SOCK_FRAME32
+} ape_sm_sock_mode_t;
+
+#define SM_SOCK_MAX_FRAME (1024 * 1024)
+
 struct _ape_sock_callbacks {
 
 	JSObject *server_obj;
 	ape_sm_compiled  *asc;
 	short int state;
 	void *private;
+	
+	ape_sm_sock_mode_t mode;
+	unsigned int max_frame;
 };
 
 struct _ape_sock_js_obj {
 	ape_socket *client;
 	JSObject *client_obj;
+	JSObject *view; /* Buffer reused for each read (binary modes) */
 };
 
 #ifdef _USE_MYSQL
+#define APE_MYSQL_BUFFER (1024*1024)
+#define APE_MYSQL_STMT_CACHE 256
+
+/* Errors raised by the pool itself (mysac errors are positive) */
+typedef enum {
+	APE_MYSQL_EQUEUE_FULL = -1,
+	APE_MYSQL_ETIMEOUT = -2,
+	APE_MYSQL_ECLOSED = -3,
+	APE_MYSQL_EPARAMS = -4
+} ape_mysql_error_t;
+
 struct _ape_mysql_queue {
 	struct _ape_mysql_queue	*next;
-	MYSAC_RES *res;
 	char *query;
 	unsigned int query_len;
 	jsval callback;
+	
+	struct timespec queued; /* then execution start */
+	unsigned long deadline; /* monotonic msec (0 : none) */
 };
 #endif
 
 typedef enum {
 	SQL_READY_FOR_QUERY,
-	SQL_NEED_QUEUE
+	SQL_NEED_QUEUE,
+	SQL_CONNECTING
 } ape_mysql_state_t;
 
 #ifdef _USE_MYSQL
-struct _ape_mysql_data {
+struct _ape_mysql_data;
+
+/* A server connection, running one query at a time */
+struct _ape_mysql_conn {
 	MYSAC *my;
-	void (*on_success)(struct _ape_mysql_data *, int);
+	int fd;
+	char *res_buf; /* reused by each query */
+	void (*on_success)(struct _ape_mysql_conn *, int);
+	ape_mysql_state_t state;
+	
+	struct _ape_mysql_queue *current;
+	struct _ape_mysql_data *pool;
+	struct _ape_mysql_conn *next;
+};
+
+/* Ape.MySQL instance : a pool of connections sharing one queue */
+struct _ape_mysql_data {
 	JSObject *jsmysql;
 	JSContext *cx;
+	acetables *g_ape;
+	
+	char *host;
+	char *login;
+	char *pass;
 	char *db;
-	void *data;
-	jsval callback;
-	ape_mysql_state_t state;
+	
+	struct _ape_mysql_conn *conns;
+	struct _ape_mysql_conn *last; /* connection of the last completed query */
+	unsigned int nconns;
+	unsigned int nconnecting;
+	unsigned int min;
+	unsigned int max;
+	int connected; /* onConnect() fired */
+	int error; /* code of the last completed query */
+	
+	unsigned int queue_limit;
+	unsigned int timeout; /* msec (0 : none) */
 	
 	struct {
 		struct _ape_mysql_queue *head;
 		struct _ape_mysql_queue *foot;
+		unsigned int length;
 	} queue;
 };
 
-static void mysac_query_success(struct _ape_mysql_data *myhandle, int code);
+/* Parsed query with "?" placeholders, cached by SQL text */
+struct _ape_mysql_stmt {
+	unsigned int nparams;
+	unsigned int *holes; /* offset of each "?" */
+};
+
+static void mysac_query_success(struct _ape_mysql_conn *conn, int code);
 static struct _ape_mysql_queue *apemysql_push_queue(struct _ape_mysql_data *myhandle, char *query, unsigned int query_len, jsval callback);
 static void apemysql_shift_queue(struct _ape_mysql_data *myhandle);
 #endif
@@ -267,74 +618,438 @@ static JSClass mysql_class = {
 };
 #endif
 
+/*
+	Lazy views over a native json_item tree (commands params) :
+	values are converted to JS on first access, the tree is shared by all
+	the views created from it and released with the last one.
+*/
+typedef struct _ape_sm_jsontree ape_sm_jsontree;
+struct _ape_sm_jsontree {
+	json_item *head;
+	unsigned int refs;
+};
+
+typedef struct _ape_sm_jsonview ape_sm_jsonview;
+struct _ape_sm_jsonview {
+	ape_sm_jsontree *tree;
+	json_item *fields;
+	unsigned int nfields;
+	unsigned char resolved[1]; /* one bit per field */
+};
+
+#define JSONVIEW_RESOLVED(view, i) (view->resolved[(i) >> 3] & (1 << ((i) & 7)))
+#define JSONVIEW_SET_RESOLVED(view, i) (view->resolved[(i) >> 3] |= (1 << ((i) & 7)))
+
+/* infos object : host, ip and http are only converted when read */
+struct _ape_sm_cmdinfos {
+	char *host;
+	char *ip;
+	http_state *request; /* headers source, NULL once the handler returned */
+	ape_sm_jsontree *http;
+	unsigned int resolved;
+};
+
+static JSBool jsonview_enumerate(JSContext *cx, JSObject *obj);
+static JSBool jsonview_resolve(JSContext *cx, JSObject *obj, jsid id, uintN flags, JSObject **objp);
+static void jsonview_finalize(JSContext *cx, JSObject *obj);
+static JSBool cmdresponse_enumerate(JSContext *cx, JSObject *obj);
+static JSBool cmdresponse_resolve(JSContext *cx, JSObject *obj, jsid id, uintN flags, JSObject **objp);
+static void cmdresponse_finalize(JSContext *cx, JSObject *obj);
+
+static JSClass jsonview_class = {
+	"Object", JSCLASS_HAS_PRIVATE | JSCLASS_NEW_RESOLVE,
+		JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+		jsonview_enumerate, (JSResolveOp)jsonview_resolve, JS_ConvertStub, jsonview_finalize,
+		JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
 static JSClass cmdresponse_class = {
-	"cmdresponse", JSCLASS_HAS_PRIVATE,
+	"cmdresponse", JSCLASS_HAS_PRIVATE | JSCLASS_NEW_RESOLVE,
 		JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
-		JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, JS_FinalizeStub,
+		cmdresponse_enumerate, (JSResolveOp)cmdresponse_resolve, JS_ConvertStub, cmdresponse_finalize,
 		JSCLASS_NO_OPTIONAL_MEMBERS
 };
 
 
+/*
+	Ape.Buffer : byte buffer shared between native code and JS.
+	Buffers handed to onRead() in binary/framing mode are views on the socket
+	input buffer, only valid during the callback (use slice() or toString()
+	to keep the data).
+*/
+typedef struct _ape_sm_buffer ape_sm_buffer;
+struct _ape_sm_buffer {
+	char *data;
+	size_t len;
+	int owned; /* data is freed with the object */
+};
+
+static void buffer_finalize(JSContext *cx, JSObject *obj)
+{
+	ape_sm_buffer *buffer = JS_GetPrivate(cx, obj);
+	
+	if (buffer != NULL) {
+		if (buffer->owned) {
+			free(buffer->data);
+		}
+		free(buffer);
+	}
+}
+
+static JSClass buffer_class = {
+	"Buffer", JSCLASS_HAS_PRIVATE,
+		JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+		JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, buffer_finalize,
+		JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static JSObject *buffer_new(JSContext *cx, char *data, size_t len, int owned, acetables *g_ape)
+{
+	JSObject *obj = JS_NewObject(cx, &buffer_class, get_property(g_ape->properties, "buffer_proto")->val, NULL);
+	ape_sm_buffer *buffer;
+	
+	if (obj == NULL) {
+		return NULL;
+	}
+	buffer = xmalloc(sizeof(*buffer));
+	buffer->data = data;
+	buffer->len = len;
+	buffer->owned = owned;
+	
+	JS_SetPrivate(cx, obj, buffer);
+	
+	return obj;
+}
+
+/* Bytes of a Buffer or of a string (encoded), "*tofree" must be JS_free()'d */
+static int sm_value_bytes(JSContext *cx, jsval val, char **data, size_t *len, char **tofree)
+{
+	*tofree = NULL;
+	
+	if (JSVAL_IS_OBJECT(val) && !JSVAL_IS_NULL(val) && JS_GET_CLASS(cx, JSVAL_TO_OBJECT(val)) == &buffer_class) {
+		ape_sm_buffer *buffer = JS_GetPrivate(cx, JSVAL_TO_OBJECT(val));
+		
+		if (buffer == NULL) {
+			return 0;
+		}
+		*data = buffer->data;
+		*len = buffer->len;
+	} else {
+		JSString *string = JS_ValueToString(cx, val);
+		
+		if (string == NULL || (*len = JS_GetStringEncodingLength(cx, string)) == (size_t)-1) {
+			return 0;
+		}
+		*data = *tofree = JS_malloc(cx, *len + 1);
+		*len = JS_EncodeStringToBuffer(string, *data, *len);
+	}
+	return 1;
+}
+
+static JSBool buffer_get_length(JSContext *cx, JSObject *obj, jsid id, jsval *vp)
+{
+	ape_sm_buffer *buffer = JS_GetInstancePrivate(cx, obj, &buffer_class, NULL);
+	
+	*vp = INT_TO_JSVAL(buffer != NULL ? buffer->len : 0);
+	
+	return JS_TRUE;
+}
+
+static JSPropertySpec buffer_props[] = {
+	{"length", 0, JSPROP_READONLY | JSPROP_PERMANENT | JSPROP_SHARED, buffer_get_length, NULL},
+	{NULL, 0, 0, NULL, NULL}
+};
+
+/* Clamp [start, end[ arguments to the buffer bounds */
+static void buffer_range(JSContext *cx, uintN argc, jsval *argv, ape_sm_buffer *buffer, size_t *start, size_t *end)
+{
+	int32 i;
+	
+	*start = 0;
+	*end = buffer->len;
+	
+	if (argc > 0 && JS_ValueToECMAInt32(cx, argv[0], &i) && i > 0) {
+		*start = MIN((size_t)i, buffer->len);
+	}
+	if (argc > 1 && JS_ValueToECMAInt32(cx, argv[1], &i) && i >= 0) {
+		*end = MIN((size_t)i, buffer->len);
+	}
+	if (*end < *start) {
+		*end = *start;
+	}
+}
+
+APE_JS_NATIVE(ape_sm_buffer_constructor)
+//{
+	JSObject *obj = JS_NewObjectForConstructor(cx, vpn);
+	ape_sm_buffer *buffer = xmalloc(sizeof(*buffer));
+	char *data, *tofree;
+	size_t len;
+	
+	buffer->data = NULL;
+	buffer->len = 0;
+	buffer->owned = 1;
+	
+	if (argc > 0 && JSVAL_IS_NUMBER(JS_ARGV(cx, vpn)[0])) {
+		int32 size;
+		
+		if (JS_ValueToECMAInt32(cx, JS_ARGV(cx, vpn)[0], &size) && size > 0) {
+			buffer->data = xmalloc(size);
+			buffer->len = size;
+			memset(buffer->data, 0, size);
+		}
+	} else if (argc > 0 && sm_value_bytes(cx, JS_ARGV(cx, vpn)[0], &data, &len, &tofree)) {
+		buffer->data = xmalloc(len + 1);
+		buffer->len = len;
+		memcpy(buffer->data, data, len);
+		if (tofree != NULL) {
+			JS_free(cx, tofree);
+		}
+	}
+	JS_SetPrivate(cx, obj, buffer);
+	
+	JS_SET_RVAL(cx, vpn, OBJECT_TO_JSVAL(obj));
+	
+	return JS_TRUE;
+}
+
+APE_JS_NATIVE(apebuffer_tostring)
+//{
+	ape_sm_buffer *buffer = JS_GetInstancePrivate(cx, JS_THIS_OBJECT(cx, vpn), &buffer_class, NULL);
+	size_t start, end;
+	
+	if (buffer == NULL) {
+		JS_SET_RVAL(cx, vpn, JS_GetEmptyStringValue(cx));
+		return JS_TRUE;
+	}
+	buffer_range(cx, argc, JS_ARGV(cx, vpn), buffer, &start, &end);
+	
+	JS_SET_RVAL(cx, vpn, STRING_TO_JSVAL(JS_NewStringCopyN(cx, buffer->data + start, end - start)));
+	
+	return JS_TRUE;
+}
+
+/* Owned copy of [start, end[ */
+APE_JS_NATIVE(apebuffer_slice)
+//{
+	ape_sm_buffer *buffer = JS_GetInstancePrivate(cx, JS_THIS_OBJECT(cx, vpn), &buffer_class, NULL);
+	size_t start, end;
+	char *data;
+	
+	if (buffer == NULL) {
+		return JS_TRUE;
+	}
+	buffer_range(cx, argc, JS_ARGV(cx, vpn), buffer, &start, &end);
+	
+	data = xmalloc(end - start + 1);
+	memcpy(data, buffer->data + start, end - start);
+	
+	JS_SET_RVAL(cx, vpn, OBJECT_TO_JSVAL(buffer_new(cx, data, end - start, 1, g_ape)));
+	
+	return JS_TRUE;
+}
+
+APE_JS_NATIVE(apebuffer_byteat)
+//{
+	ape_sm_buffer *buffer = JS_GetInstancePrivate(cx, JS_THIS_OBJECT(cx, vpn), &buffer_class, NULL);
+	int32 i;
+	
+	if (buffer == NULL || argc < 1 || !JS_ValueToECMAInt32(cx, JS_ARGV(cx, vpn)[0], &i) || i < 0 || (size_t)i >= buffer->len) {
+		return JS_TRUE;
+	}
+	JS_SET_RVAL(cx, vpn, INT_TO_JSVAL((unsigned char)buffer->data[i]));
+	
+	return JS_TRUE;
+}
+
+/* indexOf(byte | string | Buffer[, from]), -1 if not found */
+APE_JS_NATIVE(apebuffer_indexof)
+//{
+	ape_sm_buffer *buffer = JS_GetInstancePrivate(cx, JS_THIS_OBJECT(cx, vpn), &buffer_class, NULL);
+	char *needle, *tofree = NULL, *found = NULL, byte;
+	size_t nlen, from = 0;
+	int32 i;
+	
+	JS_SET_RVAL(cx, vpn, INT_TO_JSVAL(-1));
+	
+	if (buffer == NULL || argc < 1) {
+		return JS_TRUE;
+	}
+	if (argc > 1 && JS_ValueToECMAInt32(cx, JS_ARGV(cx, vpn)[1], &i) && i > 0) {
+		from = i;
+	}
+	if (JSVAL_IS_INT(JS_ARGV(cx, vpn)[0])) {
+		byte = (char)JSVAL_TO_INT(JS_ARGV(cx, vpn)[0]);
+		needle = &byte;
+		nlen = 1;
+	} else if (!sm_value_bytes(cx, JS_ARGV(cx, vpn)[0], &needle, &nlen, &tofree)) {
+		return JS_TRUE;
+	}
+	if (from < buffer->len && nlen) {
+		found = memmem(buffer->data + from, buffer->len - from, needle, nlen);
+	}
+	if (found != NULL) {
+		JS_SET_RVAL(cx, vpn, INT_TO_JSVAL(found - buffer->data));
+	}
+	if (tofree != NULL) {
+		JS_free(cx, tofree);
+	}
+	
+	return JS_TRUE;
+}
+
+/* Big endian unsigned integers (readUInt16(offset), readUInt32(offset)) */
+static JSBool buffer_read_uint(JSContext *cx, uintN argc, jsval *vpn, int size)
+{
+	ape_sm_buffer *buffer = JS_GetInstancePrivate(cx, JS_THIS_OBJECT(cx, vpn), &buffer_class, NULL);
+	unsigned char *p;
+	uint32 val = 0;
+	int32 offset;
+	int i;
+	
+	if (buffer == NULL || argc < 1 || !JS_ValueToECMAInt32(cx, JS_ARGV(cx, vpn)[0], &offset) || offset < 0 || (size_t)offset + size > buffer->len) {
+		return JS_TRUE;
+	}
+	p = (unsigned char *)buffer->data + offset;
+	
+	for (i = 0; i < size; i++) {
+		val = (val << 8) | p[i];
+	}
+	
+	return JS_NewNumberValue(cx, val, &JS_RVAL(cx, vpn));
+}
+
+static JSBool apebuffer_readuint16(JSContext *cx, uintN argc, jsval *vpn)
+{
+	return buffer_read_uint(cx, argc, vpn, 2);
+}
+
+static JSBool apebuffer_readuint32(JSContext *cx, uintN argc, jsval *vpn)
+{
+	return buffer_read_uint(cx, argc, vpn, 4);
+}
+
+static JSFunctionSpec apebuffer_funcs[] = {
+	JS_FS("toString", apebuffer_tostring, 2, 0),
+	JS_FS("slice", apebuffer_slice, 2, 0),
+	JS_FS("byteAt", apebuffer_byteat, 1, 0),
+	JS_FS("indexOf", apebuffer_indexof, 2, 0),
+	JS_FS("readUInt16", apebuffer_readuint16, 1, 0),
+	JS_FS("readUInt32", apebuffer_readuint32, 1, 0),
+	JS_FS_END
+};
+
+/* write() and writeFrame() : Buffers are sent as is, strings are encoded */
+static JSBool sm_sock_write(JSContext *cx, ape_socket *client, jsval data, int burn, int header, acetables *g_ape)
+{
+	char *bytes, *tofree;
+	size_t len;
+	
+	if (!sm_value_bytes(cx, data, &bytes, &len, &tofree)) {
+		return JS_TRUE;
+	}
+	if (header) {
+		/* length prefix and payload in a single write */
+		char *frame = xmalloc(len + header);
+		int i;
+		
+		for (i = 0; i < header; i++) {
+			frame[i] = (len >> (8 * (header - i - 1))) & 0xFF;
+		}
+		memcpy(frame + header, bytes, len);
+		
+		sendbin(client->fd, frame, len + header, burn, g_ape);
+		free(frame);
+	} else {
+		sendbin(client->fd, bytes, len, burn, g_ape);
+	}
+	
+	if (tofree != NULL) {
+		JS_free(cx, tofree);
+	}
+	
+	return JS_TRUE;
+}
+
+static void sm_sock_view_release(JSContext *cx, struct _ape_sock_js_obj *sock_obj)
+{
+	if (sock_obj != NULL && sock_obj->view != NULL) {
+		ape_sm_buffer *view = JS_GetPrivate(cx, sock_obj->view);
+		
+		view->data = NULL;
+		view->len = 0;
+		JS_RemoveObjectRoot(cx, &sock_obj->view);
+		sock_obj->view = NULL;
+	}
+}
+
 APE_JS_NATIVE(apesocket_write)
 //{
-	JSString *string;
-	char *cstring;
-	size_t lstring;
 	JSBool burn = JS_FALSE;
 	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
 	
 	struct _ape_sock_callbacks *cb = JS_GetPrivate(cx, obj);
 	ape_socket *client;
 	
-	if (cb == NULL) {
+	if (cb == NULL || argc < 1) {
 		return JS_TRUE;
 	}
 	
 	client = ((struct _ape_sock_js_obj *)cb->private)->client;
 
-	if (client == NULL || !JS_ConvertArguments(cx, argc, JS_ARGV(cx, vpn), "S/b", &string, &burn)) {
+	if (client == NULL || (argc > 1 && !JS_ValueToBoolean(cx, JS_ARGV(cx, vpn)[1], &burn))) {
 		return JS_TRUE;
 	}
 	
-	lstring = JS_GetStringEncodingLength(cx, string);
-	cstring = JS_malloc(cx, lstring);
-	lstring = JS_EncodeStringToBuffer(string, cstring, lstring);
+	return sm_sock_write(cx, client, JS_ARGV(cx, vpn)[0], (burn == JS_TRUE ? 1 : 0), 0, g_ape);
+}
+
+/* Send a length-prefixed frame (header size from the "framing" option, 32 bits by default) */
+APE_JS_NATIVE(apesocket_write_frame)
+//{
+	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
 	
-	sendbin(client->fd, cstring, lstring, (burn == JS_TRUE ? 1 : 0), g_ape);
+	struct _ape_sock_callbacks *cb = JS_GetPrivate(cx, obj);
+	ape_socket *client;
 	
-	JS_free(cx, cstring);
+	if (cb == NULL || argc < 1 || (client = ((struct _ape_sock_js_obj *)cb->private)->client) == NULL) {
+		return JS_TRUE;
+	}
 	
-	return JS_TRUE;
+	return sm_sock_write(cx, client, JS_ARGV(cx, vpn)[0], 0, (cb->mode == SM_SOCK_FRAME16 ? 2 : 4), g_ape);
 }
 
 APE_JS_NATIVE(apesocketclient_write)
 //{
-	JSString *string;
-	char *cstring;
-	size_t lstring;
 	JSBool burn = JS_FALSE;
 	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
 	
 	ape_socket *client = JS_GetPrivate(cx, obj);
 	
-	if (client == NULL) {
+	if (client == NULL || argc < 1) {
 		return JS_TRUE;
 	}
 
-	if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vpn), "S/b", &string)) {
+	if (argc > 1 && !JS_ValueToBoolean(cx, JS_ARGV(cx, vpn)[1], &burn)) {
 		return JS_TRUE;
 	}
 	
-	lstring = JS_GetStringEncodingLength(cx, string);
-	cstring = JS_malloc(cx, lstring);
-	lstring = JS_EncodeStringToBuffer(string, cstring, lstring);
+	return sm_sock_write(cx, client, JS_ARGV(cx, vpn)[0], (burn == JS_TRUE ? 1 : 0), 0, g_ape);
+}
+
+APE_JS_NATIVE(apesocketclient_write_frame)
+//{
+	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
 	
-	sendbin(client->fd, cstring, lstring, (burn == JS_TRUE ? 1 : 0), g_ape);
+	ape_socket *client = JS_GetPrivate(cx, obj);
 	
-	JS_free(cx, cstring);
+	if (client == NULL || client->attach == NULL || argc < 1) {
+		return JS_TRUE;
+	}
 	
-	return JS_TRUE;
+	return sm_sock_write(cx, client, JS_ARGV(cx, vpn)[0], 0, (((struct _ape_sock_callbacks *)client->attach)->mode == SM_SOCK_FRAME16 ? 2 : 4), g_ape);
 }
+
 APE_JS_NATIVE(apesocketclient_close)
 //{
 	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
@@ -563,6 +1278,275 @@ static json_item *jsobj_to_ape_json(JSContext *cx, JSObject *json_obj)
 	return ape_json;
 }
 
+/*
+	Direct JS -> wire serialization (sendRaw, command returns) :
+	the value graph is written straight into a growable buffer using the
+	same escaping as json_to_string(), without building a json_item tree.
+*/
+
+#define SM_JSON_MAX_DEPTH 32
+
+typedef struct _ape_sm_jsonbuf ape_sm_jsonbuf;
+struct _ape_sm_jsonbuf {
+	char *data;
+	size_t len;
+	size_t size;
+	
+	int depth;
+	JSObject *stack[SM_JSON_MAX_DEPTH]; /* objects being serialized (cycle detection) */
+};
+
+static void jsonbuf_init(ape_sm_jsonbuf *buf)
+{
+	buf->size = 512;
+	buf->len = 0;
+	buf->depth = 0;
+	buf->data = xmalloc(sizeof(char) * buf->size);
+}
+
+static void jsonbuf_reserve(ape_sm_jsonbuf *buf, size_t len)
+{
+	if (buf->len + len > buf->size) {
+		while (buf->len + len > buf->size) {
+			buf->size *= 2;
+		}
+		buf->data = xrealloc(buf->data, sizeof(char) * buf->size);
+	}
+}
+
+static void jsonbuf_append(ape_sm_jsonbuf *buf, const char *str, size_t len)
+{
+	jsonbuf_reserve(buf, len);
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+}
+
+static int jsonbuf_write_string(JSContext *cx, ape_sm_jsonbuf *buf, JSString *str)
+{
+	size_t len = JS_GetStringEncodingLength(cx, str);
+	char *out;
+	
+	if (len == (size_t)-1) {
+		return 0;
+	}
+	
+	/* Encode at the end of the reserved area then escape in place toward the front */
+	jsonbuf_reserve(buf, len * 2 + 2);
+	
+	out = buf->data + buf->len;
+	*out++ = '"';
+	
+	len = JS_EncodeStringToBuffer(str, out + len, len);
+	out += json_escape_string(out + len, out, len);
+	
+	*out++ = '"';
+	buf->len = out - buf->data;
+	
+	return 1;
+}
+
+static void jsonbuf_write_number(ape_sm_jsonbuf *buf, jsval vp)
+{
+	char num[32];
+	int len;
+	
+	if (JSVAL_IS_INT(vp)) {
+		len = sprintf(num, "%d", JSVAL_TO_INT(vp));
+	} else {
+		jsdouble dp = JSVAL_TO_DOUBLE(vp);
+		
+		if (!isfinite(dp)) {
+			jsonbuf_append(buf, "null", 4);
+			return;
+		}
+		if ((long long)trunc(dp) == dp) {
+			len = sprintf(num, "%lld", (long long)dp);
+		} else {
+			/* Same precision rules as json_to_string() */
+			len = snprintf(num, 16 + 1, "%f", dp);
+			if (len > 16) {
+				len = 16;
+			}
+		}
+	}
+	jsonbuf_append(buf, num, len);
+}
+
+static int jsonbuf_write_value(JSContext *cx, ape_sm_jsonbuf *buf, jsval vp);
+
+static int jsonbuf_write_object(JSContext *cx, ape_sm_jsonbuf *buf, JSObject *obj)
+{
+	unsigned int i, length = 0;
+	int d, ret = 1;
+	
+	for (d = 0; d < buf->depth; d++) {
+		if (buf->stack[d] == obj) {
+			JS_ReportError(cx, "Cannot serialize cyclic object");
+			return 0;
+		}
+	}
+	if (buf->depth == SM_JSON_MAX_DEPTH) {
+		JS_ReportError(cx, "Cannot serialize object : max depth (%d) exceeded", SM_JSON_MAX_DEPTH);
+		return 0;
+	}
+	
+	buf->stack[buf->depth++] = obj;
+	
+	if (JS_IsArrayObject(cx, obj) == JS_TRUE) {
+		JS_GetArrayLength(cx, obj, &length);
+		jsonbuf_append(buf, "[", 1);
+		
+		for (i = 0; i < length && ret; i++) {
+			jsval vp;
+			
+			if (i) {
+				jsonbuf_append(buf, ",", 1);
+			}
+			/* Holes, undefined and functions are written as null to keep indexes */
+			if (!JS_GetElement(cx, obj, i, &vp) || JSVAL_IS_VOID(vp) || JS_TypeOfValue(cx, vp) == JSTYPE_FUNCTION) {
+				jsonbuf_append(buf, "null", 4);
+			} else {
+				ret = jsonbuf_write_value(cx, buf, vp);
+			}
+		}
+		jsonbuf_append(buf, "]", 1);
+	} else {
+		JSIdArray *enumjson = JS_Enumerate(cx, obj);
+		int first = 1;
+		
+		if (enumjson == NULL) {
+			buf->depth--;
+			return 0;
+		}
+		jsonbuf_append(buf, "{", 1);
+		
+		for (i = 0; i < enumjson->length && ret; i++) {
+			jsval propname, vp;
+			JSString *key;
+			
+			if (!JS_GetPropertyById(cx, obj, enumjson->vector[i], &vp) || JSVAL_IS_VOID(vp) || JS_TypeOfValue(cx, vp) == JSTYPE_FUNCTION) {
+				continue;
+			}
+			JS_IdToValue(cx, enumjson->vector[i], &propname);
+			
+			if ((key = JS_ValueToString(cx, propname)) == NULL) {
+				continue;
+			}
+			if (!first) {
+				jsonbuf_append(buf, ",", 1);
+			}
+			first = 0;
+			
+			if (!jsonbuf_write_string(cx, buf, key)) {
+				ret = 0;
+				break;
+			}
+			jsonbuf_append(buf, ":", 1);
+			ret = jsonbuf_write_value(cx, buf, vp);
+		}
+		jsonbuf_append(buf, "}", 1);
+		
+		JS_DestroyIdArray(cx, enumjson);
+	}
+	
+	buf->depth--;
+	
+	return ret;
+}
+
+static int jsonbuf_write_value(JSContext *cx, ape_sm_jsonbuf *buf, jsval vp)
+{
+	if (JSVAL_IS_NULL(vp)) {
+		jsonbuf_append(buf, "null", 4);
+	} else if (JSVAL_IS_BOOLEAN(vp)) {
+		if (JSVAL_TO_BOOLEAN(vp)) {
+			jsonbuf_append(buf, "true", 4);
+		} else {
+			jsonbuf_append(buf, "false", 5);
+		}
+	} else if (JSVAL_IS_NUMBER(vp)) {
+		jsonbuf_write_number(buf, vp);
+	} else if (JSVAL_IS_STRING(vp)) {
+		return jsonbuf_write_string(cx, buf, JSVAL_TO_STRING(vp));
+	} else if (JSVAL_IS_OBJECT(vp)) {
+		return jsonbuf_write_object(cx, buf, JSVAL_TO_OBJECT(vp));
+	} else {
+		jsonbuf_append(buf, "null", 4);
+	}
+	
+	return 1;
+}
+
+/*
+	Serialize the RAW's data : either a JS object, or a string already holding
+	a JSON object which is only validated and copied as is (fast path).
+*/
+static int jsonbuf_write_data(JSContext *cx, ape_sm_jsonbuf *buf, jsval data)
+{
+	if (JSVAL_IS_STRING(data)) {
+		JSString *str = JSVAL_TO_STRING(data);
+		size_t len = JS_GetStringEncodingLength(cx, str);
+		
+		if (len == (size_t)-1) {
+			return 0;
+		}
+		jsonbuf_reserve(buf, len);
+		len = JS_EncodeStringToBuffer(str, buf->data + buf->len, len);
+		
+		if (len < 2 || buf->data[buf->len] != '{' || buf->data[buf->len + len - 1] != '}' || !json_validate(buf->data + buf->len, len)) {
+			JS_ReportError(cx, "Raw data is not a valid JSON object");
+			return 0;
+		}
+		buf->len += len;
+		
+		return 1;
+	} else if (JSVAL_IS_OBJECT(data) && !JSVAL_IS_NULL(data)) {
+		return jsonbuf_write_object(cx, buf, JSVAL_TO_OBJECT(data));
+	}
+	
+	return 0;
+}
+
+/* Append "key":value to the serialized (top level) object, value is freed */
+static void jsonbuf_set_property(ape_sm_jsonbuf *buf, const char *key, json_item *value)
+{
+	struct jsontring *string;
+	
+	if (buf->len < 2 || buf->data[buf->len - 1] != '}') {
+		free_json_item(value);
+		return;
+	}
+	buf->len--;
+	
+	if (buf->data[buf->len - 1] != '{') {
+		jsonbuf_append(buf, ",", 1);
+	}
+	jsonbuf_append(buf, "\"", 1);
+	jsonbuf_append(buf, key, strlen(key));
+	jsonbuf_append(buf, "\":", 2);
+	
+	string = json_to_string(value, NULL, 1);
+	jsonbuf_append(buf, string->jstring, string->len);
+	jsonbuf_append(buf, "}", 1);
+	
+	free(string->jstring);
+	free(string);
+}
+
+static void jsonbuf_set_property_int(ape_sm_jsonbuf *buf, const char *key, long int value)
+{
+	char num[32];
+	int len;
+	
+	if (buf->len < 2 || buf->data[buf->len - 1] != '}') {
+		return;
+	}
+	buf->len--;
+	
+	len = sprintf(num, "%s\"%s\":%li}", (buf->data[buf->len - 1] != '{' ? "," : ""), key, value);
+	jsonbuf_append(buf, num, len);
+}
+
 
 APE_JS_NATIVE(apepipe_sm_get_property)
 //{
@@ -719,114 +1703,105 @@ APE_JS_NATIVE(apepipe_sm_destroy)
 
 static JSBool sm_send_raw(JSContext *cx, transpipe *to_pipe, int chl, uintN argc, jsval *argv, acetables *g_ape)
 {
-	RAW *newraw;
+	RAW *newraw = NULL;
 	JSString *raw;
 	char *craw;
-	JSObject *json_obj = NULL, *options = NULL;
-	json_item *jstr;
+	JSObject *options = NULL;
+	ape_sm_jsonbuf buf;
 	jsval vp;
 	
 	if (to_pipe == NULL) {
 		return JS_TRUE;
 	}
 	
-	if (!JS_ConvertArguments(cx, 3, argv, "So/o", &raw, &json_obj, &options) || json_obj == NULL) {
+	if (!JS_ConvertArguments(cx, 1, argv, "S", &raw) || (!JSVAL_IS_STRING(argv[1]) && (!JSVAL_IS_OBJECT(argv[1]) || JSVAL_IS_NULL(argv[1])))) {
 		return JS_TRUE;
 	}
 	
-	craw = JS_EncodeString(cx, raw);
+	if (JSVAL_IS_OBJECT(argv[2]) && !JSVAL_IS_NULL(argv[2])) {
+		options = JSVAL_TO_OBJECT(argv[2]);
+	}
+	
+	jsonbuf_init(&buf);
 	
-	jstr = jsobj_to_ape_json(cx, json_obj);
+	if (!jsonbuf_write_data(cx, &buf, argv[1])) {
+		free(buf.data);
+		return JS_FALSE;
+	}
+	
+	craw = JS_EncodeString(cx, raw);
 
-	if (options != NULL && JS_GetProperty(cx, options, "from", &vp) && JSVAL_IS_OBJECT(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &pipe_class, 0) == JS_TRUE) {
+	if (options != NULL && JS_GetProperty(cx, options, "from", &vp) && JSVAL_IS_OBJECT(vp) && !JSVAL_IS_NULL(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &pipe_class, 0) == JS_TRUE) {
 		JSObject *js_pipe = JSVAL_TO_OBJECT(vp);
 		transpipe *from_pipe = JS_GetPrivate(cx, js_pipe);
 		
 		if (from_pipe != NULL && from_pipe->type == USER_PIPE) {
-			json_set_property_objN(jstr, "from", 4, get_json_object_pipe(from_pipe));
+			jsonbuf_set_property(&buf, "from", get_json_object_pipe(from_pipe));
 			
 			if (to_pipe->type == USER_PIPE) {
-				json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe(from_pipe));
+				jsonbuf_set_property(&buf, "pipe", get_json_object_pipe(from_pipe));
 			} else if (to_pipe->type == CHANNEL_PIPE) {
-				json_item *jcopy = json_item_copy(jstr, NULL);
-				if (((CHANNEL*)to_pipe->pipe)->head != NULL && ((CHANNEL*)to_pipe->pipe)->head->next != NULL) {
-					
-					json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe(to_pipe));
+				/* The same RAW is posted to the channel and to the other subusers of the sender */
+				jsonbuf_set_property(&buf, "pipe", get_json_object_pipe(to_pipe));
+				newraw = forge_raw_json(craw, buf.data, buf.len);
 				
-					newraw = forge_raw(craw, jstr);
+				if (((CHANNEL*)to_pipe->pipe)->head != NULL && ((CHANNEL*)to_pipe->pipe)->head->next != NULL) {
 					post_raw_channel_restricted(newraw, to_pipe->pipe, from_pipe->pipe, g_ape);
-					POSTRAW_DONE(newraw);
 				}
-				if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &subuser_class, 0) == JS_TRUE) {
+				if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && !JSVAL_IS_NULL(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &subuser_class, 0) == JS_TRUE) {
 					JSObject *subjs = JSVAL_TO_OBJECT(vp);
 					subuser *sub = JS_GetPrivate(cx, subjs);
-					if (sub != NULL && ((USERS *)from_pipe->pipe)->nsub > 1) {						
-						json_set_property_objN(jcopy, "pipe", 4, get_json_object_pipe(to_pipe));
-						newraw = forge_raw(craw, jcopy);
+					if (sub != NULL && ((USERS *)from_pipe->pipe)->nsub > 1) {
 						post_raw_restricted(newraw, from_pipe->pipe, sub, g_ape);
-					} else {
-						free_json_item(jcopy);
 					}
-					
-				} else {
-					free_json_item(jcopy);
 				}
-				
-				JS_free(cx, craw);
-				return JS_TRUE;
+				goto done;
 			}
 		} else if (from_pipe != NULL && from_pipe->type == CUSTOM_PIPE) {
-			json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe(from_pipe));
+			jsonbuf_set_property(&buf, "pipe", get_json_object_pipe(from_pipe));
 		}
 	}
 
 	/* in the case of sendResponse */
 	/* TODO : May be borken if to_pipe->type == CHANNNEL and from == USER */
 	if (chl) {
-		json_set_property_intN(jstr, "chl", 3, chl);
+		jsonbuf_set_property_int(&buf, "chl", chl);
 	}
 	
 	if (to_pipe->type == CHANNEL_PIPE && ((struct CHANNEL *)to_pipe->pipe)->head != NULL) {
-		if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &user_class, 0) == JS_TRUE) {
+		if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && !JSVAL_IS_NULL(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &user_class, 0) == JS_TRUE) {
 			JSObject *userjs = JSVAL_TO_OBJECT(vp);
 			USERS *user = JS_GetPrivate(cx, userjs);
 			
 			if (user == NULL) {
-				free_json_item(jstr);
-				
-				JS_free(cx, craw);
-				return JS_TRUE;
+				goto done;
 			}
-
-			post_raw_channel_restricted(forge_raw(craw, jstr), to_pipe->pipe, user, g_ape);
-			
-			JS_free(cx, craw);
-			return JS_TRUE;
+			newraw = forge_raw_json(craw, buf.data, buf.len);
+			post_raw_channel_restricted(newraw, to_pipe->pipe, user, g_ape);
+		} else {
+			newraw = forge_raw_json(craw, buf.data, buf.len);
+			post_raw_channel(newraw, to_pipe->pipe, g_ape);
 		}
-		post_raw_channel(forge_raw(craw, jstr), to_pipe->pipe, g_ape);
 	} else if (to_pipe->type != CHANNEL_PIPE) {
-		if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &subuser_class, 0) == JS_TRUE) {
+		if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && !JSVAL_IS_NULL(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &subuser_class, 0) == JS_TRUE) {
 			JSObject *subjs = JSVAL_TO_OBJECT(vp);
 			subuser *sub = JS_GetPrivate(cx, subjs);
 			
 			if (sub == NULL || ((USERS *)to_pipe->pipe)->nsub < 2 || to_pipe->pipe != sub->user) {
-				free_json_item(jstr);
-				
-				JS_free(cx, craw);
-				return JS_TRUE;
+				goto done;
 			}
-
-			post_raw_restricted(forge_raw(craw, jstr), to_pipe->pipe, sub, g_ape);
-			
-			JS_free(cx, craw);
-			return JS_TRUE;
-
+			newraw = forge_raw_json(craw, buf.data, buf.len);
+			post_raw_restricted(newraw, to_pipe->pipe, sub, g_ape);
+		} else {
+			newraw = forge_raw_json(craw, buf.data, buf.len);
+			post_raw(newraw, to_pipe->pipe, g_ape);
 		}
-		post_raw(forge_raw(craw, jstr), to_pipe->pipe, g_ape);
-	} else {
-		free_json_item(jstr);
 	}
 	
+done:
+	POSTRAW_DONE(newraw);
+	
+	free(buf.data);
 	JS_free(cx, craw);
 	return JS_TRUE;
 }
@@ -1132,16 +2107,46 @@ APE_JS_NATIVE(apeuser_sm_set_property)
 }
 
 #ifdef _USE_MYSQL
+static const char *apemysql_errors[] = {
+	"",
+	"Too many queries waiting for a connection",
+	"Query timed out",
+	"Connection closed",
+	"Query parameters don't match its placeholders"
+};
+
+static struct {
+	metric *wait;
+	metric *exec;
+	metric *rejected;
+	metric *timeouts;
+	long queued;
+	
+	HTBL *stmts;
+	unsigned int nstmts;
+} apemysql_stats = {NULL, NULL, NULL, NULL, 0, NULL, 0};
+
+static long apemysql_gauge_queued(acetables *g_ape)
+{
+	return apemysql_stats.queued;
+}
+
 APE_JS_NATIVE(apemysql_sm_errorstring)
 //{
 	struct _ape_mysql_data *myhandle;
 	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
+	const char *error = "";
 	
 	if ((myhandle = JS_GetPrivate(cx, obj)) == NULL) {
 		return JS_TRUE;
 	}
+	if (myhandle->error < 0 && -myhandle->error < sizeof(apemysql_errors) / sizeof(*apemysql_errors)) {
+		error = apemysql_errors[-myhandle->error];
+	} else if (myhandle->last != NULL) {
+		error = mysac_advance_error(myhandle->last->my);
+	}
 
-	JS_SET_RVAL(cx, vpn, STRING_TO_JSVAL(JS_NewStringCopyZ(cx, mysac_advance_error(myhandle->my))));
+	JS_SET_RVAL(cx, vpn, STRING_TO_JSVAL(JS_NewStringCopyZ(cx, error)));
 	
 	return JS_TRUE;
 }
@@ -1151,11 +2156,11 @@ APE_JS_NATIVE(apemysql_sm_insert_id)
 	struct _ape_mysql_data *myhandle;
 	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
 	
-	if ((myhandle = JS_GetPrivate(cx, obj)) == NULL) {
+	if ((myhandle = JS_GetPrivate(cx, obj)) == NULL || myhandle->last == NULL) {
 		return JS_TRUE;
 	}
 
-	JS_SET_RVAL(cx, vpn, INT_TO_JSVAL(mysac_insert_id(myhandle->my)));
+	JS_SET_RVAL(cx, vpn, INT_TO_JSVAL(mysac_insert_id(myhandle->last->my)));
 	
 	return JS_TRUE;
 }
@@ -1170,27 +2175,142 @@ APE_JS_NATIVE(apemysql_escape)
 		return JS_TRUE;
 	}
 	
-	cinput_c = JS_EncodeString(cx, input_c);
+	cinput_c = JS_EncodeString(cx, input_c);
+	
+	len = strlen(cinput_c);
+	escaped = xmalloc(sizeof(char) * (len*2+1));
+	
+	len = mysql_escape_string(escaped, cinput_c, len);
+	
+	JS_SET_RVAL(cx, vpn, STRING_TO_JSVAL(JS_NewStringCopyN(cx, escaped, len)));
+	
+	free(escaped);
+	JS_free(cx, cinput_c);
+	
+	return JS_TRUE;
+}
+
+static void apemysql_stmt_free(void *ptr)
+{
+	struct _ape_mysql_stmt *stmt = ptr;
+	
+	free(stmt->holes);
+	free(stmt);
+}
+
+/* Placeholders of "sql" (outside of quoted strings), parsed once per SQL text */
+static struct _ape_mysql_stmt *apemysql_stmt_get(const char *sql, unsigned int len)
+{
+	struct _ape_mysql_stmt *stmt;
+	unsigned int i;
+	char quote = '\0';
+	
+	if (apemysql_stats.stmts == NULL) {
+		apemysql_stats.stmts = hashtbl_init();
+	} else if ((stmt = hashtbl_seek(apemysql_stats.stmts, sql)) != NULL) {
+		return stmt;
+	}
+	
+	stmt = xmalloc(sizeof(*stmt));
+	stmt->nparams = 0;
+	stmt->holes = NULL;
+	
+	for (i = 0; i < len; i++) {
+		if (quote != '\0') {
+			if (sql[i] == '\\') {
+				i++;
+			} else if (sql[i] == quote) {
+				quote = '\0';
+			}
+		} else if (sql[i] == '\'' || sql[i] == '"' || sql[i] == '`') {
+			quote = sql[i];
+		} else if (sql[i] == '?') {
+			if ((stmt->nparams & 7) == 0) {
+				stmt->holes = xrealloc(stmt->holes, sizeof(*stmt->holes) * (stmt->nparams + 8));
+			}
+			stmt->holes[stmt->nparams++] = i;
+		}
+	}
+	
+	if (apemysql_stats.nstmts == APE_MYSQL_STMT_CACHE) {
+		hashtbl_empty(apemysql_stats.stmts, apemysql_stmt_free);
+		apemysql_stats.nstmts = 0;
+	}
+	hashtbl_append(apemysql_stats.stmts, sql, stmt);
+	apemysql_stats.nstmts++;
 	
-	len = strlen(cinput_c);
-	escaped = xmalloc(sizeof(char) * (len*2+1));
+	return stmt;
+}
+
+/* Build the query text with each "?" replaced by the escaped matching value of "params" */
+static char *apemysql_bind(JSContext *cx, const char *sql, unsigned int len, JSObject *params, unsigned int *query_len)
+{
+	struct _ape_mysql_stmt *stmt = apemysql_stmt_get(sql, len);
+	ape_sm_jsonbuf buf;
+	unsigned int i, pos = 0;
+	jsuint nparams;
 	
-	len = mysql_escape_string(escaped, cinput_c, len);
+	if (!JS_GetArrayLength(cx, params, &nparams) || nparams != stmt->nparams) {
+		return NULL;
+	}
+	jsonbuf_init(&buf);
 	
-	JS_SET_RVAL(cx, vpn, STRING_TO_JSVAL(JS_NewStringCopyN(cx, escaped, len)));
+	for (i = 0; i < stmt->nparams; i++) {
+		jsval val;
+		
+		jsonbuf_append(&buf, sql + pos, stmt->holes[i] - pos);
+		pos = stmt->holes[i] + 1;
+		
+		if (!JS_GetElement(cx, params, i, &val) || JSVAL_IS_NULL(val) || JSVAL_IS_VOID(val)) {
+			jsonbuf_append(&buf, "NULL", 4);
+		} else if (JSVAL_IS_BOOLEAN(val)) {
+			jsonbuf_append(&buf, (JSVAL_TO_BOOLEAN(val) ? "1" : "0"), 1);
+		} else if (JSVAL_IS_NUMBER(val)) {
+			char num[32];
+			double dval = (JSVAL_IS_INT(val) ? JSVAL_TO_INT(val) : JSVAL_TO_DOUBLE(val));
+			
+			if (isfinite(dval)) {
+				jsonbuf_append(&buf, num, snprintf(num, sizeof(num), "%.17g", dval));
+			} else {
+				jsonbuf_append(&buf, "NULL", 4);
+			}
+		} else {
+			JSString *str = JS_ValueToString(cx, val);
+			char *cstr;
+			size_t slen;
+			
+			if (str == NULL || (cstr = JS_EncodeString(cx, str)) == NULL) {
+				free(buf.data);
+				return NULL;
+			}
+			slen = strlen(cstr);
+			
+			jsonbuf_reserve(&buf, slen * 2 + 2);
+			buf.data[buf.len++] = '\'';
+			buf.len += mysql_escape_string(buf.data + buf.len, cstr, slen);
+			buf.data[buf.len++] = '\'';
+			
+			JS_free(cx, cstr);
+		}
+	}
+	jsonbuf_append(&buf, sql + pos, len - pos);
+	jsonbuf_append(&buf, "", 1);
 	
-	free(escaped);
-	JS_free(cx, cinput_c);
+	*query_len = buf.len - 1;
 	
-	return JS_TRUE;
+	return buf.data;
 }
 
+/* query(sql, [params, ]callback) : "?" in sql are replaced by the escaped params */
 APE_JS_NATIVE(apemysql_sm_query)
 //{
 	JSString *query;
+	JSObject *params = NULL;
 	struct _ape_mysql_data *myhandle;
 	jsval callback;
 	JSObject *obj = JS_THIS_OBJECT(cx, vpn);
+	char *cquery, *sql;
+	unsigned int len;
 	
 	if ((myhandle = JS_GetPrivate(cx, obj)) == NULL) {
 		return JS_TRUE;
@@ -1199,11 +2319,40 @@ APE_JS_NATIVE(apemysql_sm_query)
 	if (!JS_ConvertArguments(cx, 1, JS_ARGV(cx, vpn), "S", &query)) {
 		return JS_TRUE;
 	}
-	if (!JS_ConvertValue(cx, JS_ARGV(cx, vpn)[1], JSTYPE_FUNCTION, &callback)) {
+	if (argc > 2 && !JSVAL_IS_PRIMITIVE(JS_ARGV(cx, vpn)[1]) && JS_IsArrayObject(cx, JSVAL_TO_OBJECT(JS_ARGV(cx, vpn)[1]))) {
+		params = JSVAL_TO_OBJECT(JS_ARGV(cx, vpn)[1]);
+	}
+	if (!JS_ConvertValue(cx, JS_ARGV(cx, vpn)[params != NULL ? 2 : 1], JSTYPE_FUNCTION, &callback)) {
 		return JS_TRUE;
 	}
-
-	apemysql_push_queue(myhandle, JS_EncodeString(cx, query), JS_GetStringEncodingLength(cx, query), callback);
+	if ((cquery = JS_EncodeString(cx, query)) == NULL) {
+		return JS_TRUE;
+	}
+	len = strlen(cquery);
+	
+	if (params != NULL) {
+		sql = apemysql_bind(cx, cquery, len, params, &len);
+	} else {
+		sql = xmalloc(sizeof(char) * (len + 1));
+		memcpy(sql, cquery, len + 1);
+	}
+	JS_free(cx, cquery);
+	
+	if (sql == NULL || apemysql_push_queue(myhandle, sql, len, callback) == NULL) {
+		jsval cbparams[2], rval;
+		
+		myhandle->error = (sql == NULL ? APE_MYSQL_EPARAMS : APE_MYSQL_EQUEUE_FULL);
+		
+		cbparams[0] = JSVAL_FALSE;
+		cbparams[1] = INT_TO_JSVAL(myhandle->error);
+		
+		SM_CALL_VALUE(cx, obj, callback, "mysql", "query", 2, cbparams, &rval);
+		
+		JS_SET_RVAL(cx, vpn, JSVAL_FALSE);
+		
+		return JS_TRUE;
+	}
+	JS_SET_RVAL(cx, vpn, JSVAL_TRUE);
 	
 	return JS_TRUE;
 }
@@ -1211,6 +2360,7 @@ APE_JS_NATIVE(apemysql_sm_query)
 
 static JSFunctionSpec apesocket_funcs[] = {
 	JS_FS("write",   apesocket_write,	1, 0),
+	JS_FS("writeFrame",   apesocket_write_frame,	1, 0),
 	JS_FS("close",   apesocket_close,	0, 0),
 	JS_FS_END
 };
@@ -1222,6 +2372,7 @@ static JSFunctionSpec apesocketserver_funcs[] = {
 
 static JSFunctionSpec apesocketclient_funcs[] = {
 	JS_FS("write",   apesocketclient_write,	1, 0),
+	JS_FS("writeFrame",   apesocketclient_write_frame,	1, 0),
 	JS_FS("close",   apesocketclient_close,	0, 0),
 	JS_FS_END
 };
@@ -1321,11 +2472,15 @@ static void sm_sock_onaccept(ape_socket *client, acetables *g_ape)
 		JSObject *obj;
 		jsval params[1];
 		
+		sock_obj->view = NULL;
+		
 		cbcopy = xmalloc(sizeof(struct _ape_sock_callbacks));
 		cbcopy->private = sock_obj;
 		cbcopy->asc = cb->asc;
 		cbcopy->server_obj = cb->server_obj;
 		cbcopy->state = 1;
+		cbcopy->mode = cb->mode;
+		cbcopy->max_frame = cb->max_frame;
 		
 		client->attach = cbcopy;	
 
@@ -1342,7 +2497,7 @@ static void sm_sock_onaccept(ape_socket *client, acetables *g_ape)
 			
 			//JS_AddRoot(cb->asc->cx, &params[0]);
 			
-			JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onAccept", 1, params, &rval);
+			SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onAccept", 1, params, &rval);
 			
 			//JS_RemoveRoot(cb->asc->cx, &params[0]);
 			
@@ -1367,15 +2522,17 @@ static void sm_sock_ondisconnect(ape_socket *client, acetables *g_ape)
 				jsval params[1];
 				params[0] = OBJECT_TO_JSVAL(client_obj);
 				
-				JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onDisconnect", 1, params, &rval);
+				SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onDisconnect", 1, params, &rval);
 				JS_SetPrivate(cb->asc->cx, client_obj, (void *)NULL);
 				JS_RemoveObjectRoot(cb->asc->cx, &((struct _ape_sock_js_obj *)cb->private)->client_obj);
 			} else {
-				JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onDisconnect", 0, NULL, &rval);
+				SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onDisconnect", 0, NULL, &rval);
 				JS_SetPrivate(cb->asc->cx, cb->server_obj, (void *)NULL);
 				JS_RemoveObjectRoot(cb->asc->cx, &cb->server_obj);
 			}
 			
+			sm_sock_view_release(cb->asc->cx, cb->private);
+			
 			free(cb->private);
 			free(cb);
 			
@@ -1385,6 +2542,21 @@ static void sm_sock_ondisconnect(ape_socket *client, acetables *g_ape)
 	}
 }
 
+/* onConnectFailed("dns"|"refused"|"timeout"|"unreachable") once retries are exhausted, then onDisconnect() */
+static void sm_sock_onconnectfailed(ape_socket *client, int error, acetables *g_ape)
+{
+	jsval rval, params[1];
+	
+	if (client->attach != NULL) {
+		struct _ape_sock_callbacks *cb = ((struct _ape_sock_callbacks *)client->attach);
+		
+		params[0] = STRING_TO_JSVAL(JS_NewStringCopyZ(cb->asc->cx, ape_connect_strerror(error)));
+		
+		SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onConnectFailed", 1, params, &rval);
+	}
+	sm_sock_ondisconnect(client, g_ape);
+}
+
 static void sm_sock_onread_lf(ape_socket *client, char *data, acetables *g_ape)
 {
 	jsval rval;
@@ -1403,15 +2575,14 @@ static void sm_sock_onread_lf(ape_socket *client, char *data, acetables *g_ape)
 				params[0] = OBJECT_TO_JSVAL(client_obj);
 				params[1] = STRING_TO_JSVAL(JS_NewStringCopyZ(cb->asc->cx, data));
 
-				JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onRead", 2, params, &rval);
+				SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onRead", 2, params, &rval);
 			} else {
 				jsval params[1];
 				params[0] = STRING_TO_JSVAL(JS_NewStringCopyZ(cb->asc->cx, data));
 
-				JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onRead", 1, params, &rval);
+				SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onRead", 1, params, &rval);
 		
 			}
-		JS_MaybeGC(cb->asc->cx);
 		//JS_EndRequest(cb->asc->cx);
 		//JS_ClearContextThread(cb->asc->cx);						
 		
@@ -1427,16 +2598,93 @@ static void sm_sock_onconnect(ape_socket *client, acetables *g_ape)
 		((struct _ape_sock_js_obj *)cb->private)->client = client;
 		//JS_SetContextThread(cb->asc->cx);
 		//JS_BeginRequest(cb->asc->cx);
-			JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onConnect", 0, NULL, &rval);
+			SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onConnect", 0, NULL, &rval);
 		//JS_EndRequest(cb->asc->cx);
 		//JS_ClearContextThread(cb->asc->cx);						
 
 	}	
 }
 
-static void sm_sock_onread(ape_socket *client, ape_buffer *buf, size_t offset, acetables *g_ape)
+static void sm_sock_onread_string(struct _ape_sock_callbacks *cb, JSObject *client_obj, ape_buffer *buf)
 {
 	jsval rval;
+	
+	if (client_obj != NULL) {
+		jsval params[2];
+		params[0] = OBJECT_TO_JSVAL(client_obj);
+		params[1] = STRING_TO_JSVAL(JS_NewStringCopyN(cb->asc->cx, buf->data, buf->length));
+		SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onRead", 2, params, &rval);
+	} else {
+		jsval params[1];
+		
+		params[0] = STRING_TO_JSVAL(JS_NewStringCopyN(cb->asc->cx, buf->data, buf->length));
+
+		SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onRead", 1, params, &rval);
+
+	}
+	buf->length = 0;
+}
+
+/* onRead([client, ]buffer) with the socket's view set on "len" bytes at "data" */
+static void sm_sock_onread_view(struct _ape_sock_callbacks *cb, JSObject *client_obj, char *data, size_t len, acetables *g_ape)
+{
+	struct _ape_sock_js_obj *sock_obj = cb->private;
+	ape_sm_buffer *view;
+	jsval params[2], rval;
+	int argc = 0;
+	
+	if (sock_obj->view == NULL) {
+		if ((sock_obj->view = buffer_new(cb->asc->cx, NULL, 0, 0, g_ape)) == NULL) {
+			return;
+		}
+		JS_AddObjectRoot(cb->asc->cx, &sock_obj->view);
+	}
+	view = JS_GetPrivate(cb->asc->cx, sock_obj->view);
+	view->data = data;
+	view->len = len;
+	
+	if (client_obj != NULL) {
+		params[argc++] = OBJECT_TO_JSVAL(client_obj);
+	}
+	params[argc++] = OBJECT_TO_JSVAL(sock_obj->view);
+	
+	SM_CALL_NAME(cb->asc->cx, cb->server_obj, "socket", "onRead", argc, params, &rval);
+	
+	/* the socket buffer is about to be reused */
+	view->data = NULL;
+	view->len = 0;
+}
+
+static void sm_sock_onread_frames(struct _ape_sock_callbacks *cb, JSObject *client_obj, ape_socket *client, ape_buffer *buf, acetables *g_ape)
+{
+	size_t hlen = (cb->mode == SM_SOCK_FRAME16 ? 2 : 4), off = 0;
+	
+	while (cb->state && buf->length - off >= hlen) {
+		unsigned char *p = (unsigned char *)buf->data + off;
+		size_t len = (hlen == 2 ? (p[0] << 8) | p[1] : ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+		
+		if (len > cb->max_frame) {
+			alog_warn("JavaScript : socket frame too large (%zu bytes), closing", len);
+			shutdown(client->fd, 2);
+			buf->length = 0;
+			return;
+		}
+		if (buf->length - off - hlen < len) {
+			break;
+		}
+		sm_sock_onread_view(cb, client_obj, (char *)p + hlen, len, g_ape);
+		off += hlen + len;
+	}
+	
+	/* keep the incomplete frame at the beginning of the buffer */
+	if (off) {
+		memmove(buf->data, buf->data + off, buf->length - off);
+		buf->length -= off;
+	}
+}
+
+static void sm_sock_onread(ape_socket *client, ape_buffer *buf, size_t offset, acetables *g_ape)
+{
 	if (client->attach != NULL) {
 		struct _ape_sock_callbacks *cb = ((struct _ape_sock_callbacks *)client->attach);
 		JSObject *client_obj = ((struct _ape_sock_js_obj *)cb->private)->client_obj;
@@ -1446,27 +2694,53 @@ static void sm_sock_onread(ape_socket *client, ape_buffer *buf, size_t offset, a
 		}
 		//JS_SetContextThread(cb->asc->cx);
 		//JS_BeginRequest(cb->asc->cx);
-			
-			if (client_obj != NULL) {
-				jsval params[2];
-				params[0] = OBJECT_TO_JSVAL(client_obj);
-				params[1] = STRING_TO_JSVAL(JS_NewStringCopyN(cb->asc->cx, buf->data, buf->length));
-				JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onRead", 2, params, &rval);
-			} else {
-				jsval params[1];
-				
-				params[0] = STRING_TO_JSVAL(JS_NewStringCopyN(cb->asc->cx, buf->data, buf->length));
-
-				JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onRead", 1, params, &rval);
-
-			}
-		JS_MaybeGC(cb->asc->cx);
+		
+		switch(cb->mode) {
+			case SM_SOCK_BINARY:
+				sm_sock_onread_view(cb, client_obj, buf->data, buf->length, g_ape);
+				buf->length = 0;
+				break;
+			case SM_SOCK_FRAME16:
+			case SM_SOCK_FRAME32:
+				sm_sock_onread_frames(cb, client_obj, client, buf, g_ape);
+				break;
+			default:
+				sm_sock_onread_string(cb, client_obj, buf);
+				break;
+		}
 		//JS_EndRequest(cb->asc->cx);
 		//JS_ClearContextThread(cb->asc->cx);						
-		buf->length = 0;
 	}
 }
 
+/* {flushlf: true}, {binary: true} or {framing: 16|32, maxFrame: bytes} */
+static ape_sm_sock_mode_t sm_sock_options(JSContext *cx, JSObject *options, unsigned int *max_frame)
+{
+	jsval vp;
+	
+	*max_frame = SM_SOCK_MAX_FRAME;
+	
+	if (options == NULL) {
+		return SM_SOCK_STRING;
+	}
+	if (JS_GetProperty(cx, options, "flushlf", &vp) && JSVAL_IS_BOOLEAN(vp) && JSVAL_TO_BOOLEAN(vp)) {
+		return SM_SOCK_LINES;
+	}
+	if (JS_GetProperty(cx, options, "framing", &vp) && JSVAL_IS_INT(vp) && (JSVAL_TO_INT(vp) == 16 || JSVAL_TO_INT(vp) == 32)) {
+		if (JS_GetProperty(cx, options, "maxFrame", &vp) && JSVAL_IS_INT(vp) && JSVAL_TO_INT(vp) > 0) {
+			*max_frame = JSVAL_TO_INT(vp);
+		}
+		JS_GetProperty(cx, options, "framing", &vp);
+		
+		return (JSVAL_TO_INT(vp) == 16 ? SM_SOCK_FRAME16 : SM_SOCK_FRAME32);
+	}
+	if (JS_GetProperty(cx, options, "binary", &vp) && JSVAL_IS_BOOLEAN(vp) && JSVAL_TO_BOOLEAN(vp)) {
+		return SM_SOCK_BINARY;
+	}
+	
+	return SM_SOCK_STRING;
+}
+
 /* Reporting error from JS compilation (parse error, etc...) */
 static void reportError(JSContext *cx, const char *message, JSErrorReport *report)
 {
@@ -1552,11 +2826,345 @@ static JSObject *ape_json_to_jsobj(JSContext *cx, json_item *head, JSObject *roo
 				}								
 			}
 
-			
+			
+		}
+		head = head->next;
+	}
+	return root;
+}
+
+static void jsontree_release(ape_sm_jsontree *tree)
+{
+	if (tree != NULL && --tree->refs == 0) {
+		free_json_item(tree->head);
+		free(tree);
+	}
+}
+
+static JSObject *jsonview_new(JSContext *cx, ape_sm_jsontree *tree, json_item *fields)
+{
+	ape_sm_jsonview *view;
+	JSObject *obj;
+	json_item *item;
+	unsigned int nfields = 0;
+	
+	for (item = fields; item != NULL; item = item->next) {
+		nfields++;
+	}
+	
+	if ((obj = JS_NewObject(cx, &jsonview_class, NULL, NULL)) == NULL) {
+		return NULL;
+	}
+	
+	view = xmalloc(sizeof(*view) + nfields / 8);
+	memset(view->resolved, 0, nfields / 8 + 1);
+	
+	view->tree = tree;
+	view->fields = fields;
+	view->nfields = nfields;
+	
+	tree->refs++;
+	
+	JS_SetPrivate(cx, obj, view);
+	
+	return obj;
+}
+
+static jsval jsonview_value(JSContext *cx, ape_sm_jsontree *tree, json_item *item)
+{
+	jsval jval = JSVAL_NULL;
+	
+	if (item->jchild.child != NULL) {
+		JSObject *cobj = NULL;
+		
+		switch(item->jchild.type) {
+			case JSON_C_T_OBJ:
+				cobj = jsonview_new(cx, tree, item->jchild.child);
+				break;
+			case JSON_C_T_ARR:
+				/* arrays are small in practice and need the Array class, convert them at once */
+				cobj = ape_json_to_jsobj(cx, item->jchild.child, JS_NewArrayObject(cx, 0, NULL));
+				break;
+			default:
+				cobj = ape_json_to_jsobj(cx, item->jchild.child, NULL);
+				break;
+		}
+		jval = OBJECT_TO_JSVAL(cobj);
+	} else if (item->jval.vu.str.value != NULL) {
+		jval = STRING_TO_JSVAL(JS_NewStringCopyN(cx, item->jval.vu.str.value, item->jval.vu.str.length));
+	} else {
+		jsdouble dp = (item->jval.vu.integer_value ? item->jval.vu.integer_value : item->jval.vu.float_value);
+		JS_NewNumberValue(cx, dp, &jval);
+	}
+	
+	return jval;
+}
+
+static JSBool jsonview_define(JSContext *cx, JSObject *obj, ape_sm_jsonview *view, json_item *item, unsigned int index)
+{
+	jsval jval = jsonview_value(cx, view->tree, item);
+
+	JSONVIEW_SET_RESOLVED(view, index);
+	
+	return JS_DefineProperty(cx, obj, item->key.val, jval, NULL, NULL, JSPROP_ENUMERATE);
+}
+
+/* Compare an id with a json key (keys are defined as latin-1 strings, see JS_DefineProperty) */
+static int jsid_is_key(JSContext *cx, jsid id, const char *key, size_t len)
+{
+	if (JSID_IS_STRING(id)) {
+		size_t i, idlen;
+		const jschar *chars = JS_GetStringCharsAndLength(cx, JSID_TO_STRING(id), &idlen);
+		
+		if (chars == NULL || idlen != len) {
+			return 0;
+		}
+		for (i = 0; i < len; i++) {
+			if (chars[i] != (unsigned char)key[i]) {
+				return 0;
+			}
+		}
+		return 1;
+	} else if (JSID_IS_INT(id)) {
+		char num[16];
+		
+		return (snprintf(num, sizeof(num), "%d", JSID_TO_INT(id)) == len && memcmp(num, key, len) == 0);
+	}
+	
+	return 0;
+}
+
+static JSBool jsonview_resolve(JSContext *cx, JSObject *obj, jsid id, uintN flags, JSObject **objp)
+{
+	ape_sm_jsonview *view = JS_GetPrivate(cx, obj);
+	json_item *item, *found = NULL;
+	unsigned int i, index = 0;
+	
+	*objp = NULL;
+	
+	if (view == NULL) {
+		return JS_TRUE;
+	}
+	
+	/* same as JS_SetProperty() in sequence : the last duplicated key wins */
+	for (item = view->fields, i = 0; item != NULL; item = item->next, i++) {
+		if (item->key.val != NULL && jsid_is_key(cx, id, item->key.val, item->key.len)) {
+			found = item;
+			index = i;
+		}
+	}
+	
+	if (found == NULL || JSONVIEW_RESOLVED(view, index)) {
+		return JS_TRUE;
+	}
+	
+	if (!jsonview_define(cx, obj, view, found, index)) {
+		return JS_FALSE;
+	}
+	*objp = obj;
+	
+	return JS_TRUE;
+}
+
+/* for..in, JSON.stringify() & co : everything is needed */
+static JSBool jsonview_enumerate(JSContext *cx, JSObject *obj)
+{
+	ape_sm_jsonview *view = JS_GetPrivate(cx, obj);
+	json_item *item;
+	unsigned int i;
+	
+	if (view == NULL) {
+		return JS_TRUE;
+	}
+	
+	for (item = view->fields, i = 0; item != NULL; item = item->next, i++) {
+		if (item->key.val != NULL && !JSONVIEW_RESOLVED(view, i) && !jsonview_define(cx, obj, view, item, i)) {
+			return JS_FALSE;
+		}
+	}
+	
+	return JS_TRUE;
+}
+
+static void jsonview_finalize(JSContext *cx, JSObject *obj)
+{
+	ape_sm_jsonview *view = JS_GetPrivate(cx, obj);
+	
+	if (view != NULL) {
+		jsontree_release(view->tree);
+		free(view);
+	}
+}
+
+/*
+	Params passed to a JS command handler.
+	The handler of a command is the last one to read callbacki->param so the
+	tree is taken from the request (zero copy), hooks and bad cmd handlers
+	run before other readers and work on a native copy.
+*/
+static JSObject *ape_sm_params_to_jsobj(JSContext *cx, callbackp *callbacki)
+{
+	json_item *head = callbacki->param, *params;
+	ape_sm_jsontree *tree;
+	JSObject *obj;
+	
+	if (head == NULL) {
+		return NULL;
+	}
+	params = head->father;
+	
+	/* not a {"key":value} object (array or scalar params) */
+	if (head->key.val == NULL || params == NULL || params->jchild.child != head ||
+		params->key.val == NULL || strcasecmp(params->key.val, "params") != 0) {
+		
+		return ape_json_to_jsobj(cx, head, NULL);
+	}
+	
+	tree = xmalloc(sizeof(*tree));
+	tree->refs = 1;
+	
+	if (callbacki->data == NULL) {
+		tree->head = head;
+		params->jchild.child = NULL;
+		params->jchild.head = NULL;
+	} else {
+		tree->head = json_item_copy(head, NULL);
+	}
+	
+	obj = jsonview_new(cx, tree, tree->head);
+	
+	jsontree_release(tree);
+	
+	return obj;
+}
+
+/* Header lines of "http" (lowercased keys), NULL "http" gives an empty tree */
+static ape_sm_jsontree *ape_sm_headers_tree(http_state *http)
+{
+	ape_sm_jsontree *tree = xmalloc(sizeof(*tree));
+	json_item *headers = json_new_object(), *item;
+	int i;
+	
+	for (i = 0; http != NULL && i < http->nheaders; i++) {
+		item = json_set_property_strN(headers, HTTP_HEADER_KEY(http, i), http->headers[i].key_len, HTTP_HEADER_VALUE(http, i), http->headers[i].value_len);
+		
+		/* on the copy : the request buffer is shared */
+		s_tolower(item->key.val, item->key.len);
+	}
+	
+	tree->refs = 1;
+	tree->head = headers->jchild.child;
+	
+	headers->jchild.child = NULL;
+	free_json_item(headers);
+	
+	return tree;
+}
+
+static JSBool cmdresponse_define(JSContext *cx, JSObject *obj, struct _ape_sm_cmdinfos *infos, unsigned int prop)
+{
+	jsval jval = JSVAL_NULL;
+	const char *name = NULL;
+	
+	infos->resolved |= prop;
+	
+	switch(prop) {
+		case 1:
+			name = "host";
+			jval = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, infos->host));
+			break;
+		case 2:
+			name = "ip";
+			jval = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, infos->ip));
+			break;
+		case 4:
+			name = "http";
+			infos->http = ape_sm_headers_tree(infos->request);
+			jval = OBJECT_TO_JSVAL(jsonview_new(cx, infos->http, infos->http->head));
+			break;
+		default:
+			return JS_TRUE;
+	}
+	
+	return JS_DefineProperty(cx, obj, name, jval, NULL, NULL, JSPROP_ENUMERATE);
+}
+
+static JSBool cmdresponse_resolve(JSContext *cx, JSObject *obj, jsid id, uintN flags, JSObject **objp)
+{
+	struct _ape_sm_cmdinfos *infos = JS_GetPrivate(cx, obj);
+	unsigned int prop = 0;
+	
+	*objp = NULL;
+	
+	if (infos == NULL) {
+		return JS_TRUE;
+	}
+	
+	if (jsid_is_key(cx, id, CONST_STR_LEN("host"))) {
+		prop = 1;
+	} else if (jsid_is_key(cx, id, CONST_STR_LEN("ip"))) {
+		prop = 2;
+	} else if (jsid_is_key(cx, id, CONST_STR_LEN("http"))) {
+		prop = 4;
+	}
+	
+	if (prop == 0 || (infos->resolved & prop)) {
+		return JS_TRUE;
+	}
+	
+	if (!cmdresponse_define(cx, obj, infos, prop)) {
+		return JS_FALSE;
+	}
+	*objp = obj;
+	
+	return JS_TRUE;
+}
+
+static JSBool cmdresponse_enumerate(JSContext *cx, JSObject *obj)
+{
+	struct _ape_sm_cmdinfos *infos = JS_GetPrivate(cx, obj);
+	unsigned int prop;
+	
+	if (infos == NULL) {
+		return JS_TRUE;
+	}
+	
+	for (prop = 1; prop <= 4; prop <<= 1) {
+		if (!(infos->resolved & prop) && !cmdresponse_define(cx, obj, infos, prop)) {
+			return JS_FALSE;
 		}
-		head = head->next;
 	}
-	return root;
+	
+	return JS_TRUE;
+}
+
+static void cmdresponse_finalize(JSContext *cx, JSObject *obj)
+{
+	struct _ape_sm_cmdinfos *infos = JS_GetPrivate(cx, obj);
+	
+	if (infos != NULL) {
+		free(infos->host);
+		free(infos->ip);
+		jsontree_release(infos->http);
+		free(infos);
+	}
+}
+
+/*
+	host and ip are copied, the headers are only referenced : infos.http is
+	built from them on first access, until the handler returns.
+*/
+static struct _ape_sm_cmdinfos *ape_sm_cmdinfos_new(callbackp *callbacki)
+{
+	struct _ape_sm_cmdinfos *infos = xmalloc(sizeof(*infos));
+	
+	infos->host = xstrdup(callbacki->host != NULL ? callbacki->host : "");
+	infos->ip = xstrdup(callbacki->ip != NULL ? callbacki->ip : "");
+	infos->request = callbacki->http;
+	infos->http = NULL;
+	infos->resolved = 0;
+	
+	return infos;
 }
 
 static void ape_sm_pipe_on_send_wrapper(transpipe *pipe, USERS *user, json_item *jstr, acetables *g_ape)
@@ -1570,7 +3178,7 @@ static void ape_sm_pipe_on_send_wrapper(transpipe *pipe, USERS *user, json_item
 	params[0] = OBJECT_TO_JSVAL(APEUSER_TO_JSOBJ(user));
 	params[1] = OBJECT_TO_JSVAL(obj);
 	
-	JS_CallFunctionName(cx, pipe->data, "onSend", 2, params, &rval);
+	SM_CALL_NAME(cx, pipe->data, "pipe", "onSend", 2, params, &rval);
 	
 	JS_RemoveObjectRoot(cx, &obj);
 }
@@ -1580,14 +3188,13 @@ static unsigned int ape_sm_cmd_wrapper(callbackp *callbacki)
 {
 	acetables *g_ape = callbacki->g_ape;
 	ape_sm_compiled *asc = ASMR->scripts;
-	struct _http_header_line *hlines;
 	
-	json_item *head = callbacki->param;
 	JSContext *cx = ASMC;
 	
 	JSObject *obj; // param object
 	JSObject *cb; // cmd object
-	JSObject *hl; // http object
+	struct _ape_sm_cmdinfos *infos;
+	unsigned int ret;
 	
 	if (asc == NULL) {
 		return (RETURN_NOTHING);
@@ -1597,25 +3204,16 @@ static unsigned int ape_sm_cmd_wrapper(callbackp *callbacki)
 	//JS_BeginRequest(cx);
 		jsval jval;
 
-		obj = ape_json_to_jsobj(cx, head, NULL);
+		/* params and infos are lazy : only what the handler reads is converted */
+		obj = ape_sm_params_to_jsobj(cx, callbacki);
 		JS_AddObjectRoot(cx, &obj);
 		
 		cb = JS_NewObject(cx, &cmdresponse_class, NULL, NULL);
 		JS_AddObjectRoot(cx, &cb);
+		infos = ape_sm_cmdinfos_new(callbacki);
+		JS_SetPrivate(cx, cb, infos);
 		JS_DefineFunctions(cx, cb, cmdresponse_funcs);
 		
-		jval = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, callbacki->host));
-		/* infos.host */	
-		JS_SetProperty(cx, cb, "host", &jval);
-		
-		hl = JS_DefineObject(cx, cb, "http", NULL, NULL, 0);		
-		
-		for (hlines = callbacki->hlines; hlines != NULL; hlines = hlines->next) {
-			s_tolower(hlines->key.val, hlines->key.len);
-			jval = STRING_TO_JSVAL(JS_NewStringCopyN(cx, hlines->value.val, hlines->value.len));
-			JS_SetProperty(cx, hl, hlines->key.val, &jval);
-		}
-		
 		jval = OBJECT_TO_JSVAL(sm_ape_socket_to_jsobj(cx, callbacki->client));
 		JS_SetProperty(cx, cb, "client", &jval);
 		
@@ -1623,9 +3221,6 @@ static unsigned int ape_sm_cmd_wrapper(callbackp *callbacki)
 		/* infos.chl */
 		JS_SetProperty(cx, cb, "chl", &jval);
 		
-		jval = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, callbacki->ip));
-		JS_SetProperty(cx, cb, "ip", &jval);
-		
 		if (callbacki->call_user != NULL) {
 			jval = OBJECT_TO_JSVAL(APEUSER_TO_JSOBJ(callbacki->call_user));	
 			/* infos.user */
@@ -1639,18 +3234,21 @@ static unsigned int ape_sm_cmd_wrapper(callbackp *callbacki)
 		}
 		
 		JS_RemoveObjectRoot(cx, &obj);
-		JS_RemoveObjectRoot(cx, &cb);	
 		
 	//JS_EndRequest(cx);
 	//JS_ClearContextThread(cx);
 	
 	if (callbacki->data == NULL) {
-		return ape_fire_cmd(callbacki->cmd, obj, cb, callbacki, callbacki->g_ape);
+		ret = ape_fire_cmd(callbacki->cmd, obj, cb, callbacki, callbacki->g_ape);
 	} else {
-		return ape_fire_hook(callbacki->data, obj, cb, callbacki, callbacki->g_ape);
+		ret = ape_fire_hook(callbacki->data, obj, cb, callbacki, callbacki->g_ape);
 	}
 	
-	return (RETURN_NOTHING);
+	/* the request may be reused from now on (cb is still rooted : infos is alive) */
+	infos->request = NULL;
+	JS_RemoveObjectRoot(cx, &cb);
+	
+	return ret;
 }
 
 APE_JS_NATIVE(ape_sm_register_bad_cmd)
@@ -1670,6 +3268,7 @@ APE_JS_NATIVE(ape_sm_register_bad_cmd)
 	ascb->type = APE_BADCMD;
 	ascb->cx = cx;
 	ascb->callbackname = NULL;
+	ascb->stats = sm_handler_metric("badcmd", NULL);
 	
 	if (asc->callbacks.head == NULL) {
 		asc->callbacks.head = ascb;
@@ -1718,6 +3317,7 @@ APE_JS_NATIVE(ape_sm_register_cmd)
 	ascb->type = APE_CMD;
 	ascb->cx = cx;
 	ascb->callbackname = ccmd;
+	ascb->stats = sm_handler_metric("cmd", ccmd);
 	
 	if (asc->callbacks.head == NULL) {
 		asc->callbacks.head = ascb;
@@ -1771,6 +3371,7 @@ APE_JS_NATIVE(ape_sm_hook_cmd)
 	ascb->type = APE_HOOK;
 	ascb->cx = cx;
 	ascb->callbackname = ccmd; /* TODO: ccmd leak */
+	ascb->stats = sm_handler_metric("hook", ccmd);
 	
 	if (asc->callbacks.head == NULL) {
 		asc->callbacks.head = ascb;
@@ -1799,28 +3400,544 @@ APE_JS_NATIVE(ape_sm_include)
 		return JS_TRUE;
 	}
 	
-	cfile = JS_EncodeString(cx, file);
+	cfile = JS_EncodeString(cx, file);
+	
+	memset(rpath, '\0', sizeof(rpath));
+	strncpy(rpath, READ_CONF("scripts_path"), 255);
+	strncat(rpath, cfile, 255);
+	
+	JS_free(cx, cfile);
+	
+	if (!g_ape->is_daemon) {
+		printf("[JS] Loading script %s...\n", rpath);
+	}
+
+	bytecode = JS_CompileFile(cx, JS_GetGlobalObject(cx), rpath);
+	
+	if (bytecode == NULL) {
+		if (!g_ape->is_daemon) {
+			printf("[JS] Failed loading script %s\n", rpath);
+		}		
+		return JS_TRUE;
+	}
+
+	JS_ExecuteScript(cx, JS_GetGlobalObject(cx), bytecode, &frval);	
+	
+	return JS_TRUE;
+}
+
+/*
+	Asynchronous file API : files are read by the core workers (workers.c)
+	and the callback runs on the event loop. Whole-file reads are cached
+	(JS string kept rooted, keyed by path, validated against mtime/size/inode
+	at most every "file_cache_ttl" seconds, LRU bounded to "file_cache_size" KB).
+*/
+typedef struct _ape_sm_file ape_sm_file;
+struct _ape_sm_file {
+	char *path;
+	JSString *content;
+	size_t len;
+	
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	time_t checked;
+	
+	struct _ape_sm_file *prev; /* LRU, most recent first */
+	struct _ape_sm_file *next;
+};
+
+typedef struct _ape_sm_file_job ape_sm_file_job;
+struct _ape_sm_file_job {
+	ape_job job;
+	
+	char *path;
+	JSContext *cx;
+	jsval callback;
+	
+	size_t chunk; /* stream mode when != 0 */
+	off_t offset;
+	int include;
+	
+	/* cached version to validate */
+	int cached;
+	struct stat st;
+	
+	/* result */
+	char *data;
+	size_t len;
+	int error;
+	int unchanged;
+	int eof;
+};
+
+static struct {
+	HTBL *table;
+	ape_sm_file *head, *foot;
+	size_t size, max;
+	int ttl;
+} sm_files = {NULL, NULL, NULL, 0, 0, 1};
+
+static void sm_file_unlink(ape_sm_file *file)
+{
+	if (file->prev != NULL) {
+		file->prev->next = file->next;
+	} else {
+		sm_files.head = file->next;
+	}
+	if (file->next != NULL) {
+		file->next->prev = file->prev;
+	} else {
+		sm_files.foot = file->prev;
+	}
+}
+
+static void sm_file_touch(ape_sm_file *file)
+{
+	sm_file_unlink(file);
+	
+	file->prev = NULL;
+	file->next = sm_files.head;
+	if (sm_files.head != NULL) {
+		sm_files.head->prev = file;
+	} else {
+		sm_files.foot = file;
+	}
+	sm_files.head = file;
+}
+
+static void sm_file_remove(JSContext *cx, ape_sm_file *file)
+{
+	sm_file_unlink(file);
+	hashtbl_erase(sm_files.table, file->path);
+	
+	JS_RemoveStringRoot(cx, &file->content);
+	sm_files.size -= file->len;
+	
+	free(file->path);
+	free(file);
+}
+
+static void sm_file_store(JSContext *cx, const char *path, char *data, size_t len, struct stat *st)
+{
+	ape_sm_file *file;
+	
+	if (sm_files.table == NULL || len > sm_files.max / 8) {
+		return;
+	}
+	if ((file = hashtbl_seek(sm_files.table, path)) != NULL) {
+		sm_file_remove(cx, file);
+	}
+	while (sm_files.foot != NULL && sm_files.size + len > sm_files.max) {
+		sm_file_remove(cx, sm_files.foot);
+	}
+	
+	file = xmalloc(sizeof(*file));
+	file->path = xstrdup(path);
+	file->content = JS_NewStringCopyN(cx, data, len);
+	file->len = len;
+	file->mtime = st->st_mtime;
+	file->size = st->st_size;
+	file->ino = st->st_ino;
+	file->checked = time(NULL);
+	file->prev = file->next = NULL;
+	
+	JS_AddStringRoot(cx, &file->content);
+	
+	if ((file->next = sm_files.head) != NULL) {
+		sm_files.head->prev = file;
+	} else {
+		sm_files.foot = file;
+	}
+	sm_files.head = file;
+	sm_files.size += len;
+	
+	hashtbl_append(sm_files.table, file->path, file);
+}
+
+/* Read a whole file (or a chunk) in one go, "len" is known from fstat() */
+static char *sm_read_fd(int fd, off_t offset, size_t len, size_t *rlen)
+{
+	char *data = xmalloc(sizeof(char) * (len + 1));
+	size_t total = 0;
+	ssize_t n;
+	
+	while (total < len && (n = pread(fd, data + total, len - total, offset + total)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(data);
+			return NULL;
+		}
+		total += n;
+	}
+	*rlen = total;
+	
+	return data;
+}
+
+/* Worker thread : must not use the JS API */
+static void sm_file_work(ape_job *job)
+{
+	ape_sm_file_job *fj = job->data;
+	struct stat st;
+	int fd;
+	
+	if ((fd = open(fj->path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		fj->error = errno;
+		fj->eof = 1;
+		if (fd != -1) {
+			close(fd);
+		}
+		return;
+	}
+	
+	if (fj->cached && st.st_mtime == fj->st.st_mtime && st.st_size == fj->st.st_size && st.st_ino == fj->st.st_ino) {
+		fj->unchanged = 1;
+		fj->eof = 1;
+	} else if (fj->chunk) {
+		if ((fj->data = sm_read_fd(fd, fj->offset, fj->chunk, &fj->len)) == NULL) {
+			fj->error = errno;
+		}
+		fj->eof = (fj->data == NULL || fj->len < fj->chunk || fj->offset + fj->len >= st.st_size);
+	} else {
+		if ((fj->data = sm_read_fd(fd, 0, st.st_size, &fj->len)) == NULL) {
+			fj->error = errno;
+		}
+		fj->eof = 1;
+	}
+	fj->st = st;
+	
+	close(fd);
+}
+
+static void sm_file_job_free(ape_sm_file_job *fj)
+{
+	JS_RemoveValueRoot(fj->cx, &fj->callback);
+	free(fj->data);
+	free(fj->path);
+	free(fj);
+}
+
+/* callback(data, error, eof) */
+static void sm_file_callback(ape_sm_file_job *fj, JSString *content)
+{
+	jsval params[3], rval;
+	
+	params[0] = (content != NULL ? STRING_TO_JSVAL(content) : JSVAL_NULL);
+	params[1] = (fj->error ? STRING_TO_JSVAL(JS_NewStringCopyZ(fj->cx, strerror(fj->error))) : JSVAL_NULL);
+	params[2] = BOOLEAN_TO_JSVAL(fj->eof);
+	
+	if (!JSVAL_IS_VOID(fj->callback)) {
+		SM_CALL_VALUE(fj->cx, JS_GetGlobalObject(fj->cx), fj->callback, "file", "readFileAsync", 3, params, &rval);
+	}
+}
+
+static void sm_file_done(ape_job *job, acetables *g_ape)
+{
+	ape_sm_file_job *fj = job->data;
+	JSContext *cx = fj->cx;
+	JSString *content = NULL;
+	ape_sm_file *file = NULL;
+	
+	if (fj->unchanged) {
+		if ((file = hashtbl_seek(sm_files.table, fj->path)) == NULL) {
+			/* evicted meanwhile */
+			fj->cached = fj->unchanged = 0;
+			workers_submit(&fj->job, g_ape);
+			return;
+		}
+		file->checked = time(NULL);
+		sm_file_touch(file);
+		content = file->content;
+	} else if (fj->data != NULL) {
+		if (!fj->chunk && !fj->include) {
+			sm_file_store(cx, fj->path, fj->data, fj->len, &fj->st);
+		}
+		if ((file = hashtbl_seek(sm_files.table, fj->path)) != NULL && !fj->chunk && !fj->include) {
+			content = file->content;
+		} else if (!fj->include) {
+			content = JS_NewStringCopyN(cx, fj->data, fj->len);
+		}
+	}
+	
+	if (fj->include) {
+		JSObject *bytecode;
+		jsval frval;
+		
+		if (fj->data != NULL && (bytecode = JS_CompileScript(cx, JS_GetGlobalObject(cx), fj->data, fj->len, fj->path, 1)) != NULL) {
+			JS_ExecuteScript(cx, JS_GetGlobalObject(cx), bytecode, &frval);
+		}
+		sm_file_callback(fj, NULL);
+	} else if (fj->chunk) {
+		off_t next = fj->offset + fj->len;
+		
+		sm_file_callback(fj, content);
+		
+		if (!fj->eof && !fj->error) {
+			/* next chunk only once this one was consumed */
+			free(fj->data);
+			fj->data = NULL;
+			fj->offset = next;
+			fj->len = 0;
+			workers_submit(&fj->job, g_ape);
+			return;
+		}
+	} else {
+		sm_file_callback(fj, content);
+	}
+	
+	sm_file_job_free(fj);
+}
+
+static ape_sm_file_job *sm_file_job_new(JSContext *cx, JSString *path, jsval callback, int prefix)
+{
+	ape_sm_file_job *fj = xmalloc(sizeof(*fj));
+	char *cpath = JS_EncodeString(cx, path);
+	
+	memset(fj, 0, sizeof(*fj));
+	
+	if (prefix) {
+		char *scripts_path = READ_CONF("scripts_path");
+		
+		fj->path = xmalloc(strlen(scripts_path) + strlen(cpath) + 1);
+		sprintf(fj->path, "%s%s", scripts_path, cpath);
+	} else {
+		fj->path = xstrdup(cpath);
+	}
+	JS_free(cx, cpath);
+	
+	fj->cx = cx;
+	fj->callback = callback;
+	JS_AddValueRoot(cx, &fj->callback);
+	
+	fj->job.work = sm_file_work;
+	fj->job.done = sm_file_done;
+	fj->job.data = fj;
+	
+	return fj;
+}
+
+/* Ape.readFileAsync(path, callback(data, error, eof)[, chunk_size]) */
+APE_JS_NATIVE(ape_sm_readfile_async)
+//{
+	JSString *path;
+	JSObject *callback;
+	uint32 chunk = 0;
+	ape_sm_file_job *fj;
+	ape_sm_file *file;
+	
+	if (argc < 2 || !JS_ConvertArguments(cx, argc, JS_ARGV(cx, vpn), "So/u", &path, &callback, &chunk) || !JS_ObjectIsFunction(cx, callback)) {
+		return JS_TRUE;
+	}
+	
+	fj = sm_file_job_new(cx, path, OBJECT_TO_JSVAL(callback), 0);
+	fj->chunk = chunk;
+	
+	if (!chunk && sm_files.table != NULL && (file = hashtbl_seek(sm_files.table, fj->path)) != NULL) {
+		if (time(NULL) - file->checked < sm_files.ttl) {
+			/* cache hit : no I/O at all */
+			fj->unchanged = fj->eof = 1;
+			workers_defer(&fj->job, g_ape);
+			return JS_TRUE;
+		}
+		fj->cached = 1;
+		fj->st.st_mtime = file->mtime;
+		fj->st.st_size = file->size;
+		fj->st.st_ino = file->ino;
+	}
+	
+	workers_submit(&fj->job, g_ape);
+	
+	return JS_TRUE;
+}
+
+/* include() without blocking the loop, callback() is called once the script ran */
+APE_JS_NATIVE(ape_sm_include_async)
+//{
+	JSString *file;
+	jsval callback = JSVAL_VOID;
+	ape_sm_file_job *fj;
+	
+	if (argc < 1 || !JS_ConvertArguments(cx, 1, JS_ARGV(cx, vpn), "S", &file)) {
+		return JS_TRUE;
+	}
+	if (argc > 1 && JSVAL_IS_OBJECT(JS_ARGV(cx, vpn)[1]) && !JSVAL_IS_NULL(JS_ARGV(cx, vpn)[1]) && JS_ObjectIsFunction(cx, JSVAL_TO_OBJECT(JS_ARGV(cx, vpn)[1]))) {
+		callback = JS_ARGV(cx, vpn)[1];
+	}
+	
+	fj = sm_file_job_new(cx, file, callback, 1);
+	fj->include = 1;
+	fj->eof = 1;
+	
+	workers_submit(&fj->job, g_ape);
+	
+	return JS_TRUE;
+}
+
+/* Ape.httpRequest() handlers object, rooted until onEnd() */
+typedef struct _ape_sm_http ape_sm_http;
+struct _ape_sm_http {
+	JSContext *cx;
+	JSObject *handlers;
+};
+
+static int sm_http_handler(ape_sm_http *sh, const char *name, jsval *fval)
+{
+	return (JS_GetProperty(sh->cx, sh->handlers, name, fval) && JS_TypeOfValue(sh->cx, *fval) == JSTYPE_FUNCTION);
+}
+
+static void sm_http_on_response(http_client *req, acetables *g_ape)
+{
+	ape_sm_http *sh = req->data;
+	http_client_header *header;
+	JSObject *headers;
+	jsval fval, params[2], rval;
+	
+	if (!sm_http_handler(sh, "onResponse", &fval)) {
+		return;
+	}
+	headers = JS_NewObject(sh->cx, NULL, NULL, NULL);
+	JS_AddObjectRoot(sh->cx, &headers);
+	
+	/* names are lowercased, headers are stored last received first : the first occurrence wins */
+	for (header = req->response.headers; header != NULL; header = header->next) {
+		jsval value = STRING_TO_JSVAL(JS_NewStringCopyZ(sh->cx, header->value));
+		char *key = xstrdup(header->key), *k;
+		
+		for (k = key; *k != '\0'; k++) {
+			*k = tolower((unsigned char)*k);
+		}
+		JS_SetProperty(sh->cx, headers, key, &value);
+		free(key);
+	}
+	params[0] = INT_TO_JSVAL(req->response.status);
+	params[1] = OBJECT_TO_JSVAL(headers);
+	
+	SM_CALL_VALUE(sh->cx, sh->handlers, fval, "http", "onResponse", 2, params, &rval);
+	
+	JS_RemoveObjectRoot(sh->cx, &headers);
+}
+
+static void sm_http_on_data(http_client *req, const char *data, size_t len, acetables *g_ape)
+{
+	ape_sm_http *sh = req->data;
+	jsval fval, params[1], rval;
+	
+	if (!sm_http_handler(sh, "onData", &fval)) {
+		return;
+	}
+	params[0] = STRING_TO_JSVAL(JS_NewStringCopyN(sh->cx, data, len));
+	
+	SM_CALL_VALUE(sh->cx, sh->handlers, fval, "http", "onData", 1, params, &rval);
+}
+
+static void sm_http_on_end(http_client *req, http_client_error error, acetables *g_ape)
+{
+	ape_sm_http *sh = req->data;
+	jsval fval, params[1], rval;
+	
+	if (sm_http_handler(sh, "onEnd", &fval)) {
+		params[0] = (error ? INT_TO_JSVAL(error) : JSVAL_FALSE);
+		
+		SM_CALL_VALUE(sh->cx, sh->handlers, fval, "http", "onEnd", 1, params, &rval);
+	}
+	JS_RemoveObjectRoot(sh->cx, &sh->handlers);
+	free(sh);
+}
+
+/*
+	Ape.httpRequest({url, method, headers, body}, {onResponse(status, headers), onData(chunk), onEnd(error)})
+	HTTP/1.1 on a pooled keep-alive connection, the body is streamed through onData()
+*/
+APE_JS_NATIVE(ape_sm_http_request)
+//{
+	JSObject *options, *handlers;
+	JSString *str;
+	http_client *req;
+	ape_sm_http *sh;
+	char *url, *method = NULL;
+	jsval vp;
+	
+	if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vpn), "oo", &options, &handlers) || options == NULL || handlers == NULL) {
+		return JS_TRUE;
+	}
+	if (!JS_GetProperty(cx, options, "url", &vp) || !JSVAL_IS_STRING(vp)) {
+		JS_SET_RVAL(cx, vpn, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+	url = JS_EncodeString(cx, JSVAL_TO_STRING(vp));
+	
+	if (JS_GetProperty(cx, options, "method", &vp) && JSVAL_IS_STRING(vp)) {
+		method = JS_EncodeString(cx, JSVAL_TO_STRING(vp));
+	}
+	req = http_client_new((method != NULL ? method : "GET"), url);
+	
+	JS_free(cx, url);
+	if (method != NULL) {
+		JS_free(cx, method);
+	}
+	if (req == NULL) {
+		JS_SET_RVAL(cx, vpn, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+	
+	if (JS_GetProperty(cx, options, "headers", &vp) && !JSVAL_IS_PRIMITIVE(vp)) {
+		JSObject *headers = JSVAL_TO_OBJECT(vp);
+		JSIdArray *ids = JS_Enumerate(cx, headers);
+		int i;
+		
+		for (i = 0; ids != NULL && i < ids->length; i++) {
+			jsval key, value;
+			char *ckey, *cvalue;
+			
+			if (!JS_GetPropertyById(cx, headers, ids->vector[i], &value) || JSVAL_IS_VOID(value) || JS_TypeOfValue(cx, value) == JSTYPE_FUNCTION) {
+				continue;
+			}
+			JS_IdToValue(cx, ids->vector[i], &key);
+			
+			if ((str = JS_ValueToString(cx, key)) == NULL || (ckey = JS_EncodeString(cx, str)) == NULL) {
+				continue;
+			}
+			if ((str = JS_ValueToString(cx, value)) != NULL && (cvalue = JS_EncodeString(cx, str)) != NULL) {
+				http_client_set_header(req, ckey, cvalue);
+				JS_free(cx, cvalue);
+			}
+			JS_free(cx, ckey);
+		}
+		if (ids != NULL) {
+			JS_DestroyIdArray(cx, ids);
+		}
+	}
+	
+	/* string or Buffer */
+	if (JS_GetProperty(cx, options, "body", &vp) && !JSVAL_IS_VOID(vp) && !JSVAL_IS_NULL(vp)) {
+		char *data, *tofree;
+		size_t len;
+		
+		if (sm_value_bytes(cx, vp, &data, &len, &tofree)) {
+			http_client_set_body(req, data, len);
+			
+			if (tofree != NULL) {
+				JS_free(cx, tofree);
+			}
+		}
+	}
 	
-	memset(rpath, '\0', sizeof(rpath));
-	strncpy(rpath, READ_CONF("scripts_path"), 255);
-	strncat(rpath, cfile, 255);
+	sh = xmalloc(sizeof(*sh));
+	sh->cx = cx;
+	sh->handlers = handlers;
+	JS_AddObjectRoot(cx, &sh->handlers);
 	
-	JS_free(cx, cfile);
+	req->on_response = sm_http_on_response;
+	req->on_data = sm_http_on_data;
+	req->on_end = sm_http_on_end;
+	req->data = sh;
 	
-	if (!g_ape->is_daemon) {
-		printf("[JS] Loading script %s...\n", rpath);
-	}
-
-	bytecode = JS_CompileFile(cx, JS_GetGlobalObject(cx), rpath);
+	http_client_send(req, g_ape);
 	
-	if (bytecode == NULL) {
-		if (!g_ape->is_daemon) {
-			printf("[JS] Failed loading script %s\n", rpath);
-		}		
-		return JS_TRUE;
-	}
-
-	JS_ExecuteScript(cx, JS_GetGlobalObject(cx), bytecode, &frval);	
+	JS_SET_RVAL(cx, vpn, JSVAL_TRUE);
 	
 	return JS_TRUE;
 }
@@ -1830,9 +3947,9 @@ APE_JS_NATIVE(ape_sm_readfile)
 	JSString *string;
 	char *cstring;
 	char *content;
-	FILE *fp;
-	int size = 2048;
-	int fsize = 0;
+	struct stat st;
+	size_t len;
+	int fd;
 	
 	if (argc != 1) {
         return JS_TRUE;
@@ -1842,33 +3959,20 @@ APE_JS_NATIVE(ape_sm_readfile)
 		return JS_TRUE;
 	}
 	cstring = JS_EncodeString(cx, string);
-	fp = fopen(cstring, "r");
-	if (fp == NULL) {
+	fd = open(cstring, O_RDONLY);
+	JS_free(cx, cstring);
+	
+	if (fd == -1) {
 	    return JS_TRUE;
 	}
 	
-	content = malloc(sizeof(char) * size);
-	
-	while(!feof(fp)) {
-	    int tmp;
-	    if ((tmp = fread(content+fsize, sizeof(char), 2048, fp)) > 0) {
-	        fsize += tmp;
-	    }
-	    
-	    size += 2048;
-	    
-	    content = realloc(content, sizeof(char) * size);
+	if (fstat(fd, &st) == 0 && (content = sm_read_fd(fd, 0, st.st_size, &len)) != NULL) {
+		JS_SET_RVAL(cx, vpn, STRING_TO_JSVAL(JS_NewStringCopyN(cx, content, len)));
+		free(content);
 	}
-	
-	printf("Size : %d\n", fsize);
-	
-	JS_SET_RVAL(cx, vpn, STRING_TO_JSVAL(JS_NewStringCopyN(cx, content, fsize)));
-	
-	free(content);
-	JS_free(cx, cstring);
+	close(fd);
 	
 	return JS_TRUE;
-	
 }
 
 APE_JS_NATIVE(ape_sm_b64_encode)
@@ -2124,6 +4228,7 @@ APE_JS_NATIVE(ape_sm_addEvent)
 	ascb->type = APE_EVENT;
 	ascb->cx = cx;
 	ascb->callbackname = JS_EncodeString(cx, event);
+	ascb->stats = sm_handler_metric("event", ascb->callbackname);
 	
 	if (asc->callbacks.head == NULL) {
 		asc->callbacks.head = ascb;
@@ -2329,7 +4434,7 @@ static void ape_sm_timer_wrapper(struct _ape_sm_timer *params, int *last)
 	//JS_SetContextThread(params->cx);
 	//JS_BeginRequest(params->cx);
 		if (!params->cleared) {
-			JS_CallFunctionValue(params->cx, params->global, params->func, params->argc, params->argv, &rval);
+			SM_CALL_VALUE(params->cx, params->global, params->func, "timer", "timer", params->argc, params->argv, &rval);
 		}
 		if (params->cleared) { /* JS_CallFunctionValue can set params->Cleared to true */
 			ape_sm_compiled *asc;
@@ -2507,7 +4612,6 @@ APE_JS_NATIVE(ape_sm_sockclient_constructor)
 	JSObject *options = NULL;
 	JSObject *obj = JS_NewObjectForConstructor(cx, vpn);
 	ape_socket *pattern;
-	jsval vp;
 	struct _ape_sock_callbacks *cbcopy;
 	struct _ape_sock_js_obj *sock_obj;
 	
@@ -2520,6 +4624,7 @@ APE_JS_NATIVE(ape_sm_sockclient_constructor)
 	sock_obj = xmalloc(sizeof(*sock_obj));
 	sock_obj->client_obj = NULL;
 	sock_obj->client = NULL;
+	sock_obj->view = NULL;
 	
 	cbcopy = xmalloc(sizeof(struct _ape_sock_callbacks));
 	
@@ -2527,15 +4632,17 @@ APE_JS_NATIVE(ape_sm_sockclient_constructor)
 	cbcopy->asc = asc;
 	cbcopy->server_obj = obj;
 	cbcopy->state = 1;
+	cbcopy->mode = sm_sock_options(cx, options, &cbcopy->max_frame);
 	
 	JS_AddObjectRoot(cx, &cbcopy->server_obj);
 	
 	pattern = xmalloc(sizeof(*pattern));
 	pattern->callbacks.on_connect = sm_sock_onconnect;
 	pattern->callbacks.on_disconnect = sm_sock_ondisconnect;
+	pattern->callbacks.on_connect_failed = sm_sock_onconnectfailed;
 	pattern->callbacks.on_data_completly_sent = NULL;
 
-	if (options != NULL && JS_GetProperty(cx, options, "flushlf", &vp) && JSVAL_IS_BOOLEAN(vp) && JSVAL_TO_BOOLEAN(vp)) {
+	if (cbcopy->mode == SM_SOCK_LINES) {
 		pattern->callbacks.on_read_lf = sm_sock_onread_lf;
 		pattern->callbacks.on_read = NULL;
 	} else {
@@ -2575,24 +4682,25 @@ APE_JS_NATIVE(ape_sm_pipe_constructor)
 }
 
 #ifdef _USE_MYSQL
-static void ape_mysql_handle_io(struct _ape_mysql_data *myhandle, acetables *g_ape)
+static void ape_mysql_handle_io(struct _ape_mysql_conn *conn, acetables *g_ape)
 {
 	int ret;
 	
-	if (myhandle->my->call_it == NULL) {
+	if (conn == NULL || conn->my->call_it == NULL) {
 		return;
 	}
-	ret = mysac_io(myhandle->my);
+	ret = mysac_io(conn->my);
 
 	switch(ret) {
 		case MYERR_WANT_WRITE:
 		case MYERR_WANT_READ:
 			break;
 		default:
-			myhandle->my->call_it = NULL; /* prevent any extra IO call */
+			conn->my->call_it = NULL; /* prevent any extra IO call */
 			
-			if (myhandle->on_success != NULL) {
-				myhandle->on_success(myhandle, ret);
+			/* may free conn */
+			if (conn->on_success != NULL) {
+				conn->on_success(conn, ret);
 			}
 			
 			break;
@@ -2601,196 +4709,316 @@ static void ape_mysql_handle_io(struct _ape_mysql_data *myhandle, acetables *g_a
 
 static void ape_mysql_io_read(ape_socket *client, ape_buffer *buf, size_t offset, acetables *g_ape)
 {
-	struct _ape_mysql_data *myhandle = client->data;
-
-	ape_mysql_handle_io(myhandle, g_ape);
+	ape_mysql_handle_io(client->data, g_ape);
 }
 
 static void ape_mysql_io_write(ape_socket *client, acetables *g_ape)
 {
-	struct _ape_mysql_data *myhandle = client->data;
+	ape_mysql_handle_io(client->data, g_ape);	
+}
+
+/* Call the query callback with (result, error) and release the query */
+static void apemysql_query_end(struct _ape_mysql_data *myhandle, struct _ape_mysql_queue *query, jsval res, int code)
+{
+	jsval params[2], rval;
 	
-	ape_mysql_handle_io(myhandle, g_ape);	
+	myhandle->error = code;
+	
+	if (myhandle->jsmysql != NULL) {
+		params[0] = res;
+		params[1] = (code ? INT_TO_JSVAL(code) : JSVAL_FALSE);
+		
+		SM_CALL_VALUE(myhandle->cx, myhandle->jsmysql, query->callback, "mysql", "query", 2, params, &rval);
+	}
+	JS_RemoveValueRoot(myhandle->cx, &query->callback);
+	
+	free(query->query);
+	free(query);
 }
 
-static void mysac_setdb_success(struct _ape_mysql_data *myhandle, int code)
+/* Fail every waiting query (e.g. the server can't be reached) */
+static void apemysql_flush_queue(struct _ape_mysql_data *myhandle, int code)
 {
-	jsval rval;
-	if (myhandle->jsmysql == NULL) {
-		return;
+	struct _ape_mysql_queue *query;
+	
+	while ((query = myhandle->queue.head) != NULL) {
+		if ((myhandle->queue.head = query->next) == NULL) {
+			myhandle->queue.foot = NULL;
+		}
+		myhandle->queue.length--;
+		apemysql_stats.queued--;
+		
+		apemysql_query_end(myhandle, query, JSVAL_FALSE, code);
+	}
+}
+
+/* Detach conn from the pool and close it. The running query (if any) is returned to the caller */
+static struct _ape_mysql_queue *apemysql_conn_close(struct _ape_mysql_conn *conn)
+{
+	struct _ape_mysql_data *myhandle = conn->pool;
+	struct _ape_mysql_conn **prev;
+	struct _ape_mysql_queue *query = conn->current;
+	acetables *g_ape = myhandle->g_ape;
+	
+	for (prev = &myhandle->conns; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == conn) {
+			*prev = conn->next;
+			break;
+		}
 	}
+	myhandle->nconns--;
+	
+	if (conn->state == SQL_CONNECTING) {
+		myhandle->nconnecting--;
+	}
+	if (myhandle->last == conn) {
+		myhandle->last = NULL;
+	}
+	
+	/* mysac already closed the socket of a failed connect */
+	if (conn->fd >= 0 && conn->my->qst != MYSAC_START) {
+		events_remove(g_ape->events, conn->fd);
+		g_ape->co[conn->fd]->data = NULL;
+		close(conn->fd);
+	} else if (conn->fd >= 0) {
+		g_ape->co[conn->fd]->data = NULL;
+	}
+	
+	free(conn->my->buf);
+	mysac_close(conn->my);
+	free(conn->res_buf);
+	free(conn);
+	
+	return query;
+}
+
+static void mysac_setdb_success(struct _ape_mysql_conn *conn, int code)
+{
+	struct _ape_mysql_data *myhandle = conn->pool;
+	jsval rval;
 	
 	if (!code) {
-		myhandle->state = SQL_READY_FOR_QUERY;
-		apemysql_shift_queue(myhandle);
+		conn->state = SQL_READY_FOR_QUERY;
+		conn->on_success = NULL;
+		myhandle->nconnecting--;
 		
-		JS_CallFunctionName(myhandle->cx, myhandle->jsmysql, "onConnect", 0, NULL, &rval);
+		if (!myhandle->connected && myhandle->jsmysql != NULL) {
+			myhandle->connected = 1;
+			SM_CALL_NAME(myhandle->cx, myhandle->jsmysql, "mysql", "onConnect", 0, NULL, &rval);
+		}
+		apemysql_shift_queue(myhandle);
 	} else {
 		jsval params[1];
-		params[0] = INT_TO_JSVAL(code);
 		
-		JS_CallFunctionName(myhandle->cx, myhandle->jsmysql, "onError", 1, params, &rval);
-		
-		myhandle->jsmysql = NULL;
-		myhandle->on_success = NULL;
+		apemysql_conn_close(conn);
 		
-		/* TODO : Supress queue */
+		if (myhandle->jsmysql != NULL) {
+			params[0] = INT_TO_JSVAL(code);
+			SM_CALL_NAME(myhandle->cx, myhandle->jsmysql, "mysql", "onError", 1, params, &rval);
+		}
 		
-		free(myhandle->db);		
+		/* Nothing left to run the queue */
+		if (myhandle->nconns == 0) {
+			apemysql_flush_queue(myhandle, code);
+		}
 	}
 }
 
-static void mysac_connect_success(struct _ape_mysql_data *myhandle, int code)
+static void mysac_connect_success(struct _ape_mysql_conn *conn, int code)
 {
-	jsval rval;
-	if (myhandle->jsmysql == NULL) {
-		return;
-	}
-
 	if (!code) {
-		myhandle->on_success = mysac_setdb_success;
+		conn->on_success = mysac_setdb_success;
 		
-		mysac_set_database(myhandle->my, myhandle->db);
-		mysac_send_database(myhandle->my);
+		mysac_set_database(conn->my, conn->pool->db);
+		mysac_send_database(conn->my);
 		
 	} else {
-		jsval params[1];
-		params[0] = INT_TO_JSVAL(code);
-		
-		JS_CallFunctionName(myhandle->cx, myhandle->jsmysql, "onError", 1, params, &rval);
-		
-		/* TODO : Supress queue */
-		
-		myhandle->jsmysql = NULL;
-		myhandle->on_success = NULL;
-		
-		free(myhandle->db);
+		mysac_setdb_success(conn, code);
 	}
 }
 
-static void mysac_query_success(struct _ape_mysql_data *myhandle, int code)
+static struct _ape_mysql_conn *apemysql_conn_new(struct _ape_mysql_data *myhandle)
 {
-	struct _ape_mysql_queue *queue = myhandle->data;
-	jsval params[2], rval;
-	myhandle->state = SQL_READY_FOR_QUERY;
-	myhandle->on_success = NULL;
+	struct _ape_mysql_conn *conn;
+	acetables *g_ape = myhandle->g_ape;
+	MYSAC *my;
+	int ret;
 	
-	if (!code) {
+	if ((my = mysac_new(APE_MYSQL_BUFFER)) == NULL) {
+		return NULL;
+	}
+	mysac_setup(my, myhandle->host, myhandle->login, myhandle->pass, myhandle->db, 0);
+	
+	if ((ret = mysac_connect(my)) != MYERR_WANT_READ && ret != MYERR_WANT_WRITE) {
+		alog_warn("MySQL : Can't connect to %s (%s)", myhandle->host, mysac_advance_error(my));
+		free(my->buf);
+		mysac_close(my);
+		return NULL;
+	}
+	
+	conn = xmalloc(sizeof(*conn));
+	conn->my = my;
+	conn->fd = mysac_get_fd(my);
+	conn->res_buf = xmalloc(sizeof(char) * APE_MYSQL_BUFFER);
+	conn->state = SQL_CONNECTING;
+	conn->on_success = mysac_connect_success;
+	conn->current = NULL;
+	conn->pool = myhandle;
+	conn->next = myhandle->conns;
+	
+	myhandle->conns = conn;
+	myhandle->nconns++;
+	myhandle->nconnecting++;
+	
+	prepare_ape_socket(conn->fd, g_ape);
+
+	g_ape->co[conn->fd]->fd = conn->fd;
+	g_ape->co[conn->fd]->stream_type = STREAM_DELEGATE;
+
+	g_ape->co[conn->fd]->callbacks.on_read = ape_mysql_io_read;
+	g_ape->co[conn->fd]->callbacks.on_write = ape_mysql_io_write;
+	g_ape->co[conn->fd]->data = conn;
+
+	events_add(g_ape->events, conn->fd, EVENT_READ|EVENT_WRITE);
+	
+	return conn;
+}
+
+static void mysac_query_success(struct _ape_mysql_conn *conn, int code)
+{
+	struct _ape_mysql_data *myhandle = conn->pool;
+	struct _ape_mysql_queue *query = conn->current;
+	JSContext *cx = myhandle->cx;
+	JSObject *res = NULL;
+	
+	conn->current = NULL;
+	conn->on_success = NULL;
+	conn->state = SQL_READY_FOR_QUERY;
+	myhandle->last = conn;
+	
+	metric_observe(apemysql_stats.exec, metric_usec_since(&query->queued));
+	
+	if (!code && myhandle->jsmysql != NULL) {
 		MYSAC_ROW *row;
-		MYSAC_RES *myres = queue->res;
+		MYSAC_RES *myres = conn->my->res;
 		
 		unsigned int nfield = mysac_field_count(myres), nrow = mysac_num_rows(myres), pos = 0;
-		JSObject *res = JS_NewArrayObject(myhandle->cx, nrow, NULL); /* First param [{},{},{},] */
+		res = JS_NewArrayObject(cx, nrow, NULL); /* First param [{},{},{},] */
 		
-		JS_AddObjectRoot(myhandle->cx, &res);
+		JS_AddObjectRoot(cx, &res);
 		
 		while (nrow && (row = mysac_fetch_row(myres)) != NULL) {
 			unsigned int i;
 			jsval currentval;
-			JSObject *elem = JS_NewObject(myhandle->cx, NULL, NULL, NULL);
-			JS_AddObjectRoot(myhandle->cx, &elem);
+			JSObject *elem = JS_NewObject(cx, NULL, NULL, NULL);
+			JS_AddObjectRoot(cx, &elem);
 			currentval = OBJECT_TO_JSVAL(elem);
-			JS_SetElement(myhandle->cx, res, pos, &currentval);
-			JS_RemoveObjectRoot(myhandle->cx, &elem);
+			JS_SetElement(cx, res, pos, &currentval);
+			JS_RemoveObjectRoot(cx, &elem);
 			for (i = 0; i < nfield; i++) {
-				int fieldlen, valuelen;
+				int valuelen;
 				char *field, *val;
 				jsval jval;
 				
-				valuelen = ((MYSAC_RES *)myres)->cr->lengths[i];
-				fieldlen = ((MYSAC_RES *)myres)->cols[i].name_length;
+				valuelen = myres->cr->lengths[i];
 				
-				field = ((MYSAC_RES *)myres)->cols[i].name;
+				field = myres->cols[i].name;
 				val = row[i].blob;
 				
-				jval = (val == NULL ? JSVAL_NULL : STRING_TO_JSVAL(JS_NewStringCopyN(myhandle->cx, val, valuelen)));
+				jval = (val == NULL ? JSVAL_NULL : STRING_TO_JSVAL(JS_NewStringCopyN(cx, val, valuelen)));
 				
-				JS_SetProperty(myhandle->cx, elem, field, &jval);
+				JS_SetProperty(cx, elem, field, &jval);
 			}
 			pos++;
 		}
-		params[0] = OBJECT_TO_JSVAL(res);
-		params[1] = JSVAL_FALSE;
-
-		JS_RemoveObjectRoot(myhandle->cx, &res);
-		JS_CallFunctionValue(myhandle->cx, myhandle->jsmysql, queue->callback, 2, params, &rval);
-	} else {
-		params[0] = JSVAL_FALSE;
-		params[1] = INT_TO_JSVAL(code);
-
-		JS_CallFunctionValue(myhandle->cx, myhandle->jsmysql, queue->callback, 2, params, &rval);
+		JS_RemoveObjectRoot(cx, &res);
 	}
-	JS_RemoveValueRoot(myhandle->cx, &queue->callback);
 	
-	JS_free(myhandle->cx, queue->query);
-	free(queue->res);
-	free(queue);
-		
-	apemysql_shift_queue(myhandle);
-}
-
-static void apemysql_finalize(JSContext *cx, JSObject *jsmysql)
-{
-	struct _ape_mysql_data *myhandle;
-
-	if ((myhandle = JS_GetPrivate(cx, jsmysql)) != NULL) {
-		myhandle->jsmysql = NULL;
-		/* Todo: shutdown mysql */
+	/* Anything but an SQL error leaves the connection in an unknown state */
+	if (code && code != MYERR_MYSQL_ERROR) {
+		apemysql_conn_close(conn);
 	}
+	
+	apemysql_query_end(myhandle, query, (res != NULL ? OBJECT_TO_JSVAL(res) : JSVAL_FALSE), code);
+	
+	apemysql_shift_queue(myhandle);
 }
 
-static void apemysql_shift_queue(struct _ape_mysql_data *myhandle)
+static void apemysql_conn_query(struct _ape_mysql_conn *conn, struct _ape_mysql_queue *query)
 {
-	struct _ape_mysql_queue *queue;
 	int ret;
-	int basemem = (1024*1024);
-	MYSAC_RES *res;
-	char *res_buf;
 	
-
-	if (myhandle->queue.head == NULL || myhandle->state != SQL_READY_FOR_QUERY) {
-		return;
-	}
-	res_buf = xmalloc(sizeof(char) * basemem);
-	res = mysac_init_res(res_buf, basemem);		
-
-	queue = myhandle->queue.head;
-	queue->res = res;
+	conn->current = query;
+	conn->state = SQL_NEED_QUEUE;
 	
-	myhandle->state = SQL_NEED_QUEUE;
-	myhandle->data = queue;
+	metric_observe(apemysql_stats.wait, metric_usec_since(&query->queued));
+	clock_gettime(CLOCK_MONOTONIC, &query->queued);
 	
-	if ((myhandle->queue.head = queue->next) == NULL) {
-		myhandle->queue.foot = NULL;
-	}
-	mysac_b_set_query(myhandle->my, queue->res, queue->query, queue->query_len);
+	mysac_b_set_query(conn->my, mysac_init_res(conn->res_buf, APE_MYSQL_BUFFER), query->query, query->query_len);
 	
-	switch((ret = mysac_send_query(myhandle->my))) {
+	switch((ret = mysac_send_query(conn->my))) {
 		case MYERR_WANT_WRITE:
 		case MYERR_WANT_READ:
+			conn->on_success = mysac_query_success;
 			break;
 		default:
-			myhandle->on_success = NULL;
-			myhandle->my->call_it = NULL;
-			mysac_query_success(myhandle, ret);
-			return;
+			conn->on_success = NULL;
+			conn->my->call_it = NULL;
+			mysac_query_success(conn, ret);
+			break;
 	}
+}
+
+/* Run waiting queries on idle connections, growing the pool up to "max" */
+static void apemysql_shift_queue(struct _ape_mysql_data *myhandle)
+{
+	struct _ape_mysql_queue *query;
+	struct _ape_mysql_conn *conn;
 	
-	myhandle->on_success = mysac_query_success;
-	
+	while ((query = myhandle->queue.head) != NULL) {
+		for (conn = myhandle->conns; conn != NULL && conn->state != SQL_READY_FOR_QUERY; conn = conn->next);
+		
+		if (conn == NULL) {
+			while (myhandle->nconns < myhandle->max && myhandle->nconnecting < myhandle->queue.length) {
+				if (apemysql_conn_new(myhandle) == NULL) {
+					break;
+				}
+			}
+			if (myhandle->nconns == 0) {
+				apemysql_flush_queue(myhandle, MYERR_CANT_CONNECT);
+			}
+			return;
+		}
+		
+		if ((myhandle->queue.head = query->next) == NULL) {
+			myhandle->queue.foot = NULL;
+		}
+		myhandle->queue.length--;
+		apemysql_stats.queued--;
+		
+		apemysql_conn_query(conn, query);
+	}
 }
 
+/* Queue a query (NULL if the queue is full) */
 static struct _ape_mysql_queue *apemysql_push_queue(struct _ape_mysql_data *myhandle, char *query, unsigned int query_len, jsval callback)
 {
 	struct _ape_mysql_queue *nqueue;	
 
+	if (myhandle->queue_limit && myhandle->queue.length >= myhandle->queue_limit) {
+		METRIC_INC(apemysql_stats.rejected);
+		free(query);
+		return NULL;
+	}
 	nqueue = xmalloc(sizeof(*nqueue));
 	
 	nqueue->next = NULL;
 	nqueue->query = query;
 	nqueue->query_len = query_len;
 	nqueue->callback = callback;
-	nqueue->res = NULL;
+	
+	clock_gettime(CLOCK_MONOTONIC, &nqueue->queued);
+	nqueue->deadline = (myhandle->timeout ? sm_monotonic_msec() + myhandle->timeout : 0);
 	
 	if (myhandle->queue.foot == NULL) {
 		myhandle->queue.head = nqueue;
@@ -2798,74 +5026,170 @@ static struct _ape_mysql_queue *apemysql_push_queue(struct _ape_mysql_data *myha
 		myhandle->queue.foot->next = nqueue;
 	}
 	myhandle->queue.foot = nqueue;
+	myhandle->queue.length++;
+	apemysql_stats.queued++;
 	
 	JS_AddValueRoot(myhandle->cx, &nqueue->callback);
 
-	if (myhandle->queue.head->next == NULL && myhandle->state == SQL_READY_FOR_QUERY) {
+	apemysql_shift_queue(myhandle);
+	
+	return nqueue;
+}
+
+/*
+	Expire queries older than "timeout" (a running query can't be cancelled,
+	so its connection is dropped) and keep at least "min" connections open.
+*/
+static void apemysql_tick(struct _ape_mysql_data *myhandle, int *last)
+{
+	struct _ape_mysql_queue *expired = NULL, *query;
+	struct _ape_mysql_conn *conn, *next;
+	unsigned long now = sm_monotonic_msec();
+	
+	if (myhandle->timeout) {
+		/* same timeout for all : the oldest are at the head */
+		while ((query = myhandle->queue.head) != NULL && query->deadline <= now) {
+			if ((myhandle->queue.head = query->next) == NULL) {
+				myhandle->queue.foot = NULL;
+			}
+			myhandle->queue.length--;
+			apemysql_stats.queued--;
+			
+			query->next = expired;
+			expired = query;
+		}
+		for (conn = myhandle->conns; conn != NULL; conn = next) {
+			next = conn->next;
+			
+			if (conn->current != NULL && conn->current->deadline <= now) {
+				query = apemysql_conn_close(conn);
+				query->next = expired;
+				expired = query;
+			}
+		}
+	}
+	while (expired != NULL) {
+		query = expired;
+		expired = query->next;
 		
-		apemysql_shift_queue(myhandle);
-		return NULL;
+		METRIC_INC(apemysql_stats.timeouts);
+		apemysql_query_end(myhandle, query, JSVAL_FALSE, APE_MYSQL_ETIMEOUT);
 	}
-	return nqueue;
+	
+	if (myhandle->jsmysql == NULL) {
+		/* finalized : close the connections once their query is done */
+		for (conn = myhandle->conns; conn != NULL; conn = next) {
+			next = conn->next;
+			
+			if (conn->state == SQL_READY_FOR_QUERY) {
+				apemysql_conn_close(conn);
+			}
+		}
+		if (myhandle->conns == NULL) {
+			*last = 1;
+		}
+		return;
+	}
+	while (myhandle->nconns < myhandle->min) {
+		if (apemysql_conn_new(myhandle) == NULL) {
+			break;
+		}
+	}
+	apemysql_shift_queue(myhandle);
+}
+
+static void apemysql_finalize(JSContext *cx, JSObject *jsmysql)
+{
+	struct _ape_mysql_data *myhandle;
+
+	if ((myhandle = JS_GetPrivate(cx, jsmysql)) != NULL) {
+		myhandle->jsmysql = NULL;
+		myhandle->min = 0;
+	}
+}
+
+static char *apemysql_encode_dup(JSContext *cx, JSString *str)
+{
+	char *cstr = JS_EncodeString(cx, str), *dup = xstrdup(cstr);
+	
+	JS_free(cx, cstr);
+	
+	return dup;
 }
 
+/* new Ape.MySQL(host, login, pass, db[, {min, max, queueLimit, timeout}]) */
 APE_JS_NATIVE(ape_sm_mysql_constructor)
 //{
 	JSString *host, *login, *pass, *db;
-	char *chost, *clogin, *cpass, *cdb;
+	JSObject *options = NULL;
 	JSObject *obj = JS_NewObjectForConstructor(cx, vpn);
-	
-	MYSAC *my;
-	int fd;
 	struct _ape_mysql_data *myhandle;
+	jsval vp;
+	unsigned int i;
 	
-	if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vpn), "SSSS", &host, &login, &pass, &db)) {
+	if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vpn), "SSSS/o", &host, &login, &pass, &db, &options)) {
 		return JS_TRUE;
 	}
 	
+	if (apemysql_stats.wait == NULL) {
+		apemysql_stats.wait = metric_register("ape_mysql_queue_wait_seconds", "Time spent by MySQL queries waiting for a connection", METRIC_HISTOGRAM, NULL);
+		apemysql_stats.exec = metric_register("ape_mysql_query_seconds", "MySQL queries execution time", METRIC_HISTOGRAM, NULL);
+		apemysql_stats.rejected = metric_register("ape_mysql_rejected_total", "MySQL queries rejected (queue full)", METRIC_COUNTER, NULL);
+		apemysql_stats.timeouts = metric_register("ape_mysql_timeouts_total", "MySQL queries timed out", METRIC_COUNTER, NULL);
+		metric_register_gauge("ape_mysql_queue_length", "MySQL queries waiting for a connection", apemysql_gauge_queued);
+	}
+	
 	myhandle = xmalloc(sizeof(*myhandle));
 	
-	chost = JS_EncodeString(cx, host);
-	clogin = JS_EncodeString(cx, login);
-	cpass = JS_EncodeString(cx, pass);
-	cdb = JS_EncodeString(cx, db);
+	/* mysac keeps pointers to these */
+	myhandle->host = apemysql_encode_dup(cx, host);
+	myhandle->login = apemysql_encode_dup(cx, login);
+	myhandle->pass = apemysql_encode_dup(cx, pass);
+	myhandle->db = apemysql_encode_dup(cx, db);
 
-	my = mysac_new(1024*1024);
-	mysac_setup(my, chost, clogin, cpass, cdb, 0);
-	mysac_connect(my);
-
-	myhandle->my = my;
 	myhandle->jsmysql = obj;
 	myhandle->cx = cx;
-	myhandle->db = xstrdup(cdb);
-	myhandle->data = NULL;
-	myhandle->callback = JSVAL_NULL;
-	myhandle->state = SQL_NEED_QUEUE;
+	myhandle->g_ape = g_ape;
+	myhandle->conns = NULL;
+	myhandle->last = NULL;
+	myhandle->nconns = 0;
+	myhandle->nconnecting = 0;
+	myhandle->connected = 0;
+	myhandle->error = 0;
 	myhandle->queue.head = NULL;
 	myhandle->queue.foot = NULL;
+	myhandle->queue.length = 0;
 	
-	JS_SetPrivate(cx, obj, myhandle);
+	myhandle->min = 1;
+	myhandle->max = 4;
+	myhandle->queue_limit = 1000;
+	myhandle->timeout = 0;
 	
-	fd = mysac_get_fd(my);
-
-	prepare_ape_socket (fd, g_ape);
-
-	g_ape->co[fd]->fd = fd;
-	g_ape->co[fd]->stream_type = STREAM_DELEGATE;
-
-	g_ape->co[fd]->callbacks.on_read = ape_mysql_io_read;
-	g_ape->co[fd]->callbacks.on_write = ape_mysql_io_write;
-	g_ape->co[fd]->data = myhandle;
-
-	events_add(g_ape->events, fd, EVENT_READ|EVENT_WRITE);
+	if (options != NULL) {
+		if (JS_GetProperty(cx, options, "min", &vp) && JSVAL_IS_INT(vp) && JSVAL_TO_INT(vp) >= 0) {
+			myhandle->min = JSVAL_TO_INT(vp);
+		}
+		if (JS_GetProperty(cx, options, "max", &vp) && JSVAL_IS_INT(vp) && JSVAL_TO_INT(vp) > 0) {
+			myhandle->max = JSVAL_TO_INT(vp);
+		}
+		if (JS_GetProperty(cx, options, "queueLimit", &vp) && JSVAL_IS_INT(vp) && JSVAL_TO_INT(vp) >= 0) {
+			myhandle->queue_limit = JSVAL_TO_INT(vp);
+		}
+		if (JS_GetProperty(cx, options, "timeout", &vp) && JSVAL_IS_INT(vp) && JSVAL_TO_INT(vp) >= 0) {
+			myhandle->timeout = JSVAL_TO_INT(vp);
+		}
+	}
+	if (myhandle->max < myhandle->min) {
+		myhandle->max = myhandle->min;
+	}
+	
+	JS_SetPrivate(cx, obj, myhandle);
 	
-	//myhandle->to_call = mysac_connect;
-	myhandle->on_success = mysac_connect_success;
+	for (i = 0; i < myhandle->min; i++) {
+		apemysql_conn_new(myhandle);
+	}
 	
-	JS_free(cx, chost);
-	JS_free(cx, clogin);
-	JS_free(cx, cpass);
-	JS_free(cx, cdb);
+	add_periodical((myhandle->timeout && myhandle->timeout < 4000 ? (myhandle->timeout + 3) / 4 : 1000), 0, apemysql_tick, myhandle, g_ape);
 
 	return JS_TRUE;
 }
@@ -2878,7 +5202,6 @@ APE_JS_NATIVE(ape_sm_sockserver_constructor)
 	JSString *ip;
 	JSObject *options = NULL;
 	ape_socket *server;
-	jsval vp;
 	JSObject *obj = JS_NewObjectForConstructor(cx, vpn);
 
 	if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vpn), "iS/o", &port, &ip, &options)) {
@@ -2901,11 +5224,12 @@ APE_JS_NATIVE(ape_sm_sockserver_constructor)
 	((struct _ape_sock_callbacks *)server->attach)->private 		= NULL;
 	((struct _ape_sock_callbacks *)server->attach)->server_obj 		= obj;
 	((struct _ape_sock_callbacks *)server->attach)->state 			= 1;
+	((struct _ape_sock_callbacks *)server->attach)->mode 			= sm_sock_options(cx, options, &((struct _ape_sock_callbacks *)server->attach)->max_frame);
 	
 	JS_AddObjectRoot(cx, &((struct _ape_sock_callbacks *)server->attach)->server_obj);
 
 	/* check if flushlf is set to true in the optional object */
-	if (options != NULL && JS_GetProperty(cx, options, "flushlf", &vp) && JSVAL_IS_BOOLEAN(vp) && JSVAL_TO_BOOLEAN(vp)) {
+	if (((struct _ape_sock_callbacks *)server->attach)->mode == SM_SOCK_LINES) {
 		server->callbacks.on_read_lf = sm_sock_onread_lf;
 	} else {
 		/* use the classic read callback */
@@ -2980,11 +5304,14 @@ static JSFunctionSpec ape_funcs[] = {
 	JS_FS("mkChan", ape_sm_mkchan, 1, 0),
 	JS_FS("rmChan", ape_sm_rmchan, 1, 0),
 	JS_FS("readfile", ape_sm_readfile, 1, 0),
+	JS_FS("readFileAsync", ape_sm_readfile_async, 3, 0),
+	JS_FS("httpRequest", ape_sm_http_request, 2, 0),
 	JS_FS_END
 };
 
 static JSFunctionSpec global_funcs[] = {
 	JS_FS("include",   ape_sm_include,	1, 0),
+	JS_FS("includeAsync",   ape_sm_include_async,	2, 0),
 	JS_FS_END
 };
 
@@ -3003,7 +5330,7 @@ static JSFunctionSpec sha1_funcs[] = {
 
 static void ape_sm_define_ape(ape_sm_compiled *asc, JSContext *gcx, acetables *g_ape)
 {
-	JSObject *obj, *b64, *sha1, *sockclient, *sockserver, *custompipe, *user, *channel, *subuser;
+	JSObject *obj, *b64, *sha1, *sockclient, *sockserver, *custompipe, *buffer, *user, *channel, *subuser;
 	#ifdef _USE_MYSQL
 	JSObject *jsmysql;
 	#endif
@@ -3028,7 +5355,9 @@ static void ape_sm_define_ape(ape_sm_compiled *asc, JSContext *gcx, acetables *g
 	JS_DefineFunctions(asc->cx, sha1, sha1_funcs);
 	
 	custompipe = JS_InitClass(asc->cx, obj, NULL, &pipe_class, ape_sm_pipe_constructor, 0, NULL, NULL, NULL, NULL);
+	buffer = JS_InitClass(asc->cx, obj, NULL, &buffer_class, ape_sm_buffer_constructor, 1, buffer_props, apebuffer_funcs, NULL, NULL);
 	add_property(&g_ape->properties, "pipe_proto", custompipe, EXTEND_POINTER, EXTEND_ISPRIVATE);
+	add_property(&g_ape->properties, "buffer_proto", buffer, EXTEND_POINTER, EXTEND_ISPRIVATE);
 	
 	sockserver = JS_InitClass(asc->cx, obj, NULL, &socketserver_class, ape_sm_sockserver_constructor, 2, NULL, NULL, NULL, NULL);
 	sockclient = JS_InitClass(asc->cx, obj, NULL, &socketclient_class, ape_sm_sockclient_constructor, 2, NULL, NULL, NULL, NULL);
@@ -3055,6 +5384,36 @@ static void ape_sm_define_ape(ape_sm_compiled *asc, JSContext *gcx, acetables *g
 	JS_SetContextPrivate(asc->cx, asc);
 }
 
+/* Send an ERR raw to the caller of a command, returns 1 if it was queued on its subuser */
+static int sm_send_error(callbackp *callbacki, const char *code, const char *value, acetables *g_ape)
+{
+	RAW *newraw;
+	json_item *jlist = json_new_object();
+	
+	if (callbacki->chl) {
+		json_set_property_intN(jlist, "chl", 3, callbacki->chl);
+	}
+	json_set_property_strZ(jlist, "code", code);
+	json_set_property_strZ(jlist, "value", value);
+
+	newraw = forge_raw(RAW_ERR, jlist);
+	
+	if (callbacki->call_user != NULL) {
+		post_raw_sub(newraw, callbacki->call_subuser, g_ape);
+		POSTRAW_DONE(newraw);
+		return 1;
+	}
+	send_raw_inline(callbacki->client, callbacki->transport, newraw, g_ape);
+	
+	return 0;
+}
+
+/* The command (or one of its hooks) was stopped by the watchdog */
+static int sm_script_timeout(callbackp *callbacki, acetables *g_ape)
+{
+	return (sm_send_error(callbacki, "008", "SCRIPT_TIMEOUT", g_ape) ? RETURN_HANG : RETURN_NULL);
+}
+
 static int process_cmd_return(JSContext *cx, jsval rval, callbackp *callbacki, acetables *g_ape)
 {
 	JSObject *ret_opt = NULL;
@@ -3074,55 +5433,44 @@ static int process_cmd_return(JSContext *cx, jsval rval, callbackp *callbacki, a
 			JS_GetProperty(cx, ret_opt, "name", &rawname);
 			JS_GetProperty(cx, ret_opt, "data", &data);						
 		
-			if (!JSVAL_IS_VOID(rawname) && JSVAL_IS_STRING(rawname) && !JSVAL_IS_VOID(data) && JSVAL_IS_OBJECT(data)) {
-				json_item *rawdata = NULL;
+			if (!JSVAL_IS_VOID(rawname) && JSVAL_IS_STRING(rawname) && (JSVAL_IS_STRING(data) || (JSVAL_IS_OBJECT(data) && !JSVAL_IS_NULL(data)))) {
+				ape_sm_jsonbuf buf;
+				
+				jsonbuf_init(&buf);
 				
-				if ((rawdata = jsobj_to_ape_json(cx, JSVAL_TO_OBJECT(data))) != NULL) {
+				if (jsonbuf_write_data(cx, &buf, data)) {
 					char *crawname;
 					RAW *newraw;
 					
 					crawname = JS_EncodeString(cx, JSVAL_TO_STRING(rawname));
 					
-					newraw = forge_raw(crawname, rawdata);
+					newraw = forge_raw_json(crawname, buf.data, buf.len);
 					send_raw_inline(callbacki->client, callbacki->transport, newraw, g_ape);
 					
+					free(buf.data);
 					JS_free(cx, crawname);
 					return RETURN_NULL;
-				}			
+				}
+				free(buf.data);
 			}
 		} else {
 			unsigned int length = 0;
 			JS_GetArrayLength(cx, ret_opt, &length);
 			if (length == 2 && JS_GetElement(cx, ret_opt, 0, &vp[0]) && JS_GetElement(cx, ret_opt, 1, &vp[1]) && !JSVAL_IS_VOID(vp[0]) && !JSVAL_IS_VOID(vp[1])) {
 				if (JSVAL_IS_STRING(vp[1])) {
-					RAW *newraw;
 					JSString *code = JS_ValueToString(cx, vp[0]);
-					json_item *jlist = json_new_object();
 					char *ccode, *cvalue;
-					
-					if (callbacki->chl) {
-						json_set_property_intN(jlist, "chl", 3, callbacki->chl);
-					}
+					int queued;
 					
 					ccode = JS_EncodeString(cx, code);
 					cvalue = JS_EncodeString(cx, JSVAL_TO_STRING(vp[1]));
 
-					json_set_property_strZ(jlist, "code", ccode);
-					json_set_property_strZ(jlist, "value", cvalue);
-
-					newraw = forge_raw(RAW_ERR, jlist);
+					queued = sm_send_error(callbacki, ccode, cvalue, g_ape);
 					
 					JS_free(cx, ccode);
 					JS_free(cx, cvalue);
 					
-					if (callbacki->call_user != NULL) {
-						post_raw_sub(newraw, callbacki->call_subuser, g_ape);
-					} else {
-						send_raw_inline(callbacki->client, callbacki->transport, newraw, g_ape);	
-						return RETURN_CONTINUE;						
-					}
-					POSTRAW_DONE(newraw);
-					return RETURN_HANG;
+					return (queued ? RETURN_HANG : RETURN_CONTINUE);
 				}
 			}
 		}
@@ -3148,7 +5496,12 @@ static int ape_fire_cmd(const char *name, JSObject *obj, JSObject *cb, callbackp
 			if ((cbk->type == APE_CMD && strcasecmp(name, cbk->callbackname) == 0)) {
 				jsval rval;
 				
-				if (JS_CallFunctionValue(cbk->cx, JS_GetGlobalObject(cbk->cx), cbk->func, 2, params, &rval) == JS_FALSE) {
+				int interrupted;
+				
+				if (sm_call_value(cbk->cx, JS_GetGlobalObject(cbk->cx), cbk->func, 2, params, &rval, cbk->callbackname, cbk->stats, &interrupted) == JS_FALSE) {
+					if (interrupted) {
+						return sm_script_timeout(callbacki, g_ape);
+					}
 					return (cbk->type == APE_CMD ? RETURN_BAD_PARAMS : RETURN_BAD_CMD);
 				}
 				
@@ -3165,7 +5518,7 @@ static int ape_fire_hook(ape_sm_callback *cbk, JSObject *obj, JSObject *cb, call
 	ape_sm_compiled *asc = ASMR->scripts;
 	jsval params[3];
 	jsval rval;
-	int flagret;
+	int flagret, interrupted;
 
 	if (asc == NULL) {
 		return RETURN_CONTINUE;
@@ -3177,7 +5530,10 @@ static int ape_fire_hook(ape_sm_callback *cbk, JSObject *obj, JSObject *cb, call
 		params[2] = STRING_TO_JSVAL(JS_NewStringCopyZ(cbk->cx, callbacki->cmd));
 	}
 	
-	if (JS_CallFunctionValue(cbk->cx, cb, (cbk->func), (cbk->type == APE_BADCMD ? 3 : 2), params, &rval) == JS_FALSE) {
+	if (sm_call_value(cbk->cx, cb, cbk->func, (cbk->type == APE_BADCMD ? 3 : 2), params, &rval, (cbk->callbackname != NULL ? cbk->callbackname : "badcmd"), cbk->stats, &interrupted) == JS_FALSE) {
+		if (interrupted) {
+			return sm_script_timeout(callbacki, g_ape);
+		}
 		return (cbk->type != APE_BADCMD ? RETURN_BAD_PARAMS : RETURN_BAD_CMD);
 	}
 	
@@ -3205,7 +5561,7 @@ static void ape_fire_callback(const char *name, uintN argc, jsval *argv, acetabl
 				//JS_SetContextThread(asc->cx);
 				//JS_BeginRequest(asc->cx);
 				
-				JS_CallFunctionValue(asc->cx, asc->global, (cb->func), argc, argv, &rval);
+				sm_call_value(asc->cx, asc->global, cb->func, argc, argv, &rval, cb->callbackname, cb->stats, NULL);
 					
 				//JS_EndRequest(asc->cx);
 				//JS_ClearContextThread(asc->cx);
@@ -3217,6 +5573,13 @@ static void ape_fire_callback(const char *name, uintN argc, jsval *argv, acetabl
 	
 }
 
+static int sm_conf_int(char *key, int def)
+{
+	char *val = READ_CONF(key);
+	
+	return (val != NULL ? atoi(val) : def);
+}
+
 static void init_module(acetables *g_ape) // Called when module is loaded
 {
 	JSRuntime *rt;
@@ -3226,18 +5589,41 @@ static void init_module(acetables *g_ape) // Called when module is loaded
 	ape_sm_runtime *asr;
 	jsval rval;
 
-	rt = JS_NewRuntime(8L * 1024L * 1024L);
+	rt = JS_NewRuntime(sm_conf_int("runtime_size", 8) * 1024L * 1024L);
 	
 	if (rt == NULL) {
 		printf("[ERR] Not enougth memory\n");
 		exit(0);
 	}
 	asr = xmalloc(sizeof(*asr));
+	memset(asr, 0, sizeof(*asr));
 	asr->runtime = rt;
 	asr->scripts = NULL;
 	
+	asr->watchdog.budget = sm_conf_int("watchdog_budget", 2000);
+	asr->watchdog.timeouts = metric_register("ape_js_interrupted_total", "JavaScript handlers interrupted by the watchdog", METRIC_COUNTER, NULL);
+	JS_SetRuntimePrivate(rt, asr);
+	
 	/* Setup a global context to store shared object */
-	gcx = JS_NewContext(rt, 8192);
+	gcx = JS_NewContext(rt, sm_conf_int("stack_chunk_size", 8192));
+	
+	sm_files.table = hashtbl_init();
+	sm_files.max = sm_conf_int("file_cache_size", 8192) * 1024;
+	sm_files.ttl = sm_conf_int("file_cache_ttl", 1);
+	
+	asr->gc.cx = gcx;
+	asr->gc.max_bytes = JS_GetGCParameter(rt, JSGC_MAX_BYTES);
+	asr->gc.idle_threshold = sm_conf_int("gc_idle_threshold", 1024) * 1024;
+	asr->gc.interval = sm_conf_int("gc_interval", 250);
+	asr->gc.budget = sm_conf_int("gc_budget", 5);
+	asr->gc.pauses = metric_register("ape_js_gc_pause_seconds", "JavaScript GC pauses", METRIC_HISTOGRAM, NULL);
+	metric_register_gauge("ape_js_heap_bytes", "JavaScript GC heap size", sm_gauge_heap_bytes);
+	
+	JS_SetGCCallbackRT(rt, sm_gc_callback);
+	
+	if (asr->gc.interval > 0 && gcx != NULL) {
+		add_periodical(asr->gc.interval, 0, sm_gc_tick, asr, g_ape);
+	}
 	
 	add_property(&g_ape->properties, "sm_context", gcx, EXTEND_POINTER, EXTEND_ISPRIVATE);
 	add_property(&g_ape->properties, "sm_runtime", asr, EXTEND_POINTER, EXTEND_ISPRIVATE);
@@ -3265,6 +5651,7 @@ static void init_module(acetables *g_ape) // Called when module is loaded
 	JS_SetOptions(asc->cx, JSOPTION_VAROBJFIX | JSOPTION_JIT | JSOPTION_METHODJIT);
 	JS_SetVersion(asc->cx, JSVERSION_LATEST);
 	JS_SetErrorReporter(asc->cx, reportError);
+	JS_SetOperationCallback(asc->cx, sm_operation_callback);
 
 	asc->global = JS_NewCompartmentAndGlobalObject(asc->cx, &global_class, NULL);
 
@@ -3308,6 +5695,12 @@ static void free_module(acetables *g_ape) // Called when module is unloaded
 	ape_sm_callback *cb;
 
 	APE_JS_EVENT("stop", 0, NULL);
+	
+	while (sm_files.head != NULL) {
+		sm_file_remove(ASMC, sm_files.head);
+	}
+	hashtbl_free(sm_files.table, NULL);
+	sm_files.table = NULL;
 
 	while (asc != NULL) {
 		free(asc->filename);
@@ -3320,6 +5713,8 @@ static void free_module(acetables *g_ape) // Called when module is unloaded
 		free(prev_asc);
 	}
 
+	sm_watchdog_stop(ASMR);
+	
 	//JS_DestroyContext(ASMC);
 	JS_DestroyRuntime(ASMR->runtime);
 
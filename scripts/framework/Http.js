@@ -81,107 +81,67 @@ var Http = new Class({
 		this.write(Hash.toQueryString(data));
 	},
 	
-	getContentSize: function() {
-		return this.response.length-this.responseHeadersLength-4;
-	},
-	
-	connect: function() {		
+	connect: function(callback) {
+		var data = this.body.join('&');
+		var path = this.query || '/';
+		
 		if (this.method == 'POST') {
-			this.setHeader('Content-length', this.body.join('&').length);
 			this.setHeader('Content-Type', 'application/x-www-form-urlencoded');
+		} else if (data.length != 0) {
+			path += (path.contains('?') ? '&' : '?') + data;
+			data = null;
 		}
 
 		this.setHeader('User-Agent', 'APE JS Client');
 		this.setHeader('Accept', '*/*');
 		
-		this.socket = new Ape.sockClient(this.port, this.host, { flushlf: false });
+		this.response = [];
 		
-		this.sockConnect();
-		this.sockRead();
-	},
-	
-	sockConnect: function() {
-		this.socket.onConnect = function() {
-			if (this.body.length != 0 && this.method == 'GET') {
-				var getData = '';
-			
-				if (this.method == 'GET') {
-					getData = '?' + this.body.join('&');
-				}
-			}
-
-			var toWrite = this.method + " " + this.query + " HTTP/1.0\r\nHost: " + this.host + "\r\n";
-			
-			for (var i in this.headers) {
-				if (this.headers.hasOwnProperty(i)) {
-					toWrite += i + ': ' + this.headers[i] + "\r\n";
-				}
-			}
-
-			this.socket.write(toWrite + "\r\n");
-			this.socket.write(this.body.join('&'));
-		}.bind(this);
-	},
-	
-	sockRead: function() {
-		this.response = '';
-		this.socket.onRead = function(data) { 
-			this.response += data;
-			if (this.response.contains("\r\n\r\n")) {
-				if (!$defined(this.responseHeaders)) {
-					var tmp						= this.response.split("\r\n\r\n");
-					this.responseHeadersLength 	= tmp[0].length;
-					tmp 						= tmp[0].split("\r\n");
-					this.responseHeaders 		= {};
-					this.responseCode			= tmp[0].split(" ");
-					this.responseCode			= this.responseCode[1].toInt();
-
-					for (var i = 1; i < tmp.length; i++) {
-						var tmpHeaders = tmp[i].split(": ");
-						this.responseHeaders[tmpHeaders[0]] = tmpHeaders[1];
-					}
-				} else {
-					if ($defined(this.responseHeaders['Content-Length']) && this.getContentSize() >= this.responseHeaders['Content-Length']) {
-						this.socket.close();
-					} 
-					if ($defined(this.responseHeaders['Location'])) {
-						socket.close();
-					}
-				}
-			}				
-		}.bind(this);
+		/* HTTP/1.1 on a pooled keep-alive connection */
+		Ape.httpRequest({
+			url: 'http://' + this.host + ':' + this.port + path,
+			method: this.method,
+			headers: this.headers,
+			body: data
+		}, {
+			onResponse: function(status, headers) {
+				this.responseCode = status;
+				this.responseHeaders = headers;
+			}.bind(this),
+			onData: function(chunk) {
+				this.response.push(chunk);
+			}.bind(this),
+			onEnd: function(error) {
+				this.read(error, callback);
+			}.bind(this)
+		});
 	},
 	
-	read: function(callback) {
-		this.socket.onDisconnect = function(callback) {
-			this.response	  	 = this.response.split("\r\n\r\n");
-			this.response.shift();
-			this.response	  	 = this.response.join();
-			this.httpResponse 	 = {status:this.responseCode, headers:this.responseHeaders, body:this.response};
-			
-			if ($defined(this.responseHeaders)) {
-				if ($defined(this.responseHeaders['Location'])) {
-					var newRequest   = new Http(this.responseHeaders['Location']);
-					newRequest.setHeaders(this.headers);
-					newRequest.set('method', this.method);
-					newRequest.write(this.body.join('&'));
-					newRequest.finish(callback);
-				} else {
-					callback.run(this.httpResponse);
-				}
-			}
-		}.bind(this, callback);
+	read: function(error, callback) {
+		if (error || !$defined(this.responseHeaders)) {
+			return;
+		}
+		var location = this.responseHeaders['location'];
+		
+		if ($defined(location) && this.responseCode >= 300 && this.responseCode < 400) {
+			var newRequest = new Http(location);
+			newRequest.setHeaders(this.headers);
+			newRequest.set('method', this.method);
+			newRequest.write(this.body.join('&'));
+			newRequest.finish(callback);
+		} else {
+			this.httpResponse = {status:this.responseCode, headers:this.responseHeaders, body:this.response.join('')};
+			callback.run(this.httpResponse);
+		}
 	},
 	
 	finish: function(callback) {
-		this.connect();
-		this.read(callback);
+		this.connect(callback);
 	},
 	
 	getContent: function (callback) {
-		this.connect();
-		this.read(function(result) {
+		this.connect(function(result) {
 			callback.run(result['body']);
 		});
-	},
-});
\ No newline at end of file
+	}
+});
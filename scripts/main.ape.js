@@ -10,4 +10,5 @@ Ape.addEvent("init", function() {
 	include("utils/checkTool.js"); //Just needed for the APE JSF diagnostic tool, once APE is installed you can remove it 
 	//include("examples/ircserver.js");
 	//include("framework/http_auth.js");
+	//include("utils/benchParams.js"); //Needed by the params_* scenarios of "make bench"
 });
@@ -0,0 +1,4 @@
+/* Used by the "params_*" scenarios of bench/scenarios.conf : only params.t is read, whatever the number of fields */
+Ape.registerCmd('benchParams', false, function(params, infos) {
+	return {"name": "benchParams", "data": {"t": params.t}};
+});
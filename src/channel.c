@@ -494,7 +494,7 @@ void ban(CHANNEL *chan, USERS *banner, const char *ip, char *reason, unsigned in
 				blist = xmalloc(sizeof(*blist));
 				
 				memset(blist->reason, 0, 256);
-				strncpy(blist->ip, ip, 16);
+				strncpy(blist->ip, ip, APE_IP_LEN - 1);
 				strncpy(blist->reason, reason, 255);
 				blist->expire = nextime;
 				blist->next = bTmp;
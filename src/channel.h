@@ -53,7 +53,7 @@ typedef struct CHANNEL
 
 typedef struct BANNED
 {
-	char ip[16];
+	char ip[APE_IP_LEN];
 	char reason[257];
 	
 	long int expire;
@@ -28,6 +28,7 @@
 #include "transports.h"
 #include "hnpub.h"
 #include "raw_recently.h"
+#include "metrics.h"
 
 void do_register(acetables *g_ape)
 {
@@ -42,6 +43,8 @@ void do_register(acetables *g_ape)
 	register_cmd("JOIN", 		cmd_join, 		NEED_SESSID, g_ape);
 	register_cmd("LEFT", 		cmd_left, 		NEED_SESSID, g_ape);
 	register_cmd("SESSION",     cmd_session,	NEED_SESSID, g_ape);
+
+	register_cmd("STATS",		cmd_stats,		NEED_NOTHING, g_ape);
 }
 
 void register_cmd(const char *cmd, unsigned int (*func)(callbackp *), unsigned int need, acetables *g_ape)
@@ -50,8 +53,13 @@ void register_cmd(const char *cmd, unsigned int (*func)(callbackp *), unsigned i
 	
 	new_cmd = (callback *) xmalloc(sizeof(*new_cmd));
 
+	char label[64];
+	
 	new_cmd->func = func;
 	new_cmd->need = need;
+
+	snprintf(label, sizeof(label), "cmd=\"%s\"", cmd);
+	new_cmd->stats = metric_register("ape_cmd_duration_seconds", "Commands processing time (hooks included)", METRIC_HISTOGRAM, label);
 	
 	/* Unregister old cmd if exists */
 	if ((old_cmd = (callback *)hashtbl_seek(g_ape->hCallback, cmd)) != NULL) {
@@ -142,7 +150,7 @@ static unsigned int handle_bad_cmd(callbackp *callbacki)
 
 int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acetables *g_ape)
 {
-	callback *cmdback, tmpback = {handle_bad_cmd, NEED_NOTHING};
+	callback *cmdback, tmpback = {handle_bad_cmd, NEED_NOTHING, NULL};
 	json_item *rjson = json_lookup(ijson->jchild.child, "cmd"), *jchl;
 	subuser *sub = pc->sub;
 	unsigned int flag;
@@ -150,10 +158,11 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 
 	if (rjson != NULL && rjson->jval.vu.str.value != NULL) {
 		callbackp cp;
+		struct timespec t_cmd;
 		cp.client = NULL;
 		cp.cmd 	= rjson->jval.vu.str.value;
 		cp.data = NULL;
-		cp.hlines = NULL;
+		cp.http = NULL;
 		
 		json_item *jsid;
 		
@@ -198,6 +207,11 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 						send_raw_inline((retval.client_close->fd == pc->client->fd ? pc->client : sub->client), pc->transport, newraw, g_ape);
 						
 						shutdown(retval.client_close->fd, 2);
+
+						/* the closing listener must not reference the subuser anymore (it may be freed before its disconnect) */
+						if (retval.client_close != pc->client && retval.client_close->attach == sub) {
+							retval.client_close->attach = NULL;
+						}
 					}
 					sub->client = cp.client = retval.client_listener;
 					sub->state = retval.substate;
@@ -209,6 +223,10 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 						subuser_restor(sub, g_ape);
 					}
 				} else if (sub != NULL) {
+					/* previous listener (already answered) may not be disconnected yet */
+					if (sub->client != pc->client && sub->client->attach == sub) {
+						sub->client->attach = NULL;
+					}
 					sub->client = pc->client;
 				}
 				pc->guser->idle = (long int)time(NULL); // update user idle
@@ -242,7 +260,7 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 		cp.ip = pc->ip;
 		cp.chl = (sub != NULL ? sub->current_chl : 0);
 		cp.transport = pc->transport;
-		cp.hlines = pc->hlines;
+		cp.http = pc->http;
 		
 		/* Little hack to access user object on connect hook callback (preallocate an user) */
 		if (strncasecmp(cp.cmd, "CONNECT", 7) == 0 && cp.cmd[7] == '\0') {
@@ -251,9 +269,17 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 			sub = cp.call_subuser = cp.call_user->subuser;
 		}
 		
+		clock_gettime(CLOCK_MONOTONIC, &t_cmd);
+
 		if ((flag = call_cmd_hook(cp.cmd, &cp, g_ape)) == RETURN_CONTINUE) {
 			flag = cmdback->func(&cp);
 		}
+
+		if (cmdback->stats != NULL) {
+			metric_observe(cmdback->stats, metric_usec_since(&t_cmd));
+		} else {
+			APE_METRIC_INC(APE_M_CMD_UNKNOWN);
+		}
 		
 		if (flag & RETURN_NULL) {
 			pc->guser = NULL;
@@ -314,6 +340,11 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 			/* If tmpfd is set, we do not have any reasons to change its state */
 			sub->state = ALIVE;
 			
+			/* reconnecting EventSource */
+			if (attach && pc->transport == TRANSPORT_SSE_LONGPOLLING && pc->http != NULL) {
+				transport_sse_resume(sub, pc->http);
+			}
+			
 			if (flag & RETURN_HANG || flag & RETURN_BAD_PARAMS) {
 				return (CONNECT_KEEPALIVE);
 			}
@@ -345,13 +376,13 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 
 unsigned int checkcmd(clientget *cget, transport_t transport, subuser **iuser, acetables *g_ape)
 {	
-	struct _cmd_process pc = {cget->hlines, NULL, NULL, cget->client, cget->host, cget->ip_get, transport};
+	struct _cmd_process pc = {cget->http, NULL, NULL, cget->client, cget->host, cget->ip_get, transport};
 	
 	json_item *ijson, *ojson;
 	
 	unsigned int ret;
 
-	ijson = ojson = init_json_parser(cget->get);
+	ijson = ojson = (cget->get != NULL ? init_json_parser(cget->get) : cget->json);
 	if (ijson == NULL || ijson->jchild.child == NULL) {
 		RAW *newraw;
 		json_item *jlist = json_new_object();
@@ -736,3 +767,24 @@ unsigned int cmd_pong(callbackp *callbacki)
 }
 
 #endif
+
+/* Metrics snapshot for allowed hosts (see Metrics::allow) */
+unsigned int cmd_stats(callbackp *callbacki)
+{
+	RAW *newraw;
+
+	if (!metrics_client_allowed(callbacki->ip)) {
+		return (RETURN_BAD_CMD);
+	}
+
+	newraw = forge_raw("STATS", metrics_json(callbacki->g_ape));
+
+	if (callbacki->call_user != NULL) {
+		post_raw_sub(newraw, callbacki->call_subuser, callbacki->g_ape);
+		POSTRAW_DONE(newraw);
+	} else {
+		send_raw_inline(callbacki->client, callbacki->transport, newraw, callbacki->g_ape);
+	}
+
+	return (RETURN_NOTHING);
+}
@@ -24,6 +24,7 @@
 
 #include "users.h"
 #include "handle_http.h"
+#include "http_parser.h"
 #include "sock.h"
 #include "main.h"
 #include "transports.h"
@@ -71,7 +72,7 @@ struct _callbackp
 {
 	ape_socket *client;
 	json_item *param;
-	struct _http_header_line *hlines;
+	http_state *http; /* request headers, see http_header() */
 	
 	struct USERS *call_user;
 	
@@ -92,6 +93,7 @@ typedef struct callback
 {
 	unsigned int (*func)(struct _callbackp *); /* Callback func */
 	unsigned int need; /* Need SESSID ? */
+	struct _metric *stats; /* count & latency */
 } callback;
 
 typedef struct _callback_hook
@@ -109,7 +111,7 @@ enum {
 };
 
 struct _cmd_process {
-	struct _http_header_line *hlines;
+	http_state *http;
 	USERS *guser;
 	subuser *sub;
 	ape_socket *client;
@@ -134,6 +136,7 @@ unsigned int cmd_session(struct _callbackp *);
 unsigned int cmd_pconnect(struct _callbackp *);
 unsigned int cmd_script(struct _callbackp *);
 unsigned int cmd_pong(struct _callbackp *);
+unsigned int cmd_stats(struct _callbackp *);
 unsigned int cmd_proxy_connect(struct _callbackp *);
 unsigned int cmd_proxy_write(struct _callbackp *);
 ///////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,255 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* compress.c */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "compress.h"
+#include "http_parser.h"
+#include "config.h"
+#include "utils.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+	gzip/deflate for HTTP transports. A response (long polling, JSONP) is
+	compressed in one go with a stream borrowed for the call, a streaming
+	response (XHR streaming, event-stream) keeps its stream until the socket
+	is closed and every batch ends with a sync flush so it can be decoded
+	as it arrives.
+	
+	Streams are reset and kept for reuse : a zlib stream costs
+	(1 << (window_bits + 2)) + (1 << (mem_level + 9)) bytes, at most
+	max_streams of them are alive, responses are sent uncompressed beyond.
+*/
+
+static struct {
+	int enabled;
+	int level;
+	int window_bits;
+	int mem_level;
+	
+	unsigned int min_size;
+	unsigned int max_streams;
+	unsigned int pool_size;
+	
+	unsigned int active; /* handed out */
+	unsigned int nidle;
+	struct _compress_stream *idle[3]; /* by encoding */
+	
+	metric *in;
+	metric *out;
+} cs;
+
+static long gauge_compress_streams(acetables *g_ape)
+{
+	return cs.active + cs.nidle;
+}
+
+static int compress_config(const char *val, int def, int min, int max)
+{
+	int ret = (*val != '\0' ? atoi(val) : def);
+	
+	return (ret < min || ret > max ? def : ret);
+}
+
+void compress_init(acetables *g_ape)
+{
+	cs.enabled = (strcmp(CONFIG_VAL(Compression, enable, g_ape->srv), "no") != 0);
+	
+	cs.level = compress_config(CONFIG_VAL(Compression, level, g_ape->srv), COMPRESS_LEVEL, 1, 9);
+	cs.window_bits = compress_config(CONFIG_VAL(Compression, window_bits, g_ape->srv), COMPRESS_WINDOW_BITS, 9, 15);
+	cs.mem_level = compress_config(CONFIG_VAL(Compression, mem_level, g_ape->srv), COMPRESS_MEM_LEVEL, 1, 9);
+	cs.min_size = compress_config(CONFIG_VAL(Compression, min_size, g_ape->srv), COMPRESS_MIN_SIZE, 0, 1 << 30);
+	cs.max_streams = compress_config(CONFIG_VAL(Compression, max_streams, g_ape->srv), COMPRESS_MAX_STREAMS, 1, 1 << 20);
+	cs.pool_size = compress_config(CONFIG_VAL(Compression, pool_size, g_ape->srv), COMPRESS_POOL_SIZE, 0, 1 << 20);
+	
+	cs.in = metric_register("ape_compress_bytes_total", "Bytes going through HTTP compression", METRIC_COUNTER, "side=\"in\"");
+	cs.out = metric_register("ape_compress_bytes_total", "Bytes going through HTTP compression", METRIC_COUNTER, "side=\"out\"");
+	metric_register_gauge("ape_compress_streams", "zlib streams allocated (in use or idle)", gauge_compress_streams);
+}
+
+void compress_free(acetables *g_ape)
+{
+	int i;
+	
+	for (i = 0; i < 3; i++) {
+		while (cs.idle[i] != NULL) {
+			struct _compress_stream *next = cs.idle[i]->next;
+			
+			deflateEnd(&cs.idle[i]->z);
+			free(cs.idle[i]);
+			cs.idle[i] = next;
+		}
+	}
+	cs.nidle = 0;
+}
+
+unsigned int compress_min_size()
+{
+	return cs.min_size;
+}
+
+/* gzip is preferred, "*" stands for the codings not listed, "q=0" refuses */
+compress_encoding compress_accepted(http_state *http)
+{
+	const char *p = http_header(http, HTTP_HEADER_ACCEPT_ENCODING);
+	int gzip = -1, deflate = -1, any = -1;
+	
+	if (p == NULL) {
+		return COMPRESS_NONE;
+	}
+	while (*p != '\0') {
+		const char *token;
+		size_t len;
+		int accept = 1;
+		
+		while (*p == ' ' || *p == '\t' || *p == ',') {
+			p++;
+		}
+		token = p;
+		while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+			p++;
+		}
+		len = p - token;
+		
+		while (*p != '\0' && *p != ',') {
+			if (*p == ';') {
+				do {
+					p++;
+				} while (*p == ' ' || *p == '\t');
+				
+				if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+					accept = (strtod(&p[2], NULL) > 0);
+				}
+				continue;
+			}
+			p++;
+		}
+		if (len == 4 && strncasecmp(token, "gzip", 4) == 0) {
+			gzip = accept;
+		} else if (len == 7 && strncasecmp(token, "deflate", 7) == 0) {
+			deflate = accept;
+		} else if (len == 1 && *token == '*') {
+			any = accept;
+		}
+	}
+	if (gzip == 1 || (gzip == -1 && any == 1)) {
+		return COMPRESS_GZIP;
+	}
+	if (deflate == 1 || (deflate == -1 && any == 1)) {
+		return COMPRESS_DEFLATE;
+	}
+	return COMPRESS_NONE;
+}
+
+/* Encoding of the responses compressed on the fly */
+compress_encoding compress_negotiate(http_state *http)
+{
+	return (cs.enabled ? compress_accepted(http) : COMPRESS_NONE);
+}
+
+/* NULL if too many streams are alive */
+struct _compress_stream *compress_stream_get(compress_encoding encoding)
+{
+	struct _compress_stream *stream;
+	
+	if ((stream = cs.idle[encoding]) != NULL) {
+		cs.idle[encoding] = stream->next;
+		cs.nidle--;
+	} else if (cs.active + cs.nidle >= cs.max_streams) {
+		return NULL;
+	} else {
+		stream = xmalloc(sizeof(*stream));
+		memset(&stream->z, 0, sizeof(stream->z));
+		
+		/* windowBits + 16 : gzip wrapper (RFC 1952), zlib (RFC 1950) otherwise */
+		if (deflateInit2(&stream->z, cs.level, Z_DEFLATED, cs.window_bits + (encoding == COMPRESS_GZIP ? 16 : 0), cs.mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+			alog_warn("Failed to allocate a compression stream");
+			free(stream);
+			return NULL;
+		}
+		stream->encoding = encoding;
+	}
+	stream->next = NULL;
+	cs.active++;
+	
+	return stream;
+}
+
+void compress_stream_release(struct _compress_stream *stream)
+{
+	cs.active--;
+	
+	if (cs.nidle >= cs.pool_size) {
+		deflateEnd(&stream->z);
+		free(stream);
+		return;
+	}
+	deflateReset(&stream->z);
+	stream->next = cs.idle[stream->encoding];
+	cs.idle[stream->encoding] = stream;
+	cs.nidle++;
+}
+
+/*
+	Compress "iov" in a new buffer (to be released), "flush" is Z_FINISH for
+	a whole response or Z_SYNC_FLUSH for a chunk of a stream.
+*/
+char *compress_iov(struct _compress_stream *stream, const struct iovec *iov, int iovcnt, int flush, size_t *outlen)
+{
+	z_stream *z = &stream->z;
+	size_t size = 0, len;
+	char *out;
+	int i;
+	
+	for (i = 0; i < iovcnt; i++) {
+		size += iov[i].iov_len;
+	}
+	METRIC_ADD(cs.in, size);
+	
+	size = deflateBound(z, size) + 16;
+	out = xmalloc(size);
+	
+	z->next_out = (Bytef *)out;
+	z->avail_out = size;
+	
+	for (i = 0; i <= iovcnt; i++) {
+		z->next_in = (Bytef *)(i < iovcnt ? iov[i].iov_base : NULL);
+		z->avail_in = (i < iovcnt ? iov[i].iov_len : 0);
+		
+		do {
+			if (z->avail_out == 0) {
+				len = (char *)z->next_out - out;
+				out = xrealloc(out, size * 2);
+				
+				z->next_out = (Bytef *)&out[len];
+				z->avail_out = size;
+				size *= 2;
+			}
+			deflate(z, (i < iovcnt ? Z_NO_FLUSH : flush));
+		} while (z->avail_out == 0);
+	}
+	*outlen = (char *)z->next_out - out;
+	METRIC_ADD(cs.out, *outlen);
+	
+	return out;
+}
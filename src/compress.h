@@ -0,0 +1,64 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* compress.h */
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <zlib.h>
+
+#include "main.h"
+
+#define COMPRESS_LEVEL 6
+#define COMPRESS_MIN_SIZE 256 /* smaller responses are sent as is */
+#define COMPRESS_WINDOW_BITS 12
+#define COMPRESS_MEM_LEVEL 5
+#define COMPRESS_MAX_STREAMS 1024
+#define COMPRESS_POOL_SIZE 64
+
+/* Content-Encoding of a response, negotiated from the request Accept-Encoding */
+typedef enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_GZIP,
+	COMPRESS_DEFLATE
+} compress_encoding;
+
+struct _compress_stream {
+	z_stream z;
+	compress_encoding encoding;
+	struct _compress_stream *next; /* idle list */
+};
+
+void compress_init(acetables *g_ape);
+void compress_free(acetables *g_ape);
+
+compress_encoding compress_accepted(http_state *http);
+compress_encoding compress_negotiate(http_state *http);
+unsigned int compress_min_size();
+
+struct _compress_stream *compress_stream_get(compress_encoding encoding);
+void compress_stream_release(struct _compress_stream *stream);
+
+char *compress_iov(struct _compress_stream *stream, const struct iovec *iov, int iovcnt, int flush, size_t *outlen);
+
+#define COMPRESS_HEADER_GZIP "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n"
+#define COMPRESS_HEADER_DEFLATE "Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n\r\n"
+
+#endif
@@ -0,0 +1,382 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* connpool.c */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <errno.h>
+
+#include "connpool.h"
+#include "sock.h"
+#include "dns.h"
+#include "hash.h"
+#include "ticks.h"
+#include "utils.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+
+#define CONNPOOL_MAX_PER_HOST 8
+#define CONNPOOL_IDLE_TIMEOUT 30
+
+struct _connpool_wait {
+	connpool_callback callback;
+	void *data;
+	struct _connpool_wait *next;
+};
+
+struct _connpool_host {
+	char *host;
+	int port;
+	
+	unsigned int total; /* connecting + in use + idle */
+	unsigned int connecting;
+	
+	struct _connpool_conn *idle; /* most recently released first */
+	
+	struct {
+		struct _connpool_wait *head;
+		struct _connpool_wait *foot;
+		unsigned int length;
+	} wait;
+};
+
+struct _connpool_conn {
+	struct _connpool_host *host;
+	ape_socket *sock;
+	time_t since; /* idle since */
+	
+	struct _connpool_conn *prev;
+	struct _connpool_conn *next;
+};
+
+static struct {
+	HTBL *hosts;
+	
+	unsigned int max_per_host;
+	unsigned int idle_timeout;
+	
+	unsigned int nidle;
+	int timer;
+	
+	metric *created;
+	metric *reused;
+} cp = {NULL, CONNPOOL_MAX_PER_HOST, CONNPOOL_IDLE_TIMEOUT, 0, 0, NULL, NULL};
+
+static void connpool_dispatch(struct _connpool_host *host, acetables *g_ape);
+
+static void connpool_idle_unlink(struct _connpool_conn *conn)
+{
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		conn->host->idle = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	cp.nidle--;
+}
+
+/* Forget conn (the socket, if any, is closed by the event loop) */
+static void connpool_drop(struct _connpool_conn *conn)
+{
+	if (conn->sock != NULL) {
+		memset(&conn->sock->callbacks, 0, sizeof(conn->sock->callbacks));
+		conn->sock->data = NULL;
+		conn->sock->attach = NULL;
+		
+		shutdown(conn->sock->fd, 2);
+	}
+	conn->host->total--;
+	
+	free(conn);
+}
+
+/* The peer closed or wrote something on an idle connection ? */
+static int connpool_healthy(ape_socket *sock)
+{
+	char c;
+	
+	return (sock->state == STREAM_ONLINE && recv(sock->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static void connpool_handover(struct _connpool_conn *conn, int reused, acetables *g_ape)
+{
+	struct _connpool_host *host = conn->host;
+	struct _connpool_wait *wait = host->wait.head;
+	
+	if ((host->wait.head = wait->next) == NULL) {
+		host->wait.foot = NULL;
+	}
+	host->wait.length--;
+	
+	memset(&conn->sock->callbacks, 0, sizeof(conn->sock->callbacks));
+	conn->sock->attach = NULL;
+	
+	METRIC_INC(reused ? cp.reused : cp.created);
+	
+	wait->callback(conn->sock, reused, wait->data, g_ape);
+	free(wait);
+}
+
+/* Fail the oldest request of host (its connection couldn't be established) */
+static void connpool_fail(struct _connpool_host *host, acetables *g_ape)
+{
+	struct _connpool_wait *wait = host->wait.head;
+	
+	if (wait == NULL) {
+		return;
+	}
+	if ((host->wait.head = wait->next) == NULL) {
+		host->wait.foot = NULL;
+	}
+	host->wait.length--;
+	
+	wait->callback(NULL, 0, wait->data, g_ape);
+	free(wait);
+}
+
+static void connpool_idle_disconnect(ape_socket *sock, acetables *g_ape)
+{
+	struct _connpool_conn *conn = sock->data;
+	
+	connpool_idle_unlink(conn);
+	
+	conn->sock = NULL;
+	connpool_drop(conn);
+	sock->data = NULL;
+}
+
+static void connpool_idle_read(ape_socket *sock, ape_buffer *buf, size_t offset, acetables *g_ape)
+{
+	struct _connpool_conn *conn = sock->data;
+	
+	/* nothing is expected on an idle connection */
+	buf->length = 0;
+	
+	connpool_idle_unlink(conn);
+	connpool_drop(conn);
+}
+
+static void connpool_tick(void *params, int *last)
+{
+	HTBL_ITEM *item;
+	time_t now = time(NULL);
+	
+	for (item = cp.hosts->first; item != NULL; item = item->lnext) {
+		struct _connpool_host *host = item->addrs;
+		struct _connpool_conn *conn, *next;
+		
+		for (conn = host->idle; conn != NULL; conn = next) {
+			next = conn->next;
+			
+			if (conn->since + cp.idle_timeout <= now) {
+				connpool_idle_unlink(conn);
+				connpool_drop(conn);
+			}
+		}
+	}
+	if (cp.nidle == 0) {
+		cp.timer = 0;
+		*last = 1;
+	}
+}
+
+static void connpool_onconnect(ape_socket *sock, acetables *g_ape)
+{
+	struct _connpool_conn *conn = sock->data;
+	struct _connpool_host *host = conn->host;
+	
+	host->connecting--;
+	
+	if (host->wait.head != NULL) {
+		connpool_handover(conn, 0, g_ape);
+	} else {
+		/* requests were served by other connections meanwhile */
+		connpool_release(sock, 1, g_ape);
+	}
+}
+
+static void connpool_connect_failed(ape_socket *sock, acetables *g_ape)
+{
+	struct _connpool_conn *conn = sock->data;
+	struct _connpool_host *host = conn->host;
+	
+	host->connecting--;
+	
+	conn->sock = NULL;
+	connpool_drop(conn);
+	sock->data = NULL;
+	
+	connpool_fail(host, g_ape);
+	connpool_dispatch(host, g_ape);
+}
+
+static void connpool_resolved(char *ip, void *data, acetables *g_ape)
+{
+	struct _connpool_conn *conn = data;
+	struct _connpool_host *host = conn->host;
+	ape_socket *sock;
+	
+	if (ip == NULL || (sock = ape_connect(ip, host->port, g_ape)) == NULL) {
+		free(ip);
+		
+		host->connecting--;
+		connpool_drop(conn);
+		
+		connpool_fail(host, g_ape);
+		
+		return;
+	}
+	free(ip);
+	
+	conn->sock = sock;
+	
+	sock->data = conn;
+	sock->callbacks.on_connect = connpool_onconnect;
+	sock->callbacks.on_disconnect = connpool_connect_failed;
+}
+
+/* Serve waiting requests with idle connections, open new ones if needed */
+static void connpool_dispatch(struct _connpool_host *host, acetables *g_ape)
+{
+	while (host->wait.head != NULL && host->idle != NULL) {
+		struct _connpool_conn *conn = host->idle;
+		
+		connpool_idle_unlink(conn);
+		
+		if (!connpool_healthy(conn->sock)) {
+			connpool_drop(conn);
+			continue;
+		}
+		connpool_handover(conn, 1, g_ape);
+	}
+	
+	/* resolution may fail synchronously (and fail a request) */
+	while (host->connecting < host->wait.length && host->total < cp.max_per_host) {
+		struct _connpool_conn *conn = xmalloc(sizeof(*conn));
+		
+		conn->host = host;
+		conn->sock = NULL;
+		conn->prev = NULL;
+		conn->next = NULL;
+		
+		host->total++;
+		host->connecting++;
+		
+		ape_gethostbyname(host->host, connpool_resolved, conn, g_ape);
+	}
+}
+
+void connpool_get(const char *name, int port, connpool_callback callback, void *data, acetables *g_ape)
+{
+	struct _connpool_host *host;
+	struct _connpool_wait *wait;
+	char key[512];
+	
+	snprintf(key, sizeof(key), "%s:%d", name, port);
+	
+	if ((host = hashtbl_seek(cp.hosts, key)) == NULL) {
+		host = xmalloc(sizeof(*host));
+		host->host = xstrdup(name);
+		host->port = port;
+		host->total = 0;
+		host->connecting = 0;
+		host->idle = NULL;
+		host->wait.head = NULL;
+		host->wait.foot = NULL;
+		host->wait.length = 0;
+		
+		hashtbl_append(cp.hosts, key, host);
+	}
+	
+	wait = xmalloc(sizeof(*wait));
+	wait->callback = callback;
+	wait->data = data;
+	wait->next = NULL;
+	
+	if (host->wait.foot == NULL) {
+		host->wait.head = wait;
+	} else {
+		host->wait.foot->next = wait;
+	}
+	host->wait.foot = wait;
+	host->wait.length++;
+	
+	connpool_dispatch(host, g_ape);
+}
+
+void connpool_release(ape_socket *sock, int reuse, acetables *g_ape)
+{
+	struct _connpool_conn *conn = sock->data;
+	struct _connpool_host *host;
+	
+	if (conn == NULL) {
+		return;
+	}
+	host = conn->host;
+	
+	/* unread or unsent data : the connection can't be reused */
+	if (!reuse || sock->state != STREAM_ONLINE || sock->buffer_in.length || g_ape->bufout[sock->fd].buf != NULL) {
+		connpool_drop(conn);
+		connpool_dispatch(host, g_ape);
+		
+		return;
+	}
+	if (host->wait.head != NULL) {
+		connpool_handover(conn, 1, g_ape);
+		
+		return;
+	}
+	
+	memset(&sock->callbacks, 0, sizeof(sock->callbacks));
+	sock->callbacks.on_read = connpool_idle_read;
+	sock->callbacks.on_disconnect = connpool_idle_disconnect;
+	sock->attach = NULL;
+	
+	conn->since = time(NULL);
+	conn->prev = NULL;
+	if ((conn->next = host->idle) != NULL) {
+		host->idle->prev = conn;
+	}
+	host->idle = conn;
+	cp.nidle++;
+	
+	if (!cp.timer) {
+		cp.timer = 1;
+		add_periodical(1000, 0, connpool_tick, NULL, g_ape);
+	}
+}
+
+void connpool_init(acetables *g_ape)
+{
+	int max = atoi(CONFIG_VAL(Server, outbound_max_per_host, g_ape->srv));
+	int timeout = atoi(CONFIG_VAL(Server, outbound_idle_timeout, g_ape->srv));
+	
+	cp.max_per_host = (max > 0 ? max : CONNPOOL_MAX_PER_HOST);
+	cp.idle_timeout = (timeout > 0 ? timeout : CONNPOOL_IDLE_TIMEOUT);
+	
+	cp.hosts = hashtbl_init();
+	
+	cp.created = metric_register("ape_outbound_connections_total", "Outbound connections handed out", METRIC_COUNTER, "reused=\"0\"");
+	cp.reused = metric_register("ape_outbound_connections_total", "Outbound connections handed out", METRIC_COUNTER, "reused=\"1\"");
+}
@@ -0,0 +1,43 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* connpool.h */
+
+#ifndef _CONNPOOL_H
+#define _CONNPOOL_H
+
+#include "main.h"
+
+/*
+	Keep-alive pool for outbound connections, keyed by host:port.
+	
+	connpool_get() calls "callback" with an online socket (an idle one if
+	any, else a new connection) or NULL if the host can't be reached. The
+	socket then belongs to the caller (callbacks, attach) until it gives it
+	back with connpool_release(), which must be called exactly once : with
+	reuse = 1 once a request/response is complete, or reuse = 0 (e.g. from
+	on_disconnect) to drop it. sock->data is reserved to the pool.
+*/
+typedef void (*connpool_callback)(ape_socket *sock, int reused, void *data, acetables *g_ape);
+
+void connpool_init(acetables *g_ape);
+void connpool_get(const char *host, int port, connpool_callback callback, void *data, acetables *g_ape);
+void connpool_release(ape_socket *sock, int reuse, acetables *g_ape);
+
+#endif
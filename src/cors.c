@@ -0,0 +1,185 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* cors.c */
+
+#include <string.h>
+#include <stdio.h>
+
+#include "cors.h"
+#include "http_parser.h"
+#include "sock.h"
+#include "framing.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+	Cross-origin requests (CORS) : an allowed Origin gets its
+	Access-Control-* headers (built once per origin at startup) on every
+	response, see frame_headers(). Preflights (OPTIONS) are answered here
+	and never reach the commands.
+	
+	"*" allows any origin but never with credentials (browsers refuse it),
+	listed origins are echoed and may send their cookies.
+*/
+
+#define CORS_FORBIDDEN "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define CORS_MAX_REQUEST_HEADERS 256
+
+struct _cors_origin {
+	char *origin;
+	struct iovec headers;
+};
+
+static struct {
+	struct _cors_origin origins[CORS_MAX_ORIGINS];
+	int norigins;
+	
+	struct iovec any; /* "*", if allowed */
+	struct iovec preflight; /* methods and max age */
+} cors;
+
+static void cors_block(struct iovec *block, const char *fmt, const char *origin)
+{
+	char *buf;
+	int len = snprintf(NULL, 0, fmt, origin);
+	
+	buf = xmalloc(len + 1);
+	sprintf(buf, fmt, origin);
+	
+	block->iov_base = buf;
+	block->iov_len = len;
+}
+
+void cors_init(acetables *g_ape)
+{
+	char *allow, *tkn[CORS_MAX_ORIGINS];
+	int credentials = (strcmp(CONFIG_VAL(CORS, allow_credentials, g_ape->srv), "yes") == 0);
+	int max_age = atoi(CONFIG_VAL(CORS, max_age, g_ape->srv));
+	char age[16];
+	size_t n, i;
+	
+	allow = xstrdup(CONFIG_VAL(CORS, allow_origin, g_ape->srv));
+	n = explode(',', allow, tkn, CORS_MAX_ORIGINS - 1);
+	
+	for (i = 0; i <= n; i++) {
+		char *origin = trim(tkn[i]);
+		size_t len = strlen(origin);
+		
+		/* "https://example.com/" : the browser sends no trailing slash */
+		while (len && origin[len - 1] == '/') {
+			origin[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (strcmp(origin, "*") == 0) {
+			cors_block(&cors.any, "Access-Control-Allow-Origin: %s\r\n", "*");
+			continue;
+		}
+		cors.origins[cors.norigins].origin = xstrdup(origin);
+		cors_block(&cors.origins[cors.norigins].headers, (credentials ?
+			"Access-Control-Allow-Origin: %s\r\nAccess-Control-Allow-Credentials: true\r\nVary: Origin\r\n" :
+			"Access-Control-Allow-Origin: %s\r\nVary: Origin\r\n"), origin);
+		cors.norigins++;
+	}
+	free(allow);
+	
+	sprintf(age, "%d", (max_age > 0 ? max_age : CORS_MAX_AGE));
+	cors_block(&cors.preflight, "Access-Control-Allow-Methods: GET, POST\r\nAccess-Control-Max-Age: %s\r\n", age);
+}
+
+void cors_free(acetables *g_ape)
+{
+	int i;
+	
+	for (i = 0; i < cors.norigins; i++) {
+		free(cors.origins[i].origin);
+		free(cors.origins[i].headers.iov_base);
+	}
+	cors.norigins = 0;
+	
+	free(cors.any.iov_base);
+	free(cors.preflight.iov_base);
+	cors.any.iov_base = NULL;
+	cors.any.iov_len = 0;
+	cors.preflight.iov_base = NULL;
+}
+
+/* Access-Control-* headers for the request Origin, NULL if not allowed (or same origin) */
+const struct iovec *cors_headers(http_state *http)
+{
+	const char *origin = http_header(http, HTTP_HEADER_ORIGIN);
+	int i;
+	
+	if (origin == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < cors.norigins; i++) {
+		if (strcasecmp(cors.origins[i].origin, origin) == 0) {
+			return &cors.origins[i].headers;
+		}
+	}
+	
+	return (cors.any.iov_len ? &cors.any : NULL);
+}
+
+/* Header names only, anything else isn't echoed */
+static int cors_header_list(const char *list)
+{
+	const char *p;
+	
+	for (p = list; *p != '\0'; p++) {
+		if (!(*p == '-' || *p == '_' || *p == ',' || *p == ' ' ||
+			(*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'))) {
+			return 0;
+		}
+	}
+	return (p - list <= CORS_MAX_REQUEST_HEADERS);
+}
+
+/* OPTIONS : the connection is closed once answered */
+void cors_preflight(ape_socket *co, http_state *http, acetables *g_ape)
+{
+	const struct iovec *headers = cors_headers(http);
+	const char *method = http_header_find(http, "Access-Control-Request-Method");
+	const char *request_headers = http_header_find(http, "Access-Control-Request-Headers");
+	struct iovec iov[7];
+	int n;
+	
+	if (headers == NULL || method == NULL || (strcmp(method, "GET") != 0 && strcmp(method, "POST") != 0)) {
+		sendbin(co->fd, CONST_STR_LEN(CORS_FORBIDDEN), 1, g_ape);
+		return;
+	}
+	FRAME_BLOCK(iov[0], "HTTP/1.1 204 No Content\r\n", 25);
+	iov[1] = *headers;
+	iov[2] = cors.preflight;
+	n = 3;
+	
+	if (request_headers != NULL && *request_headers != '\0' && cors_header_list(request_headers)) {
+		FRAME_BLOCK(iov[3], "Access-Control-Allow-Headers: ", 30);
+		FRAME_BLOCK(iov[4], request_headers, strlen(request_headers));
+		FRAME_BLOCK(iov[5], "\r\n", 2);
+		n = 6;
+	}
+	FRAME_BLOCK(iov[n], "Content-Length: 0\r\nConnection: close\r\n\r\n", 40);
+	
+	sendv(co->fd, iov, n + 1, 1, g_ape);
+}
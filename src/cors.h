@@ -0,0 +1,36 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* cors.h */
+
+#ifndef _CORS_H
+#define _CORS_H
+
+#include "main.h"
+
+#define CORS_MAX_AGE 86400 /* seconds a preflight may be cached */
+#define CORS_MAX_ORIGINS 64
+
+void cors_init(acetables *g_ape);
+void cors_free(acetables *g_ape);
+
+const struct iovec *cors_headers(http_state *http);
+void cors_preflight(ape_socket *co, http_state *http, acetables *g_ape);
+
+#endif
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <udns.h>
 #include "dns.h"
@@ -42,10 +43,33 @@
 #include "events.h"
 #include "utils.h"
 #include "ticks.h"
+#include "config.h"
+#include "hash.h"
+#include "metrics.h"
 
+#define DNS_CACHE_DEFAULT 1024
+#define DNS_NEGATIVE_TTL_DEFAULT 30
+#define DNS_MAX_TTL 86400
+#define DNS_HOSTS_FILE "/etc/hosts"
 
 static enum dns_class qcls = DNS_C_IN;
 
+static struct {
+	HTBL *table;
+	struct dns_entry *head;
+	struct dns_entry *foot;
+	
+	unsigned int count;
+	unsigned int max;
+	unsigned int negative_ttl;
+	
+	int timer; /* udns timeouts are polled only while queries are pending */
+	
+	metric *hits;
+	metric *misses;
+	metric *merged;
+} cache = {NULL, NULL, NULL, 0, DNS_CACHE_DEFAULT, DNS_NEGATIVE_TTL_DEFAULT, 0, NULL, NULL, NULL};
+
 static struct query *query_new(const char *name, const unsigned char *dn, enum dns_type qtyp) {
 	struct query *q = xmalloc(sizeof(*q));
 	
@@ -57,6 +81,7 @@ static struct query *query_new(const char *name, const unsigned char *dn, enum d
 	q->name = xstrdup(name);
 	q->dn = cdn;
 	q->qtyp = qtyp;
+	q->waiters = NULL;
 	
 	return q;
 }
@@ -82,6 +107,145 @@ static void query_free(struct query *q) {
 	free(q);
 }
 
+static void ape_dns_timeout(void *params, int *last)
+{
+	dns_timeouts(NULL, -1, 0);
+	
+	if (!dns_active(NULL)) {
+		cache.timer = 0;
+		*last = 1;
+	}
+}
+
+static void cache_unlink(struct dns_entry *entry)
+{
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		cache.head = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache.foot = entry->prev;
+	}
+}
+
+static void cache_link(struct dns_entry *entry)
+{
+	entry->prev = NULL;
+	
+	if ((entry->next = cache.head) != NULL) {
+		cache.head->prev = entry;
+	} else {
+		cache.foot = entry;
+	}
+	cache.head = entry;
+}
+
+/* Drop the least recently used answers (not the lookups in progress) */
+static void cache_evict()
+{
+	struct dns_entry *entry = cache.foot, *prev;
+	
+	while (cache.count > cache.max && entry != NULL) {
+		prev = entry->prev;
+		
+		if (entry->pending == NULL) {
+			cache_unlink(entry);
+			hashtbl_erase(cache.table, entry->name);
+			
+			free(entry->name);
+			free(entry);
+			cache.count--;
+		}
+		entry = prev;
+	}
+}
+
+static struct dns_entry *cache_add(const char *name, int lru)
+{
+	struct dns_entry *entry = xmalloc(sizeof(*entry));
+	
+	entry->name = xstrdup(name);
+	entry->ip[0] = '\0';
+	entry->expires = 0;
+	entry->pending = NULL;
+	entry->prev = NULL;
+	entry->next = NULL;
+	
+	hashtbl_append(cache.table, name, entry);
+	
+	/* /etc/hosts entries are never evicted */
+	if (lru) {
+		cache_link(entry);
+		cache.count++;
+	}
+	
+	return entry;
+}
+
+/* Static IPv4 names from /etc/hosts (first match wins, like the libc) */
+static void cache_load_hosts()
+{
+	char line[1024];
+	FILE *fp;
+	
+	if ((fp = fopen(DNS_HOSTS_FILE, "r")) == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *ip, *name, *ptr;
+		struct in_addr addr;
+		struct dns_entry *entry;
+		
+		if ((ptr = strchr(line, '#')) != NULL) {
+			*ptr = '\0';
+		}
+		if ((ip = strtok(line, " \t\r\n")) == NULL || strlen(ip) > 15 || dns_pton(AF_INET, ip, &addr) <= 0) {
+			continue;
+		}
+		while ((name = strtok(NULL, " \t\r\n")) != NULL) {
+			for (ptr = name; *ptr; ptr++) {
+				*ptr = tolower((unsigned char)*ptr);
+			}
+			if (hashtbl_seek(cache.table, name) == NULL) {
+				entry = cache_add(name, 0);
+				strcpy(entry->ip, ip);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+/* Store the answer and wake up every lookup waiting for it */
+static void query_done(struct query *q, const char *ip, unsigned int ttl)
+{
+	struct dns_entry *entry = hashtbl_seek(cache.table, q->name);
+	struct dns_waiter *waiter, *next;
+	
+	if (entry != NULL && entry->pending == q) {
+		entry->pending = NULL;
+		
+		if (ip != NULL) {
+			strcpy(entry->ip, ip);
+			entry->expires = time(NULL) + (ttl < DNS_MAX_TTL ? ttl : DNS_MAX_TTL);
+		} else {
+			entry->ip[0] = '\0';
+			entry->expires = time(NULL) + cache.negative_ttl;
+		}
+	}
+	
+	/* callbacks may add entries (and evict this one) */
+	for (waiter = q->waiters; waiter != NULL; waiter = next) {
+		next = waiter->next;
+		
+		waiter->callback((ip != NULL ? xstrdup(ip) : NULL), waiter->data, q->g_ape);
+		free(waiter);
+	}
+	
+	query_free(q);
+}
 
 static void dnscb(struct dns_ctx *ctx, void *result, void *data) {
   int r = dns_status(ctx);
@@ -93,6 +257,7 @@ static void dnscb(struct dns_ctx *ctx, void *result, void *data) {
   const unsigned char *pkt, *cur, *end;
 
   if (!result) {
+    query_done(q, NULL, 0);
     return;
   }
 
@@ -123,6 +288,7 @@ static void dnscb(struct dns_ctx *ctx, void *result, void *data) {
     r = DNS_E_NODATA;
   if (r < 0) {
     free(result);
+    query_done(q, NULL, 0);
     return;
   }
   dns_rewind(&p, NULL);
@@ -131,65 +297,130 @@ static void dnscb(struct dns_ctx *ctx, void *result, void *data) {
   while(dns_nextrr(&p, &rr)) {
 	const unsigned char *dptr = rr.dnsrr_dptr;
 	if (rr.dnsrr_dsz == 4)  {
-		char *ip = xmalloc(sizeof(char) * 16);
+		char ip[16];
 		sprintf(ip, "%d.%d.%d.%d", dptr[0], dptr[1], dptr[2], dptr[3]);
 		
-		q->callback(ip, q->data, q->g_ape);
-		break;
+		free(result);
+		query_done(q, ip, rr.dnsrr_ttl);
+		return;
 	}
   }
 
   free(result);
-  query_free(q);
+  query_done(q, NULL, 0);
 }
 
-
-void ape_gethostbyname(char *name, void (*callback)(char *, void *, acetables *), void *data, acetables *g_ape)
+/*
+	Resolve "name" (IPv4). Answers are cached for their TTL (failures for
+	negative_ttl) and concurrent lookups of a name share one query.
+	The callback may be called before this function returns.
+*/
+void ape_gethostbyname(char *name, ape_dns_callback callback, void *data, acetables *g_ape)
 {
    
     struct in_addr addr;
 	struct query *q;
+	struct dns_entry *entry;
+	struct dns_waiter *waiter;
     unsigned char dn[DNS_MAXDN];
-	int abs = 0;
+	char key[DNS_MAXDN + 1];
+	int abs = 0, i;
 	enum dns_type l_qtyp = 0;
 
     if (dns_pton(AF_INET, name, &addr) > 0) {
 		/* We have an IP */
 		callback(xstrdup(name), data, g_ape);
 		return;
-    } else if (!dns_ptodn(name, strlen(name), dn, sizeof(dn), &abs)) {
+    } else if (strlen(name) > DNS_MAXDN || !dns_ptodn(name, strlen(name), dn, sizeof(dn), &abs)) {
 		/* We have an invalid domain name */
+		callback(NULL, data, g_ape);
 		return;
 	} else {
 		l_qtyp = DNS_T_A;
 	}
 	
-	q = query_new(name, dn, l_qtyp);
+	for (i = 0; name[i] != '\0'; i++) {
+		key[i] = tolower((unsigned char)name[i]);
+	}
+	key[i] = '\0';
+	
+	if ((entry = hashtbl_seek(cache.table, key)) != NULL) {
+		if (entry->pending != NULL) {
+			METRIC_INC(cache.merged);
+			
+			waiter = xmalloc(sizeof(*waiter));
+			waiter->callback = callback;
+			waiter->data = data;
+			waiter->next = entry->pending->waiters;
+			entry->pending->waiters = waiter;
+			
+			return;
+		}
+		if (!entry->expires || entry->expires > time(NULL)) {
+			METRIC_INC(cache.hits);
+			
+			if (entry->expires) {
+				cache_unlink(entry);
+				cache_link(entry);
+			}
+			callback((entry->ip[0] != '\0' ? xstrdup(entry->ip) : NULL), data, g_ape);
+			
+			return;
+		}
+		/* expired : refresh it */
+		cache_unlink(entry);
+		cache_link(entry);
+	} else {
+		entry = cache_add(key, 1);
+	}
+	METRIC_INC(cache.misses);
+	
+	q = query_new(key, dn, l_qtyp);
 	
-	q->data = data;
-	q->callback = callback;
 	q->g_ape = g_ape;
+	q->waiters = xmalloc(sizeof(*q->waiters));
+	q->waiters->callback = callback;
+	q->waiters->data = data;
+	q->waiters->next = NULL;
+	
+	entry->pending = q;
+	
+	/* evict once the new entry is pending so it is never the victim */
+	cache_evict();
 	
 	if (abs) {
 		abs = DNS_NOSRCH;
 	}
     if (!dns_submit_dn(NULL, dn, qcls, l_qtyp, abs, 0, dnscb, q)) {
-		query_free(q);
+		query_done(q, NULL, 0);
 		return;
 	}
 	
 	dns_timeouts(NULL, -1, 0);
+	
+	if (!cache.timer) {
+		cache.timer = 1;
+		add_periodical(50, 0, ape_dns_timeout, NULL, g_ape);
+	}
 }
 
-static void ape_dns_timeout(void *params, int *last)
-{
-	dns_timeouts(NULL, -1, 0);
-}
-
-
 void ape_dns_init(acetables *g_ape)
 {
 	int sock = dns_init(NULL, 1);
+	int size = atoi(CONFIG_VAL(Server, dns_cache_size, g_ape->srv));
+	char *negative_ttl = CONFIG_VAL(Server, dns_negative_ttl, g_ape->srv);
+	
+	cache.max = (size > 0 ? size : DNS_CACHE_DEFAULT);
+	
+	if (*negative_ttl != '\0') {
+		cache.negative_ttl = atoi(negative_ttl);
+	}
+	cache.table = hashtbl_init();
+	cache_load_hosts();
+	
+	cache.hits = metric_register("ape_dns_lookups_total", "DNS lookups", METRIC_COUNTER, "result=\"hit\"");
+	cache.misses = metric_register("ape_dns_lookups_total", "DNS lookups", METRIC_COUNTER, "result=\"miss\"");
+	cache.merged = metric_register("ape_dns_lookups_total", "DNS lookups", METRIC_COUNTER, "result=\"merged\"");
 
 	prepare_ape_socket(sock, g_ape);
 	
@@ -200,6 +431,4 @@ void ape_dns_init(acetables *g_ape)
 	g_ape->co[sock]->callbacks.on_write = ape_dns_write;
 
 	events_add(g_ape->events, sock, EVENT_READ|EVENT_WRITE);
-
-	add_periodical(50, 0, ape_dns_timeout, NULL, g_ape);
 }
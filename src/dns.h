@@ -26,17 +26,36 @@
 #include "sock.h"
 #include <udns.h>
 
+/* ip is NULL if the name can't be resolved, otherwise it must be freed by the callback */
+typedef void (*ape_dns_callback)(char *ip, void *data, acetables *g_ape);
+
+struct dns_waiter {
+	ape_dns_callback callback;
+	void *data;
+	struct dns_waiter *next;
+};
+
 struct query {
-	char *name;		/* original query string */
+	char *name;		/* original query string (lowercased) */
 	unsigned char *dn;		/* the DN being looked up */
-	void (*callback)(char *ip, void *data, acetables *g_ape);
-	void *data;
+	struct dns_waiter *waiters;	/* lookups of the same name merged on this query */
 	acetables *g_ape;
 	enum dns_type qtyp;		/* type of the query */
 };
 
-void ape_dns_init();
-void ape_gethostbyname(char *name, void (*callback)(char *, void *, acetables *), void *data, acetables *g_ape);
+/* Cached answer for a name, or a lookup in progress */
+struct dns_entry {
+	char *name;
+	char ip[16];		/* empty for a negative answer */
+	time_t expires;		/* 0 : never (/etc/hosts) */
+	struct query *pending;
+	
+	struct dns_entry *prev;	/* LRU, most recently used first */
+	struct dns_entry *next;
+};
+
+void ape_dns_init(acetables *g_ape);
+void ape_gethostbyname(char *name, ape_dns_callback callback, void *data, acetables *g_ape);
 
 #endif
 
@@ -39,9 +39,17 @@
 #include "proxy.h"
 #include "events.h"
 #include "transports.h"
+#include "http.h"
 #include "servers.h"
 #include "dns.h"
+#include "connpool.h"
 #include "log.h"
+#include "metrics.h"
+#include "workers.h"
+#include "compress.h"
+#include "cors.h"
+#include "static_files.h"
+#include "realip.h"
 
 #include <grp.h>
 #include <pwd.h>
@@ -277,8 +285,22 @@ int main(int argc, char **argv)
 		printf("Author  : Weelya (contact@weelya.com)\n\n");		
 	}
 	signal(SIGPIPE, SIG_IGN);
+
+	ape_log_start();
+
+	metrics_init(g_ape);
 	
 	ape_dns_init(g_ape);
+	ape_connect_init(g_ape);
+	
+	workers_init(g_ape);
+	
+	connpool_init(g_ape);
+	
+	compress_init(g_ape);
+	cors_init(g_ape);
+	static_files_init(g_ape);
+	realip_init(g_ape);
 	
 	g_ape->cmd_hook.head = NULL;
 	g_ape->cmd_hook.foot = NULL;
@@ -300,12 +322,14 @@ int main(int argc, char **argv)
 	g_ape->plugins = NULL;
 	
 	g_ape->properties = NULL;
+	memset(&g_ape->slots, 0, sizeof(g_ape->slots));
 
 	add_ticked(check_timeout, g_ape);
 	
 	do_register(g_ape);
 	
-	transport_start(g_ape);	
+	transport_start(g_ape);
+	websocket_init(g_ape);	
 	
 	findandloadplugin(g_ape);
 	
@@ -323,11 +347,18 @@ int main(int argc, char **argv)
 	
 	free(confs_path);
 
+	workers_free(g_ape);
+	
 	timers_free(g_ape);
 
 	events_free(g_ape);
 
 	transport_free(g_ape);
+	
+	compress_free(g_ape);
+	cors_free(g_ape);
+	static_files_free(g_ape);
+	realip_free(g_ape);
 
 	hashtbl_free(g_ape->hLogin, NULL);
 	hashtbl_free(g_ape->hSessid, NULL);
@@ -351,6 +382,10 @@ int main(int argc, char **argv)
 	
 	free_raw_recently(g_ape);
 
+	metrics_free(g_ape);
+
+	ape_log_done();
+
 	free(g_ape);
 	
 	return 0;
@@ -75,6 +75,7 @@ extend *add_property(extend **entry, const char *key, void *val, void (*ifree)(v
 	}
 
 	new_property->ifree = ifree;
+	new_property->slot_ref = NULL;
 	new_property->next = eTmp;
 	new_property->type = etype;
 	new_property->visibility = visibility;
@@ -150,6 +151,10 @@ void del_property(extend **entry, const char *key)
 		if (strcmp((*entry)->key, key) == 0) {
 			extend *pEntry = *entry;
 			*entry = (*entry)->next;
+
+			if (pEntry->slot_ref != NULL) {
+				*pEntry->slot_ref = NULL;
+			}
 			
 			switch(pEntry->type) {
 				case EXTEND_STR:
@@ -185,6 +190,9 @@ void clear_properties(extend **entry)
 
 	while (pEntry != NULL) {
 		pTmp = pEntry->next;
+		if (pEntry->slot_ref != NULL) {
+			*pEntry->slot_ref = NULL;
+		}
 		switch(pEntry->type) {
 			case EXTEND_STR:
 				free(pEntry->val);
@@ -267,3 +275,45 @@ extend *add_property(extend **entry, const char *key, void *val)
 }
 #endif
 
+static const char *const extend_keys[EXTEND_SLOT_MAX] = {
+	"uin",
+	"nick",
+	"vhost",
+	"friend",
+	"userlist",
+	"onlineuser",
+	"sm_context",
+	"sm_runtime"
+};
+
+/*
+	Lookup through the object slot cache, falls back to the list (and fills
+	the cache) on miss. The cache entry is cleared when the property is deleted.
+*/
+extend *get_property_slot(extend *entry, extend_slots *slots, int slot)
+{
+	extend *find;
+
+	if (slot < 0 || slot >= EXTEND_SLOT_MAX) {
+		return NULL;
+	}
+	if ((find = slots->val[slot]) != NULL) {
+		return find;
+	}
+	if ((find = get_property(entry, extend_keys[slot])) != NULL) {
+		slots->val[slot] = find;
+		find->slot_ref = &slots->val[slot];
+	}
+
+	return find;
+}
+
+void *get_property_val_slot(extend *entry, extend_slots *slots, int slot)
+{
+	extend *find;
+
+	if ((find = get_property_slot(entry, slots, slot)) != NULL) {
+		return find->val;
+	}
+	return NULL;
+}
@@ -37,8 +37,30 @@ typedef enum {
 	EXTEND_ISPRIVATE
 } EXTEND_PUBLIC;
 
+/*
+	Interned keys : hot properties of the server and of the users are
+	resolved through a per-object slot cache (extend_slots) instead of a
+	strcmp() walk of the list. Each well-known key has a fixed slot.
+*/
+typedef enum {
+	EXTEND_SLOT_UIN,
+	EXTEND_SLOT_NICK,
+	EXTEND_SLOT_VHOST,
+	EXTEND_SLOT_FRIEND,
+	EXTEND_SLOT_USERLIST,
+	EXTEND_SLOT_ONLINEUSER,
+	EXTEND_SLOT_SM_CONTEXT,
+	EXTEND_SLOT_SM_RUNTIME,
+	EXTEND_SLOT_MAX
+} EXTEND_SLOT;
+
 typedef struct _extend extend;
 
+typedef struct _extend_slots extend_slots;
+struct _extend_slots {
+	extend *val[EXTEND_SLOT_MAX];
+};
+
 struct _extend
 {	
 	void *val;
@@ -48,6 +70,7 @@ struct _extend
 	EXTEND_PUBLIC visibility;
 	
 	struct _extend *next;
+	struct _extend **slot_ref; /* slot cache entry pointing to us (if any) */
 	char key[EXTEND_KEY_LENGTH+1];
 };
 
@@ -59,4 +82,7 @@ void del_property(extend **entry, const char *key);
 extend *add_property(extend **entry, const char *key, void *val, void (*ifree)(void*),
 					 EXTEND_TYPE etype, EXTEND_PUBLIC visibility);
 void set_property(extend *entry, const char *key, void *val);
+
+extend *get_property_slot(extend *entry, extend_slots *slots, int slot);
+void *get_property_val_slot(extend *entry, extend_slots *slots, int slot);
 #endif
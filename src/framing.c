@@ -0,0 +1,312 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* framing.c */
+
+#include "framing.h"
+#include "sock.h"
+#include "http.h"
+#include "utils.h"
+#include "ws_parser.h"
+#include "msgpack.h"
+#include "compress.h"
+#include "log.h"
+
+/*
+	Output framing : a batch of raws is framed in one pass into an iovec set
+	made of the transport blocks (see transport_start()) and of the raws
+	themselves (never copied), then written with one syscall.
+	
+	[headers] [reserved for end()] [open] [begin()] raw [sep] raw ... [close]
+*/
+
+void frame_push(frame_batch *batch, const void *data, size_t len)
+{
+	if (len == 0) {
+		return;
+	}
+	if (batch->n == batch->size) {
+		struct iovec *iov = xmalloc(sizeof(*iov) * batch->size * 2);
+		
+		memcpy(iov, batch->iov, sizeof(*iov) * batch->n);
+		if (batch->iov != batch->iov_stack) {
+			free(batch->iov);
+		}
+		batch->iov = iov;
+		batch->size *= 2;
+	}
+	batch->iov[batch->n].iov_base = (void *)data;
+	batch->iov[batch->n].iov_len = len;
+	batch->n++;
+	batch->len += len;
+}
+
+/* "raw" (one reference) is released once the batch is sent */
+void frame_keep(frame_batch *batch, RAW *raw)
+{
+	if (batch->nraw == batch->raws_size) {
+		RAW **raws = xmalloc(sizeof(*raws) * batch->raws_size * 2);
+		
+		memcpy(raws, batch->raws, sizeof(*raws) * batch->nraw);
+		if (batch->raws != batch->raws_stack) {
+			free(batch->raws);
+		}
+		batch->raws = raws;
+		batch->raws_size *= 2;
+	}
+	batch->raws[batch->nraw++] = raw;
+}
+
+/* Memory living as long as the batch (e.g. per raw headers) */
+char *frame_scratch(frame_batch *batch, size_t len)
+{
+	struct _frame_scratch *scratch = batch->scratch;
+	char *ret;
+	
+	if (scratch == NULL || scratch->len + len > scratch->size) {
+		size_t size = (len > FRAME_SCRATCH_SIZE ? len : FRAME_SCRATCH_SIZE);
+		
+		scratch = xmalloc(sizeof(*scratch) + size);
+		scratch->prev = batch->scratch;
+		scratch->len = 0;
+		scratch->size = size;
+		batch->scratch = scratch;
+	}
+	ret = &scratch->data[scratch->len];
+	scratch->len += len;
+	
+	return ret;
+}
+
+static void frame_headers(frame_batch *batch)
+{
+	struct _transport_framing *framing = batch->framing;
+	ape_socket *client = batch->client;
+	
+	if (!framing->headers.iov_len) {
+		return;
+	}
+	frame_push(batch, framing->headers.iov_base, framing->headers.iov_len);
+	
+	if (client->cors != NULL) {
+		frame_push(batch, client->cors->iov_base, client->cors->iov_len);
+	}
+	
+	/* Content-Encoding goes there */
+	batch->slot = batch->n;
+	frame_push(batch, "\r\n", 2);
+	
+	batch->body = batch->n;
+	batch->body_mark = batch->len;
+	frame_push(batch, framing->preamble.iov_base, framing->preamble.iov_len);
+	
+	if (client->compress.encoding == COMPRESS_NONE) {
+		return;
+	}
+	if (!framing->stream) {
+		batch->encoding = client->compress.encoding;
+	} else if (batch->sub != NULL && client->compress.stream == NULL) {
+		/* kept until the socket is closed (NULL if none is available) */
+		client->compress.stream = compress_stream_get(client->compress.encoding);
+		batch->compress = client->compress.stream;
+	}
+}
+
+void frame_batch_init(frame_batch *batch, ape_socket *client, subuser *sub, transport_t transport, acetables *g_ape)
+{
+	struct _transport_framing *framing = transport_get_framing(client, transport, g_ape);
+	
+	batch->client = client;
+	batch->sub = sub;
+	batch->framing = framing;
+	batch->g_ape = g_ape;
+	
+	batch->iov = batch->iov_stack;
+	batch->n = 0;
+	batch->size = FRAME_BATCH_IOV;
+	batch->len = 0;
+	batch->mark = 0;
+	batch->reserved = -1;
+	batch->count = 0;
+	
+	batch->raws = batch->raws_stack;
+	batch->nraw = 0;
+	batch->raws_size = FRAME_BATCH_IOV;
+	
+	batch->scratch = NULL;
+	
+	batch->compress = NULL;
+	batch->encoding = COMPRESS_NONE;
+	batch->slot = -1;
+	batch->body = 0;
+	batch->body_mark = 0;
+	batch->zout = NULL;
+	
+	if (sub == NULL) {
+		frame_headers(batch);
+	} else if (!sub->headers.sent) {
+		sub->headers.sent = 1;
+		
+		if (sub->headers.content != NULL && framing->headers.iov_len) {
+			/* set by a module : rare, sent apart (and never compressed) */
+			http_send_headers(sub->headers.content, NULL, 0, client, g_ape);
+		} else {
+			frame_headers(batch);
+		}
+	} else {
+		batch->compress = client->compress.stream;
+	}
+	if (framing->end != NULL) {
+		frame_push(batch, batch->head, 1);
+		batch->reserved = batch->n - 1;
+		batch->mark = batch->len;
+	}
+	frame_push(batch, framing->open.iov_base, framing->open.iov_len);
+	
+	if (framing->begin != NULL) {
+		framing->begin(batch);
+	}
+}
+
+/* The batch takes over one reference to "raw" */
+void frame_batch_add(frame_batch *batch, RAW *raw)
+{
+	struct _transport_framing *framing = batch->framing;
+	
+	if (batch->count++) {
+		frame_push(batch, framing->sep.iov_base, framing->sep.iov_len);
+	}
+	if (framing->raw != NULL) {
+		framing->raw(batch, raw);
+	} else {
+		frame_push(batch, raw->data, raw->len);
+	}
+	frame_keep(batch, raw);
+}
+
+/*
+	The body is replaced by its compressed form : the whole response if it
+	is worth it (long polling, JSONP), or what this batch adds to a stream.
+*/
+static void frame_compress(frame_batch *batch)
+{
+	struct _compress_stream *stream = batch->compress;
+	int flush = Z_SYNC_FLUSH;
+	size_t len;
+	
+	if (stream == NULL) {
+		if (batch->encoding == COMPRESS_NONE || batch->n == batch->body || batch->len - batch->body_mark < compress_min_size() ||
+			(stream = compress_stream_get(batch->encoding)) == NULL) {
+			return;
+		}
+		flush = Z_FINISH;
+	}
+	if (batch->slot != -1) {
+		if (stream->encoding == COMPRESS_GZIP) {
+			FRAME_BLOCK(batch->iov[batch->slot], COMPRESS_HEADER_GZIP, sizeof(COMPRESS_HEADER_GZIP) - 1);
+		} else {
+			FRAME_BLOCK(batch->iov[batch->slot], COMPRESS_HEADER_DEFLATE, sizeof(COMPRESS_HEADER_DEFLATE) - 1);
+		}
+	}
+	if (batch->n > batch->body) {
+		batch->zout = compress_iov(stream, &batch->iov[batch->body], batch->n - batch->body, flush, &len);
+		batch->n = batch->body;
+		frame_push(batch, batch->zout, len);
+	}
+	if (flush == Z_FINISH) {
+		compress_stream_release(stream);
+	}
+}
+
+int frame_batch_send(frame_batch *batch)
+{
+	struct _transport_framing *framing = batch->framing;
+	int finish, i;
+	
+	frame_push(batch, framing->close.iov_base, framing->close.iov_len);
+	
+	if (framing->end != NULL) {
+		framing->end(batch);
+	}
+	frame_compress(batch);
+	
+	finish = sendv(batch->client->fd, batch->iov, batch->n, 0, batch->g_ape);
+	
+	for (i = 0; i < batch->nraw; i++) {
+		free_raw(batch->raws[i]);
+	}
+	while (batch->scratch != NULL) {
+		struct _frame_scratch *prev = batch->scratch->prev;
+		
+		free(batch->scratch);
+		batch->scratch = prev;
+	}
+	free(batch->zout);
+	
+	if (batch->iov != batch->iov_stack) {
+		free(batch->iov);
+	}
+	if (batch->raws != batch->raws_stack) {
+		free(batch->raws);
+	}
+	
+	return finish;
+}
+
+static void frame_reserved(frame_batch *batch, unsigned int len)
+{
+	batch->iov[batch->reserved].iov_len = len;
+	batch->len += len - 1;
+}
+
+/* RFC 6455 (or draft 06) text frame holding the whole batch */
+void frame_websocket_end(frame_batch *batch)
+{
+	websocket_state *websocket = batch->client->parser.data;
+	
+	frame_reserved(batch, ws_frame_header(batch->head, (websocket->version == WS_IETF_06 ? 0x84 : WS_FIN | WS_OP_TEXT), batch->len - batch->mark));
+}
+
+/* MessagePack form of the raw, transcoded once for all its binary recipients */
+void frame_msgpack_raw(frame_batch *batch, RAW *raw)
+{
+	size_t len;
+	
+	if (raw->bin == NULL) {
+		if ((raw->bin = msgpack_from_json(raw->data, raw->len, &len)) == NULL) {
+			alog_warn("Raw is not valid JSON, sent as nil to binary clients");
+			raw->bin = xmalloc(1);
+			raw->bin[0] = (char)0xc0;
+			len = 1;
+		}
+		raw->bin_len = len;
+	}
+	frame_push(batch, raw->bin, raw->bin_len);
+}
+
+/* Binary frame holding a MessagePack array of the raws */
+void frame_msgpack_end(frame_batch *batch)
+{
+	unsigned char array_head[5];
+	unsigned int array_len = msgpack_array_header(array_head, batch->count);
+	unsigned int len = ws_frame_header(batch->head, WS_FIN | WS_OP_BINARY, batch->len - batch->mark + array_len);
+	
+	memcpy(&batch->head[len], array_head, array_len);
+	frame_reserved(batch, len + array_len);
+}
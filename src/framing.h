@@ -0,0 +1,98 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* framing.h */
+
+#ifndef _FRAMING_H
+#define _FRAMING_H
+
+#include "main.h"
+#include "users.h"
+#include "raw.h"
+#include "transports.h"
+
+#define FRAME_BATCH_IOV 64 /* iovecs (and raws) kept on the stack */
+#define FRAME_SCRATCH_SIZE 2048
+
+struct _frame_scratch {
+	struct _frame_scratch *prev;
+	size_t len;
+	size_t size;
+	char data[];
+};
+
+/*
+	A response being framed : every block, raw and per-raw header is an
+	iovec, the whole batch is written with a single writev().
+*/
+typedef struct _frame_batch frame_batch;
+struct _frame_batch {
+	ape_socket *client;
+	subuser *sub; /* NULL for a raw sent inline */
+	struct _transport_framing *framing;
+	acetables *g_ape;
+	
+	struct iovec *iov;
+	int n;
+	int size;
+	
+	size_t len; /* bytes framed */
+	size_t mark; /* "len" when the slot filled by end() was reserved */
+	int reserved; /* that slot, -1 if none */
+	
+	int count; /* raws framed */
+	
+	struct RAW **raws; /* released once sent */
+	int nraw;
+	int raws_size;
+	
+	/* HTTP compression, see frame_compress() */
+	struct _compress_stream *compress; /* stream of the response, if any */
+	int encoding; /* whole response to compress, if large enough */
+	int slot; /* blank line ending the headers, -1 if not sent */
+	int body; /* first iovec of the body */
+	size_t body_mark; /* "len" at the start of the body */
+	char *zout;
+	
+	struct _frame_scratch *scratch;
+	unsigned char head[16]; /* written by end() */
+	
+	struct iovec iov_stack[FRAME_BATCH_IOV];
+	struct RAW *raws_stack[FRAME_BATCH_IOV];
+};
+
+void frame_batch_init(frame_batch *batch, ape_socket *client, subuser *sub, transport_t transport, acetables *g_ape);
+void frame_batch_add(frame_batch *batch, RAW *raw);
+int frame_batch_send(frame_batch *batch);
+
+void frame_push(frame_batch *batch, const void *data, size_t len);
+void frame_keep(frame_batch *batch, RAW *raw);
+char *frame_scratch(frame_batch *batch, size_t len);
+
+void frame_websocket_end(frame_batch *batch);
+void frame_msgpack_raw(frame_batch *batch, RAW *raw);
+void frame_msgpack_end(frame_batch *batch);
+
+#define FRAME_BLOCK(block, str, n) \
+	do { \
+		(block).iov_base = (void *)(str); \
+		(block).iov_len = (n); \
+	} while(0)
+
+#endif
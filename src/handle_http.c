@@ -32,6 +32,13 @@
 #include "md5.h"
 #include "sha1.h"
 #include "base64.h"
+#include "metrics.h"
+#include "ws_parser.h"
+#include "compress.h"
+#include "cors.h"
+#include "static_files.h"
+#include "realip.h"
+#include "msgpack.h"
 
 /* Websocket GUID as defined by -07 (since -06) */
 /* http://tools.ietf.org/html/draft-ietf-hybi-thewebsocketprotocol-07 */
@@ -58,11 +65,17 @@ subuser *checkrecv_websocket(ape_socket *co, acetables *g_ape)
 	cget.client = co;
 	cget.ip_get = co->ip_client;
 	cget.get    = websocket->data;
+	cget.json   = NULL;
 	cget.host   = websocket->http->host;
-	cget.hlines = websocket->http->hlines;
+	cget.http   = websocket->http;
+	
+	if (websocket->binary && websocket->opcode == WS_OP_BINARY) {
+		cget.get  = NULL;
+		cget.json = msgpack_to_json(websocket->data, websocket->data_len);
+	}
 
 	op = checkcmd(&cget, (websocket->version == WS_IETF_06 || 
-	                    websocket->version == WS_IETF_07 ? 
+	                    websocket->version == WS_RFC6455 ? 
 	                            TRANSPORT_WEBSOCKET_IETF : TRANSPORT_WEBSOCKET), 
 	              &user, g_ape);
 
@@ -75,6 +88,26 @@ subuser *checkrecv_websocket(ape_socket *co, acetables *g_ape)
 	return user;
 }
 
+/* Is proto one of the comma separated Sec-WebSocket-Protocol tokens ? */
+static int ws_protocol_offered(const char *list, const char *proto)
+{
+	size_t len = strlen(proto);
+	const char *p = list;
+	
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',') {
+			p++;
+		}
+		if (strncmp(p, proto, len) == 0 && (p[len] == '\0' || p[len] == ',' || p[len] == ' ' || p[len] == '\t')) {
+			return 1;
+		}
+		while (*p != '\0' && *p != ',') {
+			p++;
+		}
+	}
+	return 0;
+}
+
 /* 
 	WebSockets protocol rev 76 (Opening handshake)
 	http://tools.ietf.org/html/draft-hixie-thewebsocketprotocol-76 
@@ -135,6 +168,21 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 		return NULL;
 	}
 	
+	realip_http(co, http);
+
+	if (http->type == HTTP_OPTIONS) {
+		cors_preflight(co, http, g_ape);
+		return NULL;
+	}
+	
+	if (metrics_http(co, http->uri, g_ape)) {
+		return NULL;
+	}
+	
+	if (static_files_http(co, http, g_ape)) {
+		return NULL;
+	}
+	
 	if (gettransport(http->uri) == TRANSPORT_WEBSOCKET) {
 		ws_version version = WS_OLD;
 
@@ -142,14 +190,16 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 		unsigned char md5sum[16];
 		char *wsaccept = NULL;
 				
-		char *origin = get_header_line(http->hlines, "Origin");
-		char *key1 = get_header_line(http->hlines, "Sec-WebSocket-Key1");
-		char *key2 = get_header_line(http->hlines, "Sec-WebSocket-Key2");
-		char *keybase = get_header_line(http->hlines, "Sec-WebSocket-Key");
-		char *ws_version = get_header_line(http->hlines, "Sec-WebSocket-Version");
-		char *ws_protocol = get_header_line(http->hlines, "Sec-WebSocket-Protocol");
+		const char *origin = http_header(http, HTTP_HEADER_ORIGIN);
+		const char *key1 = http_header(http, HTTP_HEADER_SEC_WEBSOCKET_KEY1);
+		const char *key2 = http_header(http, HTTP_HEADER_SEC_WEBSOCKET_KEY2);
+		const char *keybase = http_header(http, HTTP_HEADER_SEC_WEBSOCKET_KEY);
+		const char *ws_version = http_header(http, HTTP_HEADER_SEC_WEBSOCKET_VERSION);
+		const char *ws_protocol = http_header(http, HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL);
+		int binary = 0;
 
-		if (origin == NULL && (origin = get_header_line(http->hlines, "Sec-WebSocket-Origin")) == NULL) {
+		/* only browsers send an Origin (optional with RFC 6455) */
+		if (origin == NULL && (origin = http_header(http, HTTP_HEADER_SEC_WEBSOCKET_ORIGIN)) == NULL && keybase == NULL) {
 			shutdown(co->fd, 2);
 			return NULL;
 		}
@@ -170,16 +220,22 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 			
 			md5_finish(&ctx, md5sum);
 		} else if (keybase != NULL) {
-		    if (ws_version != NULL) {
-		        switch(atoi(ws_version)) {
-		            case 6:
-		            default:
-		                version = WS_IETF_06;
-		                break;
-		            case 7:
-		                version = WS_IETF_07;
-		                break;
-		        }
+		    switch(ws_version != NULL ? atoi(ws_version) : 0) {
+		        case 6:
+		            version = WS_IETF_06;
+		            break;
+		        case 7:
+		        case 8:
+		        case 13:
+		            version = WS_RFC6455;
+		            break;
+		        default:
+		            sendbin(co->fd, CONST_STR_LEN(WEBSOCKET_UNSUPPORTED_VERSION), 1, g_ape);
+		            return NULL;
+		    }
+		    if (version == WS_RFC6455 && ws_protocol != NULL && ws_protocol_offered(ws_protocol, MSGPACK_WS_PROTOCOL)) {
+		        ws_protocol = MSGPACK_WS_PROTOCOL;
+		        binary = 1;
 		    }
 		    if ((wsaccept = ws_compute_key(keybase, strlen(keybase))) == NULL) {
 	        	shutdown(co->fd, 2);
@@ -212,7 +268,7 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 		        sendbin(co->fd, http->uri, strlen(http->uri), 0, g_ape);
 			    break;
 		    case WS_IETF_06:
-		    case WS_IETF_07:
+		    case WS_RFC6455:
 			    sendbin(co->fd, CONST_STR_LEN(WEBSOCKET_HARDCODED_HEADERS_IETF), 0, g_ape);
                 sendbin(co->fd, CONST_STR_LEN("Sec-WebSocket-Accept: "), 0, g_ape);
                 sendbin(co->fd, wsaccept, strlen(wsaccept), 0, g_ape);
@@ -233,13 +289,15 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 		co->parser = parser_init_stream(co);
 		websocket = co->parser.data;
 		websocket->http = http; /* keep http data */
+		http_headers_detach(http);
 		websocket->version = version;
+		websocket->binary = binary;
 		switch(version) {
 		    case WS_IETF_06:
 		        websocket->step = WS_STEP_KEY;
 		        break;
-		    case WS_IETF_07:
-		        websocket->step = WS_STEP_START;
+		    case WS_RFC6455:
+		        websocket_start(websocket);
 		        break;
 		    default:
 		        break;		    
@@ -255,11 +313,21 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 		return NULL;
 	}
 	
+	co->compress.encoding = compress_negotiate(http);
+	co->cors = cors_headers(http);
+	
 	cget.client = co;
 	cget.ip_get = co->ip_client;
 	cget.get    = http->data;
+	cget.json   = NULL;
 	cget.host   = http->host;
-	cget.hlines = http->hlines;
+	cget.http   = http;
+	
+	if (http->json != NULL) {
+		cget.get = NULL;
+		cget.json = json_stream_finish(http->json);
+		http->json = NULL;
+	}
 	
 	op = checkcmd(&cget, gettransport(http->uri), &user, g_ape);
 
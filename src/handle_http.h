@@ -30,10 +30,11 @@ subuser *checkrecv_websocket(ape_socket *co, acetables *g_ape);
 
 typedef struct clientget
 {
-	struct _http_header_line *hlines;
+	http_state *http;
 	ape_socket *client;
 	const char *ip_get;
 	const char *get;
+	json_item *json; /* already parsed (streamed body) if "get" is NULL */
 	const char *host;
 } clientget ;
 
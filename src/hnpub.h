@@ -37,28 +37,36 @@ int anchor_cmp(void *a, void *b);
 		}										\
 	} while (0)
 
+/*
+ * Hot properties are read through the owner's slot cache (see extend.h),
+ * a lookup is an array index once the property has been seen.
+ */
+#define GET_APE_SLOT(g_ape, slot)								\
+	get_property_slot(g_ape->properties, &g_ape->slots, slot)
+#define GET_USER_SLOT(user, slot)								\
+	get_property_slot(user->properties, &user->slots, slot)
+
 /*
  * USER TABLE a onlineING user table
  */
 #define MAKE_USER_TBL(g_ape)											\
 	do {																\
-		if (get_property(g_ape->properties, "userlist") == NULL) {		\
+		if (GET_APE_SLOT(g_ape, EXTEND_SLOT_USERLIST) == NULL) {		\
 			add_property(&g_ape->properties, "userlist", hashtbl_init(), NULL, \
 						 EXTEND_HTBL, EXTEND_ISPRIVATE);				\
 		}																\
 	} while (0)
 #define GET_USER_TBL(g_ape)											\
-	(get_property(g_ape->properties, "userlist") != NULL ?			\
-	 (HTBL*)get_property(g_ape->properties, "userlist")->val: NULL)
+	((HTBL*)get_property_val_slot(g_ape->properties, &g_ape->slots, EXTEND_SLOT_USERLIST))
 
 #define SET_USER_FOR_APE(g_ape, uin, user)								\
 	do {																\
-		hashtbl_append(get_property(g_ape->properties, "userlist")->val, \
-					   uin, user);										\
+		MAKE_USER_TBL(g_ape);											\
+		hashtbl_append(GET_USER_TBL(g_ape), uin, user);					\
 	} while (0)
 #define GET_USER_FROM_APE(g_ape, uin)									\
-	(get_property(g_ape->properties, "userlist") != NULL ?				\
-	 (USERS*)hashtbl_seek(get_property(g_ape->properties, "userlist")->val, uin): NULL)
+	(GET_USER_TBL(g_ape) != NULL ?										\
+	 (USERS*)hashtbl_seek(GET_USER_TBL(g_ape), uin): NULL)
 
 
 
@@ -68,26 +76,25 @@ int anchor_cmp(void *a, void *b);
  */
 #define MAKE_ONLINE_TBL(g_ape)											\
 	do {																\
-		if (get_property(g_ape->properties, "onlineuser") == NULL) {	\
+		if (GET_APE_SLOT(g_ape, EXTEND_SLOT_ONLINEUSER) == NULL) {		\
 			add_property(&g_ape->properties, "onlineuser", hashtbl_init(), NULL, \
 						 EXTEND_HTBL, EXTEND_ISPRIVATE);				\
 		}																\
 	} while (0)
 #define GET_ONLINE_TBL(ape)											\
-	(get_property(ape->properties, "onlineuser") != NULL ?			\
-	 (HTBL*)get_property(ape->properties, "onlineuser")->val: NULL)
+	((HTBL*)get_property_val_slot(ape->properties, &ape->slots, EXTEND_SLOT_ONLINEUSER))
 
 #define SET_USER_FOR_ONLINE(ape, uin, user)								\
 	do {																\
-		hashtbl_append(get_property(ape->properties, "onlineuser")->val, \
-					   uin, user);										\
+		MAKE_ONLINE_TBL(ape);											\
+		hashtbl_append(GET_ONLINE_TBL(ape), uin, user);					\
 	} while (0)
 #define GET_USER_FROM_ONLINE(ape, uin)									\
-	(get_property(ape->properties, "onlineuser") != NULL ?				\
-	 hashtbl_seek(get_property(ape->properties, "onlineuser")->val, uin): NULL)
+	(GET_ONLINE_TBL(ape) != NULL ?										\
+	 hashtbl_seek(GET_ONLINE_TBL(ape), uin): NULL)
 #define DEL_USER_FROM_ONLINE(ape, uin)									\
 	do {																\
-		hashtbl_erase(get_property(ape->properties, "onlineuser")->val, uin); \
+		hashtbl_erase(GET_ONLINE_TBL(ape), uin);						\
 	} while (0)
 
 
@@ -98,42 +105,39 @@ int anchor_cmp(void *a, void *b);
  */
 #define ADD_UIN_FOR_USER(user, uin)								\
 	do {														\
-		if (get_property(user->properties, "uin") == NULL) {	\
+		if (GET_USER_SLOT(user, EXTEND_SLOT_UIN) == NULL) {		\
 			add_property(&user->properties, "uin", uin,	NULL,	\
 						 EXTEND_STR, EXTEND_ISPUBLIC);			\
 		}														\
 	} while (0)
 #define GET_UIN_FROM_USER(user)									\
-	(get_property(user->properties, "uin") != NULL ?			\
-	 (char*)get_property(user->properties, "uin")->val: NULL)
+	((char*)get_property_val_slot(user->properties, &user->slots, EXTEND_SLOT_UIN))
 
 #define GET_VHOST_FROM_USER(user)								\
-	(get_property(user->properties, "vhost") != NULL ?			\
-	 (char*)get_property(user->properties, "vhost")->val: "-1")
+	(GET_USER_SLOT(user, EXTEND_SLOT_VHOST) != NULL ?			\
+	 (char*)GET_USER_SLOT(user, EXTEND_SLOT_VHOST)->val: "-1")
 #define INC_VHOST_FOR_USER(user, vhost)						\
 	add_property(&user->properties, "vhost", vhost, NULL,	\
 				 EXTEND_STR, EXTEND_ISPUBLIC);
 
 #define ADD_NICK_FOR_USER(user, nick)							\
 	do {														\
-		if (get_property(user->properties, "nick") == NULL) {	\
+		if (GET_USER_SLOT(user, EXTEND_SLOT_NICK) == NULL) {	\
 			add_property(&user->properties, "nick", nick, NULL,	\
 						 EXTEND_STR, EXTEND_ISPUBLIC);			\
 		}														\
 	} while (0)
 #define GET_NICK_FROM_USER(user)								\
-	(get_property(user->properties, "nick") != NULL ?			\
-	 (char*)get_property(user->properties, "nick")->val: NULL)
+	((char*)get_property_val_slot(user->properties, &user->slots, EXTEND_SLOT_NICK))
 
 #define MAKE_USER_FRIEND_TBL(user)										\
 	do {																\
-		if (get_property(user->properties, "friend") == NULL) {			\
+		if (GET_USER_SLOT(user, EXTEND_SLOT_FRIEND) == NULL) {			\
 			add_property(&user->properties, "friend", hashtbl_init(), NULL, \
 						 EXTEND_HTBL, EXTEND_ISPRIVATE);				\
 		}																\
 	} while (0)
 #define GET_USER_FRIEND_TBL(user)									\
-	(get_property(user->properties, "friend") != NULL ?				\
-	 (HTBL*)get_property(user->properties, "friend")->val: NULL)
+	((HTBL*)get_property_val_slot(user->properties, &user->slots, EXTEND_SLOT_FRIEND))
 
 #endif
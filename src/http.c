@@ -27,6 +27,10 @@
 #include "utils.h"
 #include "dns.h"
 #include "log.h"
+#include "json.h"
+#include "ws_parser.h"
+#include "config.h"
+#include "ticks.h"
 #include <stdlib.h> /* endian macros */
 #include <arpa/inet.h>
 
@@ -55,191 +59,109 @@ struct _http_attach {
 	unsigned short int port;
 };
 
-static struct _http_header_line *parse_header_line(const char *line)
+static unsigned int ws_max_message = WS_MAX_MESSAGE_DEFAULT;
+
+static void websocket_send_close(ape_socket *co, unsigned short int code, acetables *g_ape)
 {
-	unsigned int i;
-	unsigned short int state = 0;
-	struct _http_header_line *hline = NULL;
-	for (i = 0; i < 1024 && line[i] != '\0' && line[i] != '\r' && line[i] != '\n'; i++) {
-		if (i == 0) {
-			hline = xmalloc(sizeof(*hline));
-			hline->key.len = 0;
-			hline->value.len = 0;
-		}
-		switch(state) {
-			case 0:
-				if ((i == 0 && (line[i] == ':' || line[i] == ' ')) || (line[i] == ':' && line[i+1] != ' ') || (i > 63)) {
-					free(hline);
-					return NULL;
-				}
-				if (line[i] == ':') {
-					hline->key.val[hline->key.len] = '\0';
-					state = 1;
-					i++;
-				} else {
-					hline->key.val[hline->key.len++] = line[i];
+	websocket_state *websocket = co->parser.data;
+	unsigned char frame[4] = {WS_FIN | WS_OP_CLOSE, 2, code >> 8, code & 0xFF};
+	
+	websocket->closing = 1;
+	
+	/* the connection is closed once the frame is written */
+	sendbin(co->fd, (char *)frame, 4, 1, g_ape);
+}
+
+static void process_websocket_rfc(ape_socket *co, acetables *g_ape)
+{
+	ape_buffer *buffer = &co->buffer_in;
+	websocket_state *websocket = co->parser.data;
+	ape_parser *parser = &co->parser;
+	unsigned char head[WS_MAX_HEADER];
+	unsigned int length;
+	char saved;
+	
+	while (!websocket->closing) {
+		length = buffer->length;
+		
+		switch(ws_parse(websocket, buffer->data, &length)) {
+			case WS_PARSE_AGAIN:
+				buffer->length = length;
+				return;
+			case WS_PARSE_MESSAGE:
+				saved = buffer->data[websocket->data_len];
+				buffer->data[websocket->data_len] = '\0';
+				parser->onready(parser, g_ape);
+				buffer->data[websocket->data_len] = saved;
+				break;
+			case WS_PARSE_PING:
+				PACK_TCP(co->fd);
+				sendbin(co->fd, (char *)head, ws_frame_header(head, WS_FIN | WS_OP_PONG, websocket->data_len), 0, g_ape);
+				if (websocket->data_len) {
+					sendbin(co->fd, websocket->data, websocket->data_len, 0, g_ape);
 				}
+				FLUSH_TCP(co->fd);
 				break;
-			case 1:
-				hline->value.val[hline->value.len++] = line[i];
+			case WS_PARSE_PONG:
+				break;
+			case WS_PARSE_CLOSE:
+			case WS_PARSE_ERROR:
+				if (websocket->close_code != WS_CLOSE_NORMAL) {
+					alog_info("WebSocket closed by %s (%d)", co->ip_client, websocket->close_code);
+				}
+				websocket_send_close(co, websocket->close_code, g_ape);
 				break;
 		}
 	}
-	if (!state) {
-		free(hline);
-		return NULL;
-	}
-	hline->value.val[hline->value.len] = '\0';
-
-	return hline;
+	buffer->length = 0;
 }
 
-char *get_header_line(struct _http_header_line *lines, const char *key)
+/* Peers which did not send anything (not even a pong) since the last ping are dropped */
+static void websocket_ping(void *params, int *last)
 {
-	while (lines != NULL) {
-		if (strcasecmp(lines->key.val, key) == 0) {
-			return lines->value.val;
+	acetables *g_ape = params;
+	unsigned char frame[2] = {WS_FIN | WS_OP_PING, 0};
+	int i;
+	
+	for (i = 0; i < g_ape->basemem; i++) {
+		ape_socket *co = g_ape->co[i];
+		websocket_state *websocket;
+		
+		if (co == NULL || co->parser.parser_func != process_websocket || co->parser.data == NULL) {
+			continue;
 		}
+		websocket = co->parser.data;
 		
-		lines = lines->next;
+		if (websocket->version != WS_RFC6455 || websocket->closing) {
+			continue;
+		}
+		if (!websocket->alive) {
+			websocket->closing = 1;
+			shutdown(co->fd, 2);
+			continue;
+		}
+		websocket->alive = 0;
+		sendbin(co->fd, (char *)frame, 2, 0, g_ape);
 	}
-	
-	return NULL;
 }
 
-static void process_websocket_frame(ape_socket *co, acetables *g_ape)
+void websocket_init(acetables *g_ape)
 {
-    ape_buffer *buffer = &co->buffer_in;
-    websocket_state *websocket = co->parser.data;
-    ape_parser *parser = &co->parser;
-    
-    unsigned char *pData;
-    
-    for (pData = (unsigned char *)&buffer->data[websocket->offset]; websocket->offset < buffer->length; websocket->offset++, pData++) {
-        switch(websocket->step) {
-            case WS_STEP_KEY:
-                /* Copy the xor key (32 bits) */
-                websocket->key.val[websocket->key.pos] = *pData;
-                if (++websocket->key.pos == 4) {
-                    websocket->step = WS_STEP_DATA;
-                }
-                break;
-            case WS_STEP_START:
-                /* Contain fragmentaiton infos & opcode (+ reserved bits) */
-                websocket->frame_payload.start = *pData;
-
-                websocket->step = WS_STEP_LENGTH;
-                break;
-            case WS_STEP_LENGTH:
-                /* Check for MASK bit */
-                if (!(*pData & 0x80)) {
-                    return;
-                }
-                switch (*pData & 0x7F) { /* 7bit length */
-                    case 126:
-                        /* Following 16bit are length */
-                        websocket->step = WS_STEP_SHORT_LENGTH;
-                        break;
-                    case 127:
-                        /* Following 64bit are length */
-                        websocket->step = WS_STEP_EXTENDED_LENGTH;
-                        break;
-                    default:
-                        /* We have the actual length */
-                        websocket->frame_payload.extended_length = *pData & 0x7F;
-                        websocket->step = WS_STEP_KEY;
-                        break;
-                }
-                break;
-            case WS_STEP_SHORT_LENGTH:
-                memcpy(((char *)&websocket->frame_payload)+(websocket->frame_pos), 
-                        pData, 1);
-                if (websocket->frame_pos == 3) {
-                    websocket->frame_payload.extended_length = ntohs(websocket->frame_payload.short_length);
-                    websocket->step = WS_STEP_KEY;
-                }
-                break;
-            case WS_STEP_EXTENDED_LENGTH:
-                memcpy(((char *)&websocket->frame_payload)+(websocket->frame_pos),
-                        pData, 1);
-                if (websocket->frame_pos == 9) {
-                    websocket->frame_payload.extended_length = ntohl(websocket->frame_payload.extended_length >> 32);
-                    websocket->step = WS_STEP_KEY;
-                }        
-                break;
-            case WS_STEP_DATA:
-                if (websocket->data_pos == 0) {
-                    websocket->data_pos = websocket->offset;
-                }
-                
-                *pData ^= websocket->key.val[(websocket->frame_pos - websocket->data_pos) % 4];
-
-                if (--websocket->frame_payload.extended_length == 0) {
-                    unsigned char saved;
-                    
-                    websocket->data = &buffer->data[websocket->data_pos];
-                    websocket->step = WS_STEP_START;
-                    websocket->frame_pos = -1;
-                    websocket->frame_payload.extended_length = 0;
-                    websocket->data_pos = 0;
-                    websocket->key.pos = 0;
+	int max = atoi(CONFIG_VAL(Server, ws_max_message_size, g_ape->srv));
+	int ping = atoi(CONFIG_VAL(Server, ws_ping_interval, g_ape->srv));
+	
+	if (max > 0) {
+		ws_max_message = max;
+	}
+	add_periodical((ping > 0 ? ping : WS_PING_DEFAULT) * 1000, 0, websocket_ping, g_ape, g_ape);
+}
 
-                    switch(websocket->frame_payload.start & 0x0F) {
-                        case 0x8:
-                        {
-                            /*
-                              Close frame
-                              Reply by a close response
-                            */
-                            char payload_head[2] = { 0x88, 0x00 };
-                            sendbin(co->fd, payload_head, 2, 0, g_ape);
-                            return;
-                        }
-                        case 0x9:
-                        {
-                            int body_length = &buffer->data[websocket->offset+1] - websocket->data;
-                            char payload_head[2] = { 0x8a, body_length & 0x7F };
-                            
-                            /* All control frames MUST be 125 bytes or less */
-                            if (body_length > 125) {
-                                payload_head[0] = 0x88;
-                                payload_head[1] = 0x00;      
-                                sendbin(co->fd, payload_head, 2, 1, g_ape);
-                                return;
-                            }
-                            PACK_TCP(co->fd);
-                            sendbin(co->fd, payload_head, 2, 0, g_ape);
-                            if (body_length) {
-                                sendbin(co->fd, websocket->data, body_length, 0, g_ape);
-                            }
-                            FLUSH_TCP(co->fd);
-                            break;
-                        }
-                        case 0xA: /* Never called as long as we never ask for pong */
-                            break;
-                        default:
-                            /* Data frame */
-                            saved = buffer->data[websocket->offset+1];
-                            buffer->data[websocket->offset+1] = '\0';
-                            parser->onready(parser, g_ape);
-                            buffer->data[websocket->offset+1] = saved;                            
-                            break;
-                    }
-                    
-                    if (websocket->offset+1 == buffer->length) {
-                        websocket->offset = 0;
-                        buffer->length = 0;
-                        websocket->frame_pos = 0;
-                        websocket->key.pos = 0;
-                        return;
-                    }
-                }
-                break;
-            default:
-                break;
-        }
-        websocket->frame_pos++;
-    }
+/* Called once the handshake is sent */
+void websocket_start(websocket_state *websocket)
+{
+	if (websocket->version == WS_RFC6455) {
+		ws_parser_reset(websocket, ws_max_message);
+	}
 }
 
 static void process_websocket_frame_06(ape_socket *co, acetables *g_ape)
@@ -386,6 +308,11 @@ void process_websocket(ape_socket *co, acetables *g_ape)
 		return;
 	}
 	
+	if (websocket->version == WS_RFC6455) {
+		process_websocket_rfc(co, g_ape);
+		return;
+	}
+	
 	if (buffer->length > 502400) {
 		shutdown(co->fd, 2);
 		return;
@@ -395,10 +322,6 @@ void process_websocket(ape_socket *co, acetables *g_ape)
 	    process_websocket_frame_06(co, g_ape);
 	    return;
 	}
-	if (websocket->version == WS_IETF_07) {
-	    process_websocket_frame(co, g_ape);
-	    return;
-	}	
 
 	data[buffer->length - websocket->offset] = '\0';
     
@@ -440,182 +363,55 @@ void process_http(ape_socket *co, acetables *g_ape)
 	http_state *http = co->parser.data;
 	ape_parser *parser = &co->parser;
 	
-	char *data = buffer->data;
-	int pos, read, p = 0;
+	http_parse_status ret;
 	
 	if (buffer->length == 0 || parser->ready == 1 || http->error == 1) {
 		return;
 	}
-
-	/* 0 will be erased by the next read()'ing loop */
-	data[buffer->length] = '\0';
-	
-	data = &data[http->pos];
 	
-	if (*data == '\0') {
-		return;
-	}
+	ret = http_parse(http, buffer->data, buffer->length);
 	
-	/* Update the address of http->data and http->uri if buffer->data has changed (realloc) */
-	if (http->buffer_addr != NULL && buffer->data != http->buffer_addr) {
-		if (http->data != NULL) http->data = &buffer->data[(void *)http->data - (void *)http->buffer_addr];
-		if (http->uri != NULL) http->uri = &buffer->data[(void *)http->uri - (void *)http->buffer_addr];
-		http->buffer_addr = buffer->data;
+	/* POST bodies are commands : feed the JSON parser as bytes arrive and drop them */
+	if (http->type == HTTP_POST && http->body && (ret == HTTP_PARSE_AGAIN || ret == HTTP_PARSE_DONE)) {
+		if (http->json == NULL) {
+			http->json = json_stream_new();
+		}
+		json_stream_feed(http->json, &buffer->data[http->body], http->body_len);
+		buffer->length = http_body_discard(http, buffer->data, buffer->length);
 	}
 	
-	switch(http->step) {
-		case 0:
-			pos = seof(data, '\n');
-			if (pos == -1) {
-				return;
-			}
+	switch(ret) {
+		case HTTP_PARSE_AGAIN:
+			return;
+		case HTTP_PARSE_DONE:
+			parser->ready = 1;
+			urldecode(http->uri);
 			
-			switch(*(unsigned int *)data) {
-#ifdef _LITTLE_ENDIAN
-				case 0x20544547: /* GET + space */
-#endif
-#ifdef _BIG_ENDIAN
-				case 0x47455420: /* GET + space */
-#endif
-					http->type = HTTP_GET;
-					p = 4;
-					break;
-#ifdef _LITTLE_ENDIAN
-				case 0x54534F50: /* POST */
-#endif
-#ifdef _BIG_ENDIAN
-				case 0x504F5354: /* POST */
-#endif
-					http->type = HTTP_POST;
-					p = 5;
-					break;
-				default:
-					alog_info("Invalid HTTP method in request: %s", data);
-					http->error = 1;
-					shutdown(co->fd, 2);
-					return;
-			}
-			
-			if (data[p] != '/') {
-				http->error = 1;
-				shutdown(co->fd, 2);
-				return;
-			} else {
-				int i = p;
-				while (p++) {
-					switch(data[p]) {
-						case ' ':
-							http->pos = pos;
-							http->step = 1;
-							http->uri = &data[i];
-							http->buffer_addr = buffer->data;
-							data[p] = '\0';
-							process_http(co, g_ape);
-							return;
-						case '?':
-							if (data[p+1] != ' ' && data[p+1] != '\r' && data[p+1] != '\n') {
-								http->buffer_addr = buffer->data;
-								http->data = &data[p+1];
-							}
-							break;
-						case '\r':
-						case '\n':
-						case '\0':
-							alog_info("Invalid line ending in request: %s", data);
-							http->error = 1;
-							shutdown(co->fd, 2);
-							return;
-					}
-				}
-			}
+			parser->onready(parser, g_ape);
+			parser->ready = -1;
+			buffer->length = 0;
+			return;
+		case HTTP_PARSE_EMETHOD:
+			alog_info("Invalid HTTP method in request from %s", co->ip_client);
+			sendbin(co->fd, CONST_STR_LEN(HEADER_BAD_REQUEST), 0, g_ape);
 			break;
-		case 1:
-			pos = seof(data, '\n');
-			if (pos == -1) {
-
-				return;
-			}
-			if (pos == 1 || (pos == 2 && *data == '\r')) {
-				if (http->type == HTTP_GET) {
-					/* Ok, at this point we have a blank line. Ready for GET */
-					buffer->data[http->pos] = '\0';
-					urldecode(http->uri);
-					parser->onready(parser, g_ape);
-					parser->ready = -1;
-					buffer->length = 0;
-					return;
-				} else if (http->type == HTTP_GET_WS) { /* WebSockets handshake needs to read 8 bytes */
-					//urldecode(http->uri);
-					http->contentlength = 8;
-					http->buffer_addr = buffer->data;
-					http->data = &buffer->data[http->pos+(pos)];
-					http->step = 2;
-				} else {
-					/* Content-Length is mandatory in case of POST */
-					if (http->contentlength == 0) {
-						http->error = 1;
-						shutdown(co->fd, 2);
-						return;
-					} else {
-						http->buffer_addr = buffer->data; // save the addr
-						http->data = &buffer->data[http->pos+(pos)];
-						http->step = 2;
-					}
-				}
-			} else {
-				struct _http_header_line *hl;
-
-				if ((hl = parse_header_line(data)) != NULL) {
-					hl->next = http->hlines;
-					http->hlines = hl;
-					if (strcasecmp(hl->key.val, "host") == 0) {
-						http->host = hl->value.val;
-					}
-				}
-				if (http->type == HTTP_POST) {
-					/* looking for content-length instruction */
-					if (pos <= 25 && strncasecmp("content-length: ", data, 16) == 0) {
-						int cl = atoi(&data[16]);
-
-						/* Content-length can't be negative... */
-						if (cl < 1 || cl > MAX_CONTENT_LENGTH) {
-							http->error = 1;
-							shutdown(co->fd, 2);
-							return;
-						}
-						/* At this time we are ready to read "cl" bytes contents */
-						http->contentlength = cl;
-
-					}
-				} else if (http->type == HTTP_GET) {
-					if (strncasecmp("Sec-WebSocket-Key1: ", data, 20) == 0) {
-						http->type = HTTP_GET_WS;
-					}
-				}
-			}
-			http->pos += pos;
-			process_http(co, g_ape);
+		case HTTP_PARSE_EURI:
+			alog_info("Invalid request line from %s", co->ip_client);
+			sendbin(co->fd, CONST_STR_LEN(HEADER_BAD_REQUEST), 0, g_ape);
 			break;
-		case 2:
-			read = buffer->length - http->pos; // data length
-			http->pos += read;
-			http->read += read;
-			
-			if (http->read >= http->contentlength) {
-
-				parser->ready = 1;
-				urldecode(http->uri);
-				/* no more than content-length */
-				buffer->data[http->pos - (http->read - http->contentlength)] = '\0';
-				
-				parser->onready(parser, g_ape);
-				parser->ready = -1;
-				buffer->length = 0;
-			}
+		case HTTP_PARSE_ELENGTH:
+			sendbin(co->fd, CONST_STR_LEN(HEADER_TOO_LARGE), 0, g_ape);
+			break;
+		case HTTP_PARSE_ECHUNK:
+			alog_info("Invalid chunked body from %s", co->ip_client);
+			sendbin(co->fd, CONST_STR_LEN(HEADER_BAD_REQUEST), 0, g_ape);
 			break;
-		default:
+		default: /* malformed headers */
+			sendbin(co->fd, CONST_STR_LEN(HEADER_BAD_REQUEST), 0, g_ape);
 			break;
 	}
+	http->error = 1;
+	shutdown(co->fd, 2);
 }
 
 
@@ -788,15 +584,3 @@ void http_headers_free(http_headers_response *headers)
 	}
 	free(headers);
 }
-
-void free_header_line(struct _http_header_line *line)
-{
-	struct _http_header_line *tline;
-	
-	while (line != NULL) {
-		tline = line->next;
-		free(line);
-		line = tline;
-	}
-}
-
@@ -23,8 +23,12 @@
 #define _HTTP_H
 
 #include "main.h"
+#include "http_parser.h"
 
-#define MAX_CONTENT_LENGTH 51200 // 50kb
+#define MAX_CONTENT_LENGTH 51200 // 50kb, default for Server::max_body_size
+
+#define HEADER_TOO_LARGE "HTTP/1.1 413 Request Entity Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define HEADER_BAD_REQUEST "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
 
 struct _http_headers_fields
 {
@@ -63,29 +67,14 @@ typedef enum {
 } http_method;
 
 
-struct _http_header_line
-{
-	struct {
-		char val[64];
-		unsigned int len;
-	} key;
-	
-	struct {
-		char val[1024];
-		unsigned int len;
-	} value;
-	
-	struct _http_header_line *next;
-};
-
 void process_websocket(ape_socket *co, acetables *g_ape);
+void websocket_init(acetables *g_ape);
+void websocket_start(websocket_state *websocket);
 void process_http(ape_socket *co, acetables *g_ape);
 http_headers_response *http_headers_init(int code, char *detail, int detail_len);
 void http_headers_set_field(http_headers_response *headers, const char *key, int keylen, const char *value, int valuelen);
 int http_send_headers(http_headers_response *headers, const char *default_h, unsigned int default_len, ape_socket *client, acetables *g_ape);
 void http_headers_free(http_headers_response *headers);
-void free_header_line(struct _http_header_line *line);
-char *get_header_line(struct _http_header_line *lines, const char *key);
 
 #endif
 
@@ -0,0 +1,410 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* http_client.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include "http_client.h"
+#include "connpool.h"
+#include "sock.h"
+#include "utils.h"
+
+#define HTTP_CLIENT_MAX_LINE 8192
+#define HTTP_CLIENT_MAX_HEADERS 100
+
+static void http_client_connected(ape_socket *sock, int reused, void *data, acetables *g_ape);
+
+static void http_client_headers_free(http_client_header *header)
+{
+	http_client_header *next;
+	
+	for (; header != NULL; header = next) {
+		next = header->next;
+		
+		free(header->key);
+		free(header->value);
+		free(header);
+	}
+}
+
+static void http_client_free(http_client *req)
+{
+	http_client_headers_free(req->headers);
+	http_client_headers_free(req->response.headers);
+	
+	free(req->method);
+	free(req->host);
+	free(req->path);
+	free(req->body);
+	free(req);
+}
+
+static http_client_header *http_client_header_new(const char *key, size_t key_len, const char *value, size_t value_len)
+{
+	http_client_header *header = xmalloc(sizeof(*header));
+	
+	header->key = xmalloc(sizeof(char) * (key_len + 1));
+	memcpy(header->key, key, key_len);
+	header->key[key_len] = '\0';
+	
+	header->value = xmalloc(sizeof(char) * (value_len + 1));
+	memcpy(header->value, value, value_len);
+	header->value[value_len] = '\0';
+	
+	header->next = NULL;
+	
+	return header;
+}
+
+/* "http://host[:port][/path]" (https isn't supported) */
+http_client *http_client_new(const char *method, const char *url)
+{
+	http_client *req;
+	const char *host, *end, *port;
+	
+	if (strncasecmp(url, "http://", 7) != 0) {
+		return NULL;
+	}
+	host = url + 7;
+	
+	if ((end = strchr(host, '/')) == NULL) {
+		end = host + strlen(host);
+	}
+	if ((port = memchr(host, ':', end - host)) == NULL) {
+		port = end;
+	}
+	if (port == host) {
+		return NULL;
+	}
+	
+	req = xmalloc(sizeof(*req));
+	memset(req, 0, sizeof(*req));
+	
+	req->method = xstrdup(method);
+	req->host = xmalloc(sizeof(char) * (port - host + 1));
+	memcpy(req->host, host, port - host);
+	req->host[port - host] = '\0';
+	
+	req->port = (port != end ? atoi(port + 1) : 80);
+	req->path = xstrdup(*end == '/' ? end : "/");
+	
+	if (req->port <= 0 || req->port > 65535) {
+		http_client_free(req);
+		return NULL;
+	}
+	req->state = HTTP_CLIENT_STATUS;
+	
+	return req;
+}
+
+void http_client_set_header(http_client *req, const char *key, const char *value)
+{
+	http_client_header *header = http_client_header_new(key, strlen(key), value, strlen(value));
+	
+	header->next = req->headers;
+	req->headers = header;
+}
+
+void http_client_set_body(http_client *req, const char *body, size_t len)
+{
+	free(req->body);
+	
+	req->body = xmalloc(sizeof(char) * (len + 1));
+	memcpy(req->body, body, len);
+	req->body_len = len;
+}
+
+static const char *http_client_find_header(http_client_header *header, const char *key)
+{
+	for (; header != NULL; header = header->next) {
+		if (strcasecmp(header->key, key) == 0) {
+			return header->value;
+		}
+	}
+	
+	return NULL;
+}
+
+const char *http_client_get_header(http_client *req, const char *key)
+{
+	return http_client_find_header(req->response.headers, key);
+}
+
+/* Give the connection back (or drop it) and report the end of the request */
+static void http_client_finish(http_client *req, http_client_error error, int reuse, acetables *g_ape)
+{
+	if (req->sock != NULL) {
+		req->sock->attach = NULL;
+		connpool_release(req->sock, reuse, g_ape);
+		req->sock = NULL;
+	}
+	
+	req->on_end(req, error, g_ape);
+	
+	http_client_free(req);
+}
+
+/* Headers are complete : how is the body delimited ? */
+static void http_client_headers_done(http_client *req)
+{
+	const char *value;
+	
+	if (strcasecmp(req->method, "HEAD") == 0 || req->response.status == 204 || req->response.status == 304) {
+		req->state = HTTP_CLIENT_DONE;
+	} else if ((value = http_client_get_header(req, "Transfer-Encoding")) != NULL && strcasestr(value, "chunked") != NULL) {
+		req->state = HTTP_CLIENT_CHUNK_SIZE;
+	} else if ((value = http_client_get_header(req, "Content-Length")) != NULL) {
+		req->remaining = strtoull(value, NULL, 10);
+		req->state = (req->remaining ? HTTP_CLIENT_LENGTH : HTTP_CLIENT_DONE);
+	} else {
+		req->state = HTTP_CLIENT_UNTIL_CLOSE;
+		req->keepalive = 0;
+	}
+	
+	if ((value = http_client_get_header(req, "Connection")) != NULL) {
+		if (strcasestr(value, "close") != NULL) {
+			req->keepalive = 0;
+		} else if (strcasestr(value, "keep-alive") != NULL && req->state != HTTP_CLIENT_UNTIL_CLOSE) {
+			req->keepalive = 1;
+		}
+	}
+}
+
+/* Consume a part of data : returns the number of bytes used, 0 if more data is needed, -1 on error */
+static int http_client_parse(http_client *req, char *data, size_t len, acetables *g_ape)
+{
+	char *eol = NULL;
+	size_t n;
+	
+	switch(req->state) {
+		case HTTP_CLIENT_STATUS:
+		case HTTP_CLIENT_HEADERS:
+		case HTTP_CLIENT_CHUNK_SIZE:
+		case HTTP_CLIENT_TRAILER:
+			if ((eol = memmem(data, len, "\r\n", 2)) == NULL) {
+				return (len > HTTP_CLIENT_MAX_LINE ? -1 : 0);
+			}
+			break;
+		default:
+			break;
+	}
+	
+	switch(req->state) {
+		case HTTP_CLIENT_STATUS:
+			if (eol - data < 12 || strncmp(data, "HTTP/1.", 7) != 0) {
+				return -1;
+			}
+			req->keepalive = (data[7] == '1');
+			req->response.status = atoi(data + 9);
+			req->state = HTTP_CLIENT_HEADERS;
+			
+			return eol - data + 2;
+		case HTTP_CLIENT_HEADERS:
+			if (eol == data) {
+				/* interim response (100 Continue) */
+				if (req->response.status >= 100 && req->response.status < 200) {
+					http_client_headers_free(req->response.headers);
+					req->response.headers = NULL;
+					req->nheaders = 0;
+					req->state = HTTP_CLIENT_STATUS;
+					
+					return 2;
+				}
+				http_client_headers_done(req);
+				
+				if (req->on_response != NULL) {
+					req->on_response(req, g_ape);
+				}
+				
+				return 2;
+			} else {
+				char *sep = memchr(data, ':', eol - data), *value;
+				http_client_header *header;
+				
+				if (sep == NULL || ++req->nheaders > HTTP_CLIENT_MAX_HEADERS) {
+					return -1;
+				}
+				for (value = sep + 1; value < eol && (*value == ' ' || *value == '\t'); value++);
+				
+				header = http_client_header_new(data, sep - data, value, eol - value);
+				header->next = req->response.headers;
+				req->response.headers = header;
+				
+				return eol - data + 2;
+			}
+		case HTTP_CLIENT_LENGTH:
+		case HTTP_CLIENT_CHUNK_DATA:
+			n = (len < req->remaining ? len : req->remaining);
+			
+			if (req->on_data != NULL) {
+				req->on_data(req, data, n, g_ape);
+			}
+			if ((req->remaining -= n) == 0) {
+				req->state = (req->state == HTTP_CLIENT_LENGTH ? HTTP_CLIENT_DONE : HTTP_CLIENT_CHUNK_CRLF);
+			}
+			
+			return n;
+		case HTTP_CLIENT_CHUNK_SIZE:
+		{
+			char *end;
+			
+			req->remaining = strtoull(data, &end, 16);
+			
+			if (end == data) {
+				return -1;
+			}
+			req->state = (req->remaining ? HTTP_CLIENT_CHUNK_DATA : HTTP_CLIENT_TRAILER);
+			
+			return eol - data + 2;
+		}
+		case HTTP_CLIENT_CHUNK_CRLF:
+			if (len < 2) {
+				return 0;
+			}
+			if (data[0] != '\r' || data[1] != '\n') {
+				return -1;
+			}
+			req->state = HTTP_CLIENT_CHUNK_SIZE;
+			
+			return 2;
+		case HTTP_CLIENT_TRAILER:
+			if (eol == data) {
+				req->state = HTTP_CLIENT_DONE;
+			}
+			
+			return eol - data + 2;
+		case HTTP_CLIENT_UNTIL_CLOSE:
+			if (req->on_data != NULL) {
+				req->on_data(req, data, len, g_ape);
+			}
+			
+			return len;
+		default:
+			return -1;
+	}
+}
+
+static void http_client_read(ape_socket *sock, ape_buffer *buf, size_t offset, acetables *g_ape)
+{
+	http_client *req = sock->attach;
+	size_t pos = 0;
+	int n = 0;
+	
+	if (req == NULL) {
+		buf->length = 0;
+		return;
+	}
+	req->received = 1;
+	
+	while (pos < buf->length && req->state != HTTP_CLIENT_DONE && (n = http_client_parse(req, buf->data + pos, buf->length - pos, g_ape)) > 0) {
+		pos += n;
+	}
+	
+	if (n < 0) {
+		buf->length = 0;
+		http_client_finish(req, HTTP_CLIENT_EPROTOCOL, 0, g_ape);
+	} else if (req->state == HTTP_CLIENT_DONE) {
+		/* extra bytes after the response : don't trust this connection */
+		int reuse = (req->keepalive && pos == buf->length);
+		
+		buf->length = 0;
+		http_client_finish(req, HTTP_CLIENT_OK, reuse, g_ape);
+	} else if (pos) {
+		memmove(buf->data, buf->data + pos, buf->length - pos);
+		buf->length -= pos;
+	}
+}
+
+static void http_client_disconnect(ape_socket *sock, acetables *g_ape)
+{
+	http_client *req = sock->attach;
+	
+	if (req == NULL) {
+		return;
+	}
+	if (req->state == HTTP_CLIENT_UNTIL_CLOSE) {
+		http_client_finish(req, HTTP_CLIENT_OK, 0, g_ape);
+	} else if (req->reused && !req->received && !req->retried) {
+		/* the server closed the idle connection as we were using it : retry once */
+		sock->attach = NULL;
+		connpool_release(sock, 0, g_ape);
+		
+		req->sock = NULL;
+		req->retried = 1;
+		connpool_get(req->host, req->port, http_client_connected, req, g_ape);
+	} else {
+		http_client_finish(req, HTTP_CLIENT_ECLOSED, 0, g_ape);
+	}
+}
+
+static void http_client_connected(ape_socket *sock, int reused, void *data, acetables *g_ape)
+{
+	http_client *req = data;
+	http_client_header *header;
+	char *head;
+	size_t len, size;
+	
+	if (sock == NULL) {
+		http_client_finish(req, HTTP_CLIENT_ECONNECT, 0, g_ape);
+		return;
+	}
+	req->sock = sock;
+	req->reused = reused;
+	
+	sock->attach = req;
+	sock->callbacks.on_read = http_client_read;
+	sock->callbacks.on_disconnect = http_client_disconnect;
+	
+	size = strlen(req->method) + strlen(req->path) + strlen(req->host) + 96;
+	for (header = req->headers; header != NULL; header = header->next) {
+		size += strlen(header->key) + strlen(header->value) + 4;
+	}
+	head = xmalloc(sizeof(char) * size);
+	
+	len = sprintf(head, "%s %s HTTP/1.1\r\n", req->method, req->path);
+	
+	if (http_client_find_header(req->headers, "Host") == NULL) {
+		len += (req->port == 80 ? sprintf(head + len, "Host: %s\r\n", req->host) : sprintf(head + len, "Host: %s:%d\r\n", req->host, req->port));
+	}
+	for (header = req->headers; header != NULL; header = header->next) {
+		len += sprintf(head + len, "%s: %s\r\n", header->key, header->value);
+	}
+	if (req->body != NULL && http_client_find_header(req->headers, "Content-Length") == NULL) {
+		len += sprintf(head + len, "Content-Length: %zu\r\n", req->body_len);
+	}
+	len += sprintf(head + len, "\r\n");
+	
+	PACK_TCP(sock->fd);
+	sendbin(sock->fd, head, len, 0, g_ape);
+	if (req->body != NULL) {
+		sendbin(sock->fd, req->body, req->body_len, 0, g_ape);
+	}
+	FLUSH_TCP(sock->fd);
+	
+	free(head);
+}
+
+void http_client_send(http_client *req, acetables *g_ape)
+{
+	connpool_get(req->host, req->port, http_client_connected, req, g_ape);
+}
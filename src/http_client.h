@@ -0,0 +1,97 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* http_client.h */
+
+#ifndef _HTTP_CLIENT_H
+#define _HTTP_CLIENT_H
+
+#include "main.h"
+
+typedef enum {
+	HTTP_CLIENT_OK = 0,
+	HTTP_CLIENT_ECONNECT,	/* host unreachable */
+	HTTP_CLIENT_ECLOSED,	/* connection closed before the end of the response */
+	HTTP_CLIENT_EPROTOCOL	/* malformed response */
+} http_client_error;
+
+typedef enum {
+	HTTP_CLIENT_STATUS,
+	HTTP_CLIENT_HEADERS,
+	HTTP_CLIENT_LENGTH,
+	HTTP_CLIENT_CHUNK_SIZE,
+	HTTP_CLIENT_CHUNK_DATA,
+	HTTP_CLIENT_CHUNK_CRLF,
+	HTTP_CLIENT_TRAILER,
+	HTTP_CLIENT_UNTIL_CLOSE,
+	HTTP_CLIENT_DONE
+} http_client_state;
+
+typedef struct _http_client_header http_client_header;
+struct _http_client_header {
+	char *key;
+	char *value;
+	struct _http_client_header *next;
+};
+
+/*
+	HTTP/1.1 client request running on a pooled connection (see connpool.h).
+	on_response is called once the status and headers are read, on_data for
+	each piece of body (chunked encoding removed), then on_end. The request
+	is freed after on_end.
+*/
+typedef struct _http_client http_client;
+struct _http_client {
+	char *method;
+	char *host;
+	int port;
+	char *path;
+	
+	http_client_header *headers;
+	char *body;
+	size_t body_len;
+	
+	struct {
+		int status;
+		http_client_header *headers;
+	} response;
+	
+	void (*on_response)(http_client *req, acetables *g_ape);
+	void (*on_data)(http_client *req, const char *data, size_t len, acetables *g_ape);
+	void (*on_end)(http_client *req, http_client_error error, acetables *g_ape);
+	void *data;
+	
+	/* private */
+	ape_socket *sock;
+	http_client_state state;
+	unsigned long long remaining; /* body or chunk bytes */
+	unsigned int nheaders;
+	int keepalive;
+	int reused; /* sent on an idle connection */
+	int retried;
+	int received;
+};
+
+http_client *http_client_new(const char *method, const char *url);
+void http_client_set_header(http_client *req, const char *key, const char *value);
+void http_client_set_body(http_client *req, const char *body, size_t len);
+const char *http_client_get_header(http_client *req, const char *key);
+void http_client_send(http_client *req, acetables *g_ape);
+
+#endif
@@ -0,0 +1,573 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+/* http_parser.c */
+
+#include <string.h>
+
+#include "http_parser.h"
+#include "http.h"
+#include "utils.h"
+
+/*
+	Resumable request parser : http->pos is kept across reads so each byte is
+	scanned once. Headers are recorded as offsets into the connection buffer
+	and NUL terminated in place (over ':' and CR/LF), nothing is allocated.
+	
+	Body bytes are decoded (de-chunked) in place at http->body. A caller
+	streaming the body may consume them and call http_body_discard() so the
+	buffer never holds more than one read.
+*/
+
+typedef enum {
+	HTTP_STEP_METHOD = 0,
+	HTTP_STEP_URI,
+	HTTP_STEP_VERSION,
+	HTTP_STEP_LINE,
+	HTTP_STEP_KEY,
+	HTTP_STEP_VALUE_START,
+	HTTP_STEP_VALUE,
+	HTTP_STEP_SKIP, /* ignored line, wait for LF */
+	HTTP_STEP_HEAD_END,
+	HTTP_STEP_BODY,
+	HTTP_STEP_CHUNK_SIZE,
+	HTTP_STEP_CHUNK_EXT, /* extensions, wait for LF */
+	HTTP_STEP_CHUNK_DATA,
+	HTTP_STEP_CHUNK_DATA_END,
+	HTTP_STEP_TRAILER,
+	HTTP_STEP_TRAILER_LINE,
+	HTTP_STEP_TRAILER_END,
+	HTTP_STEP_DONE
+} http_step;
+
+#define HTTP_MAX_METHOD 7
+#define HTTP_MAX_KEY 255
+
+static const struct {
+	const char *name;
+	unsigned int len;
+} known_headers[HTTP_HEADER_KNOWN] = {
+	{CONST_STR_LEN("Host")},
+	{CONST_STR_LEN("Content-Length")},
+	{CONST_STR_LEN("Upgrade")},
+	{CONST_STR_LEN("Origin")},
+	{CONST_STR_LEN("Cookie")},
+	{CONST_STR_LEN("X-Forwarded-For")},
+	{CONST_STR_LEN("Transfer-Encoding")},
+	{CONST_STR_LEN("Sec-WebSocket-Key")},
+	{CONST_STR_LEN("Sec-WebSocket-Key1")},
+	{CONST_STR_LEN("Sec-WebSocket-Key2")},
+	{CONST_STR_LEN("Sec-WebSocket-Version")},
+	{CONST_STR_LEN("Sec-WebSocket-Protocol")},
+	{CONST_STR_LEN("Sec-WebSocket-Origin")},
+	{CONST_STR_LEN("Accept-Encoding")},
+	{CONST_STR_LEN("X-Real-IP")}
+};
+
+void http_parser_reset(http_state *http)
+{
+	memset(http->known, 0, sizeof(http->known));
+	http->nheaders = 0;
+	
+	http->base = NULL;
+	http->head = NULL;
+	http->uri = NULL;
+	http->data = NULL;
+	http->host = NULL;
+	
+	http->pos = 0;
+	http->mark = 0;
+	http->value = 0;
+	http->query = 0;
+	http->body = 0;
+	http->body_len = 0;
+	http->received = 0;
+	http->contentlength = -1;
+	http->chunk = -1;
+	
+	http->max_body = MAX_CONTENT_LENGTH;
+	http->json = NULL;
+	
+	http->step = HTTP_STEP_METHOD;
+	http->type = HTTP_NULL;
+	http->chunked = 0;
+	http->error = 0;
+}
+
+static http_parse_status http_parse_method(http_state *http, const char *data, unsigned int len)
+{
+	if (len == 3 && memcmp(data, "GET", 3) == 0) {
+		http->type = HTTP_GET;
+	} else if (len == 4 && memcmp(data, "POST", 4) == 0) {
+		http->type = HTTP_POST;
+	} else if (len == 7 && memcmp(data, "OPTIONS", 7) == 0) {
+		http->type = HTTP_OPTIONS; /* CORS preflight */
+	} else {
+		return HTTP_PARSE_EMETHOD;
+	}
+	
+	return HTTP_PARSE_AGAIN;
+}
+
+/* "end" is the (already NUL terminated) end of the value */
+static http_parse_status http_parse_header(http_state *http, char *data, unsigned int end)
+{
+	struct _http_header_slice *header = &http->headers[http->nheaders++];
+	const char *key = &data[header->key];
+	int i;
+	
+	header->value = http->value;
+	header->value_len = end - http->value;
+	
+	for (i = 0; i < HTTP_HEADER_KNOWN; i++) {
+		if (header->key_len == known_headers[i].len && strcasecmp(key, known_headers[i].name) == 0) {
+			break;
+		}
+	}
+	
+	/* first occurrence wins */
+	if (i == HTTP_HEADER_KNOWN || http->known[i]) {
+		return HTTP_PARSE_AGAIN;
+	}
+	http->known[i] = http->nheaders;
+	
+	switch(i) {
+		case HTTP_HEADER_CONTENT_LENGTH:
+			if (http->type == HTTP_POST) {
+				int cl = atoi(&data[header->value]);
+				
+				if (cl < 1 || cl > http->max_body) {
+					return HTTP_PARSE_ELENGTH;
+				}
+				http->contentlength = cl;
+			}
+			break;
+		case HTTP_HEADER_TRANSFER_ENCODING:
+			if (http->type == HTTP_POST) {
+				if (strcasecmp(&data[header->value], "chunked") != 0) {
+					return HTTP_PARSE_ECHUNK;
+				}
+				http->chunked = 1;
+			}
+			break;
+		case HTTP_HEADER_SEC_WEBSOCKET_KEY1:
+			/* WebSockets (draft 76) handshake has a 8 bytes body */
+			if (http->type == HTTP_GET) {
+				http->type = HTTP_GET_WS;
+			}
+			break;
+		default:
+			break;
+	}
+	
+	return HTTP_PARSE_AGAIN;
+}
+
+static unsigned short int http_parse_headers_end(http_state *http, unsigned int body)
+{
+	http->body = body;
+	
+	/* chunked wins over Content-Length (RFC 2616 4.4) */
+	if (http->chunked) {
+		http->contentlength = -1;
+		
+		return HTTP_STEP_CHUNK_SIZE;
+	}
+	
+	switch(http->type) {
+		case HTTP_GET:
+			http->contentlength = 0;
+			break;
+		case HTTP_GET_WS:
+			http->contentlength = 8;
+			break;
+		default:
+			/* no Content-Length : empty body */
+			if (http->contentlength < 0) {
+				http->contentlength = 0;
+			}
+			break;
+	}
+	
+	return HTTP_STEP_BODY;
+}
+
+static void http_parse_complete(http_state *http, char *data)
+{
+	http->step = HTTP_STEP_DONE;
+	http->base = data;
+	
+	/* no more than content-length */
+	data[http->body + http->body_len] = '\0';
+	http->contentlength = http->received;
+	
+	http->uri = &data[http->type == HTTP_POST ? 5 : (http->type == HTTP_OPTIONS ? 8 : 4)];
+	http->host = http_header(http, HTTP_HEADER_HOST);
+	
+	if (http->type != HTTP_GET) {
+		http->data = &data[http->body];
+	} else if (http->query && data[http->query] != '\0') {
+		http->data = &data[http->query];
+	}
+}
+
+/* Skip to the next CR or LF (hot path : URI, values and ignored lines) */
+static inline unsigned int http_scan_eol(const char *data, unsigned int i, unsigned int length)
+{
+	while (i < length && data[i] != '\r' && data[i] != '\n') {
+		i++;
+	}
+	return i;
+}
+
+static inline int http_hex(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/* Decode "chunked" body data from http->pos, the limit is checked before the chunk is read */
+static http_parse_status http_parse_chunked(http_state *http, char *data, unsigned int length)
+{
+	unsigned int i = http->pos, n;
+	unsigned short int step = http->step;
+	int v;
+	char c;
+	
+	while (i < length) {
+		c = data[i];
+		
+		switch(step) {
+			case HTTP_STEP_CHUNK_SIZE:
+				if ((v = http_hex(c)) != -1) {
+					if (http->chunk > (http->max_body >> 4)) {
+						return HTTP_PARSE_ELENGTH;
+					}
+					http->chunk = (http->chunk == -1 ? v : (http->chunk << 4) | v);
+					break;
+				}
+				if (http->chunk == -1) {
+					return HTTP_PARSE_ECHUNK;
+				}
+				step = HTTP_STEP_CHUNK_EXT;
+				/* fall through */
+			case HTTP_STEP_CHUNK_EXT:
+				if (c != '\n') {
+					break;
+				}
+				if (http->chunk > http->max_body - http->received) {
+					return HTTP_PARSE_ELENGTH;
+				}
+				step = (http->chunk == 0 ? HTTP_STEP_TRAILER : HTTP_STEP_CHUNK_DATA);
+				break;
+			case HTTP_STEP_CHUNK_DATA:
+				n = length - i;
+				if (n > http->chunk) {
+					n = http->chunk;
+				}
+				if (i != http->body + http->body_len) {
+					memmove(&data[http->body + http->body_len], &data[i], n);
+				}
+				http->body_len += n;
+				http->received += n;
+				
+				if ((http->chunk -= n) == 0) {
+					http->chunk = -1;
+					step = HTTP_STEP_CHUNK_DATA_END;
+				}
+				i += n;
+				continue;
+			case HTTP_STEP_CHUNK_DATA_END:
+				if (c == '\n') {
+					step = HTTP_STEP_CHUNK_SIZE;
+				} else if (c != '\r') {
+					return HTTP_PARSE_ECHUNK;
+				}
+				break;
+			case HTTP_STEP_TRAILER:
+				switch(c) {
+					case '\n':
+						http->pos = i + 1;
+						return HTTP_PARSE_DONE;
+					case '\r':
+						step = HTTP_STEP_TRAILER_END;
+						break;
+					default:
+						step = HTTP_STEP_TRAILER_LINE;
+						break;
+				}
+				break;
+			case HTTP_STEP_TRAILER_LINE:
+				if (c == '\n') {
+					step = HTTP_STEP_TRAILER;
+				}
+				break;
+			case HTTP_STEP_TRAILER_END:
+				if (c != '\n') {
+					return HTTP_PARSE_ECHUNK;
+				}
+				http->pos = i + 1;
+				return HTTP_PARSE_DONE;
+			default:
+				break;
+		}
+		i++;
+	}
+	http->pos = i;
+	http->step = step;
+	
+	return HTTP_PARSE_AGAIN;
+}
+
+/* "data" must be writable up to data[length] included */
+http_parse_status http_parse(http_state *http, char *data, unsigned int length)
+{
+	http_parse_status ret;
+	unsigned int i = http->pos, end;
+	unsigned short int step = http->step;
+	char c;
+	
+	if (step == HTTP_STEP_DONE) {
+		return HTTP_PARSE_AGAIN;
+	}
+	
+	while (i < length && step < HTTP_STEP_BODY) {
+		c = data[i];
+		
+		switch(step) {
+			case HTTP_STEP_METHOD:
+				if (c != ' ') {
+					if (i - http->mark >= HTTP_MAX_METHOD) {
+						return HTTP_PARSE_EMETHOD;
+					}
+					break;
+				}
+				if ((ret = http_parse_method(http, &data[http->mark], i - http->mark)) != HTTP_PARSE_AGAIN) {
+					return ret;
+				}
+				http->mark = i + 1;
+				step = HTTP_STEP_URI;
+				break;
+			case HTTP_STEP_URI:
+				if (i == http->mark && c != '/') {
+					return HTTP_PARSE_EURI;
+				}
+				for (; i < length; i++) {
+					c = data[i];
+					
+					if (c == ' ') {
+						data[i] = '\0';
+						step = HTTP_STEP_VERSION;
+						break;
+					} else if (c == '?') {
+						if (!http->query) {
+							http->query = i + 1;
+						}
+					} else if (c == '\r' || c == '\n' || c == '\0') {
+						return HTTP_PARSE_EURI;
+					}
+				}
+				if (i == length) {
+					continue;
+				}
+				break;
+			case HTTP_STEP_VERSION:
+			case HTTP_STEP_SKIP:
+				if ((i = http_scan_eol(data, i, length)) == length) {
+					continue;
+				}
+				if (data[i] == '\n') {
+					step = HTTP_STEP_LINE;
+				}
+				break;
+			case HTTP_STEP_LINE:
+				switch(c) {
+					case '\r':
+						step = HTTP_STEP_HEAD_END;
+						break;
+					case '\n':
+						step = http_parse_headers_end(http, i + 1);
+						break;
+					case ' ':
+					case '\t':
+					case ':':
+						/* folded or invalid line */
+						step = HTTP_STEP_SKIP;
+						break;
+					default:
+						http->mark = i;
+						step = HTTP_STEP_KEY;
+						break;
+				}
+				break;
+			case HTTP_STEP_KEY:
+				switch(c) {
+					case ':':
+						if (i - http->mark > HTTP_MAX_KEY) {
+							step = HTTP_STEP_SKIP;
+							break;
+						}
+						if (http->nheaders == HTTP_MAX_HEADERS) {
+							return HTTP_PARSE_EHEAD;
+						}
+						data[i] = '\0';
+						http->headers[http->nheaders].key = http->mark;
+						http->headers[http->nheaders].key_len = i - http->mark;
+						step = HTTP_STEP_VALUE_START;
+						break;
+					case '\n':
+						step = HTTP_STEP_LINE;
+						break;
+					case '\r':
+					case ' ':
+					case '\t':
+						step = HTTP_STEP_SKIP;
+						break;
+				}
+				break;
+			case HTTP_STEP_VALUE_START:
+				if (c == ' ' || c == '\t') {
+					break;
+				}
+				http->value = i;
+				step = HTTP_STEP_VALUE;
+				/* fall through */
+			case HTTP_STEP_VALUE:
+				if ((i = http_scan_eol(data, i, length)) == length) {
+					continue;
+				}
+				c = data[i];
+				
+				for (end = i; end > http->value && (data[end-1] == ' ' || data[end-1] == '\t'); end--);
+				data[end] = '\0';
+				
+				if ((ret = http_parse_header(http, data, end)) != HTTP_PARSE_AGAIN) {
+					return ret;
+				}
+				step = (c == '\r' ? HTTP_STEP_SKIP : HTTP_STEP_LINE);
+				break;
+			case HTTP_STEP_HEAD_END:
+				if (c != '\n') {
+					return HTTP_PARSE_EHEAD;
+				}
+				step = http_parse_headers_end(http, i + 1);
+				break;
+			default:
+				break;
+		}
+		i++;
+	}
+	http->pos = i;
+	http->step = step;
+	
+	if (step < HTTP_STEP_BODY) {
+		return HTTP_PARSE_AGAIN;
+	}
+	if (step == HTTP_STEP_BODY) {
+		unsigned int n = length - i;
+		
+		if (n > http->contentlength - http->received) {
+			n = http->contentlength - http->received;
+		}
+		http->pos += n;
+		http->body_len += n;
+		http->received += n;
+		
+		if (http->received < http->contentlength) {
+			return HTTP_PARSE_AGAIN;
+		}
+	} else if ((ret = http_parse_chunked(http, data, length)) != HTTP_PARSE_DONE) {
+		return ret;
+	}
+	http_parse_complete(http, data);
+	
+	return HTTP_PARSE_DONE;
+}
+
+/* Drop the body bytes already consumed by the caller, returns the new buffer length */
+unsigned int http_body_discard(http_state *http, char *data, unsigned int length)
+{
+	unsigned int left = length - http->pos;
+	
+	if (http->body == 0 || http->step == HTTP_STEP_DONE) {
+		return length;
+	}
+	if (left) {
+		memmove(&data[http->body], &data[http->pos], left);
+	}
+	http->pos = http->body;
+	http->body_len = 0;
+	
+	return http->body + left;
+}
+
+/* Copy the request head out of the connection buffer (kept past the request, e.g. WebSockets) */
+void http_headers_detach(http_state *http)
+{
+	if (http->base == NULL || http->head != NULL) {
+		return;
+	}
+	http->head = xmalloc(sizeof(char) * (http->body + 1));
+	memcpy(http->head, http->base, http->body);
+	http->head[http->body] = '\0';
+	
+	http->uri = &http->head[http->uri - http->base];
+	
+	if (http->host != NULL) {
+		http->host = &http->head[http->host - http->base];
+	}
+	if (http->data != NULL && http->data < &http->base[http->body]) {
+		http->data = &http->head[http->data - http->base];
+	} else {
+		http->data = NULL;
+	}
+	http->base = http->head;
+}
+
+const char *http_header(http_state *http, http_header_id id)
+{
+	if (http == NULL || http->base == NULL || !http->known[id]) {
+		return NULL;
+	}
+	
+	return HTTP_HEADER_VALUE(http, http->known[id] - 1);
+}
+
+const char *http_header_find(http_state *http, const char *key)
+{
+	int i;
+	
+	if (http == NULL || http->base == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < http->nheaders; i++) {
+		if (strcasecmp(HTTP_HEADER_KEY(http, i), key) == 0) {
+			return HTTP_HEADER_VALUE(http, i);
+		}
+	}
+	
+	return NULL;
+}
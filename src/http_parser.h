@@ -0,0 +1,49 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+/* http_parser.h */
+
+#ifndef _HTTP_PARSER_H
+#define _HTTP_PARSER_H
+
+#include "main.h"
+
+typedef enum {
+	HTTP_PARSE_AGAIN = 0, /* wait for more data */
+	HTTP_PARSE_DONE,
+	HTTP_PARSE_EMETHOD,
+	HTTP_PARSE_EURI,
+	HTTP_PARSE_ELENGTH,
+	HTTP_PARSE_EHEAD,
+	HTTP_PARSE_ECHUNK
+} http_parse_status;
+
+void http_parser_reset(http_state *http);
+http_parse_status http_parse(http_state *http, char *data, unsigned int length);
+unsigned int http_body_discard(http_state *http, char *data, unsigned int length);
+void http_headers_detach(http_state *http);
+
+const char *http_header(http_state *http, http_header_id id);
+const char *http_header_find(http_state *http, const char *key);
+
+#define HTTP_HEADER_KEY(http, i) (&(http)->base[(http)->headers[i].key])
+#define HTTP_HEADER_VALUE(http, i) (&(http)->base[(http)->headers[i].value])
+
+#endif
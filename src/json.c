@@ -191,7 +191,12 @@ static int json_evaluate_string_size(json_item *head)
 	return evalsize;
 }
 
-static int escape_json_string(char *in, char *out, int len)
+/*
+	Escape "len" bytes of "in" into "out" (which must hold 2 * len bytes).
+	Characters are processed front to back, so "out" may start up to "len"
+	bytes before "in" within the same buffer (in-place escaping).
+*/
+int json_escape_string(const char *in, char *out, int len)
 {
 	int i, e;
 	
@@ -264,7 +269,7 @@ struct jsontring *json_to_string(json_item *head, struct jsontring *string, int
 		if (head->jval.vu.str.value != NULL) {
 
 			string->jstring[string->len++] = '"';
-			string->len += escape_json_string(head->jval.vu.str.value, string->jstring + string->len, head->jval.vu.str.length); /* TODO : Add a "escape" argument to json_to_string */	
+			string->len += json_escape_string(head->jval.vu.str.value, string->jstring + string->len, head->jval.vu.str.length); /* TODO : Add a "escape" argument to json_to_string */	
 			string->jstring[string->len++] = '"';
 			
 			if (free_tree) {
@@ -350,7 +355,7 @@ struct jsontring *json_to_string(json_item *head, struct jsontring *string, int
 	return string;
 }
 
-static json_item *init_json_item()
+json_item *init_json_item()
 {
 	
 	json_item *jval = xmalloc(sizeof(*jval));
@@ -820,43 +825,114 @@ static int json_callback(void *ctx, int type, const JSON_value* value)
 	return 1;
 }
 
-json_item *init_json_parser(const char *json_string)
+/* Incremental parser : the tree is built as chunks are fed */
+struct _json_stream {
+	struct JSON_parser_struct *jc;
+	json_context jcx;
+	int error;
+};
+
+json_stream *json_stream_new()
 {
-	const char *pRaw;
 	JSON_config config;
-
-	struct JSON_parser_struct* jc = NULL;
+	json_stream *js = xmalloc(sizeof(*js));
+	
+	js->jcx.key_under = 0;
+	js->jcx.start_depth = 0;
+	js->jcx.head = NULL;
+	js->jcx.current_cx = NULL;
+	js->error = 0;
 	
-	json_context jcx = {0, 0, NULL, NULL};
-
 	init_JSON_config(&config);
 	
 	config.depth		= 15;
 	config.callback		= &json_callback;
-	config.callback_ctx	= &jcx;
+	config.callback_ctx	= &js->jcx;
 	
 	config.allow_comments	= 0;
 	config.handle_floats_manually = 0;
 
-	jc = new_JSON_parser(&config);
+	js->jc = new_JSON_parser(&config);
+	
+	return js;
+}
 
-	for (pRaw = json_string; *pRaw; pRaw++) {
-		if (!JSON_parser_char(jc, *pRaw)) {
-			free_json_item(jcx.head);
-		    delete_JSON_parser(jc);
-		    return NULL;
+/* Returns 0 once the input is invalid (following chunks are ignored) */
+int json_stream_feed(json_stream *js, const char *data, size_t len)
+{
+	size_t i;
+	
+	for (i = 0; i < len && !js->error; i++) {
+		if (!JSON_parser_char(js->jc, (unsigned char)data[i])) {
+			js->error = 1;
 		}
 	}
 	
-	if (!JSON_parser_done(jc)) {
-		free_json_item(jcx.head);
-		delete_JSON_parser(jc);
-		return NULL;
+	return !js->error;
+}
+
+/* Returns the tree (NULL if invalid) and frees "js" */
+json_item *json_stream_finish(json_stream *js)
+{
+	json_item *head = js->jcx.head;
+	
+	if (js->error || !JSON_parser_done(js->jc)) {
+		free_json_item(head);
+		head = NULL;
+	}
+	delete_JSON_parser(js->jc);
+	free(js);
+	
+	return head;
+}
+
+void json_stream_free(json_stream *js)
+{
+	if (js != NULL) {
+		free_json_item(json_stream_finish(js));
 	}
+}
 
+json_item *init_json_parser(const char *json_string)
+{
+	json_stream *js = json_stream_new();
+	
+	json_stream_feed(js, json_string, strlen(json_string));
+	
+	return json_stream_finish(js);
+}
+
+/* Check that the "len" bytes of "str" are a single well-formed JSON value (no tree is built) */
+int json_validate(const char *str, size_t len)
+{
+	size_t i;
+	JSON_config config;
+	struct JSON_parser_struct* jc = NULL;
+	int ret = 1;
+	
+	init_JSON_config(&config);
+	
+	config.depth		= 15;
+	config.callback		= NULL;
+	config.allow_comments	= 0;
+	config.handle_floats_manually = 0;
+
+	jc = new_JSON_parser(&config);
+	
+	for (i = 0; i < len; i++) {
+		if (!JSON_parser_char(jc, (unsigned char)str[i])) {
+			ret = 0;
+			break;
+		}
+	}
+	
+	if (ret && !JSON_parser_done(jc)) {
+		ret = 0;
+	}
+	
 	delete_JSON_parser(jc);
 	
-	return jcx.head;	
+	return ret;
 }
 
 void json_aff(json_item *cx, int depth)
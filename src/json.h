@@ -101,6 +101,8 @@ typedef struct _json_context {
 	
 } json_context;
 
+typedef struct _json_stream json_stream;
+
 
 void set_json(const char *name, const char *value, struct json **jprev);
 struct json *json_copy(struct json *jbase);
@@ -108,8 +110,15 @@ void json_attach(struct json *json_father, struct json *json_child, unsigned int
 void json_concat(struct json *json_father, struct json *json_child);
 void json_free(struct json *jbase);
 json_item *init_json_parser(const char *json_string);
+json_stream *json_stream_new();
+int json_stream_feed(json_stream *js, const char *data, size_t len);
+json_item *json_stream_finish(json_stream *js);
+void json_stream_free(json_stream *js);
+int json_validate(const char *str, size_t len);
+int json_escape_string(const char *in, char *out, int len);
 json_item *json_lookup(json_item *head, char *path);
 void free_json_item(json_item *cx);
+json_item *init_json_item();
 
 json_item *json_new_object();
 json_item *json_new_array();
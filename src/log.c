@@ -24,24 +24,81 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "utils.h"
 #include "log.h"
 #include "main.h"
 #include "config.h"
 
+#define LOG_SLOT_SIZE (MAX_LOG_STR + 256)
+#define LOG_BATCH 64
+
+/*
+	Lines are formatted by the caller directly into a ring slot and written
+	by a background thread with writev(). Producers never block : when the
+	ring is full the line is dropped and counted. An idle writer sleeps on a
+	pipe, written by the producer that publishes while it is asleep.
+	Until ape_log_start() (i.e. before daemonizing), lines are written inline.
+*/
+struct _log_slot {
+	volatile int ready;
+	unsigned int len;
+	char buf[LOG_SLOT_SIZE];
+};
 
 static char *trace_level[LOG_LEVELS] = {"DIE", "MESSAGE", "ERROR", "WARNING", "INFO", "DEBUG", "NOISE"};
-static int dftlv = ALOG_ERROR;
+int ape_log_lv = ALOG_ERROR;
 static int logfd = -1;
+static char *logfile = NULL;
+
+static struct {
+	struct _log_slot *slots;
+	unsigned long size; /* power of 2 */
+	volatile unsigned long head;
+	volatile unsigned long tail;
+	volatile unsigned long dropped;
+	unsigned long reported;
+
+	pthread_t thread;
+	volatile int running;
+	volatile int sleeping;
+	volatile sig_atomic_t reopen;
+	int wakeup[2];
+} ring = {NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, {-1, -1}};
+
+static void log_wakeup()
+{
+	while (write(ring.wakeup[1], "l", 1) == -1 && errno == EINTR);
+}
+
+static void log_sighup(int sign)
+{
+	ring.reopen = 1;
+	log_wakeup();
+}
 
 void ape_log_init(acetables *g_ape)
 {
+	unsigned long size = 1, want;
+	
 	if (CONFIG_VAL(Log, loglevel, g_ape->srv) != NULL) {
 		ape_log_setlv(atoi(CONFIG_VAL(Log, loglevel, g_ape->srv)));
 	}
+
+	want = strtoul(CONFIG_VAL(Log, ring_size, g_ape->srv), NULL, 10);
+	if (want == 0) {
+		want = LOG_RING_SIZE;
+	}
+	while (size < want) {
+		size <<= 1;
+	}
+	ring.size = size;
 	
-	if (CONFIG_VAL(Log, logfile, g_ape->srv) != NULL) {
+	if (*CONFIG_VAL(Log, logfile, g_ape->srv) != '\0') {
 		if (ape_log_open(CONFIG_VAL(Log, logfile, g_ape->srv)) != 1) {
 			printf("\nOpen log file %s failure\n",
 				   CONFIG_VAL(Log, logfile, g_ape->srv));
@@ -59,6 +116,11 @@ int ape_log_open(char *logfname)
 		return 1;
 	}
 
+	if (logfname != logfile) {
+		free(logfile);
+		logfile = xstrdup(logfname);
+	}
+
 	if (strcmp(logfname, "-") == 0) {
 		logfd = 1;
 		return 1;
@@ -73,7 +135,8 @@ int ape_log_open(char *logfname)
 
 int ape_log_reopen(char *logfname)
 {
-	ape_log_done();
+	if (logfd != 1 && logfd != -1)
+		close(logfd);
 	return ape_log_open(logfname);
 }
 
@@ -81,40 +144,242 @@ void ape_log_setlv(int lv)
 {
 	if (lv < 0 || lv > LOG_LEVELS)
 		return;
-	dftlv = lv;
+	ape_log_lv = lv;
+}
+
+unsigned long ape_log_dropped()
+{
+	return ring.dropped;
+}
+
+/* "[%F %H:%M:%S]" formatted once per second (per thread) */
+static int log_timestr(char *out)
+{
+	static __thread time_t last = 0;
+	static __thread char timestr[32];
+	static __thread int tr = 0;
+	time_t t = time(NULL);
+
+	if (t != last) {
+		struct tm tmp;
+
+		localtime_r(&t, &tmp);
+		tr = strftime(timestr, sizeof(timestr), "[%F %H:%M:%S]", &tmp);
+		last = t;
+	}
+	memcpy(out, timestr, tr);
+
+	return tr;
+}
+
+static void log_write(struct iovec *iov, int n)
+{
+	if (logfd != -1 && n > 0) {
+		writev(logfd, iov, n);
+	}
+}
+
+/* Write everything the producers have published, returns the number of lines */
+static int log_flush()
+{
+	struct iovec iov[LOG_BATCH];
+	unsigned long tail = ring.tail, dropped;
+	int n = 0, total = 0;
+
+	while (tail != ring.head) {
+		struct _log_slot *slot = &ring.slots[tail & (ring.size - 1)];
+
+		if (!slot->ready) {
+			break; /* reserved, not yet filled */
+		}
+		__sync_synchronize();
+		iov[n].iov_base = slot->buf;
+		iov[n].iov_len = slot->len;
+		n++;
+		tail++;
+
+		if (n == LOG_BATCH) {
+			break;
+		}
+	}
+
+	if (n) {
+		log_write(iov, n);
+
+		while (ring.tail != tail) {
+			ring.slots[ring.tail & (ring.size - 1)].ready = 0;
+			__sync_synchronize();
+			ring.tail++;
+		}
+		total = n;
+	}
+
+	if ((dropped = ring.dropped) != ring.reported) {
+		char buf[128];
+		struct iovec div;
+		int len = log_timestr(buf);
+
+		div.iov_base = buf;
+		div.iov_len = len + snprintf(buf + len, sizeof(buf) - len, "[WARNING][log] %lu line(s) dropped (ring full)\n", dropped - ring.reported);
+		log_write(&div, 1);
+		ring.reported = dropped;
+	}
+
+	return total;
+}
+
+/* Something to do for the writer */
+static int log_pending()
+{
+	return (ring.reopen || !ring.running || (ring.tail != ring.head && ring.slots[ring.tail & (ring.size - 1)].ready));
+}
+
+static void *log_thread(void *arg)
+{
+	char buf[64];
+
+	while (ring.running || ring.tail != ring.head) {
+		if (ring.reopen) {
+			ring.reopen = 0;
+			ape_log_reopen(logfile);
+		}
+		if (log_flush() == 0) {
+			if (!ring.running) {
+				break;
+			}
+			/* checked again once "sleeping" is visible : a producer either sees it or is seen */
+			ring.sleeping = 1;
+			__sync_synchronize();
+			if (!log_pending()) {
+				while (read(ring.wakeup[0], buf, sizeof(buf)) == -1 && errno == EINTR);
+			}
+			ring.sleeping = 0;
+		}
+	}
+
+	return NULL;
+}
+
+/* Must be called once the process is daemonized (threads don't survive fork()) */
+int ape_log_start()
+{
+	sigset_t set, old;
+
+	if (ring.running || logfd == -1) {
+		return 0;
+	}
+
+	if (pipe(ring.wakeup) == -1) {
+		return 0;
+	}
+	/* producers must never block on a full pipe */
+	fcntl(ring.wakeup[1], F_SETFL, fcntl(ring.wakeup[1], F_GETFL) | O_NONBLOCK);
+
+	ring.slots = xmalloc(sizeof(*ring.slots) * ring.size);
+	memset(ring.slots, 0, sizeof(*ring.slots) * ring.size);
+
+	/* the writer must not catch the process signals */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	ring.running = 1;
+	if (pthread_create(&ring.thread, NULL, log_thread, NULL) != 0) {
+		ring.running = 0;
+		free(ring.slots);
+		ring.slots = NULL;
+		close(ring.wakeup[0]);
+		close(ring.wakeup[1]);
+		ring.wakeup[0] = ring.wakeup[1] = -1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ring.running) {
+		signal(SIGHUP, &log_sighup);
+	}
+
+	return ring.running;
 }
 
 void ape_log_done()
 {
+	if (ring.running) {
+		ring.running = 0;
+		__sync_synchronize();
+		log_wakeup();
+		pthread_join(ring.thread, NULL);
+		free(ring.slots);
+		ring.slots = NULL;
+		close(ring.wakeup[0]);
+		close(ring.wakeup[1]);
+		ring.wakeup[0] = ring.wakeup[1] = -1;
+	}
 	if (logfd != 1 && logfd != -1)
 		close(logfd);
+	logfd = -1;
+
+	free(logfile);
+	logfile = NULL;
+}
+
+static unsigned int log_format(char *buf, const char *func, const char *file, long line,
+			 ape_log_lvl_t level, const char *fmt, va_list ap)
+{
+	int len, r;
+
+	len = log_timestr(buf);
+	r = snprintf(buf + len, LOG_SLOT_SIZE - len, "[%s][%s:%li %s]", trace_level[level], file, line, func);
+	len = MIN(len + r, LOG_SLOT_SIZE - MAX_LOG_STR - 1);
+
+	r = vsnprintf(buf + len, MAX_LOG_STR, fmt, ap);
+	len += MIN(r, MAX_LOG_STR - 1);
+	buf[len++] = '\n';
+
+	return len;
 }
 
 void ape_log(const char *func, const char *file, long line,
 			 ape_log_lvl_t level, const char *fmt, ...)
 {
-	int r, tr, ir;
 	va_list ap;
-	char timestr[32];
-	char infostr[128];
-	char logstr[MAX_LOG_STR];
-	time_t t;
-	struct tm *tmp;
+	unsigned long head;
+	struct _log_slot *slot;
 
-	if (logfd == -1 || level > dftlv)
+	if (logfd == -1 || level > ape_log_lv)
 		return;
 
-	t = time(NULL);
-	tmp = localtime(&t);
-	tr = strftime(timestr, 32, "[%F %H:%M:%S]", tmp);
-	ir = snprintf(infostr, 128, "[%s][%s:%li %s]", trace_level[level], file, line, func);
-
 	va_start(ap, fmt);
-	r = vsnprintf(logstr, MAX_LOG_STR, fmt, ap);
+
+	if (!ring.running) {
+		char buf[LOG_SLOT_SIZE];
+		struct iovec iov;
+
+		iov.iov_base = buf;
+		iov.iov_len = log_format(buf, func, file, line, level, fmt, ap);
+		log_write(&iov, 1);
+
+		va_end(ap);
+		return;
+	}
+
+	/* reserve a slot */
+	do {
+		head = ring.head;
+		if (head - ring.tail >= ring.size) {
+			__sync_fetch_and_add(&ring.dropped, 1);
+			va_end(ap);
+			return;
+		}
+	} while (!__sync_bool_compare_and_swap(&ring.head, head, head + 1));
+
+	slot = &ring.slots[head & (ring.size - 1)];
+	slot->len = log_format(slot->buf, func, file, line, level, fmt, ap);
 	va_end(ap);
 
-	write(logfd, timestr, tr);
-	write(logfd, infostr, ir);
-	write(logfd, logstr, r);
-	write(logfd, "\n", 1);
+	__sync_synchronize();
+	slot->ready = 1;
+
+	__sync_synchronize();
+	if (ring.sleeping) {
+		log_wakeup();
+	}
 }
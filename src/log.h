@@ -28,6 +28,18 @@
 #define MAX_LOG_STR 1024
 #define LOG_LEVELS	7
 
+/* Default number of lines the ring can hold before dropping */
+#define LOG_RING_SIZE 1024
+
+/*
+	Compile-time filter : calls above this level are compiled out
+	(e.g. -DALOG_COMPILE_LEVEL=4 to drop alog_dbg/alog_noise).
+	Values match ape_log_lvl_t.
+*/
+#ifndef ALOG_COMPILE_LEVEL
+#define ALOG_COMPILE_LEVEL 6
+#endif
+
 typedef enum {
 	ALOG_DIE = 0,
 	ALOG_FOO,
@@ -38,25 +50,53 @@ typedef enum {
 	ALOG_NOISE
 } ape_log_lvl_t;
 
+extern int ape_log_lv;
+
 void ape_log_init(acetables *g_ape);
 int ape_log_open(char *logfname);
 int ape_log_reopen(char *logfname);
 void ape_log_setlv(int lv);
+int ape_log_start();
 void ape_log_done();
+unsigned long ape_log_dropped();
+
+#define ALOG_CALL(level,f,...)											\
+	do {																\
+		if (level <= ape_log_lv)										\
+			ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,level,f,##__VA_ARGS__); \
+	} while(0)
+#define ALOG_NONE(f,...) do {} while(0)
 
+/* the writer is drained and joined before exiting : the reason must reach the log */
 #define alog_die(f,...)													\
 	do {																\
 		ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_DIE,f,##__VA_ARGS__); \
+		ape_log_done();													\
 		exit(-1);														\
 	} while(0)
-#define alog_foo(f,...)		ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_FOO,f,##__VA_ARGS__)
-#define alog_err(f,...)		ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_ERROR,f,##__VA_ARGS__)
-#define alog_warn(f,...)	ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_WARNING,f,##__VA_ARGS__)
-#define alog_dbg(f,...)		ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_DEBUG,f,##__VA_ARGS__)
-#define alog_info(f,...)	ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_INFO,f,##__VA_ARGS__)
-#define alog_noise(f,...)	ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_NOISE,f,##__VA_ARGS__)
-
-#define alog_errlog(s)		ape_log(__PRETTY_FUNCTION__,__FILE__,__LINE__,ALOG_ERROR,"%s: %s",s,strerror(errno))
+#define alog_foo(f,...)		ALOG_CALL(ALOG_FOO,f,##__VA_ARGS__)
+#define alog_err(f,...)		ALOG_CALL(ALOG_ERROR,f,##__VA_ARGS__)
+#define alog_warn(f,...)	ALOG_CALL(ALOG_WARNING,f,##__VA_ARGS__)
+
+#if ALOG_COMPILE_LEVEL >= 4
+#define alog_info(f,...)	ALOG_CALL(ALOG_INFO,f,##__VA_ARGS__)
+#else
+#define alog_info(f,...)	ALOG_NONE(f,##__VA_ARGS__)
+#endif
+
+#if ALOG_COMPILE_LEVEL >= 5
+#define alog_dbg(f,...)		ALOG_CALL(ALOG_DEBUG,f,##__VA_ARGS__)
+#else
+#define alog_dbg(f,...)		ALOG_NONE(f,##__VA_ARGS__)
+#endif
+
+#if ALOG_COMPILE_LEVEL >= 6
+#define alog_noise(f,...)	ALOG_CALL(ALOG_NOISE,f,##__VA_ARGS__)
+#else
+#define alog_noise(f,...)	ALOG_NONE(f,##__VA_ARGS__)
+#endif
+
+#define alog_errlog(s)		ALOG_CALL(ALOG_ERROR,"%s: %s",s,strerror(errno))
 
 
 /* Normal logging, printf()-alike */
@@ -31,8 +31,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <sys/uio.h>
 
 #include "hash.h"
+#include "extend.h"
 
 #define MAX_IO 4096
 #define DEFAULT_BUFFER_SIZE 2048
@@ -51,58 +53,116 @@
 
 int server_is_running;
 
-struct _transport_properties {
-	struct {
-		struct {
-			char *val;
-			int len;
-		} left;
-		struct {
-			char *val;
-			int len;
-		} right;
-	} padding;
+struct _frame_batch;
+struct RAW;
+
+/*
+	Output framing of a transport (see framing.c) : blocks built once by
+	transport_start(), optional hooks for what depends on the batch.
+*/
+struct _transport_framing {
+	struct iovec headers; /* HTTP response headers, blank line excluded (none for WebSockets) */
+	struct iovec preamble; /* body sent along with the headers */
+	struct iovec open; /* before the first raw */
+	struct iovec sep; /* between two raws */
+	struct iovec close; /* after the last raw */
+	
+	void (*begin)(struct _frame_batch *batch); /* after "open" */
+	void (*raw)(struct _frame_batch *batch, struct RAW *raw); /* instead of the raw JSON */
+	void (*end)(struct _frame_batch *batch); /* once the batch is complete */
+	
+	int stream; /* response left open : compressed with sync flushes */
 };
 
 struct _ape_transports {
 	struct {
-		struct _transport_properties properties;
+		struct _transport_framing framing;
+	} longpolling;
+	
+	struct {
+		struct _transport_framing framing;
 	} jsonp;
 	
 	struct {
-		struct _transport_properties properties;
+		struct _transport_framing framing;
 	} xhrstreaming;
 	
 	struct {
-		struct _transport_properties properties;
+		struct _transport_framing framing;
+		int history; /* events kept per subuser for Last-Event-ID */
 	} sse;
 	
 	struct {
-		struct _transport_properties properties;
+		struct _transport_framing framing;
 	} websocket;
 	
 	struct {
-	    struct _transport_properties properties;
+		struct _transport_framing framing;
+		struct _transport_framing framing_msgpack; /* "ape.msgpack" subprotocol */
 	} websocket_ietf;
 };
 
+/* Headers indexed while parsing, see http_header() */
+typedef enum {
+	HTTP_HEADER_HOST = 0,
+	HTTP_HEADER_CONTENT_LENGTH,
+	HTTP_HEADER_UPGRADE,
+	HTTP_HEADER_ORIGIN,
+	HTTP_HEADER_COOKIE,
+	HTTP_HEADER_X_FORWARDED_FOR,
+	HTTP_HEADER_TRANSFER_ENCODING,
+	HTTP_HEADER_SEC_WEBSOCKET_KEY,
+	HTTP_HEADER_SEC_WEBSOCKET_KEY1,
+	HTTP_HEADER_SEC_WEBSOCKET_KEY2,
+	HTTP_HEADER_SEC_WEBSOCKET_VERSION,
+	HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL,
+	HTTP_HEADER_SEC_WEBSOCKET_ORIGIN,
+	HTTP_HEADER_ACCEPT_ENCODING,
+	HTTP_HEADER_X_REAL_IP,
+	HTTP_HEADER_KNOWN
+} http_header_id;
+
+#define HTTP_MAX_HEADERS 64
+
+/* Offsets in the request head (NUL terminated in place) */
+struct _http_header_slice
+{
+	unsigned int key;
+	unsigned int value;
+	unsigned short int key_len;
+	unsigned short int value_len;
+};
+
 typedef struct _http_state http_state;
 struct _http_state
 {
-	struct _http_header_line *hlines;
+	struct _http_header_slice headers[HTTP_MAX_HEADERS];
+	unsigned char known[HTTP_HEADER_KNOWN]; /* index + 1 in headers, 0 if missing */
+	unsigned short int nheaders;
 	
+	/* set once the request is complete */
+	char *base; /* connection buffer, or "head" once detached */
+	char *head;
 	char *uri;
-	
-	void *buffer_addr;
 	const char *data;
 	const char *host;
 	
-	int pos;
-	int contentlength;
-	int read;
+	int pos; /* next byte to parse */
+	int mark; /* start of the current token */
+	int value; /* start of the current header value */
+	int query;
+	int body;
+	int body_len; /* decoded body bytes still in the buffer */
+	int received; /* decoded body bytes so far */
+	int contentlength; /* -1 while unknown (chunked) */
+	int chunk; /* left in the current chunk, -1 before its size */
+	int max_body;
+	
+	struct _json_stream *json; /* POST body, parsed as it arrives */
 	
 	unsigned short int step;
-	unsigned short int type; /* HTTP_GET or HTTP_POST */
+	unsigned short int type; /* HTTP_GET, HTTP_POST or HTTP_OPTIONS */
+	unsigned short int chunked;
 	unsigned short int error;
 };
 
@@ -110,7 +170,7 @@ typedef enum {
     WS_OLD,
     WS_76,
     WS_IETF_06,
-    WS_IETF_07
+    WS_RFC6455 /* Sec-WebSocket-Version 7, 8 and 13, see ws_parser.c */
 } ws_version;
 
 typedef enum {
@@ -151,6 +211,21 @@ typedef struct _websocket_state
 	ws_payload_step step;
 	int data_pos;
 	int frame_pos;
+	
+	/* RFC 6455 : the message is reassembled at the start of the buffer */
+	unsigned long long remaining; /* payload left in the current frame */
+	unsigned int msg_len;
+	unsigned int data_len;
+	unsigned int max_message;
+	unsigned int utf8; /* validation state of a text message */
+	unsigned char opcode;
+	unsigned char msg_opcode; /* message being reassembled, 0 if none */
+	unsigned char fin;
+	unsigned char mask_pos;
+	unsigned short int close_code; /* to send, see ws_parse() */
+	unsigned short int closing; /* close frame sent */
+	unsigned short int alive; /* frames received since the last ping */
+	unsigned short int binary; /* "ape.msgpack" subprotocol : MessagePack raws and commands */
 } websocket_state;
 
 typedef enum {
@@ -215,6 +290,7 @@ typedef struct _acetables
 	struct _fdevent *events;
 	struct _ape_socket **co;
 	struct _extend *properties;
+	extend_slots slots;
 	
 	const char *confs_path;
 	
@@ -235,6 +311,8 @@ struct _ape_parser {
 };
 
 typedef struct _ape_socket ape_socket;
+#define APE_IP_LEN 46 /* INET6_ADDRSTRLEN */
+
 struct _ape_socket {
 	struct {
 		void (*on_accept)(struct _ape_socket *client, acetables *g_ape);
@@ -244,18 +322,33 @@ struct _ape_socket {
 		void (*on_read_lf)(struct _ape_socket *client, char *data, acetables *g_ape);
 		void (*on_data_completly_sent)(struct _ape_socket *client, acetables *g_ape);
 		void (*on_write)(struct _ape_socket *client, acetables *g_ape);
+		void (*on_connect_failed)(struct _ape_socket *client, int error, acetables *g_ape); /* see ape_connect_error, on_disconnect if NULL */
 	} callbacks;
 
 	ape_parser parser;
 
 	ape_buffer buffer_in;
 
-	char ip_client[16];
+	char ip_client[APE_IP_LEN]; /* client address, see realip.c */
+	char ip_peer[APE_IP_LEN]; /* TCP peer, or the PROXY protocol source */
+	int proxy_header; /* PROXY protocol header still expected */
 	long int idle;
 
 	void *attach;
 	void *data;
 	
+	struct _ticks_callback *connect_timer; /* pending connect timeout */
+	struct _ape_sock_connect_async *connect_async; /* ape_connect_name() retries */
+	
+	/* HTTP response compression, see compress.c */
+	struct {
+		int encoding; /* accepted by the client */
+		struct _compress_stream *stream; /* kept by a streaming response */
+	} compress;
+	
+	const struct iovec *cors; /* Access-Control-* response headers, see cors.c */
+	struct _static_request *static_request; /* file being read, see static_files.c */
+	
 	int fd;
 	int burn_after_writing;
 	
@@ -266,8 +359,8 @@ struct _ape_socket {
 #define HEADER_DEFAULT "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: text/html\r\n\r\n"
 #define HEADER_DEFAULT_LEN 144
 
-#define HEADER_SSE "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: application/x-dom-event-stream\r\n\r\n"
-#define HEADER_SSE_LEN 165
+#define HEADER_SSE "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: text/event-stream\r\n\r\n"
+#define HEADER_SSE_LEN 152
 
 #define HEADER_XHR "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: application/x-ape-event-stream\r\n\r\n                                                                                                                                                                                                                                                                "
 #define HEADER_XHR_LEN 421
@@ -278,6 +371,7 @@ struct _ape_socket {
 #define WEBSOCKET_HARDCODED_HEADERS_OLD "HTTP/1.1 101 Web Socket Protocol Handshake\r\nUpgrade: WebSocket\r\nConnection: Upgrade\r\n"
 #define WEBSOCKET_HARDCODED_HEADERS_NEW "HTTP/1.1 101 WebSocket Protocol Handshake\r\nUpgrade: WebSocket\r\nConnection: Upgrade\r\n"
 #define WEBSOCKET_HARDCODED_HEADERS_IETF "HTTP/1.1 101 Switching Protocols\r\nUpgrade: WebSocket\r\nConnection: Upgrade\r\n"
+#define WEBSOCKET_UNSUPPORTED_VERSION "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n"
 
 enum {
 	RET_PLUGIN_CONTINUE = 0,
@@ -0,0 +1,453 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* metrics.c */
+
+#include <stdarg.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "utils.h"
+#include "config.h"
+#include "sock.h"
+#include "users.h"
+#include "log.h"
+
+static metric_histo loop_histo, lag_histo;
+
+metric ape_metrics[APE_M_MAX] = {
+	[APE_M_ACCEPTS] = {"ape_accepts_total", "Accepted client sockets", METRIC_COUNTER},
+	[APE_M_CLOSES] = {"ape_closes_total", "Closed sockets", METRIC_COUNTER},
+	[APE_M_BYTES_READ] = {"ape_read_bytes_total", "Bytes read from sockets", METRIC_COUNTER},
+	[APE_M_BYTES_WRITTEN] = {"ape_written_bytes_total", "Bytes written to sockets", METRIC_COUNTER},
+	[APE_M_SEND_EAGAIN] = {"ape_send_eagain_total", "sendbin() calls spilled to the output buffer", METRIC_COUNTER},
+	[APE_M_RAWS_FORGED] = {"ape_raws_forged_total", "Raws forged", METRIC_COUNTER},
+	[APE_M_RAWS_POSTED] = {"ape_raws_posted_total", "Raws queued to subusers", METRIC_COUNTER},
+	[APE_M_RAWS_FLUSHED] = {"ape_raws_flushed_total", "Raws written to clients", METRIC_COUNTER},
+	[APE_M_CMD_UNKNOWN] = {"ape_cmd_unknown_total", "Unknown commands received", METRIC_COUNTER},
+	[APE_M_LOOP_TIME] = {"ape_loop_duration_seconds", "Event loop iteration time (events processing)", METRIC_HISTOGRAM, 0, NULL, &loop_histo},
+	[APE_M_TIMER_LAG] = {"ape_timer_lag_seconds", "Delay between the first timer deadline and the loop wakeup", METRIC_HISTOGRAM, 0, NULL, &lag_histo}
+};
+
+/* Registered metrics (modules, per-command), grouped by name */
+static metric *registry = NULL;
+
+static int metrics_enabled = 0;
+static char *metrics_path = NULL;
+static char *metrics_allow = NULL;
+
+metric *metric_register(const char *name, const char *help, metric_type type, const char *label)
+{
+	metric *m, **prev = &registry, **last = NULL;
+
+	for (m = registry; m != NULL; prev = &m->next, m = m->next) {
+		if (strcmp(m->name, name) == 0) {
+			if ((m->label == NULL && label == NULL) || (m->label != NULL && label != NULL && strcmp(m->label, label) == 0)) {
+				return m;
+			}
+			last = &m->next;
+		}
+	}
+
+	m = xmalloc(sizeof(*m));
+	memset(m, 0, sizeof(*m));
+
+	m->name = name;
+	m->help = help;
+	m->type = type;
+	m->label = (label != NULL ? xstrdup(label) : NULL);
+
+	if (type == METRIC_HISTOGRAM) {
+		m->histo = xmalloc(sizeof(*m->histo));
+		memset(m->histo, 0, sizeof(*m->histo));
+	}
+
+	/* keep the same names together for the exposition format */
+	if (last == NULL) {
+		last = prev;
+	}
+	m->next = *last;
+	*last = m;
+
+	return m;
+}
+
+metric *metric_register_gauge(const char *name, const char *help, long (*collect)(acetables *g_ape))
+{
+	metric *m = metric_register(name, help, METRIC_GAUGE, NULL);
+
+	m->collect = collect;
+
+	return m;
+}
+
+static unsigned int histo_bucket(unsigned long usec)
+{
+	unsigned int octave, sub;
+
+	if (usec < METRIC_HISTO_SUB) {
+		return usec;
+	}
+
+	octave = (sizeof(long) * 8 - 1) - __builtin_clzl(usec); /* floor(log2) */
+	sub = (usec >> (octave - 2)) & (METRIC_HISTO_SUB - 1);
+
+	return MIN((octave - 1) * METRIC_HISTO_SUB + sub, METRIC_HISTO_BUCKETS - 1);
+}
+
+/* Upper bound (usec) of a bucket */
+static unsigned long histo_bound(unsigned int bucket)
+{
+	unsigned int octave = bucket / METRIC_HISTO_SUB + 1, sub = bucket % METRIC_HISTO_SUB;
+
+	if (bucket < METRIC_HISTO_SUB) {
+		return bucket + 1;
+	}
+
+	return (1UL << octave) + ((unsigned long)(sub + 1) << (octave - 2));
+}
+
+void metric_observe(metric *m, unsigned long usec)
+{
+	if (m->histo == NULL) {
+		return;
+	}
+	__sync_fetch_and_add(&m->histo->buckets[histo_bucket(usec)], 1);
+	__sync_fetch_and_add(&m->histo->count, 1);
+	__sync_fetch_and_add(&m->histo->sum, usec);
+}
+
+unsigned long metric_percentile(metric *m, double q)
+{
+	unsigned long want, seen = 0;
+	unsigned int i;
+
+	if (m->histo == NULL || m->histo->count == 0) {
+		return 0;
+	}
+	want = (unsigned long)(q * m->histo->count);
+
+	for (i = 0; i < METRIC_HISTO_BUCKETS; i++) {
+		seen += m->histo->buckets[i];
+		if (seen > want) {
+			return histo_bound(i);
+		}
+	}
+
+	return histo_bound(METRIC_HISTO_BUCKETS - 1);
+}
+
+unsigned long metric_usec_since(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Scrape-time gauges
+ */
+static long gauge_users(acetables *g_ape)
+{
+	return g_ape->nConnected;
+}
+
+static long gauge_bufout_bytes(acetables *g_ape)
+{
+	long total = 0;
+	int i;
+
+	for (i = 0; i < g_ape->basemem; i++) {
+		if (g_ape->bufout[i].buf != NULL) {
+			total += g_ape->bufout[i].buflen;
+		}
+	}
+
+	return total;
+}
+
+static long gauge_raws_queued(acetables *g_ape)
+{
+	USERS *user;
+	subuser *sub;
+	long total = 0;
+
+	for (user = g_ape->uHead; user != NULL; user = user->next) {
+		for (sub = user->subuser; sub != NULL; sub = sub->next) {
+			total += sub->raw_pools.nraw;
+		}
+	}
+
+	return total;
+}
+
+static long gauge_raws_queued_max(acetables *g_ape)
+{
+	USERS *user;
+	subuser *sub;
+	long max = 0;
+
+	for (user = g_ape->uHead; user != NULL; user = user->next) {
+		for (sub = user->subuser; sub != NULL; sub = sub->next) {
+			max = MAX(max, sub->raw_pools.nraw);
+		}
+	}
+
+	return max;
+}
+
+static long gauge_log_dropped(acetables *g_ape)
+{
+	return ape_log_dropped();
+}
+
+void metrics_init(acetables *g_ape)
+{
+	metrics_enabled = (strcmp(CONFIG_VAL(Metrics, enable, g_ape->srv), "no") != 0);
+
+	if (!metrics_enabled) {
+		return;
+	}
+
+	metrics_path = xstrdup(CONFIG_VAL(Metrics, http_path, g_ape->srv));
+	metrics_allow = xstrdup(CONFIG_VAL(Metrics, allow, g_ape->srv));
+
+	if (*metrics_allow == '\0') {
+		free(metrics_allow);
+		metrics_allow = xstrdup("127.0.0.1");
+	}
+
+	metric_register_gauge("ape_users", "Connected users", gauge_users);
+	metric_register_gauge("ape_bufout_bytes", "Bytes waiting in output buffers", gauge_bufout_bytes);
+	metric_register_gauge("ape_raws_queued", "Raws waiting in subusers queues", gauge_raws_queued);
+	metric_register_gauge("ape_raws_queued_max", "Longest subuser queue", gauge_raws_queued_max);
+	metric_register_gauge("ape_log_dropped", "Log lines dropped (ring full)", gauge_log_dropped);
+}
+
+void metrics_free(acetables *g_ape)
+{
+	metric *m = registry, *next;
+
+	while (m != NULL) {
+		next = m->next;
+		free(m->histo);
+		free(m->label);
+		free(m);
+		m = next;
+	}
+	registry = NULL;
+
+	free(metrics_path);
+	free(metrics_allow);
+	metrics_path = metrics_allow = NULL;
+}
+
+/*
+ * Exposition
+ */
+struct _mbuf {
+	char *buf;
+	unsigned int len;
+	unsigned int size;
+};
+
+static void mbuf_printf(struct _mbuf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if (n < b->size - b->len) {
+			b->len += n;
+			return;
+		}
+		b->size = b->size * 2 + n;
+		b->buf = xrealloc(b->buf, b->size);
+	}
+}
+
+static void prometheus_metric(struct _mbuf *b, metric *m, const char *lastname, acetables *g_ape)
+{
+	static const char *types[] = {"counter", "gauge", "histogram"};
+	const char *lbl = (m->label != NULL ? m->label : "");
+
+	if (lastname == NULL || strcmp(lastname, m->name) != 0) {
+		mbuf_printf(b, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, types[m->type]);
+	}
+
+	if (m->type == METRIC_HISTOGRAM) {
+		unsigned long cumul = 0;
+		unsigned int i;
+
+		/*
+			exported on power of 2 boundaries only, buckets are nested.
+			Always the same set of bounds : rate() needs stable series
+		*/
+		for (i = 0; i < METRIC_HISTO_BUCKETS; i++) {
+			cumul += m->histo->buckets[i];
+			if ((i + 1) % METRIC_HISTO_SUB == 0) {
+				mbuf_printf(b, "%s_bucket{%s%sle=\"%g\"} %lu\n", m->name, lbl, (*lbl ? "," : ""),
+					histo_bound(i) / 1e6, cumul);
+			}
+		}
+		mbuf_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", m->name, lbl, (*lbl ? "," : ""), m->histo->count);
+		mbuf_printf(b, "%s_sum%s%s%s %g\n", m->name, (*lbl ? "{" : ""), lbl, (*lbl ? "}" : ""), m->histo->sum / 1e6);
+		mbuf_printf(b, "%s_count%s%s%s %lu\n", m->name, (*lbl ? "{" : ""), lbl, (*lbl ? "}" : ""), m->histo->count);
+	} else {
+		mbuf_printf(b, "%s%s%s%s %ld\n", m->name, (*lbl ? "{" : ""), lbl, (*lbl ? "}" : ""),
+			(m->collect != NULL ? m->collect(g_ape) : m->val));
+	}
+}
+
+/* Prometheus text format (version 0.0.4). Must be free'd */
+char *metrics_prometheus(acetables *g_ape, unsigned int *len)
+{
+	struct _mbuf b = {xmalloc(4096), 0, 4096};
+	const char *lastname = NULL;
+	metric *m;
+	int i;
+
+	for (i = 0; i < APE_M_MAX; i++) {
+		prometheus_metric(&b, &ape_metrics[i], NULL, g_ape);
+	}
+	for (m = registry; m != NULL; m = m->next) {
+		prometheus_metric(&b, m, lastname, g_ape);
+		lastname = m->name;
+	}
+
+	*len = b.len;
+
+	return b.buf;
+}
+
+static void json_metric(json_item *jlist, metric *m, acetables *g_ape)
+{
+	char key[128];
+
+	if (m->label != NULL) {
+		char *pkey;
+		int len = snprintf(key, sizeof(key), "%s{", m->name);
+
+		/* cmd="CONNECT" -> name{cmd=CONNECT} (no quotes in JSON keys) */
+		for (pkey = m->label; *pkey != '\0' && len < sizeof(key) - 2; pkey++) {
+			if (*pkey != '"') {
+				key[len++] = *pkey;
+			}
+		}
+		key[len++] = '}';
+		key[len] = '\0';
+	} else {
+		snprintf(key, sizeof(key), "%s", m->name);
+	}
+
+	if (m->type == METRIC_HISTOGRAM) {
+		json_item *jhisto = json_new_object();
+
+		json_set_property_intZ(jhisto, "count", m->histo->count);
+		json_set_property_intZ(jhisto, "sum_us", m->histo->sum);
+		json_set_property_intZ(jhisto, "p50_us", metric_percentile(m, 0.50));
+		json_set_property_intZ(jhisto, "p99_us", metric_percentile(m, 0.99));
+		json_set_property_intZ(jhisto, "p999_us", metric_percentile(m, 0.999));
+
+		json_set_property_objZ(jlist, key, jhisto);
+	} else {
+		json_set_property_intZ(jlist, key, (m->collect != NULL ? m->collect(g_ape) : m->val));
+	}
+}
+
+json_item *metrics_json(acetables *g_ape)
+{
+	json_item *jlist = json_new_object();
+	metric *m;
+	int i;
+
+	for (i = 0; i < APE_M_MAX; i++) {
+		json_metric(jlist, &ape_metrics[i], g_ape);
+	}
+	for (m = registry; m != NULL; m = m->next) {
+		json_metric(jlist, m, g_ape);
+	}
+
+	return jlist;
+}
+
+static int metrics_allowed(const char *ip)
+{
+	char *allow, *tkn[32];
+	size_t n, i;
+	int ret = 0;
+
+	allow = xstrdup(metrics_allow);
+	n = explode(',', allow, tkn, 31);
+
+	for (i = 0; i <= n; i++) {
+		if (strcmp(trim(tkn[i]), ip) == 0 || strcmp(tkn[i], "*") == 0) {
+			ret = 1;
+			break;
+		}
+	}
+	free(allow);
+
+	return ret;
+}
+
+/* Serve the exposition format on Metrics::http_path (return 1 if the request was handled) */
+int metrics_http(ape_socket *co, const char *uri, acetables *g_ape)
+{
+	char *out, header[256];
+	unsigned int len;
+	int hlen;
+
+	if (!metrics_enabled || metrics_path == NULL || *metrics_path == '\0' || strcmp(uri, metrics_path) != 0) {
+		return 0;
+	}
+
+	if (!metrics_allowed(co->ip_client)) {
+		sendbin(co->fd, CONST_STR_LEN("HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"), 0, g_ape);
+		safe_shutdown(co->fd, g_ape);
+		return 1;
+	}
+
+	out = metrics_prometheus(g_ape, &len);
+
+	hlen = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", len);
+
+	PACK_TCP(co->fd);
+	sendbin(co->fd, header, hlen, 0, g_ape);
+	sendbin(co->fd, out, len, 0, g_ape);
+	FLUSH_TCP(co->fd);
+
+	free(out);
+
+	safe_shutdown(co->fd, g_ape);
+
+	return 1;
+}
+
+/* Used by STATS */
+int metrics_client_allowed(const char *ip)
+{
+	return (metrics_enabled && metrics_allowed(ip));
+}
@@ -0,0 +1,104 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* metrics.h */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include "main.h"
+#include "json.h"
+
+/*
+	Log-linear histogram (HDR-like) : each power of 2 (in usec) is split in
+	METRIC_HISTO_SUB buckets, i.e. ~19% max relative error on percentiles.
+*/
+#define METRIC_HISTO_SUB 4
+#define METRIC_HISTO_OCTAVES 32 /* up to ~71 minutes */
+#define METRIC_HISTO_BUCKETS (METRIC_HISTO_OCTAVES * METRIC_HISTO_SUB)
+
+typedef enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+} metric_type;
+
+typedef struct _metric_histo metric_histo;
+struct _metric_histo {
+	volatile unsigned long buckets[METRIC_HISTO_BUCKETS];
+	volatile unsigned long count;
+	volatile unsigned long sum; /* usec */
+};
+
+typedef struct _metric metric;
+struct _metric {
+	const char *name;
+	const char *help;
+	metric_type type;
+
+	volatile long val;
+	long (*collect)(acetables *g_ape); /* gauges computed on scrape */
+	metric_histo *histo;
+
+	char *label; /* e.g. cmd="CONNECT" */
+	struct _metric *next;
+};
+
+/* Core metrics, always available (even before metrics_init()) */
+typedef enum {
+	APE_M_ACCEPTS,
+	APE_M_CLOSES,
+	APE_M_BYTES_READ,
+	APE_M_BYTES_WRITTEN,
+	APE_M_SEND_EAGAIN,
+	APE_M_RAWS_FORGED,
+	APE_M_RAWS_POSTED,
+	APE_M_RAWS_FLUSHED,
+	APE_M_CMD_UNKNOWN,
+	APE_M_LOOP_TIME,
+	APE_M_TIMER_LAG,
+	APE_M_MAX
+} ape_metric_t;
+
+extern metric ape_metrics[APE_M_MAX];
+
+#define METRIC_ADD(m, n) __sync_fetch_and_add(&(m)->val, (n))
+#define METRIC_INC(m) METRIC_ADD(m, 1)
+
+#define APE_METRIC_ADD(id, n) METRIC_ADD(&ape_metrics[id], n)
+#define APE_METRIC_INC(id) METRIC_ADD(&ape_metrics[id], 1)
+#define APE_METRIC_OBSERVE(id, usec) metric_observe(&ape_metrics[id], usec)
+
+void metrics_init(acetables *g_ape);
+void metrics_free(acetables *g_ape);
+
+metric *metric_register(const char *name, const char *help, metric_type type, const char *label);
+metric *metric_register_gauge(const char *name, const char *help, long (*collect)(acetables *g_ape));
+
+void metric_observe(metric *m, unsigned long usec);
+unsigned long metric_percentile(metric *m, double q);
+
+unsigned long metric_usec_since(struct timespec *start);
+
+char *metrics_prometheus(acetables *g_ape, unsigned int *len);
+json_item *metrics_json(acetables *g_ape);
+int metrics_http(ape_socket *co, const char *uri, acetables *g_ape);
+int metrics_client_allowed(const char *ip);
+
+#endif
@@ -0,0 +1,649 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* msgpack.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "msgpack.h"
+#include "utils.h"
+
+/*
+	MessagePack <-> JSON for the "ape.msgpack" WebSocket subprotocol.
+	
+	Raws are transcoded straight from their JSON text (no tree), containers
+	get a one byte header which is widened once their size is known.
+	Commands are decoded into the same json_item tree the JSON parser builds.
+*/
+
+struct _msgpack_out {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+	
+	const char *p;
+	const char *end;
+	int depth;
+};
+
+struct _msgpack_in {
+	const unsigned char *p;
+	const unsigned char *end;
+	int depth;
+};
+
+static void mp_reserve(struct _msgpack_out *w, size_t n)
+{
+	if (w->len + n > w->size) {
+		w->size = (w->len + n) * 2;
+		w->buf = xrealloc(w->buf, w->size);
+	}
+}
+
+static void mp_put_be(struct _msgpack_out *w, unsigned char type, uint64_t val, int n)
+{
+	mp_reserve(w, n + 1);
+	w->buf[w->len++] = type;
+	while (n--) {
+		w->buf[w->len++] = (val >> (n * 8)) & 0xFF;
+	}
+}
+
+static void mp_put_int(struct _msgpack_out *w, int64_t val)
+{
+	if (val >= 0) {
+		if (val < 128) {
+			mp_put_be(w, val, 0, 0);
+		} else if (val < 256) {
+			mp_put_be(w, 0xcc, val, 1);
+		} else if (val < 65536) {
+			mp_put_be(w, 0xcd, val, 2);
+		} else if (val <= 0xFFFFFFFFLL) {
+			mp_put_be(w, 0xce, val, 4);
+		} else {
+			mp_put_be(w, 0xcf, val, 8);
+		}
+	} else if (val >= -32) {
+		mp_put_be(w, val & 0xFF, 0, 0);
+	} else if (val >= -128) {
+		mp_put_be(w, 0xd0, val & 0xFF, 1);
+	} else if (val >= -32768) {
+		mp_put_be(w, 0xd1, val & 0xFFFF, 2);
+	} else if (val >= -2147483648LL) {
+		mp_put_be(w, 0xd2, val & 0xFFFFFFFF, 4);
+	} else {
+		mp_put_be(w, 0xd3, val, 8);
+	}
+}
+
+static void mp_put_double(struct _msgpack_out *w, double val)
+{
+	union {
+		double d;
+		uint64_t u;
+	} v;
+	
+	v.d = val;
+	mp_put_be(w, 0xcb, v.u, 8);
+}
+
+static void mp_put_str_head(struct _msgpack_out *w, size_t n)
+{
+	if (n < 32) {
+		mp_put_be(w, 0xa0 | n, 0, 0);
+	} else if (n < 256) {
+		mp_put_be(w, 0xd9, n, 1);
+	} else if (n < 65536) {
+		mp_put_be(w, 0xda, n, 2);
+	} else {
+		mp_put_be(w, 0xdb, n, 4);
+	}
+}
+
+/* fixarray/fixmap, 16 or 32 bits count */
+static unsigned int mp_container_head(unsigned char *head, unsigned char fix, unsigned char type16, unsigned int n)
+{
+	if (n < 16) {
+		head[0] = fix | n;
+		return 1;
+	} else if (n < 65536) {
+		head[0] = type16;
+		head[1] = n >> 8;
+		head[2] = n & 0xFF;
+		return 3;
+	}
+	head[0] = type16 + 1;
+	head[1] = n >> 24;
+	head[2] = (n >> 16) & 0xFF;
+	head[3] = (n >> 8) & 0xFF;
+	head[4] = n & 0xFF;
+	
+	return 5;
+}
+
+unsigned int msgpack_array_header(unsigned char *head, unsigned int n)
+{
+	return mp_container_head(head, 0x90, 0xdc, n);
+}
+
+static void mp_skip_ws(struct _msgpack_out *w)
+{
+	while (w->p < w->end && (*w->p == ' ' || *w->p == '\t' || *w->p == '\n' || *w->p == '\r')) {
+		w->p++;
+	}
+}
+
+static int mp_hex4(const char *s, unsigned int *cp)
+{
+	int i;
+	
+	for (*cp = 0, i = 0; i < 4; i++) {
+		char c = s[i];
+		
+		*cp <<= 4;
+		if (c >= '0' && c <= '9') {
+			*cp |= c - '0';
+		} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+			*cp |= (c | 0x20) - 'a' + 10;
+		} else {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int mp_utf8(unsigned char *out, unsigned int cp)
+{
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	} else if (cp < 0x800) {
+		out[0] = 0xC0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	} else if (cp < 0x10000) {
+		out[0] = 0xE0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3F);
+	out[2] = 0x80 | ((cp >> 6) & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
+}
+
+/* \uXXXX (or a surrogate pair) at s, returns the escape length */
+static int mp_unicode_escape(const char *s, const char *end, unsigned int *cp)
+{
+	unsigned int low;
+	
+	if (end - s < 6 || !mp_hex4(s + 2, cp)) {
+		return 0;
+	}
+	if (*cp >= 0xD800 && *cp < 0xDC00 && end - s >= 12 && s[6] == '\\' && s[7] == 'u' && 
+		mp_hex4(s + 8, &low) && low >= 0xDC00 && low < 0xE000) {
+		
+		*cp = 0x10000 + ((*cp - 0xD800) << 10) + (low - 0xDC00);
+		return 12;
+	}
+	return 6;
+}
+
+static int mp_string(struct _msgpack_out *w)
+{
+	const char *q, *start = w->p + 1;
+	unsigned char *out;
+	unsigned int cp;
+	size_t dlen = 0;
+	int escaped = 0, n;
+	
+	/* decoded length first */
+	for (q = start; q < w->end && *q != '"'; ) {
+		if (*q != '\\') {
+			dlen++;
+			q++;
+			continue;
+		}
+		escaped = 1;
+		if (q + 1 >= w->end) {
+			return 0;
+		}
+		switch(q[1]) {
+			case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+				dlen++;
+				q += 2;
+				break;
+			case 'u':
+				if ((n = mp_unicode_escape(q, w->end, &cp)) == 0) {
+					return 0;
+				}
+				dlen += (cp < 0x80 ? 1 : (cp < 0x800 ? 2 : (cp < 0x10000 ? 3 : 4)));
+				q += n;
+				break;
+			default:
+				return 0;
+		}
+	}
+	if (q >= w->end) {
+		return 0;
+	}
+	w->p = q + 1;
+	
+	mp_put_str_head(w, dlen);
+	mp_reserve(w, dlen);
+	
+	if (!escaped) {
+		memcpy(&w->buf[w->len], start, dlen);
+		w->len += dlen;
+		return 1;
+	}
+	for (out = &w->buf[w->len], q = start; *q != '"'; ) {
+		if (*q != '\\') {
+			*out++ = *q++;
+			continue;
+		}
+		switch(q[1]) {
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+				n = mp_unicode_escape(q, w->end, &cp);
+				out += mp_utf8(out, cp);
+				q += n;
+				continue;
+			default:
+				*out++ = q[1];
+				break;
+		}
+		q += 2;
+	}
+	w->len += dlen;
+	
+	return 1;
+}
+
+static int mp_number(struct _msgpack_out *w)
+{
+	const char *q = w->p;
+	uint64_t val = 0;
+	int digits = 0, real = 0, neg = 0, overflow = 0;
+	
+	if (q < w->end && *q == '-') {
+		neg = 1;
+		q++;
+	}
+	for (; q < w->end && *q >= '0' && *q <= '9'; q++, digits++) {
+		if (val > (UINT64_MAX - 9) / 10) {
+			overflow = 1;
+		} else {
+			val = val * 10 + (*q - '0');
+		}
+	}
+	if (!digits) {
+		return 0;
+	}
+	for (; q < w->end && ((*q >= '0' && *q <= '9') || *q == '.' || *q == 'e' || *q == 'E' || *q == '+' || *q == '-'); q++) {
+		real = 1;
+	}
+	if (!real) {
+		/* clamped to int64, as the JSON parser does */
+		if (overflow || val > (uint64_t)INT64_MAX + neg) {
+			val = (uint64_t)INT64_MAX + neg;
+		}
+		mp_put_int(w, (neg ? (int64_t)(0 - val) : (int64_t)val));
+	} else {
+		char tmp[64];
+		char *tend;
+		double real_val;
+		
+		if (q - w->p >= sizeof(tmp)) {
+			return 0;
+		}
+		memcpy(tmp, w->p, q - w->p);
+		tmp[q - w->p] = '\0';
+		
+		real_val = strtod(tmp, &tend);
+		if (*tend != '\0') {
+			return 0;
+		}
+		mp_put_double(w, real_val);
+	}
+	w->p = q;
+	
+	return 1;
+}
+
+static int mp_literal(struct _msgpack_out *w, const char *lit, size_t len, unsigned char type)
+{
+	if (w->end - w->p < len || memcmp(w->p, lit, len) != 0) {
+		return 0;
+	}
+	w->p += len;
+	mp_put_be(w, type, 0, 0);
+	
+	return 1;
+}
+
+static int mp_value(struct _msgpack_out *w);
+
+static int mp_container(struct _msgpack_out *w, int map)
+{
+	char close = (map ? '}' : ']');
+	unsigned char head[5];
+	unsigned int n = 0, hlen;
+	size_t start = w->len;
+	
+	if (++w->depth > MSGPACK_MAX_DEPTH) {
+		return 0;
+	}
+	w->p++;
+	mp_put_be(w, 0, 0, 0); /* header placeholder */
+	
+	mp_skip_ws(w);
+	if (w->p < w->end && *w->p == close) {
+		w->p++;
+	} else {
+		while (1) {
+			if (map) {
+				mp_skip_ws(w);
+				if (w->p >= w->end || *w->p != '"' || !mp_string(w)) {
+					return 0;
+				}
+				mp_skip_ws(w);
+				if (w->p >= w->end || *w->p != ':') {
+					return 0;
+				}
+				w->p++;
+			}
+			if (!mp_value(w)) {
+				return 0;
+			}
+			n++;
+			mp_skip_ws(w);
+			if (w->p >= w->end) {
+				return 0;
+			}
+			if (*w->p == ',') {
+				w->p++;
+			} else if (*w->p == close) {
+				w->p++;
+				break;
+			} else {
+				return 0;
+			}
+		}
+	}
+	hlen = (map ? mp_container_head(head, 0x80, 0xde, n) : mp_container_head(head, 0x90, 0xdc, n));
+	
+	if (hlen > 1) {
+		mp_reserve(w, hlen - 1);
+		memmove(&w->buf[start + hlen], &w->buf[start + 1], w->len - start - 1);
+		w->len += hlen - 1;
+	}
+	memcpy(&w->buf[start], head, hlen);
+	w->depth--;
+	
+	return 1;
+}
+
+static int mp_value(struct _msgpack_out *w)
+{
+	mp_skip_ws(w);
+	
+	if (w->p >= w->end) {
+		return 0;
+	}
+	switch(*w->p) {
+		case '{':
+			return mp_container(w, 1);
+		case '[':
+			return mp_container(w, 0);
+		case '"':
+			return mp_string(w);
+		case 't':
+			return mp_literal(w, "true", 4, 0xc3);
+		case 'f':
+			return mp_literal(w, "false", 5, 0xc2);
+		case 'n':
+			return mp_literal(w, "null", 4, 0xc0);
+		default:
+			return mp_number(w);
+	}
+}
+
+/* NULL if json is not a valid JSON value */
+char *msgpack_from_json(const char *json, size_t len, size_t *outlen)
+{
+	struct _msgpack_out w;
+	
+	w.size = len + 16;
+	w.buf = xmalloc(w.size);
+	w.len = 0;
+	w.p = json;
+	w.end = json + len;
+	w.depth = 0;
+	
+	if (!mp_value(&w) || (mp_skip_ws(&w), w.p != w.end)) {
+		free(w.buf);
+		return NULL;
+	}
+	*outlen = w.len;
+	
+	return (char *)w.buf;
+}
+
+static uint64_t mp_get_be(struct _msgpack_in *r, int n)
+{
+	uint64_t val = 0;
+	
+	while (n--) {
+		val = (val << 8) | *r->p++;
+	}
+	return val;
+}
+
+static char *mp_dup(struct _msgpack_in *r, size_t len)
+{
+	char *str = xmalloc(len + 1);
+	
+	memcpy(str, r->p, len);
+	str[len] = '\0';
+	r->p += len;
+	
+	return str;
+}
+
+/* Length of the str/bin at r->p, -1 if it is something else (or truncated) */
+static int64_t mp_get_str(struct _msgpack_in *r)
+{
+	unsigned char type = *r->p++;
+	int n;
+	int64_t len;
+	
+	if ((type & 0xE0) == 0xa0) {
+		len = type & 0x1F;
+	} else {
+		switch(type) {
+			case 0xc4: case 0xd9: n = 1; break;
+			case 0xc5: case 0xda: n = 2; break;
+			case 0xc6: case 0xdb: n = 4; break;
+			default:
+				return -1;
+		}
+		if (r->end - r->p < n) {
+			return -1;
+		}
+		len = mp_get_be(r, n);
+	}
+	return (r->end - r->p < len ? -1 : len);
+}
+
+static int mp_read(struct _msgpack_in *r, json_item *item)
+{
+	unsigned char type;
+	uint64_t count;
+	int64_t len;
+	int map;
+	
+	if (r->p >= r->end) {
+		return 0;
+	}
+	type = *r->p;
+	
+	if (type <= 0x7f || type >= 0xe0) {
+		item->jval.vu.integer_value = (signed char)type;
+		item->type = JSON_T_INTEGER;
+		r->p++;
+		return 1;
+	}
+	if ((type & 0xE0) == 0xa0 || type == 0xc4 || type == 0xc5 || type == 0xc6 || (type >= 0xd9 && type <= 0xdb)) {
+		if ((len = mp_get_str(r)) < 0) {
+			return 0;
+		}
+		item->jval.vu.str.value = mp_dup(r, len);
+		item->jval.vu.str.length = len;
+		item->type = JSON_T_STRING;
+		return 1;
+	}
+	r->p++;
+	
+	switch(type) {
+		case 0xc0:
+			item->type = JSON_T_NULL;
+			return 1;
+		case 0xc2:
+			item->type = JSON_T_FALSE;
+			return 1;
+		case 0xc3:
+			item->jval.vu.integer_value = 1;
+			item->type = JSON_T_TRUE;
+			return 1;
+		case 0xca:
+		case 0xcb: {
+			union {
+				float f;
+				double d;
+				uint32_t u32;
+				uint64_t u64;
+			} v;
+			
+			if (r->end - r->p < (type == 0xca ? 4 : 8)) {
+				return 0;
+			}
+			if (type == 0xca) {
+				v.u32 = mp_get_be(r, 4);
+				item->jval.vu.float_value = v.f;
+			} else {
+				v.u64 = mp_get_be(r, 8);
+				item->jval.vu.float_value = v.d;
+			}
+			item->type = JSON_T_FLOAT;
+			return 1;
+		}
+		case 0xcc: case 0xcd: case 0xce: case 0xcf:
+		case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+			int n = 1 << (type & 0x3);
+			uint64_t val;
+			
+			if (r->end - r->p < n) {
+				return 0;
+			}
+			val = mp_get_be(r, n);
+			if (type >= 0xd0 && n < 8 && (val >> (n * 8 - 1))) {
+				val |= ~0ULL << (n * 8); /* sign extend */
+			}
+			item->jval.vu.integer_value = (JSON_int_t)val;
+			item->type = JSON_T_INTEGER;
+			return 1;
+		}
+		default:
+			break;
+	}
+	
+	/* containers */
+	if ((type & 0xF0) == 0x80 || (type & 0xF0) == 0x90) {
+		map = ((type & 0xF0) == 0x80);
+		count = type & 0x0F;
+	} else if (type >= 0xdc && type <= 0xdf) {
+		int n = (type & 1 ? 4 : 2);
+		
+		map = (type >= 0xde);
+		if (r->end - r->p < n) {
+			return 0;
+		}
+		count = mp_get_be(r, n);
+	} else {
+		return 0; /* ext types */
+	}
+	/* each element takes at least a byte */
+	if (count > (uint64_t)(r->end - r->p) || ++r->depth > MSGPACK_MAX_DEPTH) {
+		return 0;
+	}
+	item->jchild.type = (map ? JSON_C_T_OBJ : JSON_C_T_ARR);
+	
+	while (count--) {
+		json_item *child = init_json_item();
+		
+		child->father = item;
+		if (item->jchild.child == NULL) {
+			item->jchild.child = child;
+		} else {
+			item->jchild.head->next = child;
+		}
+		item->jchild.head = child;
+		
+		if (map) {
+			if (r->p >= r->end || (len = mp_get_str(r)) < 0) {
+				return 0;
+			}
+			child->key.val = mp_dup(r, len);
+			child->key.len = len;
+		}
+		if (!mp_read(r, child)) {
+			return 0;
+		}
+	}
+	r->depth--;
+	
+	return 1;
+}
+
+/* NULL if buf is not a single, complete MessagePack value */
+json_item *msgpack_to_json(const char *buf, size_t len)
+{
+	struct _msgpack_in r;
+	json_item *root = init_json_item();
+	
+	r.p = (const unsigned char *)buf;
+	r.end = r.p + len;
+	r.depth = 0;
+	
+	if (!mp_read(&r, root) || r.p != r.end) {
+		free_json_item(root);
+		return NULL;
+	}
+	return root;
+}
@@ -0,0 +1,36 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* msgpack.h */
+
+#ifndef _MSGPACK_H
+#define _MSGPACK_H
+
+#include "json.h"
+
+/* Sec-WebSocket-Protocol selecting MessagePack raws and commands */
+#define MSGPACK_WS_PROTOCOL "ape.msgpack"
+
+#define MSGPACK_MAX_DEPTH 32
+
+char *msgpack_from_json(const char *json, size_t len, size_t *outlen);
+json_item *msgpack_to_json(const char *buf, size_t len);
+unsigned int msgpack_array_header(unsigned char *head, unsigned int n);
+
+#endif
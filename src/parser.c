@@ -26,7 +26,8 @@
 
 static void parser_destroy_http(ape_parser *http_parser)
 {
-	free_header_line(((http_state *)http_parser->data)->hlines);
+	json_stream_free(((http_state *)http_parser->data)->json);
+	free(((http_state *)http_parser->data)->head);
 	free(http_parser->data);
 	http_parser->data = NULL;
 	http_parser->ready = 0;
@@ -60,17 +61,7 @@ ape_parser parser_init_http(ape_socket *co)
 	
 	http = http_parser.data;
 	
-	http->hlines = NULL;
-	http->pos = 0;
-	http->contentlength = -1;
-	http->read = 0;
-	http->step = 0;
-	http->type = HTTP_NULL;
-	http->error = 0;
-	http->uri = NULL;
-	http->data = NULL;
-	http->host = NULL;
-	http->buffer_addr = NULL;
+	http_parser_reset(http);
 
 	http_parser.parser_func = process_http;
 	http_parser.destroy = parser_destroy_http;
@@ -85,7 +76,7 @@ static void parser_destroy_stream(ape_parser *stream_parser)
 {
 	websocket_state *websocket = stream_parser->data;
 	
-	free_header_line(websocket->http->hlines);
+	free(websocket->http->head);
 
 	stream_parser->data = NULL;
 	stream_parser->ready = 0;
@@ -116,6 +107,7 @@ ape_parser parser_init_stream(ape_socket *co)
 	websocket->frame_payload.extended_length = 0;
 	websocket->data_pos = 0;
 	websocket->frame_pos = 0;
+	websocket->binary = 0;
 
 	stream_parser.parser_func = process_websocket;
 	stream_parser.onready = parser_ready_websocket;
@@ -29,6 +29,8 @@
 #include "plugins.h"
 #include "pipe.h"
 #include "transports.h"
+#include "metrics.h"
+#include "framing.h"
 
 RAW *forge_raw(const char *raw, json_item *jlist)
 {
@@ -53,11 +55,48 @@ RAW *forge_raw(const char *raw, json_item *jlist)
 	new_raw->next = NULL;
 	new_raw->priority = RAW_PRI_LO;
 	new_raw->refcount = 0;
+	new_raw->bin = NULL;
 
 	new_raw->data = string->jstring;
 
 	free(string);
 
+	APE_METRIC_INC(APE_M_RAWS_FORGED);
+
+	return new_raw;
+}
+
+/*
+	Same as forge_raw() but "data" is an already serialized JSON value
+	(e.g. written directly by a module), no json_item tree is involved.
+*/
+RAW *forge_raw_json(const char *raw, const char *data, size_t len)
+{
+	RAW *new_raw;
+	char head[128];
+	int hlen;
+	size_t rawlen = strlen(raw);
+	
+	hlen = snprintf(head, sizeof(head), "{\"time\":\"%li\",\"raw\":\"", time(NULL));
+	
+	new_raw = xmalloc(sizeof(*new_raw));
+	new_raw->len = hlen + rawlen + 9 + len + 1;
+	new_raw->next = NULL;
+	new_raw->priority = RAW_PRI_LO;
+	new_raw->refcount = 0;
+	new_raw->bin = NULL;
+	
+	new_raw->data = xmalloc(sizeof(char) * (new_raw->len + 1));
+	
+	memcpy(new_raw->data, head, hlen);
+	memcpy(new_raw->data + hlen, raw, rawlen);
+	memcpy(new_raw->data + hlen + rawlen, "\",\"data\":", 9);
+	memcpy(new_raw->data + hlen + rawlen + 9, data, len);
+	new_raw->data[new_raw->len - 1] = '}';
+	new_raw->data[new_raw->len] = '\0';
+	
+	APE_METRIC_INC(APE_M_RAWS_FORGED);
+	
 	return new_raw;
 }
 
@@ -68,6 +107,7 @@ void free_raw(void *p)
 	fraw->refcount--;
 	if (fraw->refcount == 0) {
 		free(fraw->data);
+		free(fraw->bin);
 		free(fraw);
 	}
 }
@@ -77,6 +117,7 @@ void delete_raw(RAW *fraw)
 	if (fraw != NULL) {
 		if (fraw->data != NULL)
 			free(fraw->data);
+		free(fraw->bin);
 		free(fraw);
 	}
 }
@@ -90,6 +131,7 @@ RAW *copy_raw(RAW *input)
 	new_raw->next = input->next;
 	new_raw->priority = input->priority;
 	new_raw->refcount = 0;
+	new_raw->bin = NULL;
 	new_raw->data = xmalloc(sizeof(char) * (new_raw->len + 1));
 
 	memcpy(new_raw->data, input->data, new_raw->len + 1);	
@@ -127,6 +169,8 @@ void post_raw_sub(RAW *raw, subuser *sub, acetables *g_ape)
 
 	(raw->refcount)++;
 
+	APE_METRIC_INC(APE_M_RAWS_POSTED);
+
 	HOOK_EVENT(post_raw_sub, raw, sub, g_ape);
 }
 
@@ -295,113 +339,12 @@ json_item* post_to_pipe(json_item *jlist, const char *rawname, const char *pipe,
 
 int send_raw_inline(ape_socket *client, transport_t transport, RAW *raw, acetables *g_ape)
 {
-	struct _transport_properties *properties;
-	int finish = 1;
-
-	properties = transport_get_properties(transport, g_ape);
-
-	switch(transport) {
-		case TRANSPORT_XHRSTREAMING:
-			finish &= http_send_headers(NULL, HEADER_XHR, HEADER_XHR_LEN, client, g_ape);
-			break;
-		case TRANSPORT_SSE_LONGPOLLING:
-			finish &= http_send_headers(NULL, HEADER_SSE, HEADER_SSE_LEN, client, g_ape);
-			break;
-		case TRANSPORT_WEBSOCKET:
-		case TRANSPORT_WEBSOCKET_IETF:
-			break;
-		default:
-			finish &= http_send_headers(NULL, HEADER_DEFAULT, HEADER_DEFAULT_LEN, client, g_ape);
-			break;
-	}
-	
-	if (properties != NULL && properties->padding.left.val != NULL) {
-		finish &= sendbin(client->fd, properties->padding.left.val, properties->padding.left.len, 0, g_ape);
-	}	
-
-
-	if (transport == TRANSPORT_WEBSOCKET_IETF) {
-	    websocket_state *websocket = client->parser.data;
-	    char payload_head[32] = { websocket->version == WS_IETF_06 ? 0x84 : 0x81 };
-	    int payload_size = raw->len+2; /* TODO: fragmentation? */
-	    int payload_length = 0;
-	    
-	    if (payload_size <= 125) {
-	        payload_head[1] = (unsigned char)payload_size & 0x7F;
-	        payload_length = 2;
-	    } else if (payload_size <= 65535) {
-	        unsigned short int s = htons(payload_size);
-	        payload_head[1] = 126;
-	        
-	        memcpy(&payload_head[2], &s, 2);
-	        
-	        payload_length = 4;
-	    } else if (payload_size <= 0xFFFFFFFF) {
-	        unsigned int s = htonl(payload_size);
-	        
-	        payload_head[1] = 127;
-	        payload_head[2] = 0;
-	        payload_head[3] = 0;
-	        payload_head[4] = 0;
-	        payload_head[5] = 0;
-	        
-            memcpy(&payload_head[6], &s, 4);
-
-	        payload_length = 10;
-	    }
-        
-        finish &= sendbin(client->fd, payload_head, payload_length, 0, g_ape);        
-	}
+	frame_batch batch;
 	
-	finish &= sendbin(client->fd, "[", 1, 0, g_ape);
-	
-	finish &= sendbin(client->fd, raw->data, raw->len, 0, g_ape);
-	
-	finish &= sendbin(client->fd, "]", 1, 0, g_ape);
-	
-	if (properties != NULL && properties->padding.right.val != NULL) {
-		finish &= sendbin(client->fd, properties->padding.right.val, properties->padding.right.len, 0, g_ape);
-	}
-	
-	delete_raw(raw);
-	
-	return finish;
-}
-
-/*
-    pre compute the payload size
-    TODO: Do that while adding raws to list
-*/
-static unsigned int raws_size(subuser *user)
-{
-    struct _raw_pool *pool;
-    int state = 0;
-    unsigned int size = 1; /* 1 for the first |[| */
-    
-	if (user->raw_pools.nraw == 0) {
-		return 0;
-	}
+	frame_batch_init(&batch, client, NULL, transport, g_ape);
+	frame_batch_add(&batch, copy_raw_z(raw));
 	
-	if (user->raw_pools.high.nraw) {
-		pool = user->raw_pools.high.rawfoot->prev;
-	} else {
-		pool = user->raw_pools.low.rawhead;
-		state = 1;
-	}    
-	while (pool->raw != NULL) {
-		struct _raw_pool *pool_next = (state ? pool->next : pool->prev);
-		
-		size +=  pool->raw->len + 1; /* 1 for trailing |,| or |]| */
-
-		pool = pool_next;
-		
-		if ((pool == NULL || pool->raw == NULL) && !state) {
-			pool = user->raw_pools.low.rawhead;
-			state = 1;
-		}
-	}
-    
-    return size;
+	return frame_batch_send(&batch);
 }
 
 /*
@@ -409,41 +352,15 @@ static unsigned int raws_size(subuser *user)
 */
 int send_raws(subuser *user, acetables *g_ape)
 {
-	int finish = 1, state = 0;
+	int finish, state = 0;
 	struct _raw_pool *pool;
-	struct _transport_properties *properties;
+	frame_batch batch;
 
-	if (user->raw_pools.nraw == 0) {
+	if (user->raw_pools.nraw == 0 && !user->sse.resume) {
 		return 1;
 	}
-
-	PACK_TCP(user->client->fd); /* Activate TCP_CORK */
-	
-	properties = transport_get_properties(user->user->transport, g_ape);
-	
-	if (!user->headers.sent) {
-		user->headers.sent = 1;
-		
-		switch(user->user->transport) {
-			case TRANSPORT_XHRSTREAMING:
-				finish &= http_send_headers(user->headers.content, HEADER_XHR, HEADER_XHR_LEN, user->client, g_ape);
-				break;
-			case TRANSPORT_SSE_LONGPOLLING:
-				finish &= http_send_headers(user->headers.content, HEADER_SSE, HEADER_SSE_LEN, user->client, g_ape);
-				break;
-			case TRANSPORT_WEBSOCKET:
-			case TRANSPORT_WEBSOCKET_IETF:
-				break;
-			default:
-				finish &= http_send_headers(user->headers.content, HEADER_DEFAULT, HEADER_DEFAULT_LEN, user->client, g_ape);
-				break;
-		}
-		
-	}
 	
-	if (properties != NULL && properties->padding.left.val != NULL) {
-		finish &= sendbin(user->client->fd, properties->padding.left.val, properties->padding.left.len, 0, g_ape);
-	}
+	frame_batch_init(&batch, user->client, user, user->user->transport, g_ape);
 
 	if (user->raw_pools.high.nraw) {
 		pool = user->raw_pools.high.rawfoot->prev;
@@ -451,59 +368,11 @@ int send_raws(subuser *user, acetables *g_ape)
 		pool = user->raw_pools.low.rawhead;
 		state = 1;
 	}
-	
-	if (user->user->transport == TRANSPORT_WEBSOCKET_IETF) {
-	    websocket_state *websocket = user->client->parser.data;
-	    char payload_head[32] = { websocket->version == WS_IETF_06 ? 0x84 : 0x81 };
-
-	    int payload_size = raws_size(user); /* TODO: fragmentation? */
-	    int payload_length = 0;
-	    
-	    if (payload_size <= 125) {
-	        payload_head[1] = (unsigned char)payload_size & 0x7F;
-	        payload_length = 2;
-	    } else if (payload_size <= 65535) {
-	        unsigned short int s = htons(payload_size);
-	        payload_head[1] = 126;
-	        
-	        memcpy(&payload_head[2], &s, 2);
-	        
-	        payload_length = 4;
-	    } else if (payload_size <= 0xFFFFFFFF) {
-	        unsigned int s = htonl(payload_size);
-	        
-	        payload_head[1] = 127;
-	        payload_head[2] = 0;
-	        payload_head[3] = 0;
-	        payload_head[4] = 0;
-	        payload_head[5] = 0;
-	        
-            memcpy(&payload_head[6], &s, 4);
-
-	        payload_length = 10;
-	    }
-        
-        finish &= sendbin(user->client->fd, payload_head, payload_length, 0, g_ape);
-
-	}
-	finish &= sendbin(user->client->fd, "[", 1, 0, g_ape);
 		
 	while (pool->raw != NULL) {
 		struct _raw_pool *pool_next = (state ? pool->next : pool->prev);
 
-		finish &= sendbin(user->client->fd, pool->raw->data, pool->raw->len, 0, g_ape);
-
-		if ((pool_next != NULL && pool_next->raw != NULL) || (!state && user->raw_pools.low.nraw)) {
-			finish &= sendbin(user->client->fd, ",", 1, 0, g_ape);
-		} else {
-			finish &= sendbin(user->client->fd, "]", 1, 0, g_ape);
-			
-			if (properties != NULL && properties->padding.right.val != NULL) {
-				finish &= sendbin(user->client->fd, properties->padding.right.val, properties->padding.right.len, 0, g_ape);
-			}
-		}
-		
-		free_raw(pool->raw);
+		frame_batch_add(&batch, pool->raw);
 		pool->raw = NULL;
 		
 		pool = pool_next;
@@ -514,6 +383,10 @@ int send_raws(subuser *user, acetables *g_ape)
 		}
 	}
 	
+	finish = frame_batch_send(&batch);
+	
+	APE_METRIC_ADD(APE_M_RAWS_FLUSHED, user->raw_pools.nraw);
+
 	user->raw_pools.high.nraw = 0;
 	user->raw_pools.low.nraw = 0;
 	user->raw_pools.nraw = 0;
@@ -521,8 +394,6 @@ int send_raws(subuser *user, acetables *g_ape)
 	user->raw_pools.high.rawfoot = user->raw_pools.high.rawhead;
 	user->raw_pools.low.rawfoot = user->raw_pools.low.rawhead;
 	
-	FLUSH_TCP(user->client->fd);
-	
 	return finish;
 }
 
@@ -46,10 +46,14 @@ typedef struct RAW
 	
 	int len;
 	int refcount;
+	
+	char *bin; /* MessagePack encoding, built on the first binary send */
+	int bin_len;
 } RAW;
 
 
 RAW *forge_raw(const char *raw, json_item *jlist);
+RAW *forge_raw_json(const char *raw, const char *data, size_t len);
 void free_raw(void *p);
 void delete_raw(RAW *fraw);
 RAW *copy_raw(RAW *input);
@@ -27,28 +27,27 @@
 #include "config.h"
 #include "queue.h"
 #include "hnpub.h"
+#include "rrc_store.h"
+#include "ticks.h"
 
 #define ADD_RRC_QUEUE_TBL(g_ape)										\
 	do {																\
 		if (get_property(g_ape->properties, "raw_recently_queue") == NULL) { \
 			add_property(&g_ape->properties, "raw_recently_queue", hashtbl_init(), \
-						 queue_destroy, EXTEND_HTBL, EXTEND_ISPRIVATE);	\
+						 rrc_entry_free, EXTEND_HTBL, EXTEND_ISPRIVATE);	\
 		}																\
 	} while (0)
-#define GET_RRC_QUEUE_TBL(g_ape)										\
-	(get_property(g_ape->properties, "raw_recently_queue") != NULL ?	\
-	 (HTBL*)get_property(g_ape->properties, "raw_recently_queue")->val: NULL)
+/* resolved once by init_raw_recently() */
+#define GET_RRC_QUEUE_TBL(g_ape) (rrc_queue_tbl)
 
 #define ADD_RRC_INDEX_TBL(g_ape)										\
 	do {																\
 		if (get_property(g_ape->properties, "raw_recently_index") == NULL) { \
 			add_property(&g_ape->properties, "raw_recently_index", hashtbl_init(), \
-						 queue_destroy, EXTEND_HTBL, EXTEND_ISPRIVATE);	\
+						 rrc_user_free, EXTEND_HTBL, EXTEND_ISPRIVATE);	\
 		}																\
 	} while (0)
-#define GET_RRC_INDEX_TBL(g_ape)										\
-	(get_property(g_ape->properties, "raw_recently_index") != NULL ?	\
-	 (HTBL*)get_property(g_ape->properties, "raw_recently_index")->val: NULL)
+#define GET_RRC_INDEX_TBL(g_ape) (rrc_index_tbl)
 
 #define PREOP_RRC_QUEUE(table, key)										\
 	do {																\
@@ -67,17 +66,99 @@
 			return;								\
 	} while (0);
 
-/* hkey: 10_11 */
-#define ASSEM_QUEUE_KEY(hkey, from, to)						\
-	if (strcmp(from, to) < 0) {								\
-		snprintf(hkey, sizeof(hkey), "%s_%s", from, to);	\
-	} else {												\
-		snprintf(hkey, sizeof(hkey), "%s_%s", to, from);	\
-	}
+/*
+ * Interned user : one per uin, owns the index of its recent peers.
+ */
+struct _rrc_user {
+	Queue *index; /* struct _rrc_slot*, most recent first */
+	char uin[];
+};
+
+/*
+ * Queue table value. For a "from_to" pair, each side has a slot that lives
+ * in the other user's index while "indexed" is set, so an index update is
+ * a flag check instead of a queue_find() over strings.
+ */
+struct _rrc_entry;
+struct _rrc_slot {
+	struct _rrc_entry *entry;
+	int side;
+};
+
+struct _rrc_entry {
+	Queue *raws;
+	struct _rrc_user *user[2];
+	struct _rrc_slot slot[2];	/* slot[i] lives in user[i]->index, points to user[!i] */
+	unsigned char indexed[2];
+};
 
 static int rrc_max_user = 0;
 static int rrc_max_msg = 0;
 
+static rrc_store *rrc_disk = NULL;
+
+static HTBL *rrc_queue_tbl = NULL;
+static HTBL *rrc_index_tbl = NULL;
+
+static void rrc_entry_free(void *p)
+{
+	struct _rrc_entry *entry = p;
+
+	queue_destroy(entry->raws);
+	free(entry);
+}
+
+/* index slots belong to the entries, only the queue is released */
+static void rrc_user_free(void *p)
+{
+	struct _rrc_user *user = p;
+
+	queue_free(user->index);
+	free(user);
+}
+
+/* evicted from an index */
+static void rrc_slot_evict(void *p)
+{
+	struct _rrc_slot *slot = p;
+
+	slot->entry->indexed[slot->side] = 0;
+}
+
+static struct _rrc_entry *rrc_entry_get(HTBL *table, const char *key)
+{
+	struct _rrc_entry *entry = hashtbl_seek(table, key);
+
+	if (entry == NULL) {
+		entry = xmalloc(sizeof(*entry));
+		memset(entry, 0, sizeof(*entry));
+
+		entry->raws = queue_new(rrc_max_msg, free_raw);
+		entry->slot[0].entry = entry->slot[1].entry = entry;
+		entry->slot[0].side = 0;
+		entry->slot[1].side = 1;
+
+		hashtbl_append(table, key, entry);
+	}
+
+	return entry;
+}
+
+static struct _rrc_user *rrc_user_get(HTBL *table, const char *uin)
+{
+	struct _rrc_user *user = hashtbl_seek(table, uin);
+
+	if (user == NULL) {
+		user = xmalloc(sizeof(*user) + strlen(uin) + 1);
+		strcpy(user->uin, uin);
+		user->index = queue_new(rrc_max_user, rrc_slot_evict);
+
+		hashtbl_append(table, uin, user);
+	}
+
+	return user;
+}
+
 /*
  * raw_queue_xxx 
  */
@@ -89,14 +170,10 @@ static void raw_queue_in(acetables *g_ape, RAW *raw, char *key)
 	
 	PREOP_RRC_QUEUE(table, key);
 
-	Queue *queue = hashtbl_seek(table, key);
-	if (!queue) {
-		queue = queue_new(rrc_max_msg, free_raw);
-		hashtbl_append(table, key, queue);
-	}
+	struct _rrc_entry *entry = rrc_entry_get(table, key);
 
 	copy_raw_z(raw);
-	queue_fixlen_push_tail(queue, raw);
+	queue_fixlen_push_tail(entry->raws, raw);
 }
 
 static void raw_queue_out(acetables *g_ape, USERS *user, char *key)
@@ -105,10 +182,10 @@ static void raw_queue_out(acetables *g_ape, USERS *user, char *key)
 
 	PREOP_RRC_QUEUE(table, key);
 	
-	Queue *queue = hashtbl_seek(table, key);
+	struct _rrc_entry *entry = hashtbl_seek(table, key);
 	QueueEntry *qe;
-	if (queue) {
-		queue_iterate(queue, qe) {
+	if (entry) {
+		queue_iterate(entry->raws, qe) {
 			post_raw(qe->data, user, g_ape);
 		}
 	}
@@ -120,10 +197,10 @@ static void raw_queue_out_sub(acetables *g_ape, subuser *sub, char *key)
 
 	PREOP_RRC_QUEUE(table, key);
 	
-	Queue *queue = hashtbl_seek(table, key);
+	struct _rrc_entry *entry = hashtbl_seek(table, key);
 	QueueEntry *qe;
-	if (queue) {
-		queue_iterate(queue, qe) {
+	if (entry) {
+		queue_iterate(entry->raws, qe) {
 			post_raw_sub(qe->data, sub, g_ape);
 		}
 	}
@@ -133,194 +210,151 @@ static void raw_queue_out_sub(acetables *g_ape, subuser *sub, char *key)
 /*
  * rrc_index_xxx
  */
-static void rrc_index_update(HTBL *table, char *from, char *to, int max)
+
+/* Put "peer" at the head of "owner"'s index (no-op if already there) */
+static void rrc_index_link(acetables *g_ape, const char *owner, const char *peer)
 {
-	Queue *index;
-	
-	if (table && from && to && max > 0) {
-		/* update from's index */
-		index = hashtbl_seek(table, from);
-		if (!index) {
-			index = queue_new(max, free);
-			hashtbl_append(table, from, index);
-		}
+	HTBL *qtable = GET_RRC_QUEUE_TBL(g_ape), *itable = GET_RRC_INDEX_TBL(g_ape);
+	struct _rrc_entry *entry;
+	char hkey[128];
+	int side;
 
-		if (queue_find(index, to, hn_str_cmp) == -1) {
-			queue_fixlen_push_head(index, strdup(to));
-		}
+	if (!qtable || !itable || rrc_max_user <= 0) return;
 
-		/* update to's index */
-		index = hashtbl_seek(table, to);
-		if (!index) {
-			index = queue_new(max, free);
-			hashtbl_append(table, to, index);
-		}
+	RRC_PAIR_KEY(hkey, owner, peer);
 
-		if (queue_find(index, from, hn_str_cmp) == -1) {
-			queue_fixlen_push_head(index, strdup(from));
-		}
-	}
-}
+	entry = rrc_entry_get(qtable, hkey);
+	side = (strcmp(owner, peer) < 0 ? 0 : 1);
 
+	if (entry->user[side] == NULL) {
+		entry->user[side] = rrc_user_get(itable, owner);
+		entry->user[!side] = rrc_user_get(itable, peer);
+	}
 
-/*
- * public
- */
-void init_raw_recently(acetables *g_ape)
-{
-	rrc_max_user = atoi(CONFIG_VAL(RawRecently, max_num_user, g_ape->srv));
-	rrc_max_msg = atoi(CONFIG_VAL(RawRecently, max_num_msg, g_ape->srv));
-	
-	if (rrc_max_user > 0 && rrc_max_msg > 0) {
-		ADD_RRC_QUEUE_TBL(g_ape);
-		ADD_RRC_INDEX_TBL(g_ape);
+	if (!entry->indexed[side]) {
+		entry->indexed[side] = 1;
+		queue_fixlen_push_head(entry->user[side]->index, &entry->slot[side]);
 	}
 }
 
-void free_raw_recently(acetables *g_ape)
+static void rrc_index_update(acetables *g_ape, char *from, char *to)
 {
-	//hashtbl_free(GET_RRC_QUEUE_TBL(g_ape), free_raw);
-	//hashtbl_free(GET_RRC_INDEX_TBL(g_ape), free);
-	del_property(&g_ape->properties, "raw_recently_queue");
-	del_property(&g_ape->properties, "raw_recently_index");
+	if (from && to) {
+		rrc_index_link(g_ape, from, to);
+		rrc_index_link(g_ape, to, from);
+	}
 }
 
-#if 0
-void load_raw_recently(acetables *g_ape)
+
+/*
+ * persistence
+ */
+static RAW *rrc_raw_new(const char *data, unsigned int len)
 {
-	HTBL *table;
-	int nTok;
-	char *tkn[256], hkey[128], *msgraw, *from, *to;
+	RAW *new_raw = xmalloc(sizeof(*new_raw));
 
-	HDF *node, *chi;
-	HTBL *etbl = GET_EVENT_TBL(g_ape);
-	mevent_t *evt = (mevent_t*)hashtbl_seek(etbl, "msg");
-	if (!evt) return;
+	new_raw->len = len;
+	new_raw->next = NULL;
+	new_raw->priority = RAW_PRI_LO;
+	new_raw->refcount = 0;
+	new_raw->bin = NULL;
+	new_raw->data = xmalloc(sizeof(char) * (len + 1));
 
-	alog_dbg("load raw recently ...");
+	memcpy(new_raw->data, data, len);
+	new_raw->data[len] = '\0';
 
-	PREOP_RRC_INDEX(table);
+	return new_raw;
+}
 
-	if (PROCESS_NOK(mevent_trigger(evt, NULL, REQ_CMD_INDEXGET, FLAGS_SYNC))) {
-		alog_err("load index error");
-		return;
-	}
+static void rrc_load_raw(const char *key, const char *data, unsigned int len, void *arg)
+{
+	push_raw_recently(arg, rrc_raw_new(data, len), (char *)key);
+}
 
-	hdf_init(&node);
-	hdf_copy(node, NULL, evt->hdfrcv);
-	node = hdf_get_child(node, "index");
-	while (node) {
-		to = hdf_get_value(node, "msgto", NULL);
-		from = hdf_get_value(node, "msgfrom", NULL);
-		if (!to || !from) goto conti;
-		nTok = explode(';', from, tkn, rrc_max_user);
-		for (int i = 0; i < nTok; i++) {
-			rrc_index_update(table, tkn[i], to, rrc_max_user);
-
-			ASSEM_QUEUE_KEY(hkey, tkn[i], to);
-			hdf_set_value(evt->hdfsnd, "msgkey", hkey);
-			if (PROCESS_OK(mevent_trigger(evt, hkey, REQ_CMD_MSGGET, FLAGS_SYNC))) {
-				chi = hdf_get_child(evt->hdfrcv, "raws");
-				while (chi) {
-					msgraw = hdf_get_value(chi, "msgraw", NULL);
-					if (msgraw) {
-						RAW *new_raw = calloc(1, sizeof(*new_raw));
-						new_raw->len = strlen(msgraw);
-						new_raw->next = NULL;
-						new_raw->priority = RAW_PRI_LO;
-						new_raw->refcount = 0;
-						new_raw->data = strdup(msgraw);
-					
-						raw_queue_in(g_ape, new_raw, hkey);
-					}
-					chi = hdf_obj_next(chi);
-				}
-			}
-		}
+static void rrc_load_pair(const char *from, const char *to, const char *data, unsigned int len, void *arg)
+{
+	push_raw_recently_byme(arg, rrc_raw_new(data, len), (char *)from, (char *)to);
+}
 
-	conti:
-		node = hdf_obj_next(node);
-	}
-	hdf_destroy(&node);
+static void rrc_load_link(const char *owner, const char *peer, void *arg)
+{
+	rrc_index_link(arg, owner, peer);
+}
 
-	alog_dbg("load raw recently done ...");
+static void rrc_store_written(acetables *g_ape)
+{
+	if (rrc_store_need_compact(rrc_disk)) {
+		rrc_store_compact(rrc_disk);
+	}
 }
 
-void save_raw_recently(acetables *g_ape)
+static void rrc_store_tick(void *params, int *last)
 {
-	HTBL *table;
-	HTBL_ITEM *item;
-	Queue *queue;
-	QueueEntry *qe;
-	char *from, *to, *msg;
+	rrc_store_poll(rrc_disk);
+}
 
-	HTBL *etbl = GET_EVENT_TBL(g_ape);
-	mevent_t *evt = (mevent_t*)hashtbl_seek(etbl, "msg");
-	if (!evt) return;
 
-	/* ============================ */
-	alog_dbg("save index table...");
+/*
+ * public
+ */
+void init_raw_recently(acetables *g_ape)
+{
+	char *path;
 
-	PREOP_RRC_INDEX(table);
-	item = table->first;
+	rrc_max_user = atoi(CONFIG_VAL(RawRecently, max_num_user, g_ape->srv));
+	rrc_max_msg = atoi(CONFIG_VAL(RawRecently, max_num_msg, g_ape->srv));
 	
-	STRING str;
-	while (item) {
-		string_init(&str);
-		
-		to = item->key;
-		queue = (Queue*)(item->addrs);
-		if (queue) {
-			queue_iterate(queue, qe) {
-				from = (char*)(qe->data);
-				string_append(&str, from);
-				string_append(&str, ":");
-			}
-			
-			hdf_set_value(evt->hdfsnd, "msgto", to);
-			hdf_set_value(evt->hdfsnd, "msgfrom", str.buf);
+	if (rrc_max_user > 0 && rrc_max_msg > 0) {
+		ADD_RRC_QUEUE_TBL(g_ape);
+		ADD_RRC_INDEX_TBL(g_ape);
 
-			if (PROCESS_NOK(mevent_trigger(evt, to, REQ_CMD_INDEXSET, FLAGS_NONE))) {
-				alog_err("save index failure %d", evt->errcode);
-			}
+		rrc_queue_tbl = get_property_val(g_ape->properties, "raw_recently_queue");
+		rrc_index_tbl = get_property_val(g_ape->properties, "raw_recently_index");
+
+		path = CONFIG_VAL(RawRecently, store_path, g_ape->srv);
+
+		if (*path != '\0' &&
+			(rrc_disk = rrc_store_open(path,
+									   atol(CONFIG_VAL(RawRecently, store_segment_size, g_ape->srv)),
+									   atol(CONFIG_VAL(RawRecently, store_compact_size, g_ape->srv)),
+									   rrc_max_msg, rrc_max_user)) != NULL) {
+			struct _rrc_store_cb cb = {rrc_load_raw, rrc_load_pair, rrc_load_link, g_ape};
+
+			rrc_store_load(rrc_disk, &cb);
+			rrc_store_written(g_ape);
+
+			add_periodical(1000, 0, rrc_store_tick, NULL, g_ape);
 		}
-		
-		string_clear(&str);
-		item = item->lnext;
 	}
-	alog_dbg("save index table done");
-
-	/* ============================ */
-	alog_dbg("save queue table...");
-
-	table = GET_RRC_QUEUE_TBL(g_ape);
-	item = table->first;
-	while (item) {
-		queue = (Queue*)(item->addrs);
-		if (queue) {
-			queue_iterate(queue, qe) {
-				msg = (char*)(qe->data);
-				hdf_set_value(evt->hdfsnd, "msgkey", item->key);
-				hdf_set_value(evt->hdfsnd, "msgraw", msg);
-				if (PROCESS_NOK(mevent_trigger(evt, to, REQ_CMD_MSGSET, FLAGS_NONE))) {
-					alog_err("save msg failure %d", evt->errcode);
-				}
-			}
-		}
+}
 
-		item = item->lnext;
+void free_raw_recently(acetables *g_ape)
+{
+	if (rrc_disk != NULL) {
+		rrc_store_close(rrc_disk);
+		rrc_disk = NULL;
 	}
-	
-	alog_dbg("save queue table done");
+
+	rrc_queue_tbl = rrc_index_tbl = NULL;
+
+	/* index queues point into the entries, release them first */
+	del_property(&g_ape->properties, "raw_recently_index");
+	del_property(&g_ape->properties, "raw_recently_queue");
 }
-#endif
 
 /*
  * push
  */
 void push_raw_recently(acetables *g_ape, RAW *raw, char *key)
 {
+	if (!raw || !key || !GET_RRC_QUEUE_TBL(g_ape)) return;
+
 	raw_queue_in(g_ape, raw, key);
+
+	if (rrc_disk != NULL) {
+		rrc_store_append_raw(rrc_disk, key, raw);
+		rrc_store_written(g_ape);
+	}
 }
 
 void push_raw_recently_byme(acetables *g_ape, RAW *raw, char *from, char *to)
@@ -332,11 +366,16 @@ void push_raw_recently_byme(acetables *g_ape, RAW *raw, char *from, char *to)
 	
 	PREOP_RRC_INDEX(table);
 
-	rrc_index_update(table, from, to, rrc_max_user);
+	rrc_index_update(g_ape, from, to);
 	
-	ASSEM_QUEUE_KEY(hkey, from, to);
+	RRC_PAIR_KEY(hkey, from, to);
 
 	raw_queue_in(g_ape, raw, hkey);
+
+	if (rrc_disk != NULL) {
+		rrc_store_append_pair(rrc_disk, from, to, raw);
+		rrc_store_written(g_ape);
+	}
 }
 
 /*
@@ -363,19 +402,24 @@ void post_raw_recently_byme(acetables *g_ape, USERS *user, char *from, char *to)
 	if (!user || !to) return;
 
 	if (from) {
-		ASSEM_QUEUE_KEY(hkey, from, to);
+		RRC_PAIR_KEY(hkey, from, to);
 		raw_queue_out(g_ape, user, hkey);
 	} else {
 		HTBL *table;
 		
 		PREOP_RRC_INDEX(table);
 
-		Queue *index = hashtbl_seek(table, to);
+		struct _rrc_user *owner = hashtbl_seek(table, to);
 		QueueEntry *qe;
 		
-		if (index) {
-			queue_iterate(index, qe) {
-				post_raw_recently_byme(g_ape, user, (char*)qe->data, to);
+		if (owner) {
+			queue_iterate(owner->index, qe) {
+				struct _rrc_slot *slot = qe->data;
+				QueueEntry *re;
+
+				queue_iterate(slot->entry->raws, re) {
+					post_raw(re->data, user, g_ape);
+				}
 			}
 		}
 	}
@@ -388,18 +432,23 @@ void post_raw_sub_recently_byme(acetables *g_ape, subuser *sub, char *from, char
 	if (!sub || !to) return;
 
 	if (from) {
-		ASSEM_QUEUE_KEY(hkey, from, to);
+		RRC_PAIR_KEY(hkey, from, to);
 		raw_queue_out_sub(g_ape, sub, hkey);
 	} else {
 		HTBL *table;
 		
 		PREOP_RRC_INDEX(table);
 
-		Queue *index = hashtbl_seek(table, to);
+		struct _rrc_user *owner = hashtbl_seek(table, to);
 		QueueEntry *qe;
-		if (index) {
-			queue_iterate(index, qe) {
-				post_raw_sub_recently_byme(g_ape, sub, (char*)qe->data, to);
+		if (owner) {
+			queue_iterate(owner->index, qe) {
+				struct _rrc_slot *slot = qe->data;
+				QueueEntry *re;
+
+				queue_iterate(slot->entry->raws, re) {
+					post_raw_sub(re->data, sub, g_ape);
+				}
 			}
 		}
 	}
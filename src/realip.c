@@ -0,0 +1,349 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* realip.c */
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "realip.h"
+#include "http_parser.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+	Client address behind load balancers.
+	
+	With Server::proxy_protocol, every accepted connection must start with
+	a PROXY protocol header (v1 text or v2 binary, as sent by HAProxy) :
+	its source address replaces the TCP peer for the whole connection.
+	
+	X-Forwarded-For (or X-Real-IP) is honored only when the peer is one of
+	Server::trusted_proxies. It is read again on every request since a
+	balancer reuses its keep-alive connections for several clients.
+*/
+
+#define PROXY_V2_SIG "\r\n\r\n\0\r\nQUIT\n"
+#define PROXY_V2_SIG_LEN 12
+#define PROXY_V2_HEAD_LEN 16
+
+struct _realip_net {
+	int family;
+	unsigned char addr[16];
+	int bits;
+};
+
+static struct {
+	struct _realip_net trusted[REALIP_MAX_TRUSTED];
+	int ntrusted;
+	
+	int proxy_protocol;
+} realip;
+
+/* "10.0.0.0/8", "::1"... */
+static int realip_net_parse(char *str, struct _realip_net *net)
+{
+	char *slash = strchr(str, '/');
+	int i, max;
+	
+	if (slash != NULL) {
+		*slash = '\0';
+	}
+	if (inet_pton(AF_INET, str, net->addr) == 1) {
+		net->family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, str, net->addr) == 1) {
+		net->family = AF_INET6;
+		max = 128;
+	} else {
+		return 0;
+	}
+	net->bits = (slash != NULL ? atoi(&slash[1]) : max);
+	
+	if (net->bits < 0 || net->bits > max) {
+		return 0;
+	}
+	/* "10.1.2.3/8" is 10.0.0.0/8 */
+	for (i = net->bits; i < max; i++) {
+		net->addr[i / 8] &= ~(0x80 >> (i % 8));
+	}
+	
+	return 1;
+}
+
+static int realip_net_match(int family, const unsigned char *addr, const struct _realip_net *net)
+{
+	int bytes = net->bits / 8, rest = net->bits % 8;
+	
+	if (family != net->family || memcmp(addr, net->addr, bytes) != 0) {
+		return 0;
+	}
+	
+	return (rest == 0 || ((addr[bytes] ^ net->addr[bytes]) & (0xff << (8 - rest))) == 0);
+}
+
+/* Parse an address (IPv4-mapped IPv6 addresses are IPv4), return its family or 0 */
+static int realip_addr(const char *str, unsigned char *addr)
+{
+	if (inet_pton(AF_INET, str, addr) == 1) {
+		return AF_INET;
+	}
+	if (inet_pton(AF_INET6, str, addr) == 1) {
+		if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)addr)) {
+			memmove(addr, &addr[12], 4);
+			return AF_INET;
+		}
+		return AF_INET6;
+	}
+	
+	return 0;
+}
+
+static int realip_trusted(const char *ip)
+{
+	unsigned char addr[16];
+	int family, i;
+	
+	if (!realip.ntrusted || (family = realip_addr(ip, addr)) == 0) {
+		return 0;
+	}
+	for (i = 0; i < realip.ntrusted; i++) {
+		if (realip_net_match(family, addr, &realip.trusted[i])) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/* Copy a valid address from [str, str+len) in its canonical form */
+static int realip_copy(char *ip, const char *str, size_t len)
+{
+	unsigned char addr[16];
+	char tmp[APE_IP_LEN];
+	int family;
+	
+	while (len && (*str == ' ' || *str == '\t')) {
+		str++;
+		len--;
+	}
+	while (len && (str[len - 1] == ' ' || str[len - 1] == '\t')) {
+		len--;
+	}
+	if (len == 0 || len >= sizeof(tmp)) {
+		return 0;
+	}
+	memcpy(tmp, str, len);
+	tmp[len] = '\0';
+	
+	if ((family = realip_addr(tmp, addr)) == 0) {
+		return 0;
+	}
+	
+	return (inet_ntop(family, addr, ip, APE_IP_LEN) != NULL);
+}
+
+void realip_init(acetables *g_ape)
+{
+	char *trusted, *tkn[REALIP_MAX_TRUSTED];
+	size_t n, i;
+	
+	realip.proxy_protocol = (atoi(CONFIG_VAL(Server, proxy_protocol, g_ape->srv)) == 1);
+	
+	trusted = xstrdup(CONFIG_VAL(Server, trusted_proxies, g_ape->srv));
+	n = explode(',', trusted, tkn, REALIP_MAX_TRUSTED - 1);
+	
+	for (i = 0; i <= n; i++) {
+		char *net = trim(tkn[i]);
+		
+		if (*net == '\0') {
+			continue;
+		}
+		if (!realip_net_parse(net, &realip.trusted[realip.ntrusted])) {
+			alog_warn("Invalid trusted proxy address : %s", net);
+			continue;
+		}
+		realip.ntrusted++;
+	}
+	free(trusted);
+}
+
+void realip_free(acetables *g_ape)
+{
+	realip.ntrusted = 0;
+}
+
+void realip_accept(ape_socket *co)
+{
+	memcpy(co->ip_peer, co->ip_client, APE_IP_LEN);
+	co->proxy_header = realip.proxy_protocol;
+}
+
+/* "PROXY TCP4 192.168.0.1 192.168.0.11 56324 443\r\n" */
+static int proxy_v1(ape_socket *co, const char *buf, size_t len)
+{
+	char line[PROXY_V1_MAX + 1], *tkn[6];
+	const char *eol;
+	size_t n;
+	
+	if ((eol = memchr(buf, '\n', (len < PROXY_V1_MAX ? len : PROXY_V1_MAX))) == NULL) {
+		return (len < PROXY_V1_MAX ? 0 : -1);
+	}
+	if (eol == buf || eol[-1] != '\r') {
+		return -1;
+	}
+	memcpy(line, buf, eol - buf - 1);
+	line[eol - buf - 1] = '\0';
+	
+	n = explode(' ', line, tkn, 6);
+	
+	if (strcmp(tkn[0], "PROXY") != 0 || n < 1) {
+		return -1;
+	}
+	if (strcmp(tkn[1], "UNKNOWN") == 0) {
+		return eol - buf + 1; /* keep the peer */
+	}
+	if (n != 5 || (strcmp(tkn[1], "TCP4") != 0 && strcmp(tkn[1], "TCP6") != 0) ||
+		!realip_copy(co->ip_peer, tkn[2], strlen(tkn[2]))) {
+		return -1;
+	}
+	
+	return eol - buf + 1;
+}
+
+/* 12 bytes signature, version/command, family, address length, addresses (and TLVs) */
+static int proxy_v2(ape_socket *co, const unsigned char *buf, size_t len)
+{
+	size_t total;
+	int family = 0;
+	
+	if (len < PROXY_V2_HEAD_LEN) {
+		return 0;
+	}
+	if ((buf[12] >> 4) != 2 || (buf[12] & 0x0f) > 1) {
+		return -1;
+	}
+	total = PROXY_V2_HEAD_LEN + ((buf[14] << 8) | buf[15]);
+	
+	if (len < total) {
+		return 0;
+	}
+	/* LOCAL (health checks) and unix sockets keep the peer */
+	if ((buf[12] & 0x0f) == 1) {
+		if ((buf[13] >> 4) == 1 && total >= PROXY_V2_HEAD_LEN + 12) {
+			family = AF_INET;
+		} else if ((buf[13] >> 4) == 2 && total >= PROXY_V2_HEAD_LEN + 36) {
+			family = AF_INET6;
+		}
+	}
+	if (family && inet_ntop(family, &buf[PROXY_V2_HEAD_LEN], co->ip_peer, APE_IP_LEN) == NULL) {
+		return -1;
+	}
+	
+	return total;
+}
+
+/* Consume the PROXY protocol header, return 1 once the request can be parsed */
+int realip_proxy_header(ape_socket *co, acetables *g_ape)
+{
+	char *buf = co->buffer_in.data;
+	size_t len = co->buffer_in.length;
+	int ret;
+	
+	if (memcmp(buf, "PROXY ", (len < 6 ? len : 6)) == 0) {
+		ret = proxy_v1(co, buf, len);
+	} else if (memcmp(buf, PROXY_V2_SIG, (len < PROXY_V2_SIG_LEN ? len : PROXY_V2_SIG_LEN)) == 0) {
+		ret = proxy_v2(co, (unsigned char *)buf, len);
+	} else {
+		ret = -1;
+	}
+	
+	if (ret == 0) {
+		return 0;
+	}
+	if (ret < 0) {
+		alog_info("Invalid PROXY protocol header from %s", co->ip_client);
+		co->buffer_in.length = 0;
+		shutdown(co->fd, 2);
+		return 0;
+	}
+	
+	co->proxy_header = 0;
+	memcpy(co->ip_client, co->ip_peer, APE_IP_LEN);
+	
+	co->buffer_in.length -= ret;
+	memmove(buf, &buf[ret], co->buffer_in.length);
+	
+	return 1;
+}
+
+/* Rightmost untrusted address of the forwarded chain */
+static int realip_forwarded(ape_socket *co, http_state *http)
+{
+	char ip[APE_IP_LEN];
+	int i, found = 0;
+	
+	for (i = http->nheaders - 1; i >= 0; i--) {
+		const char *value, *end;
+		
+		if (strcasecmp(HTTP_HEADER_KEY(http, i), "X-Forwarded-For") != 0) {
+			continue;
+		}
+		value = HTTP_HEADER_VALUE(http, i);
+		end = value + strlen(value);
+		
+		while (end > value) {
+			const char *start = end;
+			
+			while (start > value && start[-1] != ',') {
+				start--;
+			}
+			if (!realip_copy(ip, start, end - start)) {
+				return found;
+			}
+			memcpy(co->ip_client, ip, APE_IP_LEN);
+			found = 1;
+			
+			if (!realip_trusted(ip)) {
+				return 1;
+			}
+			end = (start > value ? start - 1 : start);
+		}
+	}
+	
+	return found;
+}
+
+void realip_http(ape_socket *co, http_state *http)
+{
+	const char *real;
+	
+	memcpy(co->ip_client, co->ip_peer, APE_IP_LEN);
+	
+	if (!realip_trusted(co->ip_peer) || realip_forwarded(co, http)) {
+		return;
+	}
+	if ((real = http_header(http, HTTP_HEADER_X_REAL_IP)) != NULL) {
+		realip_copy(co->ip_client, real, strlen(real));
+	}
+}
@@ -0,0 +1,788 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Philipp Fuehrer <pf@netzbeben.de>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* rrc_store.c */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "rrc_store.h"
+#include "hash.h"
+#include "queue.h"
+#include "utils.h"
+#include "log.h"
+
+static uint32_t rrc_sum(uint32_t sum, const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum = ((sum << 5) + sum) + (unsigned char)buf[i];
+	}
+
+	return sum;
+}
+
+static char *rrc_file(const char *path, const char *name, unsigned int id, const char *ext)
+{
+	char *file;
+
+	if (ext == NULL) {
+		asprintf(&file, "%s/%s", path, name);
+	} else {
+		asprintf(&file, "%s/%s.%u.%s", path, name, id, ext);
+	}
+
+	return file;
+}
+
+static int rrc_id_cmp(const void *a, const void *b)
+{
+	unsigned int ia = *(const unsigned int *)a, ib = *(const unsigned int *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/* List "rrc.<n>.<ext>" ids in path (sorted). Must be free'd */
+static unsigned int *rrc_list_ids(const char *path, const char *ext, unsigned int *n)
+{
+	DIR *dir;
+	struct dirent *ent;
+	unsigned int *ids = NULL, size = 0;
+
+	*n = 0;
+
+	if ((dir = opendir(path)) == NULL) {
+		return NULL;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		unsigned int id;
+		char sext[8];
+
+		if (sscanf(ent->d_name, "rrc.%u.%7s", &id, sext) != 2 || strcmp(sext, ext) != 0) {
+			continue;
+		}
+		if (*n == size) {
+			size += 16;
+			ids = xrealloc(ids, sizeof(*ids) * size);
+		}
+		ids[(*n)++] = id;
+	}
+	closedir(dir);
+
+	if (*n) {
+		qsort(ids, *n, sizeof(*ids), rrc_id_cmp);
+	}
+
+	return ids;
+}
+
+static int rrc_open_segment(rrc_store *store)
+{
+	char *file = rrc_file(store->path, "rrc", store->active_id, "log");
+
+	store->fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0640);
+	store->active_size = 0;
+
+	if (store->fd == -1) {
+		alog_err("Cannot open raw_recently log segment %s : %s", file, strerror(errno));
+	}
+	free(file);
+
+	return store->fd;
+}
+
+static void *rrc_map(const char *file, size_t *size)
+{
+	int fd;
+	struct stat st;
+	void *addr;
+
+	*size = 0;
+
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED) {
+		return NULL;
+	}
+	*size = st.st_size;
+
+	return addr;
+}
+
+rrc_store *rrc_store_open(const char *path, size_t segment_size, size_t compact_size, unsigned int max_msg, unsigned int max_user)
+{
+	rrc_store *store;
+	unsigned int *ids, nids;
+
+	if (mkdir(path, 0750) == -1 && errno != EEXIST) {
+		alog_err("Cannot create raw_recently store %s : %s", path, strerror(errno));
+		return NULL;
+	}
+
+	store = xmalloc(sizeof(*store));
+	store->path = xstrdup(path);
+	store->segment_size = (segment_size ? segment_size : RRC_DEFAULT_SEGMENT_SIZE);
+	store->compact_size = (compact_size ? compact_size : RRC_DEFAULT_COMPACT_SIZE);
+	store->max_msg = max_msg;
+	store->max_user = max_user;
+	store->tail_size = 0;
+	store->replaying = 0;
+	store->fd = -1;
+	store->active_id = 0;
+
+	store->compact.snap = NULL;
+	store->compact.running = 0;
+	store->compact.done = 0;
+
+	/* Never append to an existing segment, a new one is started on each run */
+	if ((ids = rrc_list_ids(path, "log", &nids)) != NULL) {
+		store->active_id = ids[nids-1] + 1;
+		free(ids);
+	}
+	if ((ids = rrc_list_ids(path, "dat", &nids)) != NULL) {
+		store->active_id = MAX(store->active_id, ids[nids-1] + 1);
+		free(ids);
+	}
+
+	if (rrc_open_segment(store) == -1) {
+		free(store->path);
+		free(store);
+		return NULL;
+	}
+
+	return store;
+}
+
+/* Replay a log segment, stop at the first truncated/corrupted record */
+static size_t rrc_replay_segment(const char *file, struct _rrc_store_cb *cb)
+{
+	size_t size, pos = 0;
+	char *map = rrc_map(file, &size);
+
+	if (map == NULL) {
+		return 0;
+	}
+
+	while (pos + sizeof(struct rrc_rec_header) <= size) {
+		struct rrc_rec_header rec;
+		const char *key, *to, *data;
+
+		memcpy(&rec, map + pos, sizeof(rec));
+
+		if ((rec.type != RRC_REC_RAW && rec.type != RRC_REC_PAIR) ||
+			size - pos - sizeof(rec) < (size_t)rec.klen + rec.tlen + rec.vlen) {
+			break;
+		}
+		key = map + pos + sizeof(rec);
+		to = key + rec.klen;
+		data = to + rec.tlen;
+
+		if (rrc_sum(rrc_sum(rrc_sum(5381, key, rec.klen), to, rec.tlen), data, rec.vlen) != rec.sum) {
+			alog_warn("Corrupted record in %s at %lu, skipping the rest of the segment", file, (unsigned long)pos);
+			break;
+		}
+
+		if (rec.type == RRC_REC_RAW) {
+			char *skey = strndup(key, rec.klen);
+
+			cb->on_raw(skey, data, rec.vlen, cb->arg);
+			free(skey);
+		} else {
+			char *sfrom = strndup(key, rec.klen), *sto = strndup(to, rec.tlen);
+
+			cb->on_pair(sfrom, sto, data, rec.vlen, cb->arg);
+			free(sfrom);
+			free(sto);
+		}
+
+		pos += sizeof(rec) + rec.klen + rec.tlen + rec.vlen;
+	}
+
+	munmap(map, size);
+
+	return pos;
+}
+
+/* off/len from the index fit in a data file of size bytes (no wrapping sum) */
+#define RRC_IN(off, len, size) ((size_t)(off) <= (size) && (size_t)(len) <= (size) - (size_t)(off))
+
+/*
+	Read the state covered by segments < upto : the last compacted index
+	(and its data file) then the log segments written after it.
+	Returns the log bytes replayed, *header is zeroed when there is no index.
+*/
+static size_t rrc_read(const char *path, unsigned int upto, struct _rrc_store_cb *cb, struct rrc_idx_header *header)
+{
+	size_t isize = 0, dsize = 0, replayed = 0;
+	char *file, *idx, *dat = NULL;
+	unsigned int tail_id = 0, *ids, nids, i;
+
+	memset(header, 0, sizeof(*header));
+
+	file = rrc_file(path, "rrc.idx", 0, NULL);
+	idx = rrc_map(file, &isize);
+	free(file);
+
+	if (idx != NULL && isize >= sizeof(*header)) {
+		memcpy(header, idx, sizeof(*header));
+
+		if (memcmp(header->magic, RRC_STORE_MAGIC, sizeof(RRC_STORE_MAGIC)) != 0 ||
+			header->version != RRC_STORE_VERSION ||
+			isize < sizeof(*header) + header->nraws * sizeof(struct rrc_idx_raw) + header->nlinks * sizeof(struct rrc_idx_link)) {
+			alog_err("Invalid raw_recently index in %s, ignoring it", path);
+			memset(header, 0, sizeof(*header));
+		} else {
+			file = rrc_file(path, "rrc", header->data_id, "dat");
+			dat = rrc_map(file, &dsize);
+			free(file);
+
+			if (dat != NULL || (header->nraws == 0 && header->nlinks == 0)) {
+				struct rrc_idx_raw *raws = (struct rrc_idx_raw *)(idx + sizeof(*header));
+				struct rrc_idx_link *links = (struct rrc_idx_link *)(raws + header->nraws);
+
+				tail_id = header->tail_id;
+
+				for (i = 0; i < header->nlinks; i++) {
+					char *owner, *peer;
+
+					if (!RRC_IN(links[i].owner_off, links[i].owner_len, dsize) || !RRC_IN(links[i].peer_off, links[i].peer_len, dsize)) {
+						break;
+					}
+					owner = strndup(dat + links[i].owner_off, links[i].owner_len);
+					peer = strndup(dat + links[i].peer_off, links[i].peer_len);
+
+					cb->on_link(owner, peer, cb->arg);
+
+					free(owner);
+					free(peer);
+				}
+				for (i = 0; i < header->nraws; i++) {
+					char *key;
+
+					if (!RRC_IN(raws[i].key_off, raws[i].key_len, dsize) || !RRC_IN(raws[i].data_off, raws[i].data_len, dsize)) {
+						break;
+					}
+					key = strndup(dat + raws[i].key_off, raws[i].key_len);
+
+					cb->on_raw(key, dat + raws[i].data_off, raws[i].data_len, cb->arg);
+
+					free(key);
+				}
+			} else {
+				alog_err("Missing raw_recently data file %u in %s", header->data_id, path);
+				memset(header, 0, sizeof(*header));
+			}
+		}
+	}
+	if (dat != NULL) {
+		munmap(dat, dsize);
+	}
+	if (idx != NULL) {
+		munmap(idx, isize);
+	}
+
+	if ((ids = rrc_list_ids(path, "log", &nids)) != NULL) {
+		for (i = 0; i < nids && ids[i] < upto; i++) {
+			if (ids[i] < tail_id) {
+				continue;
+			}
+			file = rrc_file(path, "rrc", ids[i], "log");
+			replayed += rrc_replay_segment(file, cb);
+			free(file);
+		}
+		free(ids);
+	}
+
+	return replayed;
+}
+
+/*
+	Start : the queues are rebuilt in memory by replaying the compacted
+	state (index and data file, read through mmap) then the log segments
+	written after it. Startup stays linear in the stored raws, compaction
+	only saves reading the records it superseded.
+*/
+void rrc_store_load(rrc_store *store, struct _rrc_store_cb *cb)
+{
+	struct rrc_idx_header header;
+
+	store->replaying = 1;
+
+	/* the active segment is new (see rrc_store_open), everything else is older */
+	store->tail_size += rrc_read(store->path, store->active_id, cb, &header);
+
+	if (header.nraws || header.nlinks) {
+		alog_info("raw_recently index replayed : %u raws, %u links", header.nraws, header.nlinks);
+	}
+
+	store->replaying = 0;
+}
+
+static void rrc_append(rrc_store *store, rrc_rec_t type, const char *key, const char *to, RAW *raw)
+{
+	struct rrc_rec_header rec;
+	struct iovec iov[4];
+	ssize_t len, want;
+
+	if (store == NULL || store->replaying || store->fd == -1) {
+		return;
+	}
+
+	rec.type = type;
+	rec.klen = strlen(key);
+	rec.tlen = (to != NULL ? strlen(to) : 0);
+	rec.vlen = raw->len;
+	rec.sum = rrc_sum(rrc_sum(rrc_sum(5381, key, rec.klen), to, rec.tlen), raw->data, rec.vlen);
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)key;
+	iov[1].iov_len = rec.klen;
+	iov[2].iov_base = (void *)to;
+	iov[2].iov_len = rec.tlen;
+	iov[3].iov_base = raw->data;
+	iov[3].iov_len = rec.vlen;
+
+	want = sizeof(rec) + rec.klen + rec.tlen + rec.vlen;
+
+	/* A single writev() keeps records whole for O_APPEND */
+	if ((len = writev(store->fd, iov, 4)) != want) {
+		if (len == -1) {
+			alog_errlog("rrc_append() - writev()");
+			return;
+		}
+		/* short write (e.g. ENOSPC) : cut the torn record, or stop appending after it */
+		alog_err("rrc_append() - short write (%ld of %ld bytes)", (long)len, (long)want);
+
+		if (ftruncate(store->fd, store->active_size) == -1) {
+			alog_errlog("rrc_append() - ftruncate(), raw_recently store disabled");
+			close(store->fd);
+			store->fd = -1;
+		}
+		return;
+	}
+
+	store->active_size += len;
+	store->tail_size += len;
+
+	if (store->active_size >= store->segment_size) {
+		close(store->fd);
+		store->active_id++;
+		rrc_open_segment(store);
+	}
+}
+
+void rrc_store_append_raw(rrc_store *store, const char *key, RAW *raw)
+{
+	rrc_append(store, RRC_REC_RAW, key, NULL, raw);
+}
+
+void rrc_store_append_pair(rrc_store *store, const char *from, const char *to, RAW *raw)
+{
+	rrc_append(store, RRC_REC_PAIR, from, to, raw);
+}
+
+/*
+	Compaction state : the same bounded queues as raw_recently.c, rebuilt
+	from the files by the compaction thread, so the event loop only has to
+	rotate the log segment.
+*/
+struct rrc_blob {
+	uint32_t len;
+	char data[];
+};
+
+struct _rrc_snapshot {
+	HTBL *raws;		/* key -> Queue of struct rrc_blob, oldest first */
+	HTBL *index;	/* uin -> Queue of peers (char *), most recent first */
+
+	char *path;
+
+	unsigned int max_msg;
+	unsigned int max_user;
+
+	unsigned int data_id;
+	unsigned int tail_id;
+};
+
+static rrc_snapshot *rrc_snapshot_new(rrc_store *store)
+{
+	rrc_snapshot *snap = xmalloc(sizeof(*snap));
+
+	snap->raws = hashtbl_init();
+	snap->index = hashtbl_init();
+	snap->path = xstrdup(store->path);
+	snap->max_msg = store->max_msg;
+	snap->max_user = store->max_user;
+	snap->data_id = snap->tail_id = 0;
+
+	return snap;
+}
+
+static void rrc_snapshot_free(rrc_snapshot *snap)
+{
+	hashtbl_free(snap->raws, queue_destroy);
+	hashtbl_free(snap->index, queue_destroy);
+	free(snap->path);
+	free(snap);
+}
+
+static void rrc_snapshot_raw(const char *key, const char *data, unsigned int len, void *arg)
+{
+	rrc_snapshot *snap = arg;
+	Queue *raws = hashtbl_seek(snap->raws, key);
+	struct rrc_blob *blob;
+
+	if (raws == NULL) {
+		raws = queue_new(snap->max_msg, free);
+		hashtbl_append(snap->raws, key, raws);
+	}
+	blob = xmalloc(sizeof(*blob) + len);
+	blob->len = len;
+	memcpy(blob->data, data, len);
+
+	queue_fixlen_push_tail(raws, blob);
+}
+
+/* Put "peer" at the head of "owner"'s index (no-op if already there) */
+static void rrc_snapshot_link(const char *owner, const char *peer, void *arg)
+{
+	rrc_snapshot *snap = arg;
+	Queue *index = hashtbl_seek(snap->index, owner);
+	QueueEntry *qe;
+
+	if (index == NULL) {
+		index = queue_new(snap->max_user, free);
+		hashtbl_append(snap->index, owner, index);
+	}
+	queue_iterate(index, qe) {
+		if (strcmp(qe->data, peer) == 0) {
+			return;
+		}
+	}
+	queue_fixlen_push_head(index, xstrdup(peer));
+}
+
+static void rrc_snapshot_pair(const char *from, const char *to, const char *data, unsigned int len, void *arg)
+{
+	char hkey[128];
+
+	rrc_snapshot_link(from, to, arg);
+	rrc_snapshot_link(to, from, arg);
+
+	RRC_PAIR_KEY(hkey, from, to);
+
+	rrc_snapshot_raw(hkey, data, len, arg);
+}
+
+static int rrc_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Append a string to the data file */
+static int rrc_write_str(int fd, const char *str, size_t len, uint32_t *off, uint32_t *slen, uint32_t *pos)
+{
+	*off = *pos;
+	*slen = len;
+	*pos += len;
+
+	return rrc_write_all(fd, str, len);
+}
+
+/*
+	Compaction : rebuild the state covered by the segments < tail_id, write
+	it in a new data file + index and drop the files it supersedes.
+	Runs in its own thread (or inline at shutdown), only reads files the
+	event loop no longer writes.
+*/
+static void *rrc_compact_thread(void *arg)
+{
+	rrc_snapshot *snap = arg;
+	struct _rrc_store_cb cb = {rrc_snapshot_raw, rrc_snapshot_pair, rrc_snapshot_link, snap};
+	char *dat_tmp, *dat, *idx_tmp, *idx;
+	int dfd = -1, ifd = -1, failed = 1;
+	uint32_t pos = 0;
+	unsigned int i, n, *ids, nids;
+	struct rrc_idx_header header;
+	struct rrc_idx_raw *raws = NULL;
+	struct rrc_idx_link *links = NULL;
+	HTBL_ITEM *item;
+	QueueEntry *qe;
+
+	rrc_read(snap->path, snap->tail_id, &cb, &header);
+
+	memset(&header, 0, sizeof(header));
+
+	for (item = snap->raws->first; item != NULL; item = item->lnext) {
+		header.nraws += ((Queue *)item->addrs)->num;
+	}
+	for (item = snap->index->first; item != NULL; item = item->lnext) {
+		header.nlinks += ((Queue *)item->addrs)->num;
+	}
+	raws = xmalloc(sizeof(*raws) * (header.nraws + 1));
+	links = xmalloc(sizeof(*links) * (header.nlinks + 1));
+
+	dat = rrc_file(snap->path, "rrc", snap->data_id, "dat");
+	asprintf(&dat_tmp, "%s.tmp", dat);
+	idx = rrc_file(snap->path, "rrc.idx", 0, NULL);
+	asprintf(&idx_tmp, "%s.tmp", idx);
+
+	if ((dfd = open(dat_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640)) == -1 ||
+		(ifd = open(idx_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640)) == -1) {
+		goto out;
+	}
+
+	/* links oldest first : they are replayed with a push on the head */
+	n = 0;
+	for (item = snap->index->first; item != NULL; item = item->lnext) {
+		uint32_t owner_off = 0, owner_len = 0;
+
+		for (qe = ((Queue *)item->addrs)->tail; qe != NULL; qe = qe->prev, n++) {
+			if (qe == ((Queue *)item->addrs)->tail) {
+				if (rrc_write_str(dfd, item->key, strlen(item->key), &owner_off, &owner_len, &pos) == -1) {
+					goto out;
+				}
+			}
+			links[n].owner_off = owner_off;
+			links[n].owner_len = owner_len;
+
+			if (rrc_write_str(dfd, qe->data, strlen(qe->data), &links[n].peer_off, &links[n].peer_len, &pos) == -1) {
+				goto out;
+			}
+		}
+	}
+	/* raws oldest first, the key is written once per queue */
+	n = 0;
+	for (item = snap->raws->first; item != NULL; item = item->lnext) {
+		uint32_t key_off = 0, key_len = 0;
+
+		queue_iterate(((Queue *)item->addrs), qe) {
+			struct rrc_blob *blob = qe->data;
+
+			if (qe == ((Queue *)item->addrs)->head) {
+				if (rrc_write_str(dfd, item->key, strlen(item->key), &key_off, &key_len, &pos) == -1) {
+					goto out;
+				}
+			}
+			raws[n].key_off = key_off;
+			raws[n].key_len = key_len;
+
+			if (rrc_write_str(dfd, blob->data, blob->len, &raws[n].data_off, &raws[n].data_len, &pos) == -1) {
+				goto out;
+			}
+			n++;
+		}
+	}
+
+	memcpy(header.magic, RRC_STORE_MAGIC, sizeof(RRC_STORE_MAGIC));
+	header.version = RRC_STORE_VERSION;
+	header.data_id = snap->data_id;
+	header.tail_id = snap->tail_id;
+
+	if (rrc_write_all(ifd, &header, sizeof(header)) == -1 ||
+		rrc_write_all(ifd, raws, sizeof(*raws) * header.nraws) == -1 ||
+		rrc_write_all(ifd, links, sizeof(*links) * header.nlinks) == -1) {
+		goto out;
+	}
+
+	if (fsync(dfd) == -1 || fsync(ifd) == -1) {
+		goto out;
+	}
+
+	/* rename() of the index is the commit point */
+	if (rename(dat_tmp, dat) == -1 || rename(idx_tmp, idx) == -1) {
+		goto out;
+	}
+	failed = 0;
+
+	/* Drop everything the new index supersedes */
+	if ((ids = rrc_list_ids(snap->path, "log", &nids)) != NULL) {
+		for (i = 0; i < nids && ids[i] < snap->tail_id; i++) {
+			char *file = rrc_file(snap->path, "rrc", ids[i], "log");
+			unlink(file);
+			free(file);
+		}
+		free(ids);
+	}
+	if ((ids = rrc_list_ids(snap->path, "dat", &nids)) != NULL) {
+		for (i = 0; i < nids; i++) {
+			if (ids[i] != snap->data_id) {
+				char *file = rrc_file(snap->path, "rrc", ids[i], "dat");
+				unlink(file);
+				free(file);
+			}
+		}
+		free(ids);
+	}
+
+out:
+	if (failed) {
+		alog_err("raw_recently compaction failed (%s) : %s", snap->path, strerror(errno));
+		unlink(dat_tmp);
+		unlink(idx_tmp);
+	}
+	if (dfd != -1) {
+		close(dfd);
+	}
+	if (ifd != -1) {
+		close(ifd);
+	}
+
+	free(raws);
+	free(links);
+	free(dat);
+	free(dat_tmp);
+	free(idx);
+	free(idx_tmp);
+
+	return NULL;
+}
+
+int rrc_store_need_compact(rrc_store *store)
+{
+	return (store != NULL && !store->replaying && !store->compact.running && store->tail_size >= store->compact_size);
+}
+
+/* Start a new segment : the snapshot covers everything written before it */
+static void rrc_store_rotate(rrc_store *store, rrc_snapshot *snap)
+{
+	if (store->fd != -1) {
+		close(store->fd);
+	}
+	store->active_id++;
+
+	snap->data_id = store->active_id;
+	snap->tail_id = store->active_id;
+
+	store->active_id++;
+	store->tail_size = 0;
+
+	rrc_open_segment(store);
+}
+
+static void *rrc_compact_worker(void *arg)
+{
+	rrc_store *store = arg;
+
+	rrc_compact_thread(store->compact.snap);
+
+	__sync_synchronize();
+	store->compact.done = 1;
+
+	return NULL;
+}
+
+void rrc_store_compact(rrc_store *store)
+{
+	rrc_snapshot *snap;
+
+	if (store->compact.running) {
+		return;
+	}
+	snap = rrc_snapshot_new(store);
+
+	rrc_store_rotate(store, snap);
+
+	store->compact.snap = snap;
+	store->compact.done = 0;
+	store->compact.running = 1;
+
+	if (pthread_create(&store->compact.thread, NULL, rrc_compact_worker, store) != 0) {
+		alog_errlog("rrc_store_compact() - pthread_create()");
+		store->compact.running = 0;
+		store->compact.snap = NULL;
+		rrc_snapshot_free(snap);
+	}
+}
+
+/* Reap a finished compaction (called from the event loop) */
+void rrc_store_poll(rrc_store *store)
+{
+	if (store == NULL || !store->compact.running || !store->compact.done) {
+		return;
+	}
+
+	pthread_join(store->compact.thread, NULL);
+
+	rrc_snapshot_free(store->compact.snap);
+
+	store->compact.snap = NULL;
+	store->compact.running = 0;
+	store->compact.done = 0;
+}
+
+/* Wait for the pending compaction and compact the log inline so the next start reads no log */
+void rrc_store_close(rrc_store *store)
+{
+	if (store == NULL) {
+		return;
+	}
+
+	if (store->compact.running) {
+		pthread_join(store->compact.thread, NULL);
+		store->compact.done = 1;
+		rrc_store_poll(store);
+	}
+
+	if (store->tail_size > 0) {
+		rrc_snapshot *last = rrc_snapshot_new(store);
+
+		rrc_store_rotate(store, last);
+		rrc_compact_thread(last);
+		rrc_snapshot_free(last);
+	}
+
+	if (store->fd != -1) {
+		close(store->fd);
+	}
+
+	free(store->path);
+	free(store);
+}
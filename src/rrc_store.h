@@ -0,0 +1,137 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Philipp Fuehrer <pf@netzbeben.de>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* rrc_store.h */
+
+#ifndef _RRC_STORE_H
+#define _RRC_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "main.h"
+#include "raw.h"
+
+/*
+	On-disk layout (all files live in RawRecently::store_path) :
+
+	rrc.idx      : index of the last compaction (read through mmap on start).
+	               rrc_idx_header, nraws * rrc_idx_raw, nlinks * rrc_idx_link
+	rrc.<n>.dat  : strings and raw payloads referenced by rrc.idx
+	rrc.<n>.log  : append-only log segments written since the last compaction
+	               (replayed on start when n >= rrc_idx_header.tail_id)
+*/
+
+#define RRC_STORE_MAGIC "APERRC1"
+#define RRC_STORE_VERSION 1
+
+#define RRC_DEFAULT_SEGMENT_SIZE 4194304 	/* 4 MB */
+#define RRC_DEFAULT_COMPACT_SIZE 16777216 	/* 16 MB of log before a compaction */
+
+typedef enum {
+	RRC_REC_RAW = 0x52524301,	/* key, raw */
+	RRC_REC_PAIR = 0x52524302	/* from, to, raw */
+} rrc_rec_t;
+
+struct rrc_idx_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t data_id;
+	uint32_t tail_id;
+	uint32_t nraws;
+	uint32_t nlinks;
+	uint32_t reserved;
+};
+
+struct rrc_idx_raw {
+	uint32_t key_off;
+	uint32_t key_len;
+	uint32_t data_off;
+	uint32_t data_len;
+};
+
+/* one-sided index entry : "peer" is in "owner" recent list */
+struct rrc_idx_link {
+	uint32_t owner_off;
+	uint32_t owner_len;
+	uint32_t peer_off;
+	uint32_t peer_len;
+};
+
+struct rrc_rec_header {
+	uint32_t type;
+	uint32_t klen;	/* key (or "from") length */
+	uint32_t tlen;	/* "to" length (RRC_REC_PAIR only) */
+	uint32_t vlen;	/* raw length */
+	uint32_t sum;
+};
+
+/* compaction state, see rrc_store.c */
+typedef struct _rrc_snapshot rrc_snapshot;
+
+/* queue key of a pair, the same whatever the direction : "10_11" */
+#define RRC_PAIR_KEY(hkey, from, to)						\
+	if (strcmp(from, to) < 0) {								\
+		snprintf(hkey, sizeof(hkey), "%s_%s", from, to);	\
+	} else {												\
+		snprintf(hkey, sizeof(hkey), "%s_%s", to, from);	\
+	}
+
+typedef struct _rrc_store rrc_store;
+struct _rrc_store {
+	struct {
+		rrc_snapshot *snap;
+		pthread_t thread;
+		int running;
+		volatile int done;
+	} compact;
+
+	char *path;
+
+	size_t segment_size;
+	size_t compact_size;
+	unsigned int max_msg;	/* queues bounds, applied again by the compaction */
+	unsigned int max_user;
+	size_t active_size;
+	size_t tail_size; /* log bytes written since the last compaction */
+
+	int fd;
+	int replaying;
+	unsigned int active_id;
+};
+
+struct _rrc_store_cb {
+	void (*on_raw)(const char *key, const char *data, unsigned int len, void *arg);
+	void (*on_pair)(const char *from, const char *to, const char *data, unsigned int len, void *arg);
+	void (*on_link)(const char *owner, const char *peer, void *arg);
+	void *arg;
+};
+
+rrc_store *rrc_store_open(const char *path, size_t segment_size, size_t compact_size, unsigned int max_msg, unsigned int max_user);
+void rrc_store_load(rrc_store *store, struct _rrc_store_cb *cb);
+void rrc_store_close(rrc_store *store);
+
+void rrc_store_append_raw(rrc_store *store, const char *key, RAW *raw);
+void rrc_store_append_pair(rrc_store *store, const char *from, const char *to, RAW *raw);
+
+int rrc_store_need_compact(rrc_store *store);
+void rrc_store_compact(rrc_store *store);
+void rrc_store_poll(rrc_store *store);
+
+#endif
@@ -27,10 +27,14 @@
 #include "handle_http.h"
 #include "transports.h"
 #include "parser.h"
+#include "realip.h"
 #include "main.h"
 
 static void ape_read(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
 {
+	if (co->proxy_header && !realip_proxy_header(co, g_ape)) {
+		return;
+	}
 	co->parser.parser_func(co, g_ape);
 }
 
@@ -54,7 +58,8 @@ static void ape_disconnect(ape_socket *co, acetables *g_ape)
 		
 		if (co->fd == ((subuser *)(co->attach))->client->fd) {
 
-			if (((subuser *)(co->attach))->state == ALIVE) {
+			/* an event-stream is reopened by the browser itself (Last-Event-ID) : keep the subuser */
+			if (((subuser *)(co->attach))->state == ALIVE && ((subuser *)(co->attach))->user->transport != TRANSPORT_SSE_LONGPOLLING) {
 				/*
 				 * user left or refreshed this page, so, del this subuser
 				 * (
@@ -77,9 +82,15 @@ static void ape_disconnect(ape_socket *co, acetables *g_ape)
 	}
 }
 
+/* request body limit of the listener (bytes), checked as the body streams in */
+static int max_body_size = MAX_CONTENT_LENGTH;
+
 static void ape_onaccept(ape_socket *co, acetables *g_ape)
 {
 	co->parser = parser_init_http(co);
+	((http_state *)co->parser.data)->max_body = max_body_size;
+	
+	realip_accept(co);
 }
 
 int servers_init(acetables *g_ape)
@@ -88,6 +99,9 @@ int servers_init(acetables *g_ape)
 	if ((main_server = ape_listen(atoi(CONFIG_VAL(Server, port, g_ape->srv)), CONFIG_VAL(Server, ip_listen, g_ape->srv), g_ape)) == NULL) {
 		return 0;
 	}
+	if (atoi(CONFIG_VAL(Server, max_body_size, g_ape->srv)) > 0) {
+		max_body_size = atoi(CONFIG_VAL(Server, max_body_size, g_ape->srv));
+	}
 
 	main_server->callbacks.on_read = ape_read;
 	main_server->callbacks.on_disconnect = ape_disconnect;
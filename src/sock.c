@@ -20,6 +20,9 @@
 /* sock.c */
 
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <time.h>
 #include <errno.h>
@@ -38,9 +41,14 @@
 #include "handle_http.h"
 #include "dns.h"
 #include "log.h"
+#include "metrics.h"
 #include "parser.h"
+#include "compress.h"
+#include "static_files.h"
 
-static int sendqueue(int sock, acetables *g_ape);
+static int sendqueue(int sock, int len, acetables *g_ape);
+static int sendqueue_file(int sock, acetables *g_ape);
+static int sendqueue_all(int sock, acetables *g_ape);
 
 
 static void growup(int *basemem, ape_socket ***conn_ptr, struct _fdevent *ev, struct _socks_bufout **bufout)
@@ -105,10 +113,100 @@ ape_socket *ape_listen(unsigned int port, char *listen_ip, acetables *g_ape)
 	return g_ape->co[sock];
 }
 
+static struct {
+	unsigned int timeout;
+	int retries;
+	unsigned int backoff;
+} connect_policy = {CONNECT_TIMEOUT_DEFAULT, CONNECT_RETRIES_DEFAULT, CONNECT_BACKOFF_DEFAULT};
+
+struct _ape_connect_timeout
+{
+	ape_socket *co;
+	acetables *g_ape;
+};
+
+void ape_connect_init(acetables *g_ape)
+{
+	char *timeout = CONFIG_VAL(Server, connect_timeout, g_ape->srv);
+	char *retries = CONFIG_VAL(Server, connect_retries, g_ape->srv);
+	char *backoff = CONFIG_VAL(Server, connect_backoff, g_ape->srv);
+	
+	if (atoi(timeout) > 0) {
+		connect_policy.timeout = atoi(timeout);
+	}
+	if (*retries != '\0') {
+		connect_policy.retries = atoi(retries);
+	}
+	if (atoi(backoff) > 0) {
+		connect_policy.backoff = atoi(backoff);
+	}
+}
+
+const char *ape_connect_strerror(int error)
+{
+	switch (error) {
+		case APE_CONNECT_EDNS:
+			return "dns";
+		case APE_CONNECT_EREFUSED:
+			return "refused";
+		case APE_CONNECT_ETIMEOUT:
+			return "timeout";
+		default:
+			return "unreachable";
+	}
+}
+
+static int ape_connect_errno(int err)
+{
+	switch (err) {
+		case ECONNREFUSED:
+			return APE_CONNECT_EREFUSED;
+		case ETIMEDOUT:
+			return APE_CONNECT_ETIMEOUT;
+		default:
+			return APE_CONNECT_EUNREACH;
+	}
+}
+
+static void ape_connect_cancel_timeout(ape_socket *co, acetables *g_ape)
+{
+	if (co->connect_timer != NULL) {
+		free(co->connect_timer->params);
+		del_timer_identifier(co->connect_timer->identifier, g_ape);
+		co->connect_timer = NULL;
+	}
+}
+
+/* Report the failure and release the socket */
+static void ape_connect_failed(ape_socket *co, int error, acetables *g_ape)
+{
+	if (co->callbacks.on_connect_failed != NULL) {
+		co->callbacks.on_connect_failed(co, error, g_ape);
+	} else if (co->callbacks.on_disconnect != NULL) {
+		co->callbacks.on_disconnect(co, g_ape);
+	}
+	close_socket(co->fd, g_ape);
+}
+
+static void ape_connect_timeout(struct _ape_connect_timeout *params, int *last)
+{
+	ape_socket *co = params->co;
+	acetables *g_ape = params->g_ape;
+	
+	co->connect_timer = NULL;
+	free(params);
+	
+	if (co->stream_type == STREAM_OUT && co->state == STREAM_PROGRESS) {
+		ape_connect_failed(co, APE_CONNECT_ETIMEOUT, g_ape);
+	}
+}
+
+/* NULL is returned (errno set) if the connection can't be initiated */
 ape_socket *ape_connect(char *ip, int port, acetables *g_ape)
 {
-	int sock, ret;
+	int sock, err;
 	struct sockaddr_in addr;
+	struct _ape_connect_timeout *params;
 	
 	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		alog_errlog("ape_connect() - socket() : %s");
@@ -122,7 +220,12 @@ ape_socket *ape_connect(char *ip, int port, acetables *g_ape)
 
 	setnonblocking(sock);
 	
-	if (connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == 0 || errno != EINPROGRESS) {
+	/* an immediate success is reported by the first EVENT_WRITE as well */
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == -1 && errno != EINPROGRESS) {
+		err = errno;
+		close(sock);
+		errno = err;
+		
 		return NULL;
 	}
 
@@ -139,42 +242,131 @@ ape_socket *ape_connect(char *ip, int port, acetables *g_ape)
 	g_ape->bufout[sock].buf = NULL;
 	g_ape->bufout[sock].buflen = 0;
 	g_ape->bufout[sock].allocsize = 0;
+	g_ape->bufout[sock].remaining = 0;
+
+	params = xmalloc(sizeof(*params));
+	params->co = g_ape->co[sock];
+	params->g_ape = g_ape;
+	
+	g_ape->co[sock]->connect_timer = add_timeout(connect_policy.timeout, ape_connect_timeout, params, g_ape);
 
-	ret = events_add(g_ape->events, sock, EVENT_READ|EVENT_WRITE);
+	events_add(g_ape->events, sock, EVENT_READ|EVENT_WRITE);
 	
 	return g_ape->co[sock];	
 }
 
+static void ape_connect_name_cb(char *ip, void *data, acetables *g_ape);
+
+static void ape_connect_name_free(struct _ape_sock_connect_async *asca)
+{
+	free(asca->name);
+	free(asca->sock);
+	free(asca);
+}
+
+static void ape_connect_name_retry(struct _ape_sock_connect_async *asca, int *last)
+{
+	ape_gethostbyname(asca->name, ape_connect_name_cb, asca, asca->g_ape);
+}
+
+/* Retry with an exponential backoff and full jitter, or give up */
+static void ape_connect_name_error(struct _ape_sock_connect_async *asca, int error, acetables *g_ape)
+{
+	ape_socket *pattern = asca->sock;
+	
+	if (error != APE_CONNECT_EDNS && asca->attempt < connect_policy.retries) {
+		unsigned int delay = connect_policy.backoff << asca->attempt;
+		
+		if (delay > CONNECT_BACKOFF_MAX || delay < connect_policy.backoff) {
+			delay = CONNECT_BACKOFF_MAX;
+		}
+		asca->attempt++;
+		
+		add_timeout(1 + rand() % delay, ape_connect_name_retry, asca, g_ape);
+		
+		return;
+	}
+	
+	alog_warn("ape_connect_name() - can't connect to %s:%i (%s)", asca->name, asca->port, ape_connect_strerror(error));
+	
+	if (pattern->callbacks.on_connect_failed != NULL) {
+		pattern->callbacks.on_connect_failed(pattern, error, g_ape);
+	} else if (pattern->callbacks.on_disconnect != NULL) {
+		pattern->callbacks.on_disconnect(pattern, g_ape);
+	}
+	
+	ape_connect_name_free(asca);
+}
+
+static void ape_connect_name_failed(ape_socket *sock, int error, acetables *g_ape)
+{
+	struct _ape_sock_connect_async *asca = sock->connect_async;
+	
+	sock->connect_async = NULL;
+	
+	ape_connect_name_error(asca, error, g_ape);
+}
+
+static void ape_connect_name_connected(ape_socket *sock, acetables *g_ape)
+{
+	struct _ape_sock_connect_async *asca = sock->connect_async;
+	
+	sock->connect_async = NULL;
+	sock->callbacks.on_connect = asca->sock->callbacks.on_connect;
+	sock->callbacks.on_connect_failed = NULL;
+	
+	ape_connect_name_free(asca);
+	
+	if (sock->callbacks.on_connect != NULL) {
+		sock->callbacks.on_connect(sock, g_ape);
+	}
+}
+
 static void ape_connect_name_cb(char *ip, void *data, acetables *g_ape)
 {
 	struct _ape_sock_connect_async *asca = data;
 	ape_socket *sock;
 
-	if ((sock = ape_connect(ip, asca->port, g_ape)) != NULL) {
-		
-		sock->attach = asca->sock->attach;
+	if (ip == NULL) {
+		ape_connect_name_error(asca, APE_CONNECT_EDNS, g_ape);
 		
-		sock->callbacks.on_accept = asca->sock->callbacks.on_accept;         	
-		sock->callbacks.on_connect = asca->sock->callbacks.on_connect;
-		sock->callbacks.on_disconnect = asca->sock->callbacks.on_disconnect;
-		sock->callbacks.on_read = asca->sock->callbacks.on_read;
-		sock->callbacks.on_read_lf = asca->sock->callbacks.on_read_lf;
-		sock->callbacks.on_data_completly_sent = asca->sock->callbacks.on_data_completly_sent;
-		sock->callbacks.on_write = asca->sock->callbacks.on_write;
+		return;
 	}
-	
+	sock = ape_connect(ip, asca->port, g_ape);
 	free(ip);
-	free(asca->sock);
-	free(asca);
 	
+	if (sock == NULL) {
+		ape_connect_name_error(asca, ape_connect_errno(errno), g_ape);
+		
+		return;
+	}
+	sock->attach = asca->sock->attach;
+	sock->connect_async = asca;
+	
+	sock->callbacks.on_accept = asca->sock->callbacks.on_accept;
+	sock->callbacks.on_connect = ape_connect_name_connected;
+	sock->callbacks.on_connect_failed = ape_connect_name_failed;
+	sock->callbacks.on_disconnect = asca->sock->callbacks.on_disconnect;
+	sock->callbacks.on_read = asca->sock->callbacks.on_read;
+	sock->callbacks.on_read_lf = asca->sock->callbacks.on_read_lf;
+	sock->callbacks.on_data_completly_sent = asca->sock->callbacks.on_data_completly_sent;
+	sock->callbacks.on_write = asca->sock->callbacks.on_write;
 }
 
+/*
+	"pattern" callbacks and attach are copied to the connected socket.
+	Refused or timed out attempts are retried (Server.connect_retries), then
+	pattern->callbacks.on_connect_failed() (or on_disconnect) is called with the pattern.
+*/
 void ape_connect_name(char *name, int port, ape_socket *pattern, acetables *g_ape)
 {
 	struct _ape_sock_connect_async *asca = xmalloc(sizeof(*asca));
 	
 	asca->sock = pattern;
+	asca->name = xstrdup(name);
 	asca->port = port;
+	asca->attempt = 0;
+	asca->g_ape = g_ape;
 
 	ape_gethostbyname(name, ape_connect_name_cb, asca, g_ape);
 }
@@ -202,6 +394,11 @@ void close_socket(int fd, acetables *g_ape)
 		g_ape->bufout[fd].buf = NULL;
 		g_ape->bufout[fd].allocsize = 0;
 	}
+	
+	if (g_ape->bufout[fd].remaining) {
+		close(g_ape->bufout[fd].file);
+		g_ape->bufout[fd].remaining = 0;
+	}
 
 	if (co->buffer_in.data != NULL) {
 		free(co->buffer_in.data);
@@ -211,11 +408,22 @@ void close_socket(int fd, acetables *g_ape)
 		parser_destroy(&co->parser);
 	}
 	
+	if (co->compress.stream != NULL) {
+		compress_stream_release(co->compress.stream);
+		co->compress.stream = NULL;
+	}
+	
+	static_files_cancel(co);
+	
+	ape_connect_cancel_timeout(co, g_ape);
+	
 	events_remove(g_ape->events, fd);
 
 	co->idle = 0;
 
 	close(fd);
+
+	APE_METRIC_INC(APE_M_CLOSES);
 }
 
 /* Create socket struct if not exists */
@@ -263,6 +471,7 @@ unsigned int sockroutine(acetables *g_ape)
 	int new_fd, nfds, sin_size = sizeof(struct sockaddr_in), i, tfd = 0;
 
 	struct timeval t_start, t_end;	
+	struct timespec t_loop;
 	long int ticks = 0, uticks = 0, lticks = 0;
 	struct sockaddr_in their_addr;
 
@@ -276,8 +485,12 @@ unsigned int sockroutine(acetables *g_ape)
 		int timeout_to_hang = get_first_timer_ms(g_ape);
 		nfds = events_poll(g_ape->events, timeout_to_hang);
 
+		clock_gettime(CLOCK_MONOTONIC, &t_loop);
+
 		if (nfds < 0) {
-			alog_errlog("events_poll() : ");
+			if (errno != EINTR) { /* SIGHUP (log reopen), SIGTERM... */
+				alog_errlog("events_poll() : ");
+			}
 			continue;
 		}
 		
@@ -308,6 +521,8 @@ unsigned int sockroutine(acetables *g_ape)
 						}
 
 						prepare_ape_socket(new_fd, g_ape);
+
+						APE_METRIC_INC(APE_M_ACCEPTS);
 	
 						strncpy(g_ape->co[new_fd]->ip_client, inet_ntoa(their_addr.sin_addr), 16);
 						
@@ -324,6 +539,7 @@ unsigned int sockroutine(acetables *g_ape)
 						g_ape->bufout[new_fd].buf = NULL;
 						g_ape->bufout[new_fd].buflen = 0;
 						g_ape->bufout[new_fd].allocsize = 0;
+						g_ape->bufout[new_fd].remaining = 0;
 						
 						g_ape->co[new_fd]->callbacks.on_disconnect = g_ape->co[active_fd]->callbacks.on_disconnect;
 						g_ape->co[new_fd]->callbacks.on_read = g_ape->co[active_fd]->callbacks.on_read;
@@ -360,24 +576,20 @@ unsigned int sockroutine(acetables *g_ape)
 							
 							if (ret == 0 && serror == 0) {
 
+								ape_connect_cancel_timeout(g_ape->co[active_fd], g_ape);
 								g_ape->co[active_fd]->state = STREAM_ONLINE;
 								if (g_ape->co[active_fd]->callbacks.on_connect != NULL) {
 
 									g_ape->co[active_fd]->callbacks.on_connect(g_ape->co[active_fd], g_ape);
 								}
-							} else { /* This can happen ? epoll seems set EPOLLIN as if the host is disconnecting */
-
-								if (g_ape->co[active_fd]->callbacks.on_disconnect != NULL) {
-									g_ape->co[active_fd]->callbacks.on_disconnect(g_ape->co[active_fd], g_ape);
-								}
-
-								close_socket(active_fd, g_ape);
+							} else {
+								ape_connect_failed(g_ape->co[active_fd], ape_connect_errno(ret == 0 ? serror : errno), g_ape);
 								tfd--;
 								continue;
 							}							
-						} else if (g_ape->bufout[active_fd].buf != NULL) {
+						} else if (g_ape->bufout[active_fd].buf != NULL || g_ape->bufout[active_fd].remaining) {
 
-							if (sendqueue(active_fd, g_ape) == 1) {
+							if (sendqueue_all(active_fd, g_ape) == 1) {
 								
 								if (g_ape->co[active_fd]->callbacks.on_data_completly_sent != NULL) {
 									g_ape->co[active_fd]->callbacks.on_data_completly_sent(g_ape->co[active_fd], g_ape);
@@ -438,6 +650,8 @@ unsigned int sockroutine(acetables *g_ape)
 								} else {
 									
 									g_ape->co[active_fd]->buffer_in.length += readb;
+
+									APE_METRIC_ADD(APE_M_BYTES_READ, readb);
 									
 									/* realloc the buffer for the next read (x2) */
 									if (g_ape->co[active_fd]->buffer_in.length == g_ape->co[active_fd]->buffer_in.size) {
@@ -481,12 +695,19 @@ unsigned int sockroutine(acetables *g_ape)
 			}
 		}
 		
+		APE_METRIC_OBSERVE(APE_M_LOOP_TIME, metric_usec_since(&t_loop));
+
 		gettimeofday(&t_end, NULL);
 		
 		ticks = 0;
 		
 		uticks = 1000000L * (t_end.tv_sec - t_start.tv_sec);
 		uticks += (t_end.tv_usec - t_start.tv_usec);
+
+		/* woke up for a timer : how late are we ? */
+		if (nfds == 0 && timeout_to_hang > 0 && uticks > timeout_to_hang * 1000L) {
+			APE_METRIC_OBSERVE(APE_M_TIMER_LAG, uticks - timeout_to_hang * 1000L);
+		}
 		t_start = t_end;
 		lticks += uticks;
 		/* Tic tac, tic tac */
@@ -519,31 +740,45 @@ int sendf(int sock, acetables *g_ape, char *buf, ...)
 	return finish;
 }
 
-static int sendqueue(int sock, acetables *g_ape)
+/* Write the first "len" queued bytes (return 0 if the socket is full) */
+static int sendqueue(int sock, int len, acetables *g_ape)
 {
-	int t_bytes = 0, r_bytes, n = 0;
+	int t_bytes = 0, n = 0;
 	struct _socks_bufout *bufout = &g_ape->bufout[sock];
 	
 	if (bufout->buf == NULL) {
 		return 1;
 	}
 	
-	r_bytes = bufout->buflen;
-	
-	while(t_bytes < bufout->buflen) {
-		n = write(sock, bufout->buf + t_bytes, r_bytes);
+	while(t_bytes < len) {
+		n = write(sock, bufout->buf + t_bytes, len - t_bytes);
 		if (n == -1) {
-			if (errno == EAGAIN && r_bytes > 0) {
-				/* Still not complete */
-				memmove(bufout->buf, bufout->buf + t_bytes, r_bytes);
-				/* TODO : avoid memmove */
-				bufout->buflen = r_bytes;
-				return 0;
+			if (errno == EAGAIN) {
+				break;
 			}
+			/* error : the whole queue is dropped */
+			n = -2;
 			break;
 		}
 		t_bytes += n;
-		r_bytes -= n;		
+	}
+
+	APE_METRIC_ADD(APE_M_BYTES_WRITTEN, t_bytes);
+	
+	if (n == -2) {
+		t_bytes = bufout->buflen;
+	}
+	
+	if (bufout->remaining) {
+		bufout->file_at -= (t_bytes < bufout->file_at ? t_bytes : bufout->file_at);
+	}
+	if (t_bytes < bufout->buflen) {
+		/* Still not complete */
+		memmove(bufout->buf, bufout->buf + t_bytes, bufout->buflen - t_bytes);
+		/* TODO : avoid memmove */
+		bufout->buflen -= t_bytes;
+		
+		return (t_bytes == len);
 	}
 	
 	bufout->buflen = 0;
@@ -554,6 +789,68 @@ static int sendqueue(int sock, acetables *g_ape)
 	return 1;
 }
 
+/* Send what is left of the queued file (return 0 if the socket is full) */
+static int sendqueue_file(int sock, acetables *g_ape)
+{
+	struct _socks_bufout *bufout = &g_ape->bufout[sock];
+	ssize_t n;
+	
+	while (bufout->remaining) {
+		if ((n = sendfile(sock, bufout->file, &bufout->offset, bufout->remaining)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			if (n == -1 && errno == EAGAIN) {
+				return 0;
+			}
+			/* error or truncated file : the peer gets a short body */
+			break;
+		}
+		APE_METRIC_ADD(APE_M_BYTES_WRITTEN, n);
+		bufout->remaining -= n;
+	}
+	close(bufout->file);
+	bufout->remaining = 0;
+	
+	return 1;
+}
+
+/* Flush in order : "buf" up to the file, the file, then the rest of "buf" */
+static int sendqueue_all(int sock, acetables *g_ape)
+{
+	struct _socks_bufout *bufout = &g_ape->bufout[sock];
+	
+	if (bufout->remaining && (!sendqueue(sock, bufout->file_at, g_ape) || !sendqueue_file(sock, g_ape))) {
+		return 0;
+	}
+	
+	return sendqueue(sock, bufout->buflen, g_ape);
+}
+
+/* Keep what could not be written, it is sent (in order) once the socket is writable */
+static void sendbuffer(int sock, const char *bin, unsigned int len, unsigned int burn_after_writing, acetables *g_ape)
+{
+	struct _socks_bufout *bufout = &g_ape->bufout[sock];
+	
+	if (bufout->buf == NULL) {
+		bufout->allocsize = len + 128; /* add padding to prevent extra data to be reallocated */
+		bufout->buf = xmalloc(sizeof(char) * bufout->allocsize);
+		bufout->buflen = len;
+	} else {
+		bufout->buflen += len;
+		if (bufout->buflen > bufout->allocsize) {
+			bufout->allocsize = bufout->buflen + 128;
+			bufout->buf = xrealloc(bufout->buf, sizeof(char) * bufout->allocsize);
+		}
+	}
+	
+	memcpy(bufout->buf + (bufout->buflen - len), bin, len);
+	
+	if (burn_after_writing) {
+		g_ape->co[sock]->burn_after_writing = 1;
+	}
+}
+
 /* TODO : add "nowrite" flag to avoid write syscall when calling several time sendbin() */
 int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after_writing, acetables *g_ape)
 {
@@ -563,30 +860,18 @@ int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after
 
 	if (sock != 0) {
 		while(t_bytes < len) {
-			if (g_ape->bufout[sock].buf == NULL) {
+			/* anything queued (bytes or a file) goes first */
+			if (g_ape->bufout[sock].buf == NULL && !g_ape->bufout[sock].remaining) {
 				n = write(sock, bin + t_bytes, r_bytes);
 			} else {
 				n = -2;
 			}
 			if (n < 0) {
 				if ((errno == EAGAIN && r_bytes > 0) || (n == -2)) {
-					if (g_ape->bufout[sock].buf == NULL) {
-						g_ape->bufout[sock].allocsize = r_bytes + 128; /* add padding to prevent extra data to be reallocated */
-						g_ape->bufout[sock].buf = xmalloc(sizeof(char) * g_ape->bufout[sock].allocsize);
-						g_ape->bufout[sock].buflen = r_bytes;
-					} else {
-						g_ape->bufout[sock].buflen += r_bytes;
-						if (g_ape->bufout[sock].buflen > g_ape->bufout[sock].allocsize) {
-							g_ape->bufout[sock].allocsize = g_ape->bufout[sock].buflen + 128;
-							g_ape->bufout[sock].buf = xrealloc(g_ape->bufout[sock].buf, sizeof(char) * g_ape->bufout[sock].allocsize);
-						}
-					}
-					
-					memcpy(g_ape->bufout[sock].buf + (g_ape->bufout[sock].buflen - r_bytes), bin + t_bytes, r_bytes);
-					
-					if (burn_after_writing) {
-						g_ape->co[sock]->burn_after_writing = 1;
-					}
+					APE_METRIC_ADD(APE_M_BYTES_WRITTEN, t_bytes);
+					APE_METRIC_INC(APE_M_SEND_EAGAIN);
+
+					sendbuffer(sock, bin + t_bytes, r_bytes, burn_after_writing, g_ape);
 					
 					return 0;
 				}
@@ -598,6 +883,107 @@ int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after
 		}
 	}
 	
+	APE_METRIC_ADD(APE_M_BYTES_WRITTEN, t_bytes);
+
+	if (burn_after_writing) {
+		shutdown(sock, 2);
+	}
+	
+	return 1;
+}
+
+/*
+	Same as sendbin() for a set of buffers, written with as few writev() as
+	possible. "iov" is modified.
+*/
+int sendv(int sock, struct iovec *iov, int iovcnt, unsigned int burn_after_writing, acetables *g_ape)
+{
+	ssize_t n;
+	size_t t_bytes = 0;
+	
+	if (sock == 0) {
+		return 1;
+	}
+	while (iovcnt > 0 && iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	}
+	while (iovcnt > 0 && g_ape->bufout[sock].buf == NULL && !g_ape->bufout[sock].remaining) {
+		if ((n = writev(sock, iov, (iovcnt > IOV_MAX ? IOV_MAX : iovcnt))) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				iovcnt = 0; /* same as sendbin() : dropped */
+			}
+			break;
+		}
+		t_bytes += n;
+		
+		/* skip what was written */
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	
+	APE_METRIC_ADD(APE_M_BYTES_WRITTEN, t_bytes);
+	
+	if (iovcnt > 0) {
+		APE_METRIC_INC(APE_M_SEND_EAGAIN);
+		
+		for (; iovcnt > 0; iov++, iovcnt--) {
+			if (iov->iov_len) {
+				sendbuffer(sock, iov->iov_base, iov->iov_len, burn_after_writing, g_ape);
+			}
+		}
+		return 0;
+	}
+	
+	if (burn_after_writing) {
+		shutdown(sock, 2);
+	}
+	
+	return 1;
+}
+
+/*
+	Send "count" bytes of "file" from "offset" with sendfile(), after what is
+	already queued. "file" is closed once sent, what is sent after it is
+	queued behind. Only one file can be pending : returns -1 (and closes
+	"file") otherwise.
+*/
+int sendfd(int sock, int file, off_t offset, size_t count, unsigned int burn_after_writing, acetables *g_ape)
+{
+	struct _socks_bufout *bufout = &g_ape->bufout[sock];
+	
+	if (bufout->remaining) {
+		close(file);
+		return -1;
+	}
+	if (count == 0) {
+		close(file);
+		if (burn_after_writing) {
+			safe_shutdown(sock, g_ape);
+		}
+		return (bufout->buf == NULL);
+	}
+	bufout->file = file;
+	bufout->offset = offset;
+	bufout->remaining = count;
+	bufout->file_at = (bufout->buf != NULL ? bufout->buflen : 0);
+	
+	if (bufout->buf != NULL || !sendqueue_file(sock, g_ape)) {
+		if (burn_after_writing) {
+			g_ape->co[sock]->burn_after_writing = 1;
+		}
+		return 0;
+	}
 	if (burn_after_writing) {
 		shutdown(sock, 2);
 	}
@@ -607,7 +993,7 @@ int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after
 
 void safe_shutdown(int sock, acetables *g_ape)
 {
-	if (g_ape->bufout[sock].buf == NULL) {
+	if (g_ape->bufout[sock].buf == NULL && !g_ape->bufout[sock].remaining) {
 		shutdown(sock, 2);
 	} else {
 		g_ape->co[sock]->burn_after_writing = 1;
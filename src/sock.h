@@ -41,6 +41,12 @@ struct _socks_bufout
 	int fd;
 	int buflen;
 	int allocsize;
+	
+	/* file sent once the first "file_at" bytes of "buf" are flushed, see sendfd() */
+	int file;
+	int file_at;
+	off_t offset;
+	size_t remaining;
 };
 
 struct _socks_list
@@ -49,19 +55,40 @@ struct _socks_list
 	//int *tfd;
 };
 
+#define CONNECT_TIMEOUT_DEFAULT 5000 // ms
+#define CONNECT_RETRIES_DEFAULT 2
+#define CONNECT_BACKOFF_DEFAULT 200 // ms, doubled on each retry
+#define CONNECT_BACKOFF_MAX 10000 // ms
+
+/* Reason given to callbacks.on_connect_failed() */
+typedef enum {
+	APE_CONNECT_EDNS = 1,
+	APE_CONNECT_EREFUSED,
+	APE_CONNECT_ETIMEOUT,
+	APE_CONNECT_EUNREACH
+} ape_connect_error;
+
 struct _ape_sock_connect_async
 {
 	ape_socket *sock;
+	char *name;
 	int port;
+	int attempt;
+	acetables *g_ape;
 };
 
 ape_socket *ape_listen(unsigned int port, char *listen_ip, acetables *g_ape);
+void ape_connect_init(acetables *g_ape);
 ape_socket *ape_connect(char *ip, int port, acetables *g_ape);
 void ape_connect_name(char *name, int port, ape_socket *pattern, acetables *g_ape);
+const char *ape_connect_strerror(int error);
 void prepare_ape_socket(int fd, acetables *g_ape);
+void close_socket(int fd, acetables *g_ape);
 void setnonblocking(int fd);
 int sendf(int sock, acetables *g_ape, char *buf, ...);
 int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after_writing, acetables *g_ape);
+int sendv(int sock, struct iovec *iov, int iovcnt, unsigned int burn_after_writing, acetables *g_ape);
+int sendfd(int sock, int file, off_t offset, size_t count, unsigned int burn_after_writing, acetables *g_ape);
 void safe_shutdown(int sock, acetables *g_ape);
 unsigned int sockroutine(acetables *g_ape);
 
@@ -0,0 +1,557 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* static_files.c */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "static_files.h"
+#include "http_parser.h"
+#include "compress.h"
+#include "workers.h"
+#include "sock.h"
+#include "framing.h"
+#include "hash.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+	Static files (e.g. the APE JS client) served under the Static::paths
+	prefixes, so a deployment doesn't need a web server next to aped.
+	
+	Files are opened, checked and read by the workers (workers.c), never by
+	the event loop. Small ones are kept in memory (LRU, cache_size KB) along
+	with their precompressed "file.gz" variant, and checked again (fstat) at
+	most every check_interval seconds. Larger ones are sent with sendfile().
+	ETags are made of the size and mtime, a matching If-None-Match gets a 304.
+*/
+
+struct _static_path {
+	char *prefix;
+	size_t len;
+	char *root;
+};
+
+typedef struct _static_file static_file;
+struct _static_file {
+	char *path;
+	const char *type;
+	
+	struct stat st;
+	struct stat gz_st; /* "path.gz", if not older than "path" */
+	int has_gz;
+	
+	char *data; /* NULL if not in memory */
+	char *gz;
+	
+	time_t checked;
+	
+	struct _static_file *prev; /* LRU, most recent first */
+	struct _static_file *next;
+};
+
+struct _static_request {
+	ape_job job;
+	ape_socket *co; /* NULL once the socket is closed */
+	
+	char *if_none_match;
+	int gzip; /* accepted by the client */
+	
+	size_t max_file;
+	int cached; /* "file" is the cached version to validate */
+	int unchanged;
+	int error;
+	
+	static_file file;
+	int fd; /* not read : sent with sendfile() */
+	int gz_fd;
+};
+
+static struct {
+	struct _static_path paths[STATIC_MAX_PATHS];
+	int npaths;
+	
+	HTBL *table;
+	static_file *head;
+	static_file *foot;
+	size_t size;
+	size_t max;
+	
+	size_t max_file;
+	int check_interval;
+} sf;
+
+static const struct {
+	const char *ext;
+	const char *type;
+} static_types[] = {
+	{"html", "text/html"},
+	{"htm", "text/html"},
+	{"js", "application/javascript"},
+	{"css", "text/css"},
+	{"json", "application/json"},
+	{"map", "application/json"},
+	{"txt", "text/plain"},
+	{"xml", "application/xml"},
+	{"svg", "image/svg+xml"},
+	{"png", "image/png"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"gif", "image/gif"},
+	{"ico", "image/x-icon"},
+	{"swf", "application/x-shockwave-flash"},
+	{"woff", "font/woff"},
+	{"woff2", "font/woff2"},
+	{NULL, NULL}
+};
+
+#define STATIC_NOT_FOUND "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define STATIC_FORBIDDEN "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+void static_files_init(acetables *g_ape)
+{
+	char *paths, *tkn[STATIC_MAX_PATHS];
+	int size = atoi(CONFIG_VAL(Static, cache_size, g_ape->srv));
+	int max_file = atoi(CONFIG_VAL(Static, max_file_size, g_ape->srv));
+	int interval = atoi(CONFIG_VAL(Static, check_interval, g_ape->srv));
+	size_t n, i;
+	
+	paths = xstrdup(CONFIG_VAL(Static, paths, g_ape->srv));
+	n = explode(',', paths, tkn, STATIC_MAX_PATHS - 1);
+	
+	for (i = 0; i <= n; i++) {
+		char *prefix = trim(tkn[i]), *root;
+		size_t len;
+		
+		if (*prefix == '\0') {
+			continue;
+		}
+		if (*prefix != '/' || (root = strchr(prefix, ':')) == NULL) {
+			alog_warn("Static : \"%s\" ignored, prefix:directory expected", prefix);
+			continue;
+		}
+		*root++ = '\0';
+		prefix = trim(prefix);
+		root = trim(root);
+		
+		if ((len = strlen(root)) > 1 && root[len - 1] == '/') {
+			root[len - 1] = '\0';
+		}
+		sf.paths[sf.npaths].prefix = xstrdup(prefix);
+		sf.paths[sf.npaths].len = strlen(prefix);
+		sf.paths[sf.npaths].root = xstrdup(root);
+		sf.npaths++;
+	}
+	free(paths);
+	
+	if (!sf.npaths) {
+		return;
+	}
+	sf.table = hashtbl_init();
+	sf.max = (size_t)(size > 0 ? size : STATIC_CACHE_SIZE) * 1024;
+	sf.max_file = (max_file > 0 ? max_file : STATIC_MAX_FILE_SIZE);
+	sf.check_interval = (interval > 0 ? interval : STATIC_CHECK_INTERVAL);
+}
+
+static void static_unlink(static_file *file)
+{
+	if (file->prev != NULL) {
+		file->prev->next = file->next;
+	} else if (sf.head == file) {
+		sf.head = file->next;
+	}
+	if (file->next != NULL) {
+		file->next->prev = file->prev;
+	} else if (sf.foot == file) {
+		sf.foot = file->prev;
+	}
+	file->prev = file->next = NULL;
+}
+
+static void static_touch(static_file *file)
+{
+	static_unlink(file);
+	
+	if ((file->next = sf.head) != NULL) {
+		sf.head->prev = file;
+	} else {
+		sf.foot = file;
+	}
+	sf.head = file;
+}
+
+static size_t static_file_size(static_file *file)
+{
+	return file->st.st_size + (file->has_gz ? file->gz_st.st_size : 0);
+}
+
+static void static_remove(static_file *file)
+{
+	static_unlink(file);
+	hashtbl_erase(sf.table, file->path);
+	
+	sf.size -= static_file_size(file);
+	
+	free(file->path);
+	free(file->data);
+	free(file->gz);
+	free(file);
+}
+
+/* Takes over the content of "result" (returns NULL if it doesn't fit) */
+static static_file *static_store(static_file *result)
+{
+	static_file *file;
+	size_t size = static_file_size(result);
+	
+	if (size > sf.max) {
+		return NULL;
+	}
+	if ((file = hashtbl_seek(sf.table, result->path)) != NULL) {
+		static_remove(file);
+	}
+	while (sf.foot != NULL && sf.size + size > sf.max) {
+		static_remove(sf.foot);
+	}
+	file = xmalloc(sizeof(*file));
+	*file = *result;
+	file->checked = time(NULL);
+	file->prev = file->next = NULL;
+	
+	result->path = result->data = result->gz = NULL;
+	
+	hashtbl_append(sf.table, file->path, file);
+	static_touch(file);
+	sf.size += size;
+	
+	return file;
+}
+
+void static_files_free(acetables *g_ape)
+{
+	int i;
+	
+	while (sf.head != NULL) {
+		static_remove(sf.head);
+	}
+	if (sf.table != NULL) {
+		hashtbl_free(sf.table, NULL);
+		sf.table = NULL;
+	}
+	for (i = 0; i < sf.npaths; i++) {
+		free(sf.paths[i].prefix);
+		free(sf.paths[i].root);
+	}
+	sf.npaths = 0;
+}
+
+static const char *static_type(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	int i;
+	
+	if (ext != NULL && strchr(ext, '/') == NULL) {
+		for (i = 0; static_types[i].ext != NULL; i++) {
+			if (strcasecmp(&ext[1], static_types[i].ext) == 0) {
+				return static_types[i].type;
+			}
+		}
+	}
+	return "application/octet-stream";
+}
+
+/*
+	Filesystem path of "uri" (to be released) : 0 if it isn't under a prefix,
+	-1 if it is but isn't allowed (dot segments, hidden files).
+*/
+static int static_path(const char *uri, char **path)
+{
+	size_t len = strcspn(uri, "?#");
+	int i;
+	
+	for (i = 0; i < sf.npaths; i++) {
+		struct _static_path *p = &sf.paths[i];
+		const char *rest = &uri[p->len];
+		size_t rest_len = len - p->len, root_len;
+		
+		if (len < p->len || strncmp(uri, p->prefix, p->len) != 0 ||
+			(p->prefix[p->len - 1] != '/' && rest_len && *rest != '/')) {
+			continue;
+		}
+		if (memmem(uri, len, "/.", 2) != NULL) {
+			return -1;
+		}
+		root_len = strlen(p->root);
+		
+		*path = xmalloc(root_len + rest_len + sizeof("/index.html"));
+		memcpy(*path, p->root, root_len);
+		
+		if (*rest != '/') {
+			(*path)[root_len++] = '/';
+		}
+		memcpy(&(*path)[root_len], rest, rest_len);
+		(*path)[root_len + rest_len] = '\0';
+		
+		if ((*path)[root_len + rest_len - 1] == '/') {
+			strcat(*path, "index.html");
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static void static_error(ape_socket *co, int error, acetables *g_ape)
+{
+	if (error == EACCES) {
+		sendbin(co->fd, CONST_STR_LEN(STATIC_FORBIDDEN), 1, g_ape);
+	} else {
+		sendbin(co->fd, CONST_STR_LEN(STATIC_NOT_FOUND), 1, g_ape);
+	}
+}
+
+static int static_etag_match(const char *if_none_match, const char *etag)
+{
+	return (if_none_match != NULL && (strstr(if_none_match, etag) != NULL || strcmp(if_none_match, "*") == 0));
+}
+
+/* "fd" and "gz_fd" (-1 if the file is in memory) are closed */
+static void static_respond(ape_socket *co, static_file *file, int gzip, const char *if_none_match, int fd, int gz_fd, acetables *g_ape)
+{
+	char header[512], etag[64];
+	int gz = (gzip && file->has_gz), len;
+	size_t size = (gz ? file->gz_st.st_size : file->st.st_size);
+	
+	snprintf(etag, sizeof(etag), "\"%lx-%lx%s\"", (unsigned long)file->st.st_size, (unsigned long)file->st.st_mtime, (gz ? "-gz" : ""));
+	
+	if (static_etag_match(if_none_match, etag)) {
+		len = snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n", etag);
+		sendbin(co->fd, header, len, 1, g_ape);
+	} else {
+		len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\nETag: %s\r\nCache-Control: no-cache\r\n%s%sConnection: close\r\n\r\n",
+			file->type, (unsigned long)size, etag, (gz ? "Content-Encoding: gzip\r\n" : ""), (file->has_gz ? "Vary: Accept-Encoding\r\n" : ""));
+		
+		if (file->data != NULL) {
+			struct iovec iov[2];
+			
+			FRAME_BLOCK(iov[0], header, len);
+			FRAME_BLOCK(iov[1], (gz ? file->gz : file->data), size);
+			
+			sendv(co->fd, iov, 2, 1, g_ape);
+		} else {
+			sendbin(co->fd, header, len, 0, g_ape);
+			sendfd(co->fd, (gz ? gz_fd : fd), 0, size, 1, g_ape);
+			
+			if (gz) {
+				gz_fd = -1;
+			} else {
+				fd = -1;
+			}
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	if (gz_fd != -1) {
+		close(gz_fd);
+	}
+}
+
+static int static_same(struct stat *a, struct stat *b)
+{
+	return (a->st_mtime == b->st_mtime && a->st_size == b->st_size && a->st_ino == b->st_ino);
+}
+
+static char *static_read(int fd, size_t len)
+{
+	char *data = xmalloc(len + 1);
+	size_t total = 0;
+	ssize_t n;
+	
+	while (total < len) {
+		if ((n = pread(fd, &data[total], len - total, total)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			free(data);
+			return NULL;
+		}
+		total += n;
+	}
+	return data;
+}
+
+/* Worker thread : must not use APE structures */
+static void static_work(ape_job *job)
+{
+	struct _static_request *req = job->data;
+	static_file *file = &req->file;
+	struct stat st = file->st, gz_st = file->gz_st;
+	int has_gz = file->has_gz, fd, gz_fd = -1;
+	char gz_path[PATH_MAX];
+	
+	if ((fd = open(file->path, O_RDONLY)) == -1) {
+		req->error = errno;
+		return;
+	}
+	if (fstat(fd, &file->st) == -1 || !S_ISREG(file->st.st_mode)) {
+		req->error = ENOENT;
+		close(fd);
+		return;
+	}
+	
+	/* precompressed variant, ignored if older than the file */
+	if (snprintf(gz_path, sizeof(gz_path), "%s.gz", file->path) < (int)sizeof(gz_path) && (gz_fd = open(gz_path, O_RDONLY)) != -1) {
+		if (fstat(gz_fd, &file->gz_st) == -1 || !S_ISREG(file->gz_st.st_mode) || file->gz_st.st_mtime < file->st.st_mtime) {
+			close(gz_fd);
+			gz_fd = -1;
+		}
+	}
+	file->has_gz = (gz_fd != -1);
+	
+	if (req->cached && static_same(&st, &file->st) && has_gz == file->has_gz && (!has_gz || static_same(&gz_st, &file->gz_st))) {
+		req->unchanged = 1;
+	} else if ((size_t)file->st.st_size <= req->max_file && (!file->has_gz || (size_t)file->gz_st.st_size <= req->max_file)) {
+		if ((file->data = static_read(fd, file->st.st_size)) == NULL ||
+			(file->has_gz && (file->gz = static_read(gz_fd, file->gz_st.st_size)) == NULL)) {
+			req->error = EIO;
+		}
+	} else {
+		req->fd = fd;
+		req->gz_fd = gz_fd;
+		return;
+	}
+	close(fd);
+	if (gz_fd != -1) {
+		close(gz_fd);
+	}
+}
+
+static void static_done(ape_job *job, acetables *g_ape)
+{
+	struct _static_request *req = job->data;
+	ape_socket *co = req->co;
+	static_file *file = NULL;
+	
+	if (req->unchanged) {
+		if ((file = hashtbl_seek(sf.table, req->file.path)) == NULL) {
+			/* evicted meanwhile */
+			req->cached = req->unchanged = 0;
+			workers_submit(&req->job, g_ape);
+			return;
+		}
+		file->checked = time(NULL);
+		static_touch(file);
+	} else if (!req->error) {
+		req->file.type = static_type(req->file.path);
+		
+		if (req->file.data == NULL || (file = static_store(&req->file)) == NULL) {
+			file = &req->file;
+		}
+	}
+	if (co != NULL) {
+		co->static_request = NULL;
+		
+		if (req->error) {
+			static_error(co, req->error, g_ape);
+		} else {
+			static_respond(co, file, req->gzip, req->if_none_match, req->fd, req->gz_fd, g_ape);
+			req->fd = req->gz_fd = -1;
+		}
+	}
+	if (req->fd != -1) {
+		close(req->fd);
+	}
+	if (req->gz_fd != -1) {
+		close(req->gz_fd);
+	}
+	free(req->file.path);
+	free(req->file.data);
+	free(req->file.gz);
+	free(req->if_none_match);
+	free(req);
+}
+
+/* Return 1 if the request is for a static file (answered now or once read) */
+int static_files_http(ape_socket *co, http_state *http, acetables *g_ape)
+{
+	struct _static_request *req;
+	static_file *file;
+	const char *if_none_match;
+	char *path = NULL;
+	int ret;
+	
+	if (!sf.npaths || http->type != HTTP_GET || (ret = static_path(http->uri, &path)) == 0) {
+		return 0;
+	}
+	if (ret == -1) {
+		static_error(co, ENOENT, g_ape);
+		return 1;
+	}
+	if_none_match = http_header_find(http, "If-None-Match");
+	
+	if ((file = hashtbl_seek(sf.table, path)) != NULL && file->checked + sf.check_interval > time(NULL)) {
+		static_touch(file);
+		static_respond(co, file, (compress_accepted(http) == COMPRESS_GZIP), if_none_match, -1, -1, g_ape);
+		free(path);
+		
+		return 1;
+	}
+	req = xmalloc(sizeof(*req));
+	memset(req, 0, sizeof(*req));
+	
+	req->job.work = static_work;
+	req->job.done = static_done;
+	req->job.data = req;
+	
+	req->co = co;
+	req->if_none_match = (if_none_match != NULL ? xstrdup(if_none_match) : NULL);
+	req->gzip = (compress_accepted(http) == COMPRESS_GZIP);
+	req->max_file = sf.max_file;
+	req->fd = req->gz_fd = -1;
+	req->file.path = path;
+	
+	if (file != NULL) {
+		req->cached = 1;
+		req->file.st = file->st;
+		req->file.gz_st = file->gz_st;
+		req->file.has_gz = file->has_gz;
+	}
+	co->static_request = req;
+	
+	workers_submit(&req->job, g_ape);
+	
+	return 1;
+}
+
+/* The socket is closed : a pending request is dropped once read */
+void static_files_cancel(ape_socket *co)
+{
+	if (co->static_request != NULL) {
+		co->static_request->co = NULL;
+		co->static_request = NULL;
+	}
+}
@@ -0,0 +1,38 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* static_files.h */
+
+#ifndef _STATIC_FILES_H
+#define _STATIC_FILES_H
+
+#include "main.h"
+
+#define STATIC_CACHE_SIZE 4096 /* KB */
+#define STATIC_MAX_FILE_SIZE 65536 /* larger files are sent with sendfile() */
+#define STATIC_CHECK_INTERVAL 2 /* seconds between two checks of a cached file */
+#define STATIC_MAX_PATHS 16
+
+void static_files_init(acetables *g_ape);
+void static_files_free(acetables *g_ape);
+
+int static_files_http(ape_socket *co, http_state *http, acetables *g_ape);
+void static_files_cancel(ape_socket *co);
+
+#endif
@@ -133,6 +133,10 @@ void del_timer_identifier(unsigned int identifier, acetables *g_ape)
 			} else {
 				g_ape->timers.timers = timers->next;
 			}
+			/* deltas are relative to the previous timer */
+			if (timers->next != NULL) {
+				timers->next->delta += timers->delta;
+			}
 
 			free(timers);
 			break;
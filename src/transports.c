@@ -22,6 +22,10 @@
 #include "transports.h"
 #include "config.h"
 #include "utils.h"
+#include "raw.h"
+#include "http.h"
+#include "ticks.h"
+#include "framing.h"
 
 struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_socket *client, transport_t transport)
 {
@@ -68,7 +72,7 @@ void transport_data_completly_sent(subuser *sub, transport_t transport)
 	}	
 }
 
-struct _transport_properties *transport_get_properties(transport_t transport, acetables *g_ape)
+struct _transport_framing *transport_get_framing(ape_socket *client, transport_t transport, acetables *g_ape)
 {
 	switch(transport) {
 		case TRANSPORT_LONGPOLLING:
@@ -76,74 +80,233 @@ struct _transport_properties *transport_get_properties(transport_t transport, ac
 		default:
 			break;
 		case TRANSPORT_XHRSTREAMING:
-			return &(g_ape->transports.xhrstreaming.properties);
+			return &(g_ape->transports.xhrstreaming.framing);
 		case TRANSPORT_JSONP:
-			return &(g_ape->transports.jsonp.properties);
+			return &(g_ape->transports.jsonp.framing);
 		case TRANSPORT_SSE_LONGPOLLING:
-			return &(g_ape->transports.sse.properties);
+			return &(g_ape->transports.sse.framing);
 		case TRANSPORT_WEBSOCKET:
-			return &(g_ape->transports.websocket.properties);
-	    case TRANSPORT_WEBSOCKET_IETF:
-	        return &(g_ape->transports.websocket_ietf.properties);
-	}	
-	return NULL;
+			return &(g_ape->transports.websocket.framing);
+		case TRANSPORT_WEBSOCKET_IETF:
+			if (((websocket_state *)client->parser.data)->binary) {
+				return &(g_ape->transports.websocket_ietf.framing_msgpack);
+			}
+			return &(g_ape->transports.websocket_ietf.framing);
+	}
+	return &(g_ape->transports.longpolling.framing);
 }
 
-void transport_start(acetables *g_ape)
+/*
+	text/event-stream : every raw is an event with its own "id", the last
+	events sent are kept per subuser so a reconnecting EventSource resumes
+	from its Last-Event-ID instead of resyncing.
+*/
+
+static void transport_sse_event(frame_batch *batch, RAW *raw, unsigned long id)
 {
-	char *eval_func = CONFIG_VAL(JSONP, eval_func, g_ape->srv);
-	int len = strlen(eval_func);
+	char *head = frame_scratch(batch, 40);
 	
-	if (len) {
-		g_ape->transports.jsonp.properties.padding.left.val = xmalloc(sizeof(char) * (len + 3));
-		strcpy(g_ape->transports.jsonp.properties.padding.left.val, eval_func);
-		strcat(g_ape->transports.jsonp.properties.padding.left.val, "('");
-		g_ape->transports.jsonp.properties.padding.left.len = len+2;
-		
-		g_ape->transports.jsonp.properties.padding.right.val = xstrdup("')");
-		g_ape->transports.jsonp.properties.padding.right.len = 2;
+	frame_push(batch, head, sprintf(head, "id: %lu\ndata: [", id));
+	frame_push(batch, raw->data, raw->len);
+	frame_push(batch, "]\n\n", 3);
+}
+
+static void transport_sse_raw(frame_batch *batch, RAW *raw)
+{
+	subuser *sub = batch->sub;
+	int size = batch->g_ape->transports.sse.history;
+	struct _sse_event *event;
+	
+	if (sub == NULL) {
+		/* not attached to a subuser : no event id */
+		frame_push(batch, "data: [", 7);
+		frame_push(batch, raw->data, raw->len);
+		frame_push(batch, "]\n\n", 3);
+		return;
+	}
+	if (sub->sse.history == NULL) {
+		sub->sse.history = xmalloc(sizeof(*sub->sse.history) * size);
+		memset(sub->sse.history, 0, sizeof(*sub->sse.history) * size);
+	}
+	event = &sub->sse.history[++sub->sse.id % size];
+	
+	if (event->raw != NULL) {
+		free_raw(event->raw);
+	}
+	event->raw = copy_raw_z(raw);
+	event->id = sub->sse.id;
+	
+	transport_sse_event(batch, raw, event->id);
+}
+
+/* Send again what followed the client Last-Event-ID (as long as it is still in the history) */
+static void transport_sse_replay(frame_batch *batch)
+{
+	subuser *sub = batch->sub;
+	int size = batch->g_ape->transports.sse.history;
+	unsigned long id;
+	
+	if (sub == NULL) {
+		return;
+	}
+	id = sub->sse.resume + 1;
+	sub->sse.resume = 0;
+	
+	if (id == 1 || sub->sse.history == NULL) {
+		return;
+	}
+	if (sub->sse.id >= (unsigned long)size && id <= sub->sse.id - size) {
+		id = sub->sse.id - size + 1;
+	}
+	for (; id <= sub->sse.id; id++) {
+		struct _sse_event *event = &sub->sse.history[id % size];
 		
-	} else {
-		g_ape->transports.jsonp.properties.padding.left.val = NULL;
+		if (event->raw != NULL && event->id == id) {
+			/* the slot may be reused by a raw of this batch */
+			frame_keep(batch, copy_raw_z(event->raw));
+			transport_sse_event(batch, event->raw, id);
+		}
 	}
+}
 
-	g_ape->transports.xhrstreaming.properties.padding.left.val = NULL;
-	g_ape->transports.xhrstreaming.properties.padding.left.len = 0;
+/* Called when "sub" gets a new event-stream listener */
+void transport_sse_resume(subuser *sub, http_state *http)
+{
+	const char *last = http_header_find(http, "Last-Event-ID");
+	unsigned long id;
+	
+	if (last == NULL || (id = strtoul(last, NULL, 10)) >= sub->sse.id) {
+		return;
+	}
+	sub->sse.resume = id;
+}
 
-	g_ape->transports.xhrstreaming.properties.padding.right.val = xstrdup("\n\n");
-	g_ape->transports.xhrstreaming.properties.padding.right.len = 2;
+void transport_sse_free(subuser *sub, acetables *g_ape)
+{
+	int i;
 	
-	g_ape->transports.sse.properties.padding.left.val = xstrdup("Event: ape-event\nData: ");
-	g_ape->transports.sse.properties.padding.left.len = 24;
+	if (sub->sse.history == NULL) {
+		return;
+	}
+	for (i = 0; i < g_ape->transports.sse.history; i++) {
+		if (sub->sse.history[i].raw != NULL) {
+			free_raw(sub->sse.history[i].raw);
+		}
+	}
+	free(sub->sse.history);
+	sub->sse.history = NULL;
+}
 
-	g_ape->transports.sse.properties.padding.right.val = xstrdup("\n\n");
-	g_ape->transports.sse.properties.padding.right.len = 2;
+/* Comment lines keep idle streams open through proxies */
+static void transport_sse_heartbeat(void *params, int *last)
+{
+	acetables *g_ape = params;
+	USERS *user;
+	subuser *sub;
+	frame_batch batch;
 	
-	g_ape->transports.websocket.properties.padding.left.val = xstrdup("\x00");
-	g_ape->transports.websocket.properties.padding.left.len = 1;
+	for (user = g_ape->uHead; user != NULL; user = user->next) {
+		if (user->transport != TRANSPORT_SSE_LONGPOLLING) {
+			continue;
+		}
+		for (sub = user->subuser; sub != NULL; sub = sub->next) {
+			if (sub->state != ALIVE || sub->burn_after_writing || sub->need_update) {
+				continue;
+			}
+			/* framed as any batch : the stream may be compressed */
+			frame_batch_init(&batch, sub->client, sub, TRANSPORT_SSE_LONGPOLLING, g_ape);
+			frame_push(&batch, ":\n\n", 3);
+			
+			if (!frame_batch_send(&batch)) {
+				sub->burn_after_writing = 1;
+			}
+		}
+	}
+}
+
+/* "headers" ends with a blank line, what follows is sent along */
+static void transport_framing_init(struct _transport_framing *framing, const char *headers, int headers_len)
+{
+	const char *end = (headers_len ? memmem(headers, headers_len, "\r\n\r\n", 4) : NULL);
 	
-	g_ape->transports.websocket.properties.padding.right.val = xstrdup("\xFF");
-	g_ape->transports.websocket.properties.padding.right.len = 1;
+	if (end != NULL) {
+		FRAME_BLOCK(framing->headers, headers, end + 2 - headers);
+		FRAME_BLOCK(framing->preamble, end + 4, headers + headers_len - (end + 4));
+	} else {
+		FRAME_BLOCK(framing->headers, NULL, 0);
+		FRAME_BLOCK(framing->preamble, NULL, 0);
+	}
+	FRAME_BLOCK(framing->open, "[", 1);
+	FRAME_BLOCK(framing->sep, ",", 1);
+	FRAME_BLOCK(framing->close, "]", 1);
 	
-	g_ape->transports.websocket_ietf.properties.padding.left.val = NULL;
-	g_ape->transports.websocket_ietf.properties.padding.left.len = 0;
+	framing->begin = NULL;
+	framing->raw = NULL;
+	framing->end = NULL;
+	framing->stream = 0;
+}
+
+void transport_start(acetables *g_ape)
+{
+	struct _ape_transports *transports = &g_ape->transports;
+	char *eval_func = CONFIG_VAL(JSONP, eval_func, g_ape->srv);
+	int len = strlen(eval_func), heartbeat;
+	
+	transport_framing_init(&transports->longpolling.framing, HEADER_DEFAULT, HEADER_DEFAULT_LEN);
+	
+	/* eval_func('[...]') */
+	transport_framing_init(&transports->jsonp.framing, HEADER_DEFAULT, HEADER_DEFAULT_LEN);
+	
+	if (len) {
+		char *open = xmalloc(sizeof(char) * (len + 3));
+		
+		memcpy(open, eval_func, len);
+		memcpy(open + len, "('[", 3);
+		FRAME_BLOCK(transports->jsonp.framing.open, open, len + 3);
+		FRAME_BLOCK(transports->jsonp.framing.close, "]')", 3);
+	}
+	
+	transport_framing_init(&transports->xhrstreaming.framing, HEADER_XHR, HEADER_XHR_LEN);
+	FRAME_BLOCK(transports->xhrstreaming.framing.close, "]\n\n", 3);
+	transports->xhrstreaming.framing.stream = 1;
 	
-	g_ape->transports.websocket_ietf.properties.padding.right.val = NULL;
-	g_ape->transports.websocket_ietf.properties.padding.right.len = 0;		
+	/* text/event-stream : one event per raw */
+	transport_framing_init(&transports->sse.framing, HEADER_SSE, HEADER_SSE_LEN);
+	FRAME_BLOCK(transports->sse.framing.open, NULL, 0);
+	FRAME_BLOCK(transports->sse.framing.sep, NULL, 0);
+	FRAME_BLOCK(transports->sse.framing.close, NULL, 0);
+	transports->sse.framing.begin = transport_sse_replay;
+	transports->sse.framing.raw = transport_sse_raw;
+	transports->sse.framing.stream = 1;
 	
+	if ((transports->sse.history = atoi(CONFIG_VAL(SSE, history, g_ape->srv))) <= 0) {
+		transports->sse.history = SSE_HISTORY_DEFAULT;
+	}
+	if ((heartbeat = atoi(CONFIG_VAL(SSE, heartbeat, g_ape->srv))) <= 0) {
+		heartbeat = SSE_HEARTBEAT_DEFAULT;
+	}
+	add_periodical(heartbeat * 1000, 0, transport_sse_heartbeat, g_ape, g_ape);
+	
+	/* hixie-76 : 0x00 [...] 0xFF */
+	transport_framing_init(&transports->websocket.framing, NULL, 0);
+	FRAME_BLOCK(transports->websocket.framing.open, "\x00[", 2);
+	FRAME_BLOCK(transports->websocket.framing.close, "]\xFF", 2);
+	
+	/* a single frame per batch, its header is known once the batch is complete */
+	transport_framing_init(&transports->websocket_ietf.framing, NULL, 0);
+	transports->websocket_ietf.framing.end = frame_websocket_end;
+	
+	transport_framing_init(&transports->websocket_ietf.framing_msgpack, NULL, 0);
+	FRAME_BLOCK(transports->websocket_ietf.framing_msgpack.open, NULL, 0);
+	FRAME_BLOCK(transports->websocket_ietf.framing_msgpack.sep, NULL, 0);
+	FRAME_BLOCK(transports->websocket_ietf.framing_msgpack.close, NULL, 0);
+	transports->websocket_ietf.framing_msgpack.raw = frame_msgpack_raw;
+	transports->websocket_ietf.framing_msgpack.end = frame_msgpack_end;
 }
 
 void transport_free(acetables *g_ape)
 {
-	free(g_ape->transports.websocket.properties.padding.right.val);
-	free(g_ape->transports.websocket.properties.padding.left.val);
-	free(g_ape->transports.sse.properties.padding.right.val);
-	free(g_ape->transports.sse.properties.padding.left.val);
-	free(g_ape->transports.xhrstreaming.properties.padding.right.val);
-
-	if (g_ape->transports.jsonp.properties.padding.left.val != NULL) {
-		free(g_ape->transports.jsonp.properties.padding.left.val);
-		free(g_ape->transports.jsonp.properties.padding.right.val);
+	if (g_ape->transports.jsonp.framing.open.iov_len > 1) {
+		free(g_ape->transports.jsonp.framing.open.iov_base);
 	}
 }
-
@@ -33,6 +33,15 @@ struct _transport_open_same_host_p
 	int substate;
 };
 
+#define SSE_HISTORY_DEFAULT 64
+#define SSE_HEARTBEAT_DEFAULT 15 /* seconds */
+
+struct _sse_event
+{
+	struct RAW *raw;
+	unsigned long id;
+};
+
 typedef enum {
 	TRANSPORT_LONGPOLLING,
 	TRANSPORT_XHRSTREAMING,
@@ -49,6 +58,9 @@ struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_so
 void transport_data_completly_sent(subuser *sub, transport_t transport);
 void transport_start(acetables *g_ape);
 void transport_free(acetables *g_ape);
-struct _transport_properties *transport_get_properties(transport_t transport, acetables *g_ape);
+struct _transport_framing *transport_get_framing(ape_socket *client, transport_t transport, acetables *g_ape);
+
+void transport_sse_resume(subuser *sub, http_state *http);
+void transport_sse_free(subuser *sub, acetables *g_ape);
 
 #endif
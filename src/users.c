@@ -130,6 +130,7 @@ USERS *init_user(acetables *g_ape)
 	nuser->sessions.length = 0;
 	
 	nuser->properties = NULL;
+	memset(&nuser->slots, 0, sizeof(nuser->slots));
 	nuser->subuser = NULL;
 	nuser->nsub = 0;
 	nuser->type = HUMAN;
@@ -160,7 +161,7 @@ USERS *adduser(ape_socket *client, const char *host, const char *ip, USERS *allo
 		FIRE_EVENT(allocateuser, nuser, client, host, ip, g_ape);
 		
 		nuser = init_user(g_ape);
-		strncpy(nuser->ip, ip, 16);
+		strncpy(nuser->ip, ip, APE_IP_LEN - 1);
 		
 		nuser->pipe = init_pipe(nuser, USER_PIPE, g_ape);
 		nuser->type = (client != NULL ? HUMAN : BOT);
@@ -269,7 +270,7 @@ void check_timeout(acetables *g_ape, int *last)
 					delsubuser(n, g_ape);
 					continue;
 				}
-				if ((*n)->state == ALIVE && (*n)->raw_pools.nraw && !(*n)->need_update && !(*n)->burn_after_writing) {
+				if ((*n)->state == ALIVE && ((*n)->raw_pools.nraw || (*n)->sse.resume) && !(*n)->need_update && !(*n)->burn_after_writing) {
 
 					/* Data completetly sent => closed */
 					if (send_raws(*n, g_ape)) {
@@ -470,6 +471,10 @@ subuser *addsubuser(ape_socket *client, const char *channel, USERS *user, acetab
 	sub->headers.sent = 0;
 	sub->headers.content = NULL;
 	
+	sub->sse.id = 0;
+	sub->sse.resume = 0;
+	sub->sse.history = NULL;
+	
 	sub->burn_after_writing = 0;
 	
 	sub->idle = time(NULL);
@@ -604,6 +609,8 @@ void delsubuser(subuser **current, acetables *g_ape)
 	del->raw_pools.nraw = 0;
 	del->client->attach = NULL;
 	
+	transport_sse_free(del, g_ape);
+	
 	clear_properties(&del->properties);
 	
 	if (del->state == ALIVE) {
@@ -64,6 +64,7 @@ typedef struct USERS
 	struct CHANLIST *chan_foot;
 	struct _transpipe *pipe;
 	struct _extend *properties;
+	extend_slots slots;
 	struct _subuser *subuser;
 	
 	json_item *cmdqueue;
@@ -77,7 +78,7 @@ typedef struct USERS
 	unsigned short int type;
 	unsigned short int istmp;
 
-	char ip[16]; // ipv4
+	char ip[APE_IP_LEN];
 	char lastping[24];
 	char sessid[33];
 
@@ -106,6 +107,13 @@ struct _subuser
 		int sent;
 	} headers;
 	
+	/* text/event-stream, see transports.c */
+	struct {
+		unsigned long id; /* last event id */
+		unsigned long resume; /* Last-Event-ID of the new listener, 0 if none */
+		struct _sse_event *history; /* ring of the last events sent */
+	} sse;
+	
 	struct _extend *properties;
 	struct _subuser *next;
 	ape_socket *client;
@@ -95,10 +95,10 @@ char *trim(char *s)
 
 	i = strlen(s) - 1;
 	
-	while (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r') {
+	while (i >= 0 && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')) {
 		i--;
 	}
-	if (i < (strlen(s) - 1)) {
+	if (i < (int)strlen(s) - 1) {
 		s[i+1] = '\0';
 	}
 	return s;
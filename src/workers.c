@@ -0,0 +1,220 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* workers.c */
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "workers.h"
+#include "sock.h"
+#include "events.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+#define WORKERS_DEFAULT 2
+#define WORKERS_MAX 64
+
+/*
+	Jobs are queued to the threads, results come back in the "done" list and
+	the loop is woken up through a pipe registered as a STREAM_DELEGATE socket.
+	Threads are started on the first submitted job.
+*/
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	
+	ape_job *todo, *todo_foot;
+	ape_job *done, *done_foot;
+	
+	pthread_t threads[WORKERS_MAX];
+	int nthreads;
+	int size;
+	int running;
+	
+	int wakeup[2];
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, NULL, {0}, 0, 0, 0, {-1, -1}};
+
+static void job_push(ape_job **head, ape_job **foot, ape_job *job)
+{
+	job->next = NULL;
+	
+	if (*foot == NULL) {
+		*head = job;
+	} else {
+		(*foot)->next = job;
+	}
+	*foot = job;
+}
+
+static void job_done(ape_job *job)
+{
+	int wake;
+	
+	pthread_mutex_lock(&pool.lock);
+	wake = (pool.done == NULL);
+	job_push(&pool.done, &pool.done_foot, job);
+	pthread_mutex_unlock(&pool.lock);
+	
+	if (wake) {
+		while (write(pool.wakeup[1], "j", 1) == -1 && errno == EINTR);
+	}
+}
+
+static void *worker_thread(void *data)
+{
+	ape_job *job;
+	
+	while (1) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.todo == NULL && pool.running) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		}
+		if ((job = pool.todo) == NULL) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		if ((pool.todo = job->next) == NULL) {
+			pool.todo_foot = NULL;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		
+		job->work(job);
+		job_done(job);
+	}
+	
+	return NULL;
+}
+
+/* Called by the event loop when a worker completed some jobs */
+static void workers_read(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
+{
+	char buf[64];
+	ape_job *job, *next;
+	
+	while (read(pool.wakeup[0], buf, sizeof(buf)) > 0);
+	
+	pthread_mutex_lock(&pool.lock);
+	job = pool.done;
+	pool.done = pool.done_foot = NULL;
+	pthread_mutex_unlock(&pool.lock);
+	
+	for (; job != NULL; job = next) {
+		next = job->next;
+		job->done(job, g_ape);
+	}
+}
+
+static void workers_start()
+{
+	sigset_t set, old;
+	
+	/* workers must not catch the process signals */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	
+	pool.running = 1;
+	
+	for (pool.nthreads = 0; pool.nthreads < pool.size; pool.nthreads++) {
+		if (pthread_create(&pool.threads[pool.nthreads], NULL, worker_thread, NULL) != 0) {
+			alog_warn("Cannot start worker thread #%i", pool.nthreads);
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	if (pool.nthreads == 0) {
+		pool.size = 0;
+	}
+}
+
+void workers_init(acetables *g_ape)
+{
+	int size = atoi(CONFIG_VAL(Server, workers, g_ape->srv));
+	
+	pool.size = (size > 0 ? MIN(size, WORKERS_MAX) : WORKERS_DEFAULT);
+	
+	if (pipe(pool.wakeup) == -1) {
+		alog_errlog("workers pipe() : ");
+		pool.size = 0;
+		return;
+	}
+	setnonblocking(pool.wakeup[0]);
+	setnonblocking(pool.wakeup[1]);
+	
+	prepare_ape_socket(pool.wakeup[0], g_ape);
+	
+	g_ape->co[pool.wakeup[0]]->fd = pool.wakeup[0];
+	g_ape->co[pool.wakeup[0]]->stream_type = STREAM_DELEGATE;
+	g_ape->co[pool.wakeup[0]]->callbacks.on_read = workers_read;
+	
+	events_add(g_ape->events, pool.wakeup[0], EVENT_READ);
+}
+
+void workers_submit(ape_job *job, acetables *g_ape)
+{
+	if (!pool.running && pool.size != 0) {
+		workers_start();
+	}
+	if (pool.size == 0) { /* no pool : run inline */
+		job->work(job);
+		job->done(job, g_ape);
+		return;
+	}
+	
+	pthread_mutex_lock(&pool.lock);
+	job_push(&pool.todo, &pool.todo_foot, job);
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Only call job->done, at the next loop iteration (e.g. result already known) */
+void workers_defer(ape_job *job, acetables *g_ape)
+{
+	if (pool.wakeup[1] == -1) {
+		job->done(job, g_ape);
+		return;
+	}
+	job_done(job);
+}
+
+/* Pending jobs are completed, their results dropped with the loop */
+void workers_free(acetables *g_ape)
+{
+	int i;
+	
+	if (pool.running) {
+		pthread_mutex_lock(&pool.lock);
+		pool.running = 0;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+		
+		for (i = 0; i < pool.nthreads; i++) {
+			pthread_join(pool.threads[i], NULL);
+		}
+	}
+	if (pool.wakeup[0] != -1) {
+		close(pool.wakeup[0]);
+		close(pool.wakeup[1]);
+	}
+}
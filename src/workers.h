@@ -0,0 +1,47 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* workers.h */
+
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+#include "main.h"
+
+/*
+	Small thread pool for blocking jobs (file I/O...).
+	"work" runs in a worker thread and must not touch APE structures,
+	"done" is then called from the event loop.
+*/
+typedef struct _ape_job ape_job;
+struct _ape_job {
+	void (*work)(ape_job *job);
+	void (*done)(ape_job *job, acetables *g_ape);
+	
+	void *data;
+	
+	struct _ape_job *next;
+};
+
+void workers_init(acetables *g_ape);
+void workers_submit(ape_job *job, acetables *g_ape);
+void workers_defer(ape_job *job, acetables *g_ape);
+void workers_free(acetables *g_ape);
+
+#endif
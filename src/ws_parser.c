@@ -0,0 +1,379 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+/* ws_parser.c */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "ws_parser.h"
+
+/*
+	RFC 6455 frame parser. Headers are read once complete, payloads are
+	unmasked a word at a time and data frames are moved down to the start of
+	the buffer so a fragmented message ends up contiguous. Control frames
+	(possibly between fragments) are returned from where they stand.
+	
+	Unparsed bytes are moved down after the message on each call : the
+	buffer never holds more than a message and one read.
+*/
+
+void ws_parser_reset(websocket_state *ws, unsigned int max_message)
+{
+	ws->offset = 0;
+	ws->data = NULL;
+	ws->remaining = 0;
+	ws->msg_len = 0;
+	ws->data_len = 0;
+	ws->max_message = max_message;
+	ws->utf8 = 0;
+	ws->opcode = 0;
+	ws->msg_opcode = 0;
+	ws->fin = 0;
+	ws->mask_pos = 0;
+	ws->close_code = 0;
+	ws->closing = 0;
+	ws->alive = 1;
+	ws->step = WS_STEP_START;
+}
+
+static void ws_unmask(unsigned char *data, unsigned long long len, const unsigned char *key, unsigned char pos)
+{
+	unsigned char k[8];
+	unsigned long long i = 0;
+	uint64_t mask, word;
+	int j;
+	
+	for (j = 0; j < 8; j++) {
+		k[j] = key[(pos + j) & 3];
+	}
+	memcpy(&mask, k, 8);
+	
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&word, &data[i], 8);
+		word ^= mask;
+		memcpy(&data[i], &word, 8);
+	}
+	for (; i < len; i++) {
+		data[i] ^= k[i & 7];
+	}
+}
+
+/*
+	Incremental UTF-8 check, "state" holds the continuation bytes still
+	expected and the range allowed for the next one (overlongs, surrogates
+	and code points above U+10FFFF are rejected).
+*/
+#define UTF8_STATE(need, lo, hi) ((need) | ((lo) << 8) | ((hi) << 16))
+
+static int ws_utf8(unsigned int *state, const unsigned char *s, unsigned long long len)
+{
+	unsigned int need = *state & 0xFF, lo = (*state >> 8) & 0xFF, hi = *state >> 16;
+	unsigned long long i = 0;
+	uint64_t word;
+	unsigned char c;
+	
+	while (i < len) {
+		c = s[i];
+		
+		if (need) {
+			if (c < lo || c > hi) {
+				return 0;
+			}
+			need--;
+			lo = 0x80;
+			hi = 0xBF;
+			i++;
+			continue;
+		}
+		if (c < 0x80) {
+			/* ASCII run */
+			for (i++; i + 8 <= len; i += 8) {
+				memcpy(&word, &s[i], 8);
+				if (word & 0x8080808080808080ULL) {
+					break;
+				}
+			}
+			continue;
+		}
+		lo = 0x80;
+		hi = 0xBF;
+		
+		if (c >= 0xC2 && c <= 0xDF) {
+			need = 1;
+		} else if (c == 0xE0) {
+			need = 2;
+			lo = 0xA0;
+		} else if (c == 0xED) {
+			need = 2;
+			hi = 0x9F;
+		} else if (c >= 0xE1 && c <= 0xEF) {
+			need = 2;
+		} else if (c == 0xF0) {
+			need = 3;
+			lo = 0x90;
+		} else if (c >= 0xF1 && c <= 0xF3) {
+			need = 3;
+		} else if (c == 0xF4) {
+			need = 3;
+			hi = 0x8F;
+		} else {
+			return 0;
+		}
+		i++;
+	}
+	*state = (need ? UTF8_STATE(need, lo, hi) : 0);
+	
+	return 1;
+}
+
+static int ws_close_code_valid(unsigned int code)
+{
+	return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+}
+
+static int ws_error(websocket_state *ws, unsigned short int code)
+{
+	ws->close_code = code;
+	
+	return -1;
+}
+
+/* Parse the frame header at ws->offset : 1 once read, 0 if incomplete, -1 on error */
+static int ws_parse_header(websocket_state *ws, unsigned char *data, unsigned int length)
+{
+	unsigned int avail = length - ws->offset, hlen = 6;
+	unsigned char *head = &data[ws->offset];
+	unsigned long long len;
+	int i;
+	
+	if (avail < 2) {
+		return 0;
+	}
+	if (head[0] & 0x70) {
+		/* no extension negotiated */
+		return ws_error(ws, WS_CLOSE_PROTOCOL);
+	}
+	if (!(head[1] & 0x80)) {
+		/* client frames must be masked */
+		return ws_error(ws, WS_CLOSE_PROTOCOL);
+	}
+	len = head[1] & 0x7F;
+	
+	if (len == 126) {
+		hlen += 2;
+	} else if (len == 127) {
+		hlen += 8;
+	}
+	if (avail < hlen) {
+		return 0;
+	}
+	if (len == 126) {
+		len = (head[2] << 8) | head[3];
+	} else if (len == 127) {
+		if (head[2] & 0x80) {
+			return ws_error(ws, WS_CLOSE_PROTOCOL);
+		}
+		for (len = 0, i = 2; i < 10; i++) {
+			len = (len << 8) | head[i];
+		}
+	}
+	
+	ws->fin = head[0] & WS_FIN;
+	ws->opcode = head[0] & 0x0F;
+	
+	switch(ws->opcode) {
+		case WS_OP_CLOSE:
+		case WS_OP_PING:
+		case WS_OP_PONG:
+			if (!ws->fin || len > 125) {
+				return ws_error(ws, WS_CLOSE_PROTOCOL);
+			}
+			break;
+		case WS_OP_CONTINUATION:
+			if (!ws->msg_opcode) {
+				return ws_error(ws, WS_CLOSE_PROTOCOL);
+			}
+			break;
+		case WS_OP_TEXT:
+		case WS_OP_BINARY:
+			if (ws->msg_opcode) {
+				return ws_error(ws, WS_CLOSE_PROTOCOL);
+			}
+			ws->msg_opcode = ws->opcode;
+			ws->utf8 = 0;
+			break;
+		default:
+			return ws_error(ws, WS_CLOSE_PROTOCOL);
+	}
+	if (!(ws->opcode & 0x08) && len > ws->max_message - ws->msg_len) {
+		return ws_error(ws, WS_CLOSE_TOO_BIG);
+	}
+	memcpy(ws->key.val, &head[hlen - 4], 4);
+	
+	ws->offset += hlen;
+	ws->remaining = len;
+	ws->mask_pos = 0;
+	ws->alive = 1;
+	ws->step = WS_STEP_DATA;
+	
+	return 1;
+}
+
+static ws_parse_status ws_parse_control(websocket_state *ws, unsigned char *data)
+{
+	unsigned char *payload = &data[ws->offset];
+	
+	ws_unmask(payload, ws->remaining, ws->key.val, 0);
+	
+	ws->data = (char *)payload;
+	ws->data_len = ws->remaining;
+	ws->offset += ws->remaining;
+	ws->remaining = 0;
+	ws->step = WS_STEP_START;
+	
+	switch(ws->opcode) {
+		case WS_OP_PING:
+			return WS_PARSE_PING;
+		case WS_OP_PONG:
+			return WS_PARSE_PONG;
+		default:
+			break;
+	}
+	
+	/* close : optional code and UTF-8 reason */
+	if (ws->data_len == 0) {
+		ws->close_code = WS_CLOSE_NORMAL;
+	} else {
+		unsigned int state = 0;
+		
+		if (ws->data_len == 1 || !ws_close_code_valid((payload[0] << 8) | payload[1])) {
+			ws->close_code = WS_CLOSE_PROTOCOL;
+			return WS_PARSE_ERROR;
+		}
+		if (!ws_utf8(&state, &payload[2], ws->data_len - 2) || state != 0) {
+			ws->close_code = WS_CLOSE_INVALID_DATA;
+			return WS_PARSE_ERROR;
+		}
+		ws->close_code = (payload[0] << 8) | payload[1];
+	}
+	
+	return WS_PARSE_CLOSE;
+}
+
+/* Call again after each returned message/frame. "*length" may shrink (see above) */
+ws_parse_status ws_parse(websocket_state *ws, char *buf, unsigned int *length)
+{
+	unsigned char *data = (unsigned char *)buf;
+	unsigned int n, left;
+	int ret;
+	
+	while (1) {
+		if (ws->step == WS_STEP_START && (ret = ws_parse_header(ws, data, *length)) != 1) {
+			if (ret == -1) {
+				return WS_PARSE_ERROR;
+			}
+			break;
+		}
+		
+		if (ws->opcode & 0x08) {
+			if (*length - ws->offset < ws->remaining) {
+				break;
+			}
+			return ws_parse_control(ws, data);
+		}
+		
+		n = *length - ws->offset;
+		if (n > ws->remaining) {
+			n = ws->remaining;
+		}
+		if (n) {
+			ws_unmask(&data[ws->offset], n, ws->key.val, ws->mask_pos);
+			
+			if (ws->msg_opcode == WS_OP_TEXT && !ws_utf8(&ws->utf8, &data[ws->offset], n)) {
+				ws->close_code = WS_CLOSE_INVALID_DATA;
+				return WS_PARSE_ERROR;
+			}
+			if (ws->offset != ws->msg_len) {
+				memmove(&data[ws->msg_len], &data[ws->offset], n);
+			}
+			ws->msg_len += n;
+			ws->offset += n;
+			ws->remaining -= n;
+			ws->mask_pos = (ws->mask_pos + n) & 3;
+		}
+		if (ws->remaining) {
+			break;
+		}
+		ws->step = WS_STEP_START;
+		
+		if (ws->fin) {
+			if (ws->msg_opcode == WS_OP_TEXT && ws->utf8 != 0) {
+				ws->close_code = WS_CLOSE_INVALID_DATA;
+				return WS_PARSE_ERROR;
+			}
+			ws->data = buf;
+			ws->data_len = ws->msg_len;
+			ws->opcode = ws->msg_opcode;
+			ws->msg_opcode = 0;
+			ws->msg_len = 0;
+			
+			return WS_PARSE_MESSAGE;
+		}
+	}
+	
+	/* keep the unparsed bytes right after the message */
+	left = *length - ws->offset;
+	
+	if (ws->offset != ws->msg_len) {
+		if (left) {
+			memmove(&data[ws->msg_len], &data[ws->offset], left);
+		}
+		ws->offset = ws->msg_len;
+		*length = ws->msg_len + left;
+	}
+	
+	return WS_PARSE_AGAIN;
+}
+
+/* Server frames are never masked, returns the header length (up to WS_MAX_HEADER) */
+unsigned int ws_frame_header(unsigned char *head, unsigned char start, unsigned long long len)
+{
+	int i;
+	
+	head[0] = start;
+	
+	if (len <= 125) {
+		head[1] = len;
+		return 2;
+	}
+	if (len <= 0xFFFF) {
+		head[1] = 126;
+		head[2] = (len >> 8) & 0xFF;
+		head[3] = len & 0xFF;
+		return 4;
+	}
+	head[1] = 127;
+	for (i = 9; i >= 2; i--, len >>= 8) {
+		head[i] = len & 0xFF;
+	}
+	
+	return 10;
+}
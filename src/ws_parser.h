@@ -0,0 +1,62 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010, 2011  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+/* ws_parser.h */
+
+#ifndef _WS_PARSER_H
+#define _WS_PARSER_H
+
+#include "main.h"
+
+#define WS_MAX_MESSAGE_DEFAULT 524288
+#define WS_PING_DEFAULT 30 /* seconds */
+
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+#define WS_FIN 0x80
+
+/* Close codes (RFC 6455 7.4.1) */
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_INVALID_DATA 1007
+#define WS_CLOSE_TOO_BIG 1009
+
+#define WS_MAX_HEADER 14
+
+typedef enum {
+	WS_PARSE_AGAIN = 0, /* wait for more data */
+	WS_PARSE_MESSAGE, /* ws->data, ws->data_len, ws->opcode */
+	WS_PARSE_PING, /* control frames : payload in ws->data, ws->data_len */
+	WS_PARSE_PONG,
+	WS_PARSE_CLOSE, /* ws->close_code is the code to echo */
+	WS_PARSE_ERROR /* fail the connection with ws->close_code */
+} ws_parse_status;
+
+void ws_parser_reset(websocket_state *ws, unsigned int max_message);
+ws_parse_status ws_parse(websocket_state *ws, char *data, unsigned int *length);
+unsigned int ws_frame_header(unsigned char *head, unsigned char start, unsigned long long len);
+
+#endif